@@ -15,6 +15,9 @@
 #include "device_priv.h"
 #include "monitor.h"
 #include "platform.h"
+#ifdef __linux__
+    #include "simulator_priv.h"
+#endif
 
 hs_device *hs_device_ref(hs_device *dev)
 {
@@ -89,8 +92,12 @@ int hs_port_open(hs_device *dev, hs_port_mode mode, hs_port **rport)
 
     switch (dev->type) {
         case HS_DEVICE_TYPE_HID: {
-#ifdef __APPLE__
+#if defined(__APPLE__)
             return _hs_darwin_open_hid_port(dev, mode, rport);
+#elif defined(__linux__)
+            if (_hs_simulator_owns_device(dev))
+                return _hs_simulator_open_hid_port(dev, mode, rport);
+            return _hs_open_file_port(dev, mode, rport);
 #else
             return _hs_open_file_port(dev, mode, rport);
 #endif
@@ -111,6 +111,8 @@ struct hs_device {
     char *serial_number_string;
     /** Device interface number. */
     uint8_t iface_number;
+    /** Set for devices created by the simulator (see LIBHS_SIMULATOR). */
+    bool simulated;
 
     /** Match pointer, copied from udata in @ref hs_match_spec. */
     void *match_udata;
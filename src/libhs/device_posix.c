@@ -110,8 +110,9 @@ restart:
                          strerror(errno));
             goto error;
         }
+        // Simulated boards use ptys, which don't have modem control lines
         r = ioctl(port->u.file.fd, TIOCMBIS, &modem_bits);
-        if (r < 0) {
+        if (r < 0 && !(dev->simulated && (errno == ENOTTY || errno == EINVAL))) {
             r = hs_error(HS_ERROR_SYSTEM, "ioctl(TIOCMBIS, TIOCM_DTR) failed on '%s': %s",
                          dev->path, strerror(errno));
             goto error;
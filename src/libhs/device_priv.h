@@ -45,6 +45,9 @@ struct hs_port {
             uint8_t *read_buf;
             size_t read_buf_size;
             bool numbered_hid_reports;
+
+            // Set for simulated HalfKay devices, see simulator_linux.c
+            struct _hs_simulator_board *simulator_board;
     #endif
         } file;
 
@@ -19,6 +19,7 @@
 #include "device_priv.h"
 #include "hid.h"
 #include "platform.h"
+#include "simulator_priv.h"
 
 static bool detect_kernel26_byte_bug()
 {
@@ -62,6 +63,8 @@ restart:
         if (!r)
             return 0;
     }
+    if (port->u.file.simulator_board)
+        return 0;
 
     if (port->u.file.numbered_hid_reports) {
         /* Work around a hidraw bug introduced in Linux 2.6.28 and fixed in Linux 2.6.34, see
@@ -110,6 +113,8 @@ ssize_t hs_hid_write(hs_port *port, const uint8_t *buf, size_t size)
 
     if (size < 2)
         return 0;
+    if (port->u.file.simulator_board)
+        return _hs_simulator_hid_write(port, buf, size);
 
     ssize_t r;
 
@@ -137,6 +142,9 @@ ssize_t hs_hid_get_feature_report(hs_port *port, uint8_t report_id, uint8_t *buf
 
     ssize_t r;
 
+    if (port->u.file.simulator_board)
+        return hs_error(HS_ERROR_IO, "Simulated device '%s' has no feature reports", port->path);
+
     if (size >= 2)
         buf[1] = report_id;
 
@@ -163,6 +171,8 @@ ssize_t hs_hid_send_feature_report(hs_port *port, const uint8_t *buf, size_t siz
 
     if (size < 2)
         return 0;
+    if (port->u.file.simulator_board)
+        return hs_error(HS_ERROR_IO, "Simulated device '%s' has no feature reports", port->path);
 
     ssize_t r;
 
@@ -80,6 +80,9 @@
         #include "monitor_linux.c"
         #include "platform_posix.c"
         #include "serial_posix.c"
+        #ifdef _HS_HAVE_SIMULATOR
+            #include "simulator_linux.c"
+        #endif
     #else
         #error "Platform not supported"
     #endif
@@ -117,3 +117,40 @@ bool _hs_match_helper_has_type(const _hs_match_helper *helper, hs_device_type ty
 {
     return helper->types & (uint32_t)(1 << type);
 }
+
+bool _hs_match_helper_match_ids(const _hs_match_helper *helper, hs_device_type type,
+                                uint16_t vid, uint16_t pid)
+{
+    if (!_hs_match_helper_has_type(helper, type))
+        return false;
+    if (!helper->specs_count)
+        return true;
+
+    for (unsigned int i = 0; i < helper->specs_count; i++) {
+        const hs_match_spec *spec = &helper->specs[i];
+
+        if (spec->type && (hs_device_type)spec->type != type)
+            continue;
+        if ((!spec->vid || spec->vid == vid) && (!spec->pid || spec->pid == pid))
+            return true;
+    }
+
+    return false;
+}
+
+bool _hs_match_helper_has_ids(const _hs_match_helper *helper, hs_device_type type)
+{
+    if (!_hs_match_helper_has_type(helper, type) || !helper->specs_count)
+        return false;
+
+    for (unsigned int i = 0; i < helper->specs_count; i++) {
+        const hs_match_spec *spec = &helper->specs[i];
+
+        if (spec->type && (hs_device_type)spec->type != type)
+            continue;
+        if (!spec->vid)
+            return false;
+    }
+
+    return true;
+}
@@ -30,4 +30,11 @@ bool _hs_match_helper_match(const _hs_match_helper *helper, const hs_device *dev
                             void **rmatch_udata);
 bool _hs_match_helper_has_type(const _hs_match_helper *helper, hs_device_type type);
 
+/* These two let backends discard devices (or skip them entirely) as soon as they know the
+   USB vendor and product IDs, before reading anything else. */
+bool _hs_match_helper_match_ids(const _hs_match_helper *helper, hs_device_type type,
+                                uint16_t vid, uint16_t pid);
+// Returns true if every spec that matches this type requires a vendor ID
+bool _hs_match_helper_has_ids(const _hs_match_helper *helper, hs_device_type type);
+
 #endif
@@ -9,17 +9,23 @@
    See the LICENSE file for more details. */
 
 #include "common_priv.h"
+#include <arpa/inet.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <linux/hidraw.h>
+#include <linux/netlink.h>
 #include <libudev.h>
 #include <pthread.h>
 #include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <unistd.h>
+#include "array.h"
 #include "device_priv.h"
 #include "match_priv.h"
 #include "monitor_priv.h"
 #include "platform.h"
+#include "simulator_priv.h"
 
 struct hs_monitor {
     _hs_match_helper match_helper;
@@ -27,6 +33,19 @@ struct hs_monitor {
 
     struct udev_monitor *udev_mon;
     int wait_fd;
+
+    /* Native uevent socket, used instead of udev_mon unless LIBHS_LINUX_FORCE_LIBUDEV is set
+       or the socket cannot be created. The sysfs directory of the last USB device stays open
+       because its interfaces usually show up one after the other. */
+    int netlink_fd;
+    int netlink_group;
+    char *usb_dir_path;
+    int usb_dir_fd;
+    bool netlink_overflow;
+
+    // Simulated devices replace udev, see simulator_linux.c
+    bool simulated;
+    bool simulator_started;
 };
 
 struct device_subsystem {
@@ -46,6 +65,21 @@ static struct device_subsystem device_subsystems[] = {
     {NULL}
 };
 
+/* Header of the messages udevd sends to the udev group, the properties follow as in kernel
+   messages (KEY=VALUE strings, each terminated by NUL). */
+struct udev_netlink_header {
+    char prefix[8];
+    unsigned int magic;
+    unsigned int header_size;
+    unsigned int properties_off;
+    unsigned int properties_len;
+};
+
+#define UDEV_NETLINK_MAGIC 0xFEEDCAFE
+#define UEVENT_BUFFER_SIZE 8192
+
+typedef _HS_ARRAY(hs_device *) device_array;
+
 static pthread_mutex_t udev_init_lock = PTHREAD_MUTEX_INITIALIZER;
 static struct udev *udev;
 static int common_eventfd = -1;
@@ -191,18 +225,14 @@ static size_t read_hid_descriptor_sysfs(struct udev_aggregate *agg, uint8_t *des
     return (size_t)r;
 }
 
-static size_t read_hid_descriptor_hidraw(struct udev_aggregate *agg, uint8_t *desc_buf,
+static size_t read_hid_descriptor_hidraw(const char *node_path, uint8_t *desc_buf,
                                          size_t desc_buf_size)
 {
-    const char *node_path;
     int fd = -1;
     int hidraw_desc_size = 0;
     struct hidraw_report_descriptor hidraw_desc;
     int r;
 
-    node_path = udev_device_get_devnode(agg->dev);
-    if (!node_path)
-        goto cleanup;
     fd = open(node_path, O_RDONLY);
     if (fd < 0)
         goto cleanup;
@@ -311,7 +341,7 @@ static void fill_hid_properties(struct udev_aggregate *agg, hs_device *dev)
     // The sysfs report_descriptor file appeared in 2011, somewhere around Linux 2.6.38
     desc_size = read_hid_descriptor_sysfs(agg, desc, sizeof(desc));
     if (!desc_size) {
-        desc_size = read_hid_descriptor_hidraw(agg, desc, sizeof(desc));
+        desc_size = read_hid_descriptor_hidraw(dev->path, desc, sizeof(desc));
         if (!desc_size) {
             // This will happen pretty often on old kernels, most HID nodes are root-only
             hs_log(HS_LOG_DEBUG, "Cannot get HID report descriptor from '%s'", dev->path);
@@ -322,7 +352,34 @@ static void fill_hid_properties(struct udev_aggregate *agg, hs_device *dev)
     parse_hid_descriptor(dev, desc, desc_size);
 }
 
-static int read_device_information(struct udev_device *udev_dev, hs_device **rdev)
+static hs_device_type get_subsystem_type(const char *subsystem)
+{
+    for (unsigned int i = 0; device_subsystems[i].subsystem; i++) {
+        if (strcmp(subsystem, device_subsystems[i].subsystem) == 0)
+            return device_subsystems[i].type;
+    }
+
+    return 0;
+}
+
+static bool test_device_ids(struct udev_aggregate *agg, const _hs_match_helper *match_helper)
+{
+    const char *subsystem, *vid, *pid;
+    hs_device_type type;
+
+    subsystem = udev_device_get_subsystem(agg->dev);
+    type = subsystem ? get_subsystem_type(subsystem) : 0;
+    vid = udev_device_get_sysattr_value(agg->usb, "idVendor");
+    pid = udev_device_get_sysattr_value(agg->usb, "idProduct");
+    if (!type || !vid || !pid)
+        return false;
+
+    return _hs_match_helper_match_ids(match_helper, type, (uint16_t)strtoul(vid, NULL, 16),
+                                      (uint16_t)strtoul(pid, NULL, 16));
+}
+
+static int read_device_information(struct udev_device *udev_dev,
+                                   const _hs_match_helper *match_helper, hs_device **rdev)
 {
     struct udev_aggregate agg;
     hs_device *dev = NULL;
@@ -336,6 +393,12 @@ static int read_device_information(struct udev_device *udev_dev, hs_device **rde
         goto cleanup;
     }
 
+    // Most devices do not match, don't read anything else for them
+    if (!test_device_ids(&agg, match_helper)) {
+        r = 0;
+        goto cleanup;
+    }
+
     dev = (hs_device *)calloc(1, sizeof(*dev));
     if (!dev) {
         r = hs_error(HS_ERROR_MEMORY, NULL);
@@ -360,6 +423,472 @@ cleanup:
     return r;
 }
 
+static void close_usb_directory(hs_monitor *monitor)
+{
+    if (monitor->usb_dir_fd >= 0)
+        close(monitor->usb_dir_fd);
+    monitor->usb_dir_fd = -1;
+    free(monitor->usb_dir_path);
+    monitor->usb_dir_path = NULL;
+}
+
+static int open_usb_directory(hs_monitor *monitor, const char *devpath, size_t len, int *rfd)
+{
+    char path[4096];
+    char *usb_dir_path;
+    int fd;
+
+    if (monitor->usb_dir_fd >= 0 && strlen(monitor->usb_dir_path) == len &&
+            strncmp(monitor->usb_dir_path, devpath, len) == 0) {
+        *rfd = monitor->usb_dir_fd;
+        return 1;
+    }
+    close_usb_directory(monitor);
+
+    if (snprintf(path, sizeof(path), "/sys%.*s", (int)len, devpath) >= (int)sizeof(path))
+        return 0;
+    usb_dir_path = strndup(devpath, len);
+    if (!usb_dir_path)
+        return hs_error(HS_ERROR_MEMORY, NULL);
+
+    // The device may already be gone, in which case we ignore the event
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        free(usb_dir_path);
+        return 0;
+    }
+
+    monitor->usb_dir_path = usb_dir_path;
+    monitor->usb_dir_fd = fd;
+
+    *rfd = fd;
+    return 1;
+}
+
+// Trailing whitespace is removed, like udev_device_get_sysattr_value() does
+static const char *read_sysfs_attribute(int dir_fd, const char *name, char *buf, size_t size)
+{
+    int fd;
+    ssize_t len;
+
+    fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    len = read(fd, buf, size - 1);
+    close(fd);
+    if (len < 0)
+        return NULL;
+
+    while (len && strchr(" \t\r\n", buf[len - 1]))
+        len--;
+    buf[len] = 0;
+
+    return buf;
+}
+
+static int read_sysfs_hex(int dir_fd, const char *name, uint16_t *rvalue)
+{
+    char buf[16];
+    const char *value;
+
+    value = read_sysfs_attribute(dir_fd, name, buf, sizeof(buf));
+    if (!value)
+        return 0;
+
+    errno = 0;
+    *rvalue = (uint16_t)strtoul(value, NULL, 16);
+    if (errno)
+        return 0;
+
+    return 1;
+}
+
+static int read_sysfs_string(int dir_fd, const char *name, char **rstr)
+{
+    // sysfs attributes are at most one page long
+    char buf[4096];
+    const char *value;
+
+    value = read_sysfs_attribute(dir_fd, name, buf, sizeof(buf));
+    if (!value)
+        return 0;
+
+    *rstr = strdup(value);
+    if (!*rstr)
+        return hs_error(HS_ERROR_MEMORY, NULL);
+
+    return 1;
+}
+
+// USB interface directories are named like 1-2.3:1.0 (bus-ports:config.interface)
+static bool is_usb_interface_name(const char *name, size_t len)
+{
+    const char *end = name + len;
+    const char *ptr = name;
+
+    if (ptr == end || !isdigit((unsigned char)*ptr))
+        return false;
+    while (ptr < end && isdigit((unsigned char)*ptr))
+        ptr++;
+    if (ptr == end || *ptr++ != '-')
+        return false;
+    while (ptr < end && (isdigit((unsigned char)*ptr) || *ptr == '.'))
+        ptr++;
+    if (ptr == end || *ptr++ != ':')
+        return false;
+    while (ptr < end && (isdigit((unsigned char)*ptr) || *ptr == '.'))
+        ptr++;
+
+    return ptr == end && isdigit((unsigned char)end[-1]);
+}
+
+static int fill_uevent_device_details(hs_monitor *monitor, const struct _hs_uevent *ev,
+                                      hs_device *dev)
+{
+    const char *iface_name = NULL, *usb_name;
+    size_t iface_len = 0, usb_len;
+    int usb_fd;
+    int r;
+
+    if (strcmp(ev->subsystem, "hidraw") == 0) {
+        dev->type = HS_DEVICE_TYPE_HID;
+    } else if (strcmp(ev->subsystem, "tty") == 0) {
+        dev->type = HS_DEVICE_TYPE_SERIAL;
+    } else {
+        return 0;
+    }
+
+    // Find the USB interface and device in the path, without going through sysfs
+    for (const char *ptr = ev->devpath; *ptr;) {
+        const char *name = ptr + 1;
+        size_t len = strcspn(name, "/");
+
+        if (is_usb_interface_name(name, len)) {
+            iface_name = name;
+            iface_len = len;
+            break;
+        }
+        ptr = name + len;
+    }
+    if (!iface_name || iface_name - 1 == ev->devpath)
+        return 0;
+    usb_len = (size_t)(iface_name - 1 - ev->devpath);
+    usb_name = iface_name - 1;
+    while (usb_name > ev->devpath && usb_name[-1] != '/')
+        usb_name--;
+
+    r = open_usb_directory(monitor, ev->devpath, usb_len, &usb_fd);
+    if (r <= 0)
+        return r;
+
+    /* Reject devices the match specs can't accept before we allocate anything or read
+       the rest of sysfs. */
+    if (!read_sysfs_hex(usb_fd, "idVendor", &dev->vid) ||
+            !read_sysfs_hex(usb_fd, "idProduct", &dev->pid))
+        return 0;
+    if (!_hs_match_helper_match_ids(&monitor->match_helper, dev->type, dev->vid, dev->pid))
+        return 0;
+
+    // The kernel sends names relative to /dev, udevd sends absolute paths
+    if (ev->devname[0] == '/') {
+        dev->path = strdup(ev->devname);
+    } else {
+        r = _hs_asprintf(&dev->path, "/dev/%s", ev->devname);
+        if (r < 0)
+            dev->path = NULL;
+    }
+    if (!dev->path)
+        return hs_error(HS_ERROR_MEMORY, NULL);
+    if (access(dev->path, F_OK) != 0)
+        return 0;
+
+    dev->key = strdup(ev->devpath);
+    if (!dev->key)
+        return hs_error(HS_ERROR_MEMORY, NULL);
+
+    // The USB device directory name is busnum-devpath, which gives us the location
+    r = _hs_asprintf(&dev->location, "usb-%.*s", (int)(iface_name - 1 - usb_name), usb_name);
+    if (r < 0)
+        return hs_error(HS_ERROR_MEMORY, NULL);
+    for (char *ptr = dev->location; *ptr; ptr++) {
+        if (*ptr == '.')
+            *ptr = '-';
+    }
+
+    errno = 0;
+    dev->iface_number = (uint8_t)strtoul(iface_name + iface_len - 1, NULL, 10);
+    if (errno)
+        return 0;
+
+    if (!read_sysfs_hex(usb_fd, "bcdDevice", &dev->bcd_device))
+        return 0;
+    if (read_sysfs_string(usb_fd, "manufacturer", &dev->manufacturer_string) < 0 ||
+            read_sysfs_string(usb_fd, "product", &dev->product_string) < 0 ||
+            read_sysfs_string(usb_fd, "serial", &dev->serial_number_string) < 0)
+        return hs_error(HS_ERROR_MEMORY, NULL);
+
+    if (dev->type == HS_DEVICE_TYPE_HID) {
+        uint8_t desc[HID_MAX_DESCRIPTOR_SIZE];
+        char report_path[4096];
+        size_t desc_size = 0;
+        int fd;
+
+        /* The HID device (e.g. 0003:16C0:0478.0001) is the grandparent of the hidraw
+           device, in .../hidraw/hidrawX. */
+        size_t hid_len = strlen(ev->devpath);
+        for (unsigned int i = 0; i < 2 && hid_len; i++) {
+            while (hid_len && ev->devpath[hid_len - 1] != '/')
+                hid_len--;
+            if (hid_len)
+                hid_len--;
+        }
+
+        if (hid_len > usb_len + 1) {
+            snprintf(report_path, sizeof(report_path), "%.*s/report_descriptor",
+                     (int)(hid_len - usb_len - 1), ev->devpath + usb_len + 1);
+
+            fd = openat(usb_fd, report_path, O_RDONLY | O_CLOEXEC);
+            if (fd >= 0) {
+                ssize_t len = read(fd, desc, sizeof(desc));
+                if (len > 0)
+                    desc_size = (size_t)len;
+                close(fd);
+            }
+        }
+        if (!desc_size)
+            desc_size = read_hid_descriptor_hidraw(dev->path, desc, sizeof(desc));
+
+        if (desc_size) {
+            parse_hid_descriptor(dev, desc, desc_size);
+        } else {
+            hs_log(HS_LOG_DEBUG, "Cannot get HID report descriptor from '%s'", dev->path);
+        }
+    }
+
+    return 1;
+}
+
+static int read_uevent_device(hs_monitor *monitor, const struct _hs_uevent *ev, hs_device **rdev)
+{
+    hs_device *dev;
+    int r;
+
+    dev = (hs_device *)calloc(1, sizeof(*dev));
+    if (!dev)
+        return hs_error(HS_ERROR_MEMORY, NULL);
+    dev->refcount = 1;
+    dev->status = HS_DEVICE_STATUS_ONLINE;
+
+    r = fill_uevent_device_details(monitor, ev, dev);
+    if (r <= 0) {
+        hs_device_unref(dev);
+        return r;
+    }
+
+    *rdev = dev;
+    return 1;
+}
+
+static int open_netlink_socket(hs_monitor *monitor)
+{
+    struct sockaddr_nl snl = {0};
+    int buf_size = 4 * 1024 * 1024;
+    int one = 1;
+    int fd = -1;
+    int r;
+
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) {
+        r = hs_error(HS_ERROR_SYSTEM, "socket(NETLINK_KOBJECT_UEVENT) failed: %s",
+                     strerror(errno));
+        goto error;
+    }
+
+    /* Listen to udevd when it runs: it broadcasts events once the rules have been applied,
+       so the device nodes have the correct permissions. */
+    monitor->netlink_group = access("/run/udev/control", F_OK) == 0 ? _HS_UEVENT_GROUP_UDEV
+                                                                    : _HS_UEVENT_GROUP_KERNEL;
+
+    // Hotplug storms (e.g. hub power cycles) produce a lot of events at once
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &buf_size, sizeof(buf_size)) < 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+    r = setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &one, sizeof(one));
+    if (r < 0) {
+        r = hs_error(HS_ERROR_SYSTEM, "setsockopt(SO_PASSCRED) failed: %s", strerror(errno));
+        goto error;
+    }
+
+    snl.nl_family = AF_NETLINK;
+    snl.nl_groups = (uint32_t)monitor->netlink_group;
+    r = bind(fd, (struct sockaddr *)&snl, sizeof(snl));
+    if (r < 0) {
+        r = hs_error(HS_ERROR_SYSTEM, "bind() on netlink socket failed: %s", strerror(errno));
+        goto error;
+    }
+
+    monitor->netlink_fd = fd;
+    return 0;
+
+error:
+    if (fd >= 0)
+        close(fd);
+    return r;
+}
+
+bool _hs_parse_uevent(char *buf, size_t len, int group, struct _hs_uevent *rev)
+{
+    struct _hs_uevent ev = {0};
+    char *props;
+    size_t props_len;
+
+    if (group == _HS_UEVENT_GROUP_UDEV) {
+        struct udev_netlink_header header;
+
+        if (len < sizeof(header))
+            return false;
+        memcpy(&header, buf, sizeof(header));
+        if (memcmp(header.prefix, "libudev", 8) != 0 || ntohl(header.magic) != UDEV_NETLINK_MAGIC)
+            return false;
+        if (header.properties_off < sizeof(header) || header.properties_off > len ||
+                header.properties_len > len - header.properties_off)
+            return false;
+
+        props = buf + header.properties_off;
+        props_len = header.properties_len;
+    } else {
+        // Kernel messages start with action@devpath
+        size_t header_len = strnlen(buf, len);
+        if (header_len == len || !memchr(buf, '@', header_len))
+            return false;
+
+        props = buf + header_len + 1;
+        props_len = len - header_len - 1;
+    }
+
+    for (size_t i = 0; i < props_len;) {
+        char *key = props + i;
+        size_t key_len = strnlen(key, props_len - i);
+
+        if (i + key_len == props_len)
+            break;
+        i += key_len + 1;
+
+        if (strncmp(key, "ACTION=", 7) == 0) {
+            ev.action = key + 7;
+        } else if (strncmp(key, "DEVPATH=", 8) == 0) {
+            ev.devpath = key + 8;
+        } else if (strncmp(key, "SUBSYSTEM=", 10) == 0) {
+            ev.subsystem = key + 10;
+        } else if (strncmp(key, "DEVNAME=", 8) == 0) {
+            ev.devname = key + 8;
+        }
+    }
+    if (!ev.action || !ev.devpath || !ev.subsystem)
+        return false;
+
+    *rev = ev;
+    return true;
+}
+
+// Returns 1 and fills ev when an event is available, 0 if there are none left
+static int receive_uevent(hs_monitor *monitor, char *buf, size_t size, struct _hs_uevent *rev)
+{
+    for (;;) {
+        struct sockaddr_nl snl = {0};
+        char cred_buf[CMSG_SPACE(sizeof(struct ucred))];
+        struct iovec iov = {buf, size - 1};
+        struct msghdr msg = {0};
+        struct cmsghdr *cmsg;
+        const struct ucred *cred;
+        ssize_t len;
+
+        msg.msg_name = &snl;
+        msg.msg_namelen = sizeof(snl);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cred_buf;
+        msg.msg_controllen = sizeof(cred_buf);
+
+        len = recvmsg(monitor->netlink_fd, &msg, 0);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            if (errno == ENOBUFS) {
+                hs_log(HS_LOG_WARNING, "Some device events were lost (netlink buffer overflow)");
+                monitor->netlink_overflow = true;
+                continue;
+            }
+            return hs_error(HS_ERROR_SYSTEM, "recvmsg() on netlink socket failed: %s",
+                            strerror(errno));
+        }
+
+        // Only trust the kernel and udevd (running as root), like libudev does
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_CREDENTIALS)
+            continue;
+        cred = (const struct ucred *)CMSG_DATA(cmsg);
+        if (cred->uid != 0)
+            continue;
+        if (snl.nl_groups != (uint32_t)monitor->netlink_group ||
+                (monitor->netlink_group == _HS_UEVENT_GROUP_KERNEL && snl.nl_pid))
+            continue;
+
+        buf[len] = 0;
+        if (_hs_parse_uevent(buf, (size_t)len, monitor->netlink_group, rev))
+            return 1;
+    }
+}
+
+static int refresh_netlink(hs_monitor *monitor, hs_enumerate_func *f, void *udata)
+{
+    char buf[UEVENT_BUFFER_SIZE];
+    struct _hs_uevent ev;
+    int r;
+
+    while ((r = receive_uevent(monitor, buf, sizeof(buf), &ev)) > 0) {
+        bool interesting = false;
+
+        for (unsigned int i = 0; device_subsystems[i].subsystem; i++) {
+            if (strcmp(ev.subsystem, device_subsystems[i].subsystem) == 0 &&
+                    _hs_match_helper_has_type(&monitor->match_helper, device_subsystems[i].type)) {
+                interesting = true;
+                break;
+            }
+        }
+        if (!interesting)
+            continue;
+
+        r = 0;
+        if (strcmp(ev.action, "add") == 0) {
+            hs_device *dev = NULL;
+
+            if (ev.devname) {
+                r = read_uevent_device(monitor, &ev, &dev);
+                if (r > 0) {
+                    r = _hs_match_helper_match(&monitor->match_helper, dev, &dev->match_udata);
+                    if (r)
+                        r = _hs_monitor_add(&monitor->devices, dev, f, udata);
+                }
+            }
+
+            hs_device_unref(dev);
+        } else if (strcmp(ev.action, "remove") == 0) {
+            // The USB device is going away too, or has been replaced (e.g. board reboot)
+            if (monitor->usb_dir_path &&
+                    strncmp(ev.devpath, monitor->usb_dir_path, strlen(monitor->usb_dir_path)) == 0)
+                close_usb_directory(monitor);
+
+            _hs_monitor_remove(&monitor->devices, ev.devpath, f, udata);
+        }
+        if (r)
+            return r;
+    }
+
+    return r;
+}
+
 static void release_udev(void)
 {
     close(common_eventfd);
@@ -407,42 +936,245 @@ cleanup:
     return r;
 }
 
-static int enumerate(_hs_match_helper *match_helper, hs_enumerate_func *f, void *udata)
+/* Building devices is dominated by sysfs reads and HID descriptor parsing, so on machines
+   with many matching devices the initial scan is spread over a few threads. Each thread
+   uses its own udev context, and results are reported in scan order once all of them are
+   done. */
+#define ENUMERATE_MAX_WORKERS 4
+#define ENUMERATE_DEVICES_PER_WORKER 8
+
+struct enumerate_batch {
+    _HS_ARRAY(char *) syspaths;
+
+    const _hs_match_helper *match_helper;
+    hs_device **devices;
+};
+
+struct enumerate_worker {
+    struct enumerate_batch *batch;
+    unsigned int start;
+    unsigned int stride;
+
+    pthread_t thread;
+    bool started;
+    int r;
+};
+
+static void release_enumerate_batch(struct enumerate_batch *batch)
 {
-    struct udev_enumerate *enumerate;
+    if (batch->devices) {
+        for (size_t i = 0; i < batch->syspaths.count; i++)
+            hs_device_unref(batch->devices[i]);
+        free(batch->devices);
+    }
+    for (size_t i = 0; i < batch->syspaths.count; i++)
+        free(batch->syspaths.values[i]);
+    _hs_array_release(&batch->syspaths);
+}
+
+static int collect_syspaths(struct udev_enumerate *enumerate, struct enumerate_batch *batch)
+{
+    struct udev_list_entry *cur;
     int r;
 
-    enumerate = udev_enumerate_new(udev);
-    if (!enumerate) {
-        r = hs_error(HS_ERROR_MEMORY, NULL);
-        goto cleanup;
+    // Current implementation of udev_enumerate_scan_devices() does not fail
+    r = udev_enumerate_scan_devices(enumerate);
+    if (r < 0)
+        return hs_error(HS_ERROR_SYSTEM, "udev_enumerate_scan_devices() failed");
+
+    udev_list_entry_foreach(cur, udev_enumerate_get_list_entry(enumerate)) {
+        char *syspath;
+
+        syspath = strdup(udev_list_entry_get_name(cur));
+        if (!syspath)
+            return hs_error(HS_ERROR_MEMORY, NULL);
+        r = _hs_array_push(&batch->syspaths, syspath);
+        if (r < 0) {
+            free(syspath);
+            return hs_error(HS_ERROR_MEMORY, NULL);
+        }
+    }
+
+    return 0;
+}
+
+static int read_batch_devices(struct udev *ctx, struct enumerate_batch *batch,
+                              unsigned int start, unsigned int stride)
+{
+    for (size_t i = start; i < batch->syspaths.count; i += stride) {
+        struct udev_device *udev_dev;
+        int r;
+
+        udev_dev = udev_device_new_from_syspath(ctx, batch->syspaths.values[i]);
+        if (!udev_dev) {
+            if (errno == ENOMEM)
+                return hs_error(HS_ERROR_MEMORY, NULL);
+            continue;
+        }
+
+        r = read_device_information(udev_dev, batch->match_helper, &batch->devices[i]);
+        udev_device_unref(udev_dev);
+        if (r < 0)
+            return r;
+    }
+
+    return 0;
+}
+
+static void *enumerate_worker_thread(void *udata)
+{
+    struct enumerate_worker *worker = (struct enumerate_worker *)udata;
+    struct udev *ctx;
+
+    /* Error masks are thread-local, so the calling thread reports the error once we're
+       done. read_device_information() can only fail with HS_ERROR_MEMORY. */
+    hs_error_mask(HS_ERROR_MEMORY);
+
+    ctx = udev_new();
+    if (ctx) {
+        worker->r = read_batch_devices(ctx, worker->batch, worker->start, worker->stride);
+        udev_unref(ctx);
+    } else {
+        worker->r = HS_ERROR_MEMORY;
+    }
+
+    hs_error_unmask();
+    return NULL;
+}
+
+static unsigned int count_enumerate_workers(size_t count)
+{
+    long cpus;
+    size_t workers;
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 2)
+        return 1;
+
+    workers = count / ENUMERATE_DEVICES_PER_WORKER;
+    if (workers > (size_t)cpus)
+        workers = (size_t)cpus;
+    if (workers > ENUMERATE_MAX_WORKERS)
+        workers = ENUMERATE_MAX_WORKERS;
+
+    return workers ? (unsigned int)workers : 1;
+}
+
+static int process_enumerate_batch(struct enumerate_batch *batch, hs_enumerate_func *f,
+                                   void *udata)
+{
+    struct enumerate_worker workers[ENUMERATE_MAX_WORKERS] = {0};
+    unsigned int workers_count;
+    int r;
+
+    if (!batch->syspaths.count)
+        return 0;
+
+    batch->devices = (hs_device **)calloc(batch->syspaths.count, sizeof(*batch->devices));
+    if (!batch->devices)
+        return hs_error(HS_ERROR_MEMORY, NULL);
+
+    /* Devices are interleaved between workers, HID devices tend to be grouped together
+       and they cost more than serial devices. The calling thread takes the first share. */
+    workers_count = count_enumerate_workers(batch->syspaths.count);
+    for (unsigned int i = 1; i < workers_count; i++) {
+        workers[i].batch = batch;
+        workers[i].start = i;
+        workers[i].stride = workers_count;
+
+        // If we can't start a thread, we'll just do its share ourselves
+        workers[i].started = !pthread_create(&workers[i].thread, NULL,
+                                             enumerate_worker_thread, &workers[i]);
+    }
+
+    r = read_batch_devices(udev, batch, 0, workers_count);
+    for (unsigned int i = 1; i < workers_count; i++) {
+        if (workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
+            if (workers[i].r < 0 && r >= 0)
+                r = hs_error(HS_ERROR_MEMORY, NULL);
+        } else if (r >= 0) {
+            r = read_batch_devices(udev, batch, i, workers_count);
+        }
+    }
+    if (r < 0)
+        return r;
+
+    for (size_t i = 0; i < batch->syspaths.count; i++) {
+        hs_device *dev = batch->devices[i];
+
+        if (!dev)
+            continue;
+
+        if (_hs_match_helper_match(batch->match_helper, dev, &dev->match_udata)) {
+            r = (*f)(dev, udata);
+            if (r)
+                return r;
+        }
     }
 
+    return 0;
+}
+
+static struct udev_enumerate *new_subsystem_enumerate(_hs_match_helper *match_helper,
+                                                      bool with_ids)
+{
+    struct udev_enumerate *enumerate;
+
+    enumerate = udev_enumerate_new(udev);
+    if (!enumerate)
+        return NULL;
+
     udev_enumerate_add_match_is_initialized(enumerate);
     for (unsigned int i = 0; device_subsystems[i].subsystem; i++) {
-        if (_hs_match_helper_has_type(match_helper, device_subsystems[i].type)) {
-            r = udev_enumerate_add_match_subsystem(enumerate, device_subsystems[i].subsystem);
-            if (r < 0) {
-                r = hs_error(HS_ERROR_MEMORY, NULL);
-                goto cleanup;
+        hs_device_type type = device_subsystems[i].type;
+
+        if (_hs_match_helper_has_type(match_helper, type) &&
+                _hs_match_helper_has_ids(match_helper, type) == with_ids) {
+            if (udev_enumerate_add_match_subsystem(enumerate, device_subsystems[i].subsystem) < 0) {
+                udev_enumerate_unref(enumerate);
+                return NULL;
             }
         }
     }
 
-    // Current implementation of udev_enumerate_scan_devices() does not fail
-    r = udev_enumerate_scan_devices(enumerate);
+    return enumerate;
+}
+
+/* When the match specs restrict a device type to specific vendor IDs, we look for matching
+   USB devices first and then only enumerate their children, instead of going through every
+   device of this type (e.g. hundreds of virtual tty devices). */
+static int collect_usb_parents(_hs_match_helper *match_helper, struct enumerate_batch *batch)
+{
+    struct udev_enumerate *usb_enumerate = NULL;
+    struct udev_list_entry *cur;
+    int r;
+
+    usb_enumerate = udev_enumerate_new(udev);
+    if (!usb_enumerate) {
+        r = hs_error(HS_ERROR_MEMORY, NULL);
+        goto cleanup;
+    }
+    udev_enumerate_add_match_is_initialized(usb_enumerate);
+    if (udev_enumerate_add_match_subsystem(usb_enumerate, "usb") < 0 ||
+            udev_enumerate_add_match_property(usb_enumerate, "DEVTYPE", "usb_device") < 0) {
+        r = hs_error(HS_ERROR_MEMORY, NULL);
+        goto cleanup;
+    }
+    r = udev_enumerate_scan_devices(usb_enumerate);
     if (r < 0) {
         r = hs_error(HS_ERROR_SYSTEM, "udev_enumerate_scan_devices() failed");
         goto cleanup;
     }
 
-    struct udev_list_entry *cur;
-    udev_list_entry_foreach(cur, udev_enumerate_get_list_entry(enumerate)) {
-        struct udev_device *udev_dev;
-        hs_device *dev;
+    udev_list_entry_foreach(cur, udev_enumerate_get_list_entry(usb_enumerate)) {
+        struct udev_device *usb_dev;
+        struct udev_enumerate *enumerate;
+        const char *vid, *pid;
+        bool match = false;
 
-        udev_dev = udev_device_new_from_syspath(udev, udev_list_entry_get_name(cur));
-        if (!udev_dev) {
+        usb_dev = udev_device_new_from_syspath(udev, udev_list_entry_get_name(cur));
+        if (!usb_dev) {
             if (errno == ENOMEM) {
                 r = hs_error(HS_ERROR_MEMORY, NULL);
                 goto cleanup;
@@ -450,26 +1182,95 @@ static int enumerate(_hs_match_helper *match_helper, hs_enumerate_func *f, void
             continue;
         }
 
-        r = read_device_information(udev_dev, &dev);
-        udev_device_unref(udev_dev);
-        if (r < 0)
-            goto cleanup;
-        if (!r)
+        vid = udev_device_get_sysattr_value(usb_dev, "idVendor");
+        pid = udev_device_get_sysattr_value(usb_dev, "idProduct");
+        if (vid && pid) {
+            for (unsigned int i = 0; device_subsystems[i].subsystem; i++) {
+                hs_device_type type = device_subsystems[i].type;
+
+                if (_hs_match_helper_has_ids(match_helper, type) &&
+                        _hs_match_helper_match_ids(match_helper, type,
+                                                   (uint16_t)strtoul(vid, NULL, 16),
+                                                   (uint16_t)strtoul(pid, NULL, 16))) {
+                    match = true;
+                    break;
+                }
+            }
+        }
+        if (!match) {
+            udev_device_unref(usb_dev);
             continue;
+        }
 
-        if (_hs_match_helper_match(match_helper, dev, &dev->match_udata)) {
-            r = (*f)(dev, udata);
-            hs_device_unref(dev);
-            if (r)
-                goto cleanup;
-        } else {
-            hs_device_unref(dev);
+        enumerate = new_subsystem_enumerate(match_helper, true);
+        if (!enumerate) {
+            udev_device_unref(usb_dev);
+            r = hs_error(HS_ERROR_MEMORY, NULL);
+            goto cleanup;
+        }
+        r = udev_enumerate_add_match_parent(enumerate, usb_dev);
+        udev_device_unref(usb_dev);
+        if (r < 0) {
+            udev_enumerate_unref(enumerate);
+            r = hs_error(HS_ERROR_MEMORY, NULL);
+            goto cleanup;
         }
+
+        r = collect_syspaths(enumerate, batch);
+        udev_enumerate_unref(enumerate);
+        if (r < 0)
+            goto cleanup;
     }
 
     r = 0;
+cleanup:
+    udev_enumerate_unref(usb_enumerate);
+    return r;
+}
+
+static int enumerate(_hs_match_helper *match_helper, hs_enumerate_func *f, void *udata)
+{
+    struct enumerate_batch batch = {0};
+    struct udev_enumerate *enumerate = NULL;
+    bool scan = false, filter = false;
+    int r;
+
+    for (unsigned int i = 0; device_subsystems[i].subsystem; i++) {
+        hs_device_type type = device_subsystems[i].type;
+
+        if (_hs_match_helper_has_type(match_helper, type)) {
+            if (_hs_match_helper_has_ids(match_helper, type)) {
+                filter = true;
+            } else {
+                scan = true;
+            }
+        }
+    }
+
+    batch.match_helper = match_helper;
+
+    if (scan) {
+        enumerate = new_subsystem_enumerate(match_helper, false);
+        if (!enumerate) {
+            r = hs_error(HS_ERROR_MEMORY, NULL);
+            goto cleanup;
+        }
+
+        r = collect_syspaths(enumerate, &batch);
+        if (r < 0)
+            goto cleanup;
+    }
+    if (filter) {
+        r = collect_usb_parents(match_helper, &batch);
+        if (r < 0)
+            goto cleanup;
+    }
+
+    r = process_enumerate_batch(&batch, f, udata);
+
 cleanup:
     udev_enumerate_unref(enumerate);
+    release_enumerate_batch(&batch);
     return r;
 }
 
@@ -493,11 +1294,15 @@ int hs_enumerate(const hs_match_spec *matches, unsigned int count, hs_enumerate_
 
     _hs_match_helper match_helper = {0};
     struct enumerate_enumerate_context ctx;
+    bool simulated;
     int r;
 
-    r = init_udev();
-    if (r < 0)
-        return r;
+    simulated = _hs_simulator_enabled();
+    if (!simulated) {
+        r = init_udev();
+        if (r < 0)
+            return r;
+    }
 
     r = _hs_match_helper_init(&match_helper, matches, count);
     if (r < 0)
@@ -506,7 +1311,11 @@ int hs_enumerate(const hs_match_spec *matches, unsigned int count, hs_enumerate_
     ctx.f = f;
     ctx.udata = udata;
 
-    r = enumerate(&match_helper, enumerate_enumerate_callback, &ctx);
+    if (simulated) {
+        r = _hs_simulator_enumerate(&match_helper, enumerate_enumerate_callback, &ctx);
+    } else {
+        r = enumerate(&match_helper, enumerate_enumerate_callback, &ctx);
+    }
 
     _hs_match_helper_release(&match_helper);
     return r;
@@ -525,6 +1334,8 @@ int hs_monitor_new(const hs_match_spec *matches, unsigned int count, hs_monitor
         goto error;
     }
     monitor->wait_fd = -1;
+    monitor->netlink_fd = -1;
+    monitor->usb_dir_fd = -1;
 
     r = _hs_match_helper_init(&monitor->match_helper, matches, count);
     if (r < 0)
@@ -534,6 +1345,20 @@ int hs_monitor_new(const hs_match_spec *matches, unsigned int count, hs_monitor
     if (r < 0)
         goto error;
 
+    // The simulator signals this eventfd directly when devices change
+    if (_hs_simulator_enabled()) {
+        monitor->simulated = true;
+
+        monitor->wait_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (monitor->wait_fd < 0) {
+            r = hs_error(HS_ERROR_SYSTEM, "eventfd() failed: %s", strerror(errno));
+            goto error;
+        }
+
+        *rmonitor = monitor;
+        return 0;
+    }
+
     r = init_udev();
     if (r < 0)
         goto error;
@@ -555,6 +1380,10 @@ error:
 void hs_monitor_free(hs_monitor *monitor)
 {
     if (monitor) {
+        if (monitor->simulator_started)
+            hs_monitor_stop(monitor);
+        if (monitor->netlink_fd >= 0)
+            hs_monitor_stop(monitor);
         close(monitor->wait_fd);
         udev_monitor_unref(monitor->udev_mon);
 
@@ -578,8 +1407,46 @@ int hs_monitor_start(hs_monitor *monitor)
 
     int r;
 
-    if (monitor->udev_mon)
+    if (monitor->simulated) {
+        if (monitor->simulator_started)
+            return 0;
+
+        r = _hs_simulator_register_monitor(monitor->wait_fd);
+        if (r < 0)
+            return r;
+        monitor->simulator_started = true;
+
+        r = _hs_simulator_enumerate(&monitor->match_helper, monitor_enumerate_callback, monitor);
+        if (r < 0) {
+            hs_monitor_stop(monitor);
+            return r;
+        }
+
         return 0;
+    }
+
+    if (monitor->udev_mon || monitor->netlink_fd >= 0)
+        return 0;
+
+    if (!getenv("LIBHS_LINUX_FORCE_LIBUDEV")) {
+        // Start listening before the enumeration, or we could miss some events
+        hs_error_mask(HS_ERROR_SYSTEM);
+        r = open_netlink_socket(monitor);
+        hs_error_unmask();
+        if (!r) {
+            r = enumerate(&monitor->match_helper, monitor_enumerate_callback, monitor);
+            if (r < 0)
+                goto error;
+
+            if (dup3(monitor->netlink_fd, monitor->wait_fd, O_CLOEXEC) < 0) {
+                r = hs_error(HS_ERROR_SYSTEM, "dup3() failed: %s", strerror(errno));
+                goto error;
+            }
+            return 0;
+        }
+
+        hs_log(HS_LOG_DEBUG, "Falling back to libudev monitor: %s", hs_error_last_message());
+    }
 
     monitor->udev_mon = udev_monitor_new_from_netlink(udev, "udev");
     if (!monitor->udev_mon) {
@@ -607,9 +1474,10 @@ int hs_monitor_start(hs_monitor *monitor)
     if (r < 0)
         goto error;
 
-    /* Given the documentation of dup3() and the kernel code handling it, I'm reasonably sure
-       nothing can make this call fail. */
-    dup3(udev_monitor_get_fd(monitor->udev_mon), monitor->wait_fd, O_CLOEXEC);
+    if (dup3(udev_monitor_get_fd(monitor->udev_mon), monitor->wait_fd, O_CLOEXEC) < 0) {
+        r = hs_error(HS_ERROR_SYSTEM, "dup3() failed: %s", strerror(errno));
+        goto error;
+    }
 
     return 0;
 
@@ -622,12 +1490,32 @@ void hs_monitor_stop(hs_monitor *monitor)
 {
     assert(monitor);
 
-    if (!monitor->udev_mon)
+    if (monitor->simulated) {
+        if (!monitor->simulator_started)
+            return;
+
+        _hs_simulator_unregister_monitor(monitor->wait_fd);
+        _hs_monitor_clear_devices(&monitor->devices);
+        monitor->simulator_started = false;
+
+        return;
+    }
+
+    if (!monitor->udev_mon && monitor->netlink_fd < 0)
         return;
 
     _hs_monitor_clear_devices(&monitor->devices);
 
-    dup3(common_eventfd, monitor->wait_fd, O_CLOEXEC);
+    /* The old descriptor stays in place if this fails, the poll handle may then report
+       spurious events but the refresh functions handle that. */
+    if (dup3(common_eventfd, monitor->wait_fd, O_CLOEXEC) < 0)
+        hs_log(HS_LOG_WARNING, "dup3() failed: %s", strerror(errno));
+    if (monitor->netlink_fd >= 0) {
+        close(monitor->netlink_fd);
+        monitor->netlink_fd = -1;
+        monitor->netlink_overflow = false;
+        close_usb_directory(monitor);
+    }
     udev_monitor_unref(monitor->udev_mon);
     monitor->udev_mon = NULL;
 }
@@ -638,6 +1526,70 @@ hs_handle hs_monitor_get_poll_handle(const hs_monitor *monitor)
     return monitor->wait_fd;
 }
 
+static int rescan_enumerate_callback(hs_device *dev, void *udata)
+{
+    device_array *devs = (device_array *)udata;
+
+    if (_hs_array_push(devs, hs_device_ref(dev)) < 0) {
+        hs_device_unref(dev);
+        return hs_error(HS_ERROR_MEMORY, NULL);
+    }
+
+    return 0;
+}
+
+/* Some events were lost, compare the current devices to the ones we know about and
+   report the differences. */
+static int rescan_devices(hs_monitor *monitor, hs_enumerate_func *f, void *udata)
+{
+    device_array devs = {0};
+    device_array gone = {0};
+    int r;
+
+    // Nothing we have cached about sysfs can be trusted anymore
+    close_usb_directory(monitor);
+
+    r = enumerate(&monitor->match_helper, rescan_enumerate_callback, &devs);
+    if (r < 0)
+        goto cleanup;
+
+    _hs_htable_foreach(cur, &monitor->devices) {
+        hs_device *dev = _hs_container_of(cur, hs_device, hnode);
+        bool found = false;
+
+        for (size_t i = 0; i < devs.count; i++) {
+            if (strcmp(devs.values[i]->key, dev->key) == 0 &&
+                    devs.values[i]->iface_number == dev->iface_number) {
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            r = _hs_array_push(&gone, hs_device_ref(dev));
+            if (r < 0) {
+                hs_device_unref(dev);
+                r = hs_error(HS_ERROR_MEMORY, NULL);
+                goto cleanup;
+            }
+        }
+    }
+    for (size_t i = 0; i < gone.count; i++)
+        _hs_monitor_remove(&monitor->devices, gone.values[i]->key, f, udata);
+
+    r = 0;
+    for (size_t i = 0; i < devs.count && !r; i++)
+        r = _hs_monitor_add(&monitor->devices, devs.values[i], f, udata);
+
+cleanup:
+    for (size_t i = 0; i < gone.count; i++)
+        hs_device_unref(gone.values[i]);
+    _hs_array_release(&gone);
+    for (size_t i = 0; i < devs.count; i++)
+        hs_device_unref(devs.values[i]);
+    _hs_array_release(&devs);
+    return r;
+}
+
 int hs_monitor_refresh(hs_monitor *monitor, hs_enumerate_func *f, void *udata)
 {
     assert(monitor);
@@ -645,6 +1597,25 @@ int hs_monitor_refresh(hs_monitor *monitor, hs_enumerate_func *f, void *udata)
     struct udev_device *udev_dev;
     int r;
 
+    if (monitor->simulated) {
+        uint64_t value;
+        ssize_t len _HS_POSSIBLY_UNUSED;
+
+        if (!monitor->simulator_started)
+            return 0;
+
+        len = read(monitor->wait_fd, &value, sizeof(value));
+        return _hs_simulator_refresh(&monitor->match_helper, &monitor->devices, f, udata);
+    }
+
+    if (monitor->netlink_fd >= 0) {
+        r = refresh_netlink(monitor, f, udata);
+        if (!r && monitor->netlink_overflow) {
+            monitor->netlink_overflow = false;
+            r = rescan_devices(monitor, f, udata);
+        }
+        return r;
+    }
     if (!monitor->udev_mon)
         return 0;
 
@@ -656,7 +1627,7 @@ int hs_monitor_refresh(hs_monitor *monitor, hs_enumerate_func *f, void *udata)
         if (strcmp(action, "add") == 0) {
             hs_device *dev = NULL;
 
-            r = read_device_information(udev_dev, &dev);
+            r = read_device_information(udev_dev, &monitor->match_helper, &dev);
             if (r > 0) {
                 r = _hs_match_helper_match(&monitor->match_helper, dev, &dev->match_udata);
                 if (r)
@@ -26,4 +26,25 @@ void _hs_monitor_remove(_hs_htable *devices, const char *key, hs_enumerate_func
 
 int _hs_monitor_list(_hs_htable *devices, hs_enumerate_func *f, void *udata);
 
+#ifdef __linux__
+
+// Multicast groups of NETLINK_KOBJECT_UEVENT sockets
+enum {
+    _HS_UEVENT_GROUP_KERNEL = 1,
+    _HS_UEVENT_GROUP_UDEV = 2
+};
+
+// Strings point inside the message buffer, devname is NULL for devices without a node
+struct _hs_uevent {
+    const char *action;
+    const char *devpath;
+    const char *subsystem;
+    const char *devname;
+};
+
+// Parse a message from the kernel or from udevd, buf must be NUL-terminated after len
+bool _hs_parse_uevent(char *buf, size_t len, int group, struct _hs_uevent *rev);
+
+#endif
+
 #endif
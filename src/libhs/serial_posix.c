@@ -16,6 +16,9 @@
 #include "device_priv.h"
 #include "platform.h"
 #include "serial.h"
+#ifdef __linux__
+    #include "simulator_priv.h"
+#endif
 
 int hs_serial_set_config(hs_port *port, const hs_serial_config *config)
 {
@@ -24,16 +27,22 @@ int hs_serial_set_config(hs_port *port, const hs_serial_config *config)
 
     struct termios tio;
     int modem_bits;
+    bool has_modem_bits;
     int r;
 
     r = tcgetattr(port->u.file.fd, &tio);
     if (r < 0)
         return hs_error(HS_ERROR_SYSTEM, "Unable to get serial port settings from '%s': %s",
                         port->path, strerror(errno));
+    /* Simulated boards use ptys, which don't have modem control lines. RTS and DTR changes
+       are ignored for them. */
     r = ioctl(port->u.file.fd, TIOCMGET, &modem_bits);
-    if (r < 0)
+    if (r < 0 && !(port->dev->simulated && (errno == ENOTTY || errno == EINVAL)))
         return hs_error(HS_ERROR_SYSTEM, "Unable to get modem bits from '%s': %s",
                         port->path, strerror(errno));
+    has_modem_bits = (r >= 0);
+    if (!has_modem_bits)
+        modem_bits = 0;
 
     if (config->baudrate) {
         speed_t std_baudrate;
@@ -162,15 +171,23 @@ int hs_serial_set_config(hs_port *port, const hs_serial_config *config)
         }
     }
 
-    r = ioctl(port->u.file.fd, TIOCMSET, &modem_bits);
-    if (r < 0)
-        return hs_error(HS_ERROR_SYSTEM, "Unable to set modem bits of '%s': %s",
-                        port->path, strerror(errno));
+    if (has_modem_bits) {
+        r = ioctl(port->u.file.fd, TIOCMSET, &modem_bits);
+        if (r < 0)
+            return hs_error(HS_ERROR_SYSTEM, "Unable to set modem bits of '%s': %s",
+                            port->path, strerror(errno));
+    }
     r = tcsetattr(port->u.file.fd, TCSANOW, &tio);
     if (r < 0)
         return hs_error(HS_ERROR_SYSTEM, "Unable to change serial port settings of '%s': %s",
                         port->path, strerror(errno));
 
+#ifdef __linux__
+    // Simulated Teensy boards reboot when the baud rate is set to 134
+    if (config->baudrate)
+        _hs_simulator_set_baudrate(port->dev, config->baudrate);
+#endif
+
     return 0;
 }
 
@@ -187,9 +204,12 @@ int hs_serial_get_config(hs_port *port, hs_serial_config *config)
         return hs_error(HS_ERROR_SYSTEM, "Unable to read port settings from '%s': %s",
                         port->path, strerror(errno));
     r = ioctl(port->u.file.fd, TIOCMGET, &modem_bits);
-    if (r < 0)
-        return hs_error(HS_ERROR_SYSTEM, "Unable to get modem bits from '%s': %s",
-                        port->path, strerror(errno));
+    if (r < 0) {
+        if (!port->dev->simulated || (errno != ENOTTY && errno != EINVAL))
+            return hs_error(HS_ERROR_SYSTEM, "Unable to get modem bits from '%s': %s",
+                            port->path, strerror(errno));
+        modem_bits = 0;
+    }
 
     /* 0 is the INVALID value for all parameters, we keep that value if we can't interpret
        a termios value (only a cross-platform subset of it is exposed in hs_serial_config). */
@@ -0,0 +1,734 @@
+/* libhs - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/libhs
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#include "common_priv.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <termios.h>
+#include <unistd.h>
+#include "array.h"
+#include "device_priv.h"
+#include "monitor_priv.h"
+#include "platform.h"
+#include "simulator_priv.h"
+
+/* Simulated Teensy boards replace real devices when the LIBHS_SIMULATOR environment
+   variable is set, so that the whole reboot, upload and reset cycle can run (and be
+   measured) without any hardware:
+
+   - In run mode, each board is a serial device backed by a pty, and whatever is written
+     to it gets echoed back. Setting the baud rate to 134 reboots it to the bootloader.
+   - In bootloader mode, each board is a HalfKay HID device handled in-process. The first
+     block triggers an erase, during which writes stall (HS_ERROR_IO). Other blocks take
+     some time to write, and a write to 0xFFFFFF resets the board to run mode.
+
+   Each mode change removes the device, and the new one shows up after the reboot delay,
+   like with real boards. The variable contains comma-separated settings, for example
+   "boards=4,model=teensy36,erase=300,write=2,reboot=200" (delays in milliseconds). */
+
+#define SIMULATOR_KEY_PREFIX "/sim/"
+#define SIMULATOR_MAX_BOARDS 64
+#define SIMULATOR_BASE_SERIAL 10000000
+
+#define TEENSY_VID 0x16C0
+#define TEENSY_SERIAL_PID 0x483
+#define TEENSY_HALFKAY_PID 0x478
+#define TEENSY_HALFKAY_USAGE_PAGE 0xFF9C
+
+struct simulator_model {
+    const char *name;
+    uint16_t bcd_device;
+    uint16_t halfkay_usage;
+};
+
+enum simulator_mode {
+    SIMULATOR_MODE_OFF,
+    SIMULATOR_MODE_RUN,
+    SIMULATOR_MODE_BOOTLOADER
+};
+
+struct _hs_simulator_board {
+    unsigned int idx;
+    unsigned int generation;
+
+    enum simulator_mode mode;
+    hs_device *dev;
+
+    // Rebooting boards come back in next_mode at next_mode_time
+    enum simulator_mode next_mode;
+    uint64_t next_mode_time;
+
+    // Run mode, we keep a slave descriptor open or the master would poll HUP forever
+    int pty_master;
+    int pty_slave;
+
+    // Bootloader mode, writes stall until busy_until
+    uint64_t busy_until;
+    size_t blocks_count;
+};
+
+typedef _HS_ARRAY(int) simulator_fd_array;
+
+struct simulator {
+    pthread_mutex_t mutex;
+    bool init;
+    bool enabled;
+
+    unsigned int boards_count;
+    const struct simulator_model *model;
+    int erase_delay;
+    int write_delay;
+    int reboot_delay;
+
+    struct _hs_simulator_board boards[SIMULATOR_MAX_BOARDS];
+    simulator_fd_array monitor_fds;
+
+    // Wakes up the simulator thread when a reboot is scheduled
+    int wake_fd;
+};
+
+static const struct simulator_model simulator_models[] = {
+    {"teensy30", 0x274, 0x1D},
+    {"teensy31", 0x275, 0x1E},
+    {"teensy32", 0x275, 0x21},
+    {"teensylc", 0x273, 0x20},
+    {"teensy35", 0x276, 0x1F},
+    {"teensy36", 0x277, 0x22},
+    {"teensy40", 0x279, 0x24},
+    {NULL}
+};
+
+static struct simulator simulator = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+static void parse_settings(const char *settings)
+{
+    char buf[256];
+    char *token, *saveptr;
+
+    simulator.boards_count = 1;
+    simulator.model = &simulator_models[5];
+    simulator.erase_delay = 300;
+    simulator.write_delay = 2;
+    simulator.reboot_delay = 200;
+
+    strncpy(buf, settings, sizeof(buf));
+    buf[sizeof(buf) - 1] = 0;
+
+    for (token = strtok_r(buf, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(token, '=');
+        int number;
+
+        if (value) {
+            *value++ = 0;
+        } else {
+            // A lone number is the number of boards, "1" is fine to enable the simulator
+            value = token;
+            token = "boards";
+        }
+        number = atoi(value);
+
+        if (strcmp(token, "boards") == 0 && number > 0) {
+            simulator.boards_count = (unsigned int)number;
+            if (simulator.boards_count > SIMULATOR_MAX_BOARDS)
+                simulator.boards_count = SIMULATOR_MAX_BOARDS;
+        } else if (strcmp(token, "model") == 0) {
+            const struct simulator_model *model = simulator_models;
+
+            while (model->name && strcmp(model->name, value) != 0)
+                model++;
+            if (model->name) {
+                simulator.model = model;
+            } else {
+                hs_log(HS_LOG_WARNING, "Unknown simulated model '%s'", value);
+            }
+        } else if (strcmp(token, "erase") == 0 && number >= 0) {
+            simulator.erase_delay = number;
+        } else if (strcmp(token, "write") == 0 && number >= 0) {
+            simulator.write_delay = number;
+        } else if (strcmp(token, "reboot") == 0 && number >= 0) {
+            simulator.reboot_delay = number;
+        } else {
+            hs_log(HS_LOG_WARNING, "Ignoring invalid simulator setting '%s'", token);
+        }
+    }
+}
+
+static void notify_monitors(void)
+{
+    uint64_t value = 1;
+
+    for (size_t i = 0; i < simulator.monitor_fds.count; i++) {
+        ssize_t r _HS_POSSIBLY_UNUSED = write(simulator.monitor_fds.values[i], &value,
+                                             sizeof(value));
+    }
+}
+
+static void close_pty(struct _hs_simulator_board *board)
+{
+    if (board->pty_slave >= 0)
+        close(board->pty_slave);
+    board->pty_slave = -1;
+    if (board->pty_master >= 0)
+        close(board->pty_master);
+    board->pty_master = -1;
+}
+
+static int open_pty(struct _hs_simulator_board *board, char *path, size_t size)
+{
+    struct termios tio;
+    int r;
+
+    board->pty_master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC | O_NONBLOCK);
+    if (board->pty_master < 0) {
+        r = hs_error(HS_ERROR_SYSTEM, "posix_openpt() failed: %s", strerror(errno));
+        goto error;
+    }
+    if (grantpt(board->pty_master) < 0 || unlockpt(board->pty_master) < 0 ||
+            ptsname_r(board->pty_master, path, size)) {
+        r = hs_error(HS_ERROR_SYSTEM, "Failed to set up pty: %s", strerror(errno));
+        goto error;
+    }
+
+    board->pty_slave = open(path, O_RDWR | O_NOCTTY | O_CLOEXEC | O_NONBLOCK);
+    if (board->pty_slave < 0) {
+        r = hs_error(HS_ERROR_SYSTEM, "open('%s') failed: %s", path, strerror(errno));
+        goto error;
+    }
+
+    // Echo is done by the simulator thread, the line discipline must not mangle anything
+    if (tcgetattr(board->pty_slave, &tio) < 0) {
+        r = hs_error(HS_ERROR_SYSTEM, "tcgetattr() failed on '%s': %s", path, strerror(errno));
+        goto error;
+    }
+    cfmakeraw(&tio);
+    if (tcsetattr(board->pty_slave, TCSANOW, &tio) < 0) {
+        r = hs_error(HS_ERROR_SYSTEM, "tcsetattr() failed on '%s': %s", path, strerror(errno));
+        goto error;
+    }
+
+    return 0;
+
+error:
+    close_pty(board);
+    return r;
+}
+
+static int create_device(struct _hs_simulator_board *board, enum simulator_mode mode,
+                         hs_device **rdev)
+{
+    hs_device *dev;
+    char path[256];
+    int r;
+
+    dev = (hs_device *)calloc(1, sizeof(*dev));
+    if (!dev) {
+        r = hs_error(HS_ERROR_MEMORY, NULL);
+        goto error;
+    }
+    dev->refcount = 1;
+    dev->status = HS_DEVICE_STATUS_ONLINE;
+
+    if (mode == SIMULATOR_MODE_RUN) {
+        r = open_pty(board, path, sizeof(path));
+        if (r < 0)
+            goto error;
+
+        dev->type = HS_DEVICE_TYPE_SERIAL;
+        dev->pid = TEENSY_SERIAL_PID;
+        r = _hs_asprintf(&dev->serial_number_string, "%u", SIMULATOR_BASE_SERIAL + board->idx);
+        if (r < 0)
+            goto memory_error;
+        dev->product_string = strdup("USB Serial");
+        if (!dev->product_string)
+            goto memory_error;
+    } else {
+        snprintf(path, sizeof(path), "sim:halfkay:%u", board->idx);
+
+        dev->type = HS_DEVICE_TYPE_HID;
+        dev->pid = TEENSY_HALFKAY_PID;
+        dev->u.hid.usage_page = TEENSY_HALFKAY_USAGE_PAGE;
+        dev->u.hid.usage = simulator.model->halfkay_usage;
+        // HalfKay reports the serial number in hexadecimal
+        r = _hs_asprintf(&dev->serial_number_string, "%08X", SIMULATOR_BASE_SERIAL + board->idx);
+        if (r < 0)
+            goto memory_error;
+    }
+    dev->vid = TEENSY_VID;
+    dev->bcd_device = simulator.model->bcd_device;
+    dev->simulated = true;
+    dev->manufacturer_string = strdup("Teensyduino");
+    if (!dev->manufacturer_string)
+        goto memory_error;
+
+    r = _hs_asprintf(&dev->key, SIMULATOR_KEY_PREFIX "%u/%s/%u", board->idx,
+                     hs_device_type_strings[dev->type], ++board->generation);
+    if (r < 0)
+        goto memory_error;
+    // Each board gets its own hub port
+    r = _hs_asprintf(&dev->location, "usb-9-%u", board->idx + 1);
+    if (r < 0)
+        goto memory_error;
+    dev->path = strdup(path);
+    if (!dev->path)
+        goto memory_error;
+
+    *rdev = dev;
+    return 0;
+
+memory_error:
+    r = hs_error(HS_ERROR_MEMORY, NULL);
+error:
+    close_pty(board);
+    hs_device_unref(dev);
+    return r;
+}
+
+// Call with the mutex locked
+static void switch_board_mode(struct _hs_simulator_board *board, enum simulator_mode mode)
+{
+    hs_device_unref(board->dev);
+    board->dev = NULL;
+    close_pty(board);
+
+    board->mode = SIMULATOR_MODE_OFF;
+    board->next_mode = SIMULATOR_MODE_OFF;
+
+    if (mode != SIMULATOR_MODE_OFF) {
+        if (create_device(board, mode, &board->dev) < 0)
+            return;
+        board->mode = mode;
+        board->busy_until = 0;
+        board->blocks_count = 0;
+    }
+
+    notify_monitors();
+}
+
+// Call with the mutex locked
+static void reboot_board(struct _hs_simulator_board *board, enum simulator_mode mode)
+{
+    uint64_t value = 1;
+    ssize_t r _HS_POSSIBLY_UNUSED;
+
+    hs_log(HS_LOG_DEBUG, "Rebooting simulated board %u to %s mode", board->idx,
+           mode == SIMULATOR_MODE_RUN ? "run" : "bootloader");
+
+    switch_board_mode(board, SIMULATOR_MODE_OFF);
+    board->next_mode = mode;
+    board->next_mode_time = hs_millis() + (uint64_t)simulator.reboot_delay;
+
+    r = write(simulator.wake_fd, &value, sizeof(value));
+}
+
+static void echo_serial(struct _hs_simulator_board *board)
+{
+    uint8_t buf[4096];
+    ssize_t len;
+
+    len = read(board->pty_master, buf, sizeof(buf));
+    if (len > 0) {
+        // Drop what does not fit, like a device would if nobody reads its output
+        ssize_t r _HS_POSSIBLY_UNUSED = write(board->pty_master, buf, (size_t)len);
+    }
+}
+
+static void *simulator_thread(void *udata)
+{
+    _HS_UNUSED(udata);
+
+    struct pollfd pfds[SIMULATOR_MAX_BOARDS + 1];
+    unsigned int pfd_boards[SIMULATOR_MAX_BOARDS + 1];
+
+    while (true) {
+        unsigned int pfds_count = 0;
+        int timeout = -1;
+        uint64_t now;
+
+        pthread_mutex_lock(&simulator.mutex);
+
+        now = hs_millis();
+        pfds[pfds_count].fd = simulator.wake_fd;
+        pfds[pfds_count++].events = POLLIN;
+        for (unsigned int i = 0; i < simulator.boards_count; i++) {
+            struct _hs_simulator_board *board = &simulator.boards[i];
+
+            if (board->next_mode != SIMULATOR_MODE_OFF) {
+                if (now >= board->next_mode_time) {
+                    switch_board_mode(board, board->next_mode);
+                } else {
+                    int delay = (int)(board->next_mode_time - now);
+                    if (timeout < 0 || delay < timeout)
+                        timeout = delay;
+                }
+            }
+
+            if (board->pty_master >= 0) {
+                pfds[pfds_count].fd = board->pty_master;
+                pfds[pfds_count].events = POLLIN;
+                pfd_boards[pfds_count++] = i;
+            }
+        }
+
+        pthread_mutex_unlock(&simulator.mutex);
+
+        if (poll(pfds, pfds_count, timeout) <= 0)
+            continue;
+
+        if (pfds[0].revents & POLLIN) {
+            uint64_t value;
+            ssize_t r _HS_POSSIBLY_UNUSED = read(simulator.wake_fd, &value, sizeof(value));
+        }
+
+        pthread_mutex_lock(&simulator.mutex);
+        for (unsigned int i = 1; i < pfds_count; i++) {
+            struct _hs_simulator_board *board = &simulator.boards[pfd_boards[i]];
+
+            // The board may have rebooted in the mean time
+            if (pfds[i].revents & POLLIN && board->pty_master == pfds[i].fd)
+                echo_serial(board);
+        }
+        pthread_mutex_unlock(&simulator.mutex);
+    }
+
+    return NULL;
+}
+
+static void init_simulator(void)
+{
+    const char *settings;
+    pthread_t thread;
+    int r;
+
+    if (simulator.init)
+        return;
+    simulator.init = true;
+
+    settings = getenv("LIBHS_SIMULATOR");
+    if (!settings || !settings[0])
+        return;
+    parse_settings(settings);
+
+    simulator.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (simulator.wake_fd < 0) {
+        hs_error(HS_ERROR_SYSTEM, "eventfd() failed: %s", strerror(errno));
+        return;
+    }
+
+    for (unsigned int i = 0; i < simulator.boards_count; i++) {
+        struct _hs_simulator_board *board = &simulator.boards[i];
+
+        board->idx = i;
+        board->pty_master = -1;
+        board->pty_slave = -1;
+        switch_board_mode(board, SIMULATOR_MODE_RUN);
+    }
+
+    r = pthread_create(&thread, NULL, simulator_thread, NULL);
+    if (r) {
+        hs_error(HS_ERROR_SYSTEM, "pthread_create() failed: %s", strerror(r));
+        return;
+    }
+    pthread_detach(thread);
+
+    hs_log(HS_LOG_DEBUG, "Simulating %u %s board(s)", simulator.boards_count,
+           simulator.model->name);
+    simulator.enabled = true;
+}
+
+bool _hs_simulator_enabled(void)
+{
+    bool enabled;
+
+    pthread_mutex_lock(&simulator.mutex);
+    init_simulator();
+    enabled = simulator.enabled;
+    pthread_mutex_unlock(&simulator.mutex);
+
+    return enabled;
+}
+
+static hs_device *copy_device(const hs_device *dev)
+{
+    hs_device *copy;
+
+    copy = (hs_device *)calloc(1, sizeof(*copy));
+    if (!copy)
+        return NULL;
+    *copy = *dev;
+    copy->refcount = 1;
+    memset(&copy->hnode, 0, sizeof(copy->hnode));
+
+    copy->key = strdup(dev->key);
+    copy->location = strdup(dev->location);
+    copy->path = strdup(dev->path);
+    copy->manufacturer_string = dev->manufacturer_string ? strdup(dev->manufacturer_string) : NULL;
+    copy->product_string = dev->product_string ? strdup(dev->product_string) : NULL;
+    copy->serial_number_string = dev->serial_number_string ? strdup(dev->serial_number_string) : NULL;
+    if (!copy->key || !copy->location || !copy->path ||
+            (dev->manufacturer_string && !copy->manufacturer_string) ||
+            (dev->product_string && !copy->product_string) ||
+            (dev->serial_number_string && !copy->serial_number_string)) {
+        hs_device_unref(copy);
+        return NULL;
+    }
+
+    return copy;
+}
+
+/* Each caller gets its own copies, because match_udata and status are specific to each
+   monitor. Returns the number of devices, or an error. */
+static int copy_current_devices(hs_device **rdevs)
+{
+    unsigned int count = 0;
+    int r;
+
+    pthread_mutex_lock(&simulator.mutex);
+    for (unsigned int i = 0; i < simulator.boards_count; i++) {
+        const struct _hs_simulator_board *board = &simulator.boards[i];
+
+        if (!board->dev)
+            continue;
+
+        rdevs[count] = copy_device(board->dev);
+        if (!rdevs[count]) {
+            r = hs_error(HS_ERROR_MEMORY, NULL);
+            goto error;
+        }
+        count++;
+    }
+    pthread_mutex_unlock(&simulator.mutex);
+
+    return (int)count;
+
+error:
+    pthread_mutex_unlock(&simulator.mutex);
+    for (unsigned int i = 0; i < count; i++)
+        hs_device_unref(rdevs[i]);
+    return r;
+}
+
+int _hs_simulator_enumerate(const _hs_match_helper *match_helper, hs_enumerate_func *f,
+                            void *udata)
+{
+    hs_device *devs[SIMULATOR_MAX_BOARDS];
+    int count, r;
+
+    count = copy_current_devices(devs);
+    if (count < 0)
+        return count;
+
+    r = 0;
+    for (int i = 0; i < count; i++) {
+        hs_device *dev = devs[i];
+
+        if (!r && _hs_match_helper_match(match_helper, dev, &dev->match_udata))
+            r = (*f)(dev, udata);
+        hs_device_unref(dev);
+    }
+
+    return r;
+}
+
+int _hs_simulator_register_monitor(int fd)
+{
+    int r;
+
+    pthread_mutex_lock(&simulator.mutex);
+    r = _hs_array_push(&simulator.monitor_fds, fd);
+    pthread_mutex_unlock(&simulator.mutex);
+
+    return r;
+}
+
+void _hs_simulator_unregister_monitor(int fd)
+{
+    pthread_mutex_lock(&simulator.mutex);
+    for (size_t i = 0; i < simulator.monitor_fds.count; i++) {
+        if (simulator.monitor_fds.values[i] == fd) {
+            _hs_array_remove(&simulator.monitor_fds, i, 1);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&simulator.mutex);
+}
+
+int _hs_simulator_refresh(const _hs_match_helper *match_helper, _hs_htable *devices,
+                          hs_enumerate_func *f, void *udata)
+{
+    hs_device *devs[SIMULATOR_MAX_BOARDS];
+    hs_device *gone[SIMULATOR_MAX_BOARDS];
+    unsigned int gone_count = 0;
+    int count, r;
+
+    count = copy_current_devices(devs);
+    if (count < 0)
+        return count;
+
+    /* Device keys change after each reboot, so comparing keys is enough to detect quick
+       remove/add sequences that happened since the last refresh. */
+    _hs_htable_foreach(cur, devices) {
+        hs_device *dev = _hs_container_of(cur, hs_device, hnode);
+        bool found = false;
+
+        for (int i = 0; i < count; i++) {
+            if (strcmp(devs[i]->key, dev->key) == 0) {
+                found = true;
+                break;
+            }
+        }
+        if (!found && gone_count < SIMULATOR_MAX_BOARDS)
+            gone[gone_count++] = hs_device_ref(dev);
+    }
+    for (unsigned int i = 0; i < gone_count; i++) {
+        _hs_monitor_remove(devices, gone[i]->key, f, udata);
+        hs_device_unref(gone[i]);
+    }
+
+    r = 0;
+    for (int i = 0; i < count; i++) {
+        hs_device *dev = devs[i];
+
+        if (!r && _hs_match_helper_match(match_helper, dev, &dev->match_udata))
+            r = _hs_monitor_add(devices, dev, f, udata);
+        hs_device_unref(dev);
+    }
+
+    return r;
+}
+
+bool _hs_simulator_owns_device(const hs_device *dev)
+{
+    return strncmp(dev->key, SIMULATOR_KEY_PREFIX, strlen(SIMULATOR_KEY_PREFIX)) == 0;
+}
+
+// Call with the mutex locked, returns NULL if the device is gone
+static struct _hs_simulator_board *find_device_board(const hs_device *dev)
+{
+    unsigned int idx;
+
+    if (!_hs_simulator_owns_device(dev))
+        return NULL;
+
+    idx = (unsigned int)strtoul(dev->key + strlen(SIMULATOR_KEY_PREFIX), NULL, 10);
+    if (idx >= simulator.boards_count)
+        return NULL;
+    if (!simulator.boards[idx].dev || strcmp(simulator.boards[idx].dev->key, dev->key) != 0)
+        return NULL;
+
+    return &simulator.boards[idx];
+}
+
+int _hs_simulator_open_hid_port(hs_device *dev, hs_port_mode mode, hs_port **rport)
+{
+    hs_port *port;
+    struct _hs_simulator_board *board;
+    int r;
+
+    port = (hs_port *)calloc(1, sizeof(*port));
+    if (!port) {
+        r = hs_error(HS_ERROR_MEMORY, NULL);
+        goto error;
+    }
+    port->type = dev->type;
+    port->mode = mode;
+    port->path = dev->path;
+    port->dev = hs_device_ref(dev);
+
+    // Never ready, HalfKay does not send anything back
+    port->u.file.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (port->u.file.fd < 0) {
+        r = hs_error(HS_ERROR_SYSTEM, "eventfd() failed: %s", strerror(errno));
+        goto error;
+    }
+
+    pthread_mutex_lock(&simulator.mutex);
+    board = find_device_board(dev);
+    pthread_mutex_unlock(&simulator.mutex);
+    if (!board) {
+        r = hs_error(HS_ERROR_NOT_FOUND, "Device '%s' not found", dev->path);
+        goto error;
+    }
+    port->u.file.simulator_board = board;
+
+    *rport = port;
+    return 0;
+
+error:
+    hs_port_close(port);
+    return r;
+}
+
+ssize_t _hs_simulator_hid_write(hs_port *port, const uint8_t *buf, size_t size)
+{
+    struct _hs_simulator_board *board;
+    uint32_t address;
+    uint64_t now;
+    int delay = 0;
+
+    if (size < 4)
+        return hs_error(HS_ERROR_IO, "I/O error while writing to '%s': %s", port->path,
+                        strerror(EINVAL));
+    address = (uint32_t)buf[1] | ((uint32_t)buf[2] << 8) | ((uint32_t)buf[3] << 16);
+
+    pthread_mutex_lock(&simulator.mutex);
+
+    board = port->u.file.simulator_board;
+    if (board != find_device_board(port->dev)) {
+        pthread_mutex_unlock(&simulator.mutex);
+        return hs_error(HS_ERROR_IO, "I/O error while writing to '%s': %s", port->path,
+                        strerror(ENODEV));
+    }
+
+    now = hs_millis();
+    if (now < board->busy_until) {
+        pthread_mutex_unlock(&simulator.mutex);
+        // Same thing the kernel reports when HalfKay stalls
+        return hs_error(HS_ERROR_IO, "I/O error while writing to '%s': %s", port->path,
+                        strerror(EPIPE));
+    }
+
+    if (address == 0xFFFFFF) {
+        hs_log(HS_LOG_DEBUG, "Simulated board %u received %zu blocks", board->idx,
+               board->blocks_count);
+        reboot_board(board, SIMULATOR_MODE_RUN);
+    } else if (!address) {
+        board->busy_until = now + (uint64_t)simulator.erase_delay;
+        board->blocks_count = 1;
+    } else {
+        delay = simulator.write_delay;
+        board->blocks_count++;
+    }
+
+    pthread_mutex_unlock(&simulator.mutex);
+
+    // Like a real USB transfer, the write returns once the device has accepted the block
+    if (delay)
+        usleep((useconds_t)delay * 1000);
+
+    return (ssize_t)size;
+}
+
+void _hs_simulator_set_baudrate(const hs_device *dev, unsigned int baudrate)
+{
+    struct _hs_simulator_board *board;
+
+    if (!_hs_simulator_owns_device(dev))
+        return;
+
+    pthread_mutex_lock(&simulator.mutex);
+    board = find_device_board(dev);
+    if (board && board->mode == SIMULATOR_MODE_RUN && baudrate == 134)
+        reboot_board(board, SIMULATOR_MODE_BOOTLOADER);
+    pthread_mutex_unlock(&simulator.mutex);
+}
@@ -0,0 +1,115 @@
+/* libhs - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/libhs
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#ifndef _HS_SIMULATOR_PRIV_H
+#define _HS_SIMULATOR_PRIV_H
+
+#include "common_priv.h"
+#include "device.h"
+#include "htable.h"
+#include "match_priv.h"
+#include "monitor.h"
+
+struct hs_port;
+
+#ifdef _HS_HAVE_SIMULATOR
+
+bool _hs_simulator_enabled(void);
+
+int _hs_simulator_enumerate(const _hs_match_helper *match_helper, hs_enumerate_func *f,
+                            void *udata);
+
+/* The simulator signals monitor eventfd descriptors when devices change, and monitors
+   call _hs_simulator_refresh() to catch up. */
+int _hs_simulator_register_monitor(int fd);
+void _hs_simulator_unregister_monitor(int fd);
+int _hs_simulator_refresh(const _hs_match_helper *match_helper, _hs_htable *devices,
+                          hs_enumerate_func *f, void *udata);
+
+bool _hs_simulator_owns_device(const hs_device *dev);
+int _hs_simulator_open_hid_port(hs_device *dev, hs_port_mode mode, struct hs_port **rport);
+ssize_t _hs_simulator_hid_write(struct hs_port *port, const uint8_t *buf, size_t size);
+void _hs_simulator_set_baudrate(const hs_device *dev, unsigned int baudrate);
+
+#else
+
+// Without the simulator, nothing is simulated and the monitors never call these
+
+static inline bool _hs_simulator_enabled(void)
+{
+    return false;
+}
+
+static inline int _hs_simulator_enumerate(const _hs_match_helper *match_helper,
+                                          hs_enumerate_func *f, void *udata)
+{
+    _HS_UNUSED(match_helper);
+    _HS_UNUSED(f);
+    _HS_UNUSED(udata);
+
+    return 0;
+}
+
+static inline int _hs_simulator_register_monitor(int fd)
+{
+    _HS_UNUSED(fd);
+    return hs_error(HS_ERROR_SYSTEM, "The device simulator is not available");
+}
+
+static inline void _hs_simulator_unregister_monitor(int fd)
+{
+    _HS_UNUSED(fd);
+}
+
+static inline int _hs_simulator_refresh(const _hs_match_helper *match_helper,
+                                        _hs_htable *devices, hs_enumerate_func *f, void *udata)
+{
+    _HS_UNUSED(match_helper);
+    _HS_UNUSED(devices);
+    _HS_UNUSED(f);
+    _HS_UNUSED(udata);
+
+    return 0;
+}
+
+static inline bool _hs_simulator_owns_device(const hs_device *dev)
+{
+    _HS_UNUSED(dev);
+    return false;
+}
+
+static inline int _hs_simulator_open_hid_port(hs_device *dev, hs_port_mode mode,
+                                              struct hs_port **rport)
+{
+    _HS_UNUSED(mode);
+    _HS_UNUSED(rport);
+
+    return hs_error(HS_ERROR_NOT_FOUND, "Simulated device '%s' does not exist", dev->path);
+}
+
+static inline ssize_t _hs_simulator_hid_write(struct hs_port *port, const uint8_t *buf,
+                                              size_t size)
+{
+    _HS_UNUSED(port);
+    _HS_UNUSED(buf);
+    _HS_UNUSED(size);
+
+    return hs_error(HS_ERROR_IO, "The device simulator is not available");
+}
+
+static inline void _hs_simulator_set_baudrate(const hs_device *dev, unsigned int baudrate)
+{
+    _HS_UNUSED(dev);
+    _HS_UNUSED(baudrate);
+}
+
+#endif
+
+#endif
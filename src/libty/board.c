@@ -19,6 +19,7 @@
 #include "monitor.h"
 #include "system.h"
 #include "task.h"
+#include "task_priv.h"
 #include "timer.h"
 
 static const char *capability_names[] = {
@@ -30,13 +31,6 @@ static const char *capability_names[] = {
     "serial"
 };
 
-#ifdef _WIN32
-    #define MANUAL_REBOOT_DELAY 15000
-#else
-    #define MANUAL_REBOOT_DELAY 8000
-#endif
-#define FINAL_TASK_TIMEOUT 8000
-
 const char *ty_board_capability_get_name(ty_board_capability cap)
 {
     assert((int)cap >= 0 && (int)cap < TY_BOARD_CAPABILITY_COUNT);
@@ -66,6 +60,12 @@ void ty_board_unref(ty_board *board)
 
         ty_mutex_release(&board->ifaces_lock);
 
+        assert(!board->current_task && !board->queued_tasks.count &&
+               !board->merged_tasks.count);
+        ty_mutex_release(&board->tasks_lock);
+        _hs_array_release(&board->queued_tasks);
+        _hs_array_release(&board->merged_tasks);
+
         for (size_t i = 0; i < board->ifaces.count; i++) {
             ty_board_interface *iface = board->ifaces.values[i];
             ty_board_interface_unref(iface);
@@ -274,42 +274,22 @@ cleanup:
     return r;
 }
 
-struct wait_for_context {
-    ty_board *board;
-    ty_board_capability capability;
-};
-
-static int wait_for_callback(ty_monitor *monitor, void *udata)
-{
-    TY_UNUSED(monitor);
-
-    struct wait_for_context *ctx = udata;
-    ty_board *board = ctx->board;
-
-    if (board->status == TY_BOARD_STATUS_DROPPED)
-        return ty_error(TY_ERROR_NOT_FOUND, "Board '%s' has disappeared", board->tag);
-
-    return ty_board_has_capability(board, ctx->capability);
-}
-
 int ty_board_wait_for(ty_board *board, ty_board_capability capability, int timeout)
 {
     assert(board);
 
     ty_monitor *monitor = board->monitor;
-    struct wait_for_context ctx;
 
     if (board->status == TY_BOARD_STATUS_DROPPED)
         return ty_error(TY_ERROR_NOT_FOUND, "Board '%s' has disappeared", board->tag);
     if (!monitor)
         return ty_error(TY_ERROR_NOT_FOUND, "Cannot wait on unmonitored board '%s'", board->tag);
 
-    ctx.board = board;
-    ctx.capability = capability;
-
-    return ty_monitor_wait(monitor, wait_for_callback, &ctx, timeout);
+    return _ty_monitor_wait_board(monitor, board, capability, timeout);
 }
 
+/* These two open and close the serial interface each time, which goes through the board
+   and interface locks. Use ty_board_serial_acquire() for sustained I/O. */
 ssize_t ty_board_serial_read(ty_board *board, char *buf, size_t size, int timeout)
 {
     assert(board);
@@ -319,15 +299,13 @@ ssize_t ty_board_serial_read(ty_board *board, char *buf, size_t size, int timeou
     ty_board_interface *iface;
     ssize_t r;
 
-    r = ty_board_open_interface(board, TY_BOARD_CAPABILITY_SERIAL, &iface);
+    r = ty_board_serial_acquire(board, &iface);
     if (r < 0)
         return r;
-    if (!r)
-        return ty_error(TY_ERROR_MODE, "Board '%s' is not available for serial I/O", board->tag);
 
-    r = (*iface->class_vtable->serial_read)(iface, buf, size, timeout);
+    r = ty_board_interface_serial_read(iface, buf, size, timeout);
 
-    ty_board_interface_close(iface);
+    ty_board_serial_release(iface);
     return r;
 }
 
@@ -339,19 +317,47 @@ ssize_t ty_board_serial_write(ty_board *board, const char *buf, size_t size)
     ty_board_interface *iface;
     ssize_t r;
 
-    r = ty_board_open_interface(board, TY_BOARD_CAPABILITY_SERIAL, &iface);
+    r = ty_board_serial_acquire(board, &iface);
+    if (r < 0)
+        return r;
+
+    r = ty_board_interface_serial_write(iface, buf, size);
+
+    ty_board_serial_release(iface);
+    return r;
+}
+
+/* The interface stays open until ty_board_serial_release(), even if the monitor drops it
+   in the meantime: the port is only closed once the last user is gone. I/O through a
+   dropped interface fails with TY_ERROR_IO, acquire a new handle to resume. */
+int ty_board_serial_acquire(ty_board *board, ty_board_interface **riface)
+{
+    assert(board);
+    assert(riface);
+
+    int r;
+
+    r = ty_board_open_interface(board, TY_BOARD_CAPABILITY_SERIAL, riface);
     if (r < 0)
         return r;
     if (!r)
         return ty_error(TY_ERROR_MODE, "Board '%s' is not available for serial I/O", board->tag);
 
-    r = (*iface->class_vtable->serial_write)(iface, buf, size);
+    return 0;
+}
 
+void ty_board_serial_release(ty_board_interface *iface)
+{
     ty_board_interface_close(iface);
-    return r;
 }
 
 int ty_board_upload(ty_board *board, ty_firmware *fw, ty_board_upload_progress_func *pf, void *udata)
+{
+    return _ty_board_upload(board, fw, NULL, pf, udata);
+}
+
+int _ty_board_upload(ty_board *board, ty_firmware *fw, ty_board_upload_stats *rstats,
+                     ty_board_upload_progress_func *pf, void *udata)
 {
     assert(board);
     assert(fw);
@@ -368,7 +374,7 @@ int ty_board_upload(ty_board *board, ty_firmware *fw, ty_board_upload_progress_f
     }
     assert(board->model);
 
-    r = (*iface->class_vtable->upload)(iface, fw, pf, udata);
+    r = (*iface->class_vtable->upload)(iface, fw, rstats, pf, udata);
 
 cleanup:
     ty_board_interface_close(iface);
@@ -508,6 +514,48 @@ hs_port *ty_board_interface_get_handle(const ty_board_interface *iface)
     return iface->port;
 }
 
+bool ty_board_interface_is_dropped(const ty_board_interface *iface)
+{
+    assert(iface);
+    return _ty_atomic_load(&iface->dropped);
+}
+
+// The caller must have opened the interface, see ty_board_serial_acquire()
+ssize_t ty_board_interface_serial_read(ty_board_interface *iface, char *buf, size_t size,
+                                       int timeout)
+{
+    assert(iface);
+    assert(iface->open_count);
+    assert(buf);
+    assert(size);
+
+    if (_ty_atomic_load(&iface->dropped))
+        return ty_error(TY_ERROR_IO, "Serial device '%s' has disappeared", iface->dev->path);
+    if (!iface->class_vtable->serial_read)
+        return ty_error(TY_ERROR_MODE, "Interface '%s' does not support serial I/O", iface->name);
+
+    return (*iface->class_vtable->serial_read)(iface, buf, size, timeout);
+}
+
+ssize_t ty_board_interface_serial_write(ty_board_interface *iface, const char *buf, size_t size)
+{
+    assert(iface);
+    assert(iface->open_count);
+    assert(buf);
+
+    if (_ty_atomic_load(&iface->dropped))
+        return ty_error(TY_ERROR_IO, "Serial device '%s' has disappeared", iface->dev->path);
+    if (!iface->class_vtable->serial_write)
+        return ty_error(TY_ERROR_MODE, "Interface '%s' does not support serial I/O", iface->name);
+
+    return (*iface->class_vtable->serial_write)(iface, buf, size);
+}
+
+void _ty_board_interface_drop(ty_board_interface *iface)
+{
+    _ty_atomic_store(&iface->dropped, 1);
+}
+
 void ty_board_interface_get_descriptors(const ty_board_interface *iface, struct ty_descriptor_set *set, int id)
 {
     assert(iface);
@@ -517,6 +565,183 @@ void ty_board_interface_get_descriptors(const ty_board_interface *iface, struct
         ty_descriptor_set_add(set, hs_port_get_poll_handle(iface->port), id);
 }
 
+static int run_upload(ty_task *task);
+static int run_reset(ty_task *task);
+
+// Finish a task that will never run, and release the tasks queued behind it
+static void drop_board_task(ty_task *task, int ret)
+{
+    _ty_task_begin(task);
+    _ty_task_end(task, ret);
+}
+
+/* Board tasks can be started at any time, they wait for the previous ones and run in order.
+   Two uploads in a row collapse into the most recent one, and a reset that follows an
+   upload (which resets the board anyway) is merged into it: it finishes when the upload
+   does, with the same result. */
+static int claim_board_task(ty_task *task)
+{
+    ty_board *board = task->u.board_task.board;
+    ty_task *prev, *superseded = NULL;
+    int r;
+
+    ty_mutex_lock(&board->tasks_lock);
+
+    if (!board->current_task) {
+        board->current_task = ty_task_ref(task);
+        ty_mutex_unlock(&board->tasks_lock);
+
+        return 1;
+    }
+
+    prev = board->queued_tasks.count
+           ? board->queued_tasks.values[board->queued_tasks.count - 1]
+           : board->current_task;
+    if (task->task_run == run_reset && prev->task_run == run_upload &&
+            !(prev->u.upload.flags & TY_UPLOAD_NORESET)) {
+        struct _ty_board_merged_task *merged;
+
+        r = _hs_array_grow(&board->merged_tasks, 1);
+        if (r < 0) {
+            ty_mutex_unlock(&board->tasks_lock);
+            return ty_libhs_translate_error(r);
+        }
+        merged = &board->merged_tasks.values[board->merged_tasks.count++];
+        merged->task = ty_task_ref(task);
+        merged->into = prev;
+
+        ty_mutex_unlock(&board->tasks_lock);
+
+        ty_log(TY_LOG_DEBUG, "Merging task '%s' into '%s', which resets the board",
+               task->name, prev->name);
+
+        return 0;
+    }
+
+    if (task->task_run == run_upload && prev->task_run == run_upload &&
+            board->queued_tasks.count) {
+        superseded = prev;
+        board->queued_tasks.values[board->queued_tasks.count - 1] = ty_task_ref(task);
+
+        // Tasks merged into the old upload now depend on the new one
+        for (size_t i = 0; i < board->merged_tasks.count; i++) {
+            if (board->merged_tasks.values[i].into == superseded)
+                board->merged_tasks.values[i].into = task;
+        }
+    } else {
+        r = _hs_array_push(&board->queued_tasks, task);
+        if (r < 0) {
+            ty_mutex_unlock(&board->tasks_lock);
+            return ty_libhs_translate_error(r);
+        }
+        ty_task_ref(task);
+    }
+
+    ty_mutex_unlock(&board->tasks_lock);
+
+    if (superseded) {
+        r = ty_error(TY_ERROR_SUPERSEDED, "Upload to board '%s' was superseded by a newer one",
+                     board->tag);
+        drop_board_task(superseded, r);
+        ty_task_unref(superseded);
+    }
+
+    return 0;
+}
+
+// Call with board->tasks_lock locked, returns the first task merged into this one
+static ty_task *take_merged_task(ty_board *board, const ty_task *task)
+{
+    for (size_t i = 0; i < board->merged_tasks.count; i++) {
+        struct _ty_board_merged_task *merged = &board->merged_tasks.values[i];
+
+        if (merged->into == task) {
+            ty_task *merged_task = merged->task;
+
+            _hs_array_remove(&board->merged_tasks, i, 1);
+            return merged_task;
+        }
+    }
+
+    return NULL;
+}
+
+static void release_board_task(ty_task *task, ty_board *board)
+{
+    ty_task *merged_task, *next;
+    int r;
+
+    ty_mutex_lock(&board->tasks_lock);
+
+    // Tasks merged into this one share its outcome
+    while ((merged_task = take_merged_task(board, task))) {
+        ty_mutex_unlock(&board->tasks_lock);
+
+        drop_board_task(merged_task, task->ret);
+        ty_task_unref(merged_task);
+
+        ty_mutex_lock(&board->tasks_lock);
+    }
+
+    if (board->current_task != task) {
+        ty_mutex_unlock(&board->tasks_lock);
+        return;
+    }
+
+    ty_task_unref(board->current_task);
+    board->current_task = NULL;
+
+    if (!board->queued_tasks.count) {
+        ty_mutex_unlock(&board->tasks_lock);
+        return;
+    }
+
+    // Hand the board to the next task right away
+    next = board->queued_tasks.values[0];
+    _hs_array_remove(&board->queued_tasks, 0, 1);
+    board->current_task = next;
+
+    ty_mutex_unlock(&board->tasks_lock);
+
+    // If it fails, the next release will move on to the following task
+    r = _ty_task_submit(next);
+    if (r < 0)
+        drop_board_task(next, r);
+}
+
+// Queued and merged tasks end right away, the others check the flag once they run
+static void cancel_board_task(ty_task *task)
+{
+    ty_board *board = task->u.board_task.board;
+    bool dropped = false;
+    int r;
+
+    if (!board)
+        return;
+
+    ty_mutex_lock(&board->tasks_lock);
+    for (size_t i = 0; i < board->queued_tasks.count; i++) {
+        if (board->queued_tasks.values[i] == task) {
+            _hs_array_remove(&board->queued_tasks, i, 1);
+            dropped = true;
+            break;
+        }
+    }
+    for (size_t i = 0; !dropped && i < board->merged_tasks.count; i++) {
+        if (board->merged_tasks.values[i].task == task) {
+            _hs_array_remove(&board->merged_tasks, i, 1);
+            dropped = true;
+        }
+    }
+    ty_mutex_unlock(&board->tasks_lock);
+
+    if (dropped) {
+        r = ty_error(TY_ERROR_CANCELED, "Task '%s' was canceled", task->name);
+        drop_board_task(task, r);
+        ty_task_unref(task);
+    }
+}
+
 static int new_board_task(ty_board *board, const char *action, int (*run)(ty_task *task),
                           ty_task **rtask)
 {
@@ -524,31 +749,28 @@ static int new_board_task(ty_board *board, const char *action, int (*run)(ty_tas
     ty_task *task = NULL;
     int r;
 
-    if (board->current_task)
-        return ty_error(TY_ERROR_BUSY, "Board '%s' is busy on task '%s'", board->tag,
-                        board->current_task->name);
-
     snprintf(task_name_buf, sizeof(task_name_buf), "%s@%s", action, board->tag);
     r = ty_task_new(task_name_buf, run, &task);
     if (r < 0)
         return r;
 
-    board->current_task = ty_task_ref(task);
+    task->task_claim = claim_board_task;
+    task->task_cancel = cancel_board_task;
+    task->affinity = board;
 
     *rtask = task;
     return 0;
 }
 
-static void cleanup_task_board(ty_board **board_ptr)
+static void cleanup_task_board(ty_task *task, ty_board **board_ptr)
 {
-    ty_task_unref((*board_ptr)->current_task);
-    (*board_ptr)->current_task = NULL;
+    release_board_task(task, *board_ptr);
     ty_board_unref(*board_ptr);
     *board_ptr = NULL;
 }
 
-static int select_compatible_firmware(ty_board *board, ty_firmware **fws, unsigned int fws_count,
-                                      ty_firmware **rfw)
+int _ty_board_select_firmware(ty_board *board, ty_firmware **fws, unsigned int fws_count,
+                              ty_firmware **rfw)
 {
     ty_model fw_models[64];
     unsigned int fw_models_count = 0;
@@ -584,8 +806,8 @@ static int select_compatible_firmware(ty_board *board, ty_firmware **fws, unsign
     }
 }
 
-static int upload_progress_callback(const ty_board *board, const ty_firmware *fw,
-                                    size_t uploaded_size, size_t flash_size, void *udata)
+int _ty_board_upload_progress(const ty_board *board, const ty_firmware *fw,
+                              size_t uploaded_size, size_t flash_size, void *udata)
 {
     TY_UNUSED(board);
     TY_UNUSED(udata);
@@ -607,7 +829,15 @@ static int upload_progress_callback(const ty_board *board, const ty_firmware *fw
     return 0;
 }
 
-static void unref_upload_firmware(void *ptr)
+void _ty_upload_report_split_upload(ty_upload_report *report, uint64_t upload_time)
+{
+    uint64_t erase_time = TY_MIN(report->upload.erase_time, upload_time);
+
+    report->phase_times[TY_UPLOAD_PHASE_ERASE] = erase_time;
+    report->phase_times[TY_UPLOAD_PHASE_WRITE] = upload_time - erase_time;
+}
+
+void _ty_board_unref_upload_firmware(void *ptr)
 {
     ty_firmware_unref(ptr);
 }
@@ -615,13 +845,17 @@ static void unref_upload_firmware(void *ptr)
 static int run_upload(ty_task *task)
 {
     ty_board *board = task->u.upload.board;
+    ty_upload_report *report = &task->u.upload.report;
     ty_firmware *fw;
+    uint64_t start, phase_start;
     int flags = task->u.upload.flags, r;
 
+    start = ty_micros();
+
     if (flags & TY_UPLOAD_NOCHECK) {
         fw = task->u.upload.fws[0];
     } else if (ty_models[board->model].mcu) {
-        r = select_compatible_firmware(board, task->u.upload.fws, task->u.upload.fws_count, &fw);
+        r = _ty_board_select_firmware(board, task->u.upload.fws, task->u.upload.fws_count, &fw);
         if (r < 0)
             return r;
     } else {
@@ -644,6 +878,7 @@ static int run_upload(ty_task *task)
     }
 
 wait:
+    // This fails with TY_ERROR_CANCELED if the task is canceled while we wait
     r = ty_board_wait_for(board, TY_BOARD_CAPABILITY_UPLOAD,
                            flags & TY_UPLOAD_WAIT ? -1 : MANUAL_REBOOT_DELAY);
     if (r < 0)
@@ -651,20 +886,26 @@ wait:
     if (!r) {
         ty_log(TY_LOG_INFO, "Reboot didn't work, press button manually");
         flags |= TY_UPLOAD_WAIT;
+        report->retries++;
 
         goto wait;
     }
+    report->phase_times[TY_UPLOAD_PHASE_REBOOT] = ty_micros() - start;
 
     if (!fw) {
-        r = select_compatible_firmware(board, task->u.upload.fws, task->u.upload.fws_count, &fw);
+        r = _ty_board_select_firmware(board, task->u.upload.fws, task->u.upload.fws_count, &fw);
         if (r < 0)
             return r;
     }
 
-    r = ty_board_upload(board, fw, upload_progress_callback, NULL);
+    phase_start = ty_micros();
+    r = _ty_board_upload(board, fw, &report->upload, _ty_board_upload_progress, NULL);
     if (r < 0)
         return r;
+    task->usb.transferred = fw->total_size;
+    _ty_upload_report_split_upload(report, ty_micros() - phase_start);
 
+    phase_start = ty_micros();
     if (!(flags & TY_UPLOAD_NORESET)) {
         ty_log(TY_LOG_INFO, "Sending reset command");
         r = ty_board_reset(board);
@@ -679,9 +920,11 @@ wait:
     } else {
         ty_log(TY_LOG_INFO, "Firmware uploaded, reset the board to use it");
     }
+    report->phase_times[TY_UPLOAD_PHASE_RESET] = ty_micros() - phase_start;
+    report->total_time = ty_micros() - start;
 
     task->result = ty_firmware_ref(fw);
-    task->result_cleanup = unref_upload_firmware;
+    task->result_cleanup = _ty_board_unref_upload_firmware;
     return 0;
 }
 
@@ -691,7 +934,7 @@ static void finalize_upload(ty_task *task)
         ty_firmware_unref(task->u.upload.fws[i]);
     free(task->u.upload.fws);
 
-    cleanup_task_board(&task->u.upload.board);
+    cleanup_task_board(task, &task->u.upload.board);
 }
 
 int ty_upload(ty_board *board, ty_firmware **fws, unsigned int fws_count, int flags,
@@ -711,6 +954,13 @@ int ty_upload(ty_board *board, ty_firmware **fws, unsigned int fws_count, int fl
     task->u.upload.board = ty_board_ref(board);
     task->task_finalize = finalize_upload;
 
+    // Parallel uploads behind the same hub get in each other's way
+    task->usb.location = strdup(board->location);
+    if (!task->usb.location) {
+        r = ty_error(TY_ERROR_MEMORY, NULL);
+        goto error;
+    }
+
     if (fws_count > TY_UPLOAD_MAX_FIRMWARES) {
         ty_log(TY_LOG_WARNING, "Cannot select more than %d firmwares per upload",
                TY_UPLOAD_MAX_FIRMWARES);
@@ -718,6 +968,8 @@ int ty_upload(ty_board *board, ty_firmware **fws, unsigned int fws_count, int fl
     }
     if (flags & TY_UPLOAD_NOCHECK)
         fws_count = 1;
+    if (flags & TY_UPLOAD_EVENT_LOOP)
+        task->task_start = _ty_engine_submit;
 
     task->u.upload.fws = malloc(fws_count * sizeof(ty_firmware *));
     if (!task->u.upload.fws) {
@@ -772,7 +1024,7 @@ static int run_reset(ty_task *task)
 
 static void finalize_reset(ty_task *task)
 {
-    cleanup_task_board(&task->u.reset.board);
+    cleanup_task_board(task, &task->u.reset.board);
 }
 
 int ty_reset(ty_board *board, ty_task **rtask)
@@ -821,7 +1073,7 @@ static int run_reboot(ty_task *task)
 
 static void finalize_reboot(ty_task *task)
 {
-    cleanup_task_board(&task->u.reboot.board);
+    cleanup_task_board(task, &task->u.reboot.board);
 }
 
 int ty_reboot(ty_board *board, ty_task **rtask)
@@ -847,29 +1099,45 @@ static int run_send(ty_task *task)
     ty_board *board = task->u.send.board;
     const char *buf = task->u.send.buf;
     size_t size = task->u.send.size;
+    ty_board_interface *iface;
     size_t written;
+    int r;
+
+    r = ty_board_serial_acquire(board, &iface);
+    if (r < 0)
+        return r;
 
     written = 0;
     while (written < size) {
         size_t block_size;
-        ssize_t r;
+        ssize_t len;
 
         ty_progress("Sending", written, size);
 
-        block_size = TY_MIN(1024, size - written);
-        r = ty_board_serial_write(board, buf + written, block_size);
+        r = _ty_task_check_canceled();
         if (r < 0)
-            return (int)r;
-        written += (size_t)r;
+            goto cleanup;
+
+        block_size = TY_MIN(1024, size - written);
+        len = ty_board_interface_serial_write(iface, buf + written, block_size);
+        if (len < 0) {
+            r = (int)len;
+            goto cleanup;
+        }
+        written += (size_t)len;
     }
 
-    return 0;
+    r = 0;
+
+cleanup:
+    ty_board_serial_release(iface);
+    return r;
 }
 
 static void finalize_send(ty_task *task)
 {
     free(task->u.send.buf);
-    cleanup_task_board(&task->u.send.board);
+    cleanup_task_board(task, &task->u.send.board);
 }
 
 int ty_send(ty_board *board, const char *buf, size_t size, ty_task **rtask)
@@ -909,7 +1177,13 @@ static int run_send_file(ty_task *task)
     FILE *fp = task->u.send_file.fp;
     size_t size = task->u.send_file.size;
     const char *filename = task->u.send_file.filename;
+    ty_board_interface *iface;
     size_t written;
+    int r;
+
+    r = ty_board_serial_acquire(board, &iface);
+    if (r < 0)
+        return r;
 
     written = 0;
     while (written < size) {
@@ -919,29 +1193,40 @@ static int run_send_file(ty_task *task)
 
         ty_progress("Sending", written, size);
 
+        r = _ty_task_check_canceled();
+        if (r < 0)
+            goto cleanup;
+
         block_size = fread(buf, 1, sizeof(buf), fp);
         if (!block_size) {
             if (feof(fp)) {
                 break;
             } else {
-                return ty_error(TY_ERROR_IO, "I/O error while reading '%s'", filename);
+                r = ty_error(TY_ERROR_IO, "I/O error while reading '%s'", filename);
+                goto cleanup;
             }
         }
 
         block_written = 0;
         while (block_written < block_size) {
-            ssize_t r = ty_board_serial_write(board, buf + block_written,
-                                              block_size - block_written);
-            if (r < 0)
-                return (int)r;
-            block_written += (size_t)r;
+            ssize_t len = ty_board_interface_serial_write(iface, buf + block_written,
+                                                          block_size - block_written);
+            if (len < 0) {
+                r = (int)len;
+                goto cleanup;
+            }
+            block_written += (size_t)len;
         }
 
         written += block_size;
     }
     ty_progress("Sending", size, size);
 
-    return 0;
+    r = 0;
+
+cleanup:
+    ty_board_serial_release(iface);
+    return r;
 }
 
 static void finalize_send_file(ty_task *task)
@@ -949,7 +1234,7 @@ static void finalize_send_file(ty_task *task)
     free(task->u.send_file.filename);
     if (task->u.send_file.fp)
         fclose(task->u.send_file.fp);
-    cleanup_task_board(&task->u.send_file.board);
+    cleanup_task_board(task, &task->u.send_file.board);
 }
 
 int ty_send_file(ty_board *board, const char *filename, ty_task **rtask)
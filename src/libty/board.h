@@ -13,6 +13,7 @@
 
 #include "common.h"
 #include "class.h"
+#include "histogram.h"
 
 TY_C_BEGIN
 
@@ -47,12 +48,58 @@ typedef enum ty_board_status {
 enum {
     TY_UPLOAD_WAIT = 1,
     TY_UPLOAD_NORESET = 2,
-    TY_UPLOAD_NOCHECK = 4
+    TY_UPLOAD_NOCHECK = 4,
+    // Run in the upload event loop instead of a pool thread, see engine.c
+    TY_UPLOAD_EVENT_LOOP = 8
 };
 
 #define TY_UPLOAD_MAX_FIRMWARES 256
 
+typedef enum ty_upload_phase {
+    // Reboot to the bootloader, or wait for the user to press the button
+    TY_UPLOAD_PHASE_REBOOT,
+    // First block, which triggers the flash erase
+    TY_UPLOAD_PHASE_ERASE,
+    TY_UPLOAD_PHASE_WRITE,
+    // Reset, and wait for the new firmware to run
+    TY_UPLOAD_PHASE_RESET,
+
+    TY_UPLOAD_PHASE_COUNT
+} ty_upload_phase;
+
 typedef int ty_board_list_interfaces_func(ty_board_interface *iface, void *udata);
+
+// Times are in microseconds, except for the pacing delays
+typedef struct ty_board_upload_stats {
+    unsigned int writes;
+    // Writes rejected by the bootloader because it was still busy
+    unsigned int stalls;
+    uint64_t write_time;
+    uint64_t max_write_time;
+    // Time spent waiting between writes, including the erase delay
+    uint64_t wait_time;
+    // First block and the erase delay after it
+    uint64_t erase_time;
+
+    // Successful writes, and blocks from the first attempt to the successful write
+    ty_histogram write_latency;
+    ty_histogram block_latency;
+
+    // Pacing used (and maybe adjusted) by this upload, in milliseconds
+    int erase_delay;
+    int retry_delay;
+} ty_board_upload_stats;
+
+// Filled by upload tasks, times are in microseconds
+typedef struct ty_upload_report {
+    uint64_t phase_times[TY_UPLOAD_PHASE_COUNT];
+    uint64_t total_time;
+
+    // Number of times the task had to wait again for the bootloader
+    unsigned int retries;
+    ty_board_upload_stats upload;
+} ty_upload_report;
+
 typedef int ty_board_upload_progress_func(const ty_board *board, const struct ty_firmware *fw,
                                           size_t uploaded_size, size_t flash_size, void *udata);
 
@@ -92,6 +139,9 @@ int ty_board_wait_for(ty_board *board, ty_board_capability capability, int timeo
 ssize_t ty_board_serial_read(ty_board *board, char *buf, size_t size, int timeout);
 ssize_t ty_board_serial_write(ty_board *board, const char *buf, size_t size);
 
+int ty_board_serial_acquire(ty_board *board, ty_board_interface **riface);
+void ty_board_serial_release(ty_board_interface *iface);
+
 int ty_board_upload(ty_board *board, struct ty_firmware *fw, ty_board_upload_progress_func *pf, void *udata);
 int ty_board_reset(ty_board *board);
 int ty_board_reboot(ty_board *board);
@@ -109,6 +159,11 @@ const char *ty_board_interface_get_path(const ty_board_interface *iface);
 
 struct hs_device *ty_board_interface_get_device(const ty_board_interface *iface);
 struct hs_port *ty_board_interface_get_handle(const ty_board_interface *iface);
+bool ty_board_interface_is_dropped(const ty_board_interface *iface);
+
+ssize_t ty_board_interface_serial_read(ty_board_interface *iface, char *buf, size_t size,
+                                       int timeout);
+ssize_t ty_board_interface_serial_write(ty_board_interface *iface, const char *buf, size_t size);
 void ty_board_interface_get_descriptors(const ty_board_interface *iface, struct ty_descriptor_set *set, int id);
 
 int ty_upload(ty_board *board, struct ty_firmware **fws, unsigned int fws_count,
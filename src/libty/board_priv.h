@@ -37,12 +37,29 @@ struct ty_board_interface {
     ty_mutex open_lock;
     unsigned int open_count;
     hs_port *port;
+
+    /* Set (atomically) by the monitor when the device goes away, pinned serial handles
+       check it instead of going through the board locks. */
+    unsigned int dropped;
+};
+
+// A task dropped because another one does its job, it finishes with the same outcome
+struct _ty_board_merged_task {
+    ty_task *task;
+    ty_task *into;
 };
 
 struct ty_board {
     unsigned int refcount;
 
     struct ty_monitor *monitor;
+    _hs_htable_head location_hnode;
+    _hs_htable_head id_hnode;
+    // Positions in the monitor board list and drop heap, plus one (0 when absent)
+    size_t monitor_index;
+    size_t drop_index;
+    // Position in the pending monitor event batch, plus one (0 when absent)
+    size_t batch_index;
 
     ty_board_status status;
     uint64_t missing_since;
@@ -61,9 +78,39 @@ struct ty_board {
     int capabilities;
     ty_board_interface *cap2iface[16];
 
+    // Board tasks run one at a time, the others wait in order (see claim_board_task)
+    ty_mutex tasks_lock;
     ty_task *current_task;
+    _HS_ARRAY(ty_task *) queued_tasks;
+    _HS_ARRAY(struct _ty_board_merged_task) merged_tasks;
 };
 
+#ifdef _WIN32
+    #define MANUAL_REBOOT_DELAY 15000
+#else
+    #define MANUAL_REBOOT_DELAY 8000
+#endif
+#define FINAL_TASK_TIMEOUT 8000
+
+int _ty_board_select_firmware(ty_board *board, struct ty_firmware **fws, unsigned int fws_count,
+                              struct ty_firmware **rfw);
+// Same as ty_board_upload(), but fills *rstats (if not NULL) with the upload statistics
+int _ty_board_upload(ty_board *board, struct ty_firmware *fw, ty_board_upload_stats *rstats,
+                     ty_board_upload_progress_func *pf, void *udata);
+int _ty_board_upload_progress(const ty_board *board, const struct ty_firmware *fw,
+                              size_t uploaded_size, size_t flash_size, void *udata);
+void _ty_board_interface_drop(ty_board_interface *iface);
+
+// The class measures the erase, the rest of the upload time goes to the write phase
+void _ty_upload_report_split_upload(ty_upload_report *report, uint64_t upload_time);
+void _ty_board_unref_upload_firmware(void *ptr);
+
+int _ty_monitor_wait_board(struct ty_monitor *monitor, ty_board *board,
+                           ty_board_capability capability, int timeout);
+
+int _ty_engine_submit(ty_task *task);
+void _ty_engine_wake(void);
+
 TY_C_END
 
 #endif
@@ -12,6 +12,7 @@
 #include "class_priv.h"
 #include "../libhs/array.h"
 #include "../libhs/device.h"
+#include "firmware.h"
 #include "ini.h"
 #include "system.h"
 
@@ -248,3 +249,75 @@ ty_model ty_models_find(const char *name)
 
     return 0;
 }
+
+/* Get the plan for this model from the firmware, or build it. The plan stays attached to
+   the firmware, and the reference you get must be released with _ty_upload_plan_unref(). */
+int _ty_upload_plan_get(ty_firmware *fw, const struct _ty_class_vtable *vtable,
+                        ty_model model, _ty_upload_plan_build_func *f, _ty_upload_plan **rplan)
+{
+    assert(fw);
+    assert(vtable);
+    assert(f);
+    assert(rplan);
+
+    _ty_upload_plan *plan;
+    int r;
+
+    // Boards uploading the same firmware wait for the first one to build the plan
+    ty_mutex_lock(&fw->plans_mutex);
+
+    for (plan = fw->plans; plan; plan = plan->next) {
+        if (plan->vtable == vtable && plan->model == model) {
+            *rplan = _ty_upload_plan_ref(plan);
+            r = 0;
+            goto cleanup;
+        }
+    }
+
+    plan = calloc(1, sizeof(*plan));
+    if (!plan) {
+        r = ty_error(TY_ERROR_MEMORY, NULL);
+        goto cleanup;
+    }
+    plan->refcount = 1;
+    plan->vtable = vtable;
+    plan->model = model;
+
+    r = (*f)(fw, model, plan);
+    if (r < 0) {
+        _ty_upload_plan_unref(plan);
+        goto cleanup;
+    }
+
+    plan->next = fw->plans;
+    fw->plans = plan;
+
+    *rplan = _ty_upload_plan_ref(plan);
+    r = 0;
+
+cleanup:
+    ty_mutex_unlock(&fw->plans_mutex);
+    return r;
+}
+
+_ty_upload_plan *_ty_upload_plan_ref(_ty_upload_plan *plan)
+{
+    assert(plan);
+
+    _ty_refcount_increase(&plan->refcount);
+    return plan;
+}
+
+void _ty_upload_plan_unref(_ty_upload_plan *plan)
+{
+    if (plan) {
+        if (_ty_refcount_decrease(&plan->refcount))
+            return;
+
+        free(plan->reports);
+        free(plan->sizes);
+        free(plan->addresses);
+    }
+
+    free(plan);
+}
@@ -18,6 +18,8 @@
 
 TY_C_BEGIN
 
+struct _ty_upload_plan;
+
 struct _ty_class_vtable {
     int (*load_interface)(ty_board_interface *iface);
     int (*update_board)(ty_board_interface *iface, ty_board *board, bool new_board);
@@ -29,11 +31,42 @@ struct _ty_class_vtable {
     ssize_t (*serial_read)(ty_board_interface *iface, char *buf, size_t size, int timeout);
     ssize_t (*serial_write)(ty_board_interface *iface, const char *buf, size_t size);
     int (*upload)(ty_board_interface *iface, struct ty_firmware *fw,
-                  ty_board_upload_progress_func *pf, void *udata);
+                  ty_board_upload_stats *stats, ty_board_upload_progress_func *pf, void *udata);
+    /* Optional, used by the upload event loop to upload one step at a time. upload_step()
+       returns 1 once the upload is done, or 0 if it must be called again after *rdelay
+       milliseconds. upload_end() must be called in all cases. */
+    int (*upload_start)(ty_board_interface *iface, struct ty_firmware *fw,
+                        ty_board_upload_stats *stats, ty_board_upload_progress_func *pf,
+                        void *udata, void **rsession);
+    int (*upload_step)(ty_board_interface *iface, void *session, int *rdelay);
+    void (*upload_end)(void *session);
     int (*reset)(ty_board_interface *iface);
     int (*reboot)(ty_board_interface *iface);
 };
 
+/* Everything needed to upload a firmware to a given model, down to the formatted reports.
+   Plans are immutable once built, and shared by all the uploads of the same firmware. */
+typedef struct _ty_upload_plan {
+    unsigned int refcount;
+    struct _ty_upload_plan *next;
+
+    const struct _ty_class_vtable *vtable;
+    ty_model model;
+
+    // Flash size, used as the maximum for progress reports
+    size_t flash_size;
+    size_t report_size;
+    unsigned int blocks_count;
+    uint32_t *addresses;
+    // Firmware bytes in each block, for progress reports
+    size_t *sizes;
+    // Concatenated reports, report_size bytes each
+    uint8_t *reports;
+} _ty_upload_plan;
+
+typedef int _ty_upload_plan_build_func(const struct ty_firmware *fw, ty_model model,
+                                       _ty_upload_plan *plan);
+
 struct _ty_class {
     const char *name;
     const struct _ty_class_vtable *vtable;
@@ -45,6 +78,11 @@ extern const unsigned int _ty_classes_count;
 extern const hs_match_spec *_ty_class_match_specs;
 extern unsigned int _ty_class_match_specs_count;
 
+int _ty_upload_plan_get(struct ty_firmware *fw, const struct _ty_class_vtable *vtable,
+                        ty_model model, _ty_upload_plan_build_func *f, _ty_upload_plan **rplan);
+_ty_upload_plan *_ty_upload_plan_ref(_ty_upload_plan *plan);
+void _ty_upload_plan_unref(_ty_upload_plan *plan);
+
 TY_C_END
 
 #endif
@@ -16,7 +16,9 @@
 #include "board_priv.h"
 #include "class_priv.h"
 #include "firmware.h"
+#include "ini.h"
 #include "system.h"
+#include "task_priv.h"
 
 #define SEREMU_TX_SIZE 32
 #define SEREMU_RX_SIZE 64
@@ -29,6 +31,9 @@ enum {
 
 extern const struct _ty_class_vtable _ty_teensy_class_vtable;
 
+static int init_halfkay_pacing(void);
+static unsigned int halfkay_pacing_once;
+
 static ty_model identify_model_bcd(uint16_t bcd_device)
 {
     ty_model model = 0;
@@ -128,6 +133,7 @@ static int teensy_load_interface(ty_board_interface *iface)
                     if (iface->model) {
                         iface->capabilities |= 1 << TY_BOARD_CAPABILITY_UPLOAD;
                         iface->capabilities |= 1 << TY_BOARD_CAPABILITY_RESET;
+                        _ty_once(&halfkay_pacing_once, init_halfkay_pacing);
                     }
                 } break;
 
@@ -416,8 +422,9 @@ static unsigned int teensy_identify_models(const ty_firmware *fw, ty_model *rmod
     }
 
     /* Now try AVR Teensies. We search for machine code that matches model-specific code in
-       _reboot_Teensyduino_(). Not elegant, but it does the work. */
-    if (fw->max_address <= 130048) {
+       _reboot_Teensyduino_(). Not elegant, but it does the work. The size is not known
+       yet (zero) while the firmware is still streaming, we'll get called again later. */
+    if (fw->max_address && fw->max_address <= 130048) {
         for (unsigned int i = 0; i < fw->segments_count; i++) {
             const ty_firmware_segment *segment = &fw->segments[i];
             if (segment->size < sizeof(uint64_t))
@@ -519,72 +526,354 @@ static ssize_t teensy_serial_write(ty_board_interface *iface, const char *buf, s
     return 0;
 }
 
-static int halfkay_send(hs_port *port, unsigned int halfkay_version, size_t block_size,
-                        size_t addr, const void *data, size_t size, unsigned int timeout)
+static size_t halfkay_get_report_size(unsigned int halfkay_version, size_t block_size)
 {
-    uint8_t buf[2048] = {0};
-    uint64_t start;
-
-    ssize_t r;
+    switch (halfkay_version) {
+        case 1:
+        case 2: { return block_size + 3; } break;
+        case 3: { return block_size + 65; } break;
+    }
 
-    // Update if header gets bigger than 64 bytes
-    assert(size < sizeof(buf) - 65);
+    assert(false);
+    return 0;
+}
 
+// The report must be zeroed, and big enough for halfkay_get_report_size() bytes
+static void halfkay_format_report(unsigned int halfkay_version, size_t addr, const void *data,
+                                  size_t size, uint8_t *report)
+{
     switch (halfkay_version) {
         case 1: {
-            buf[1] = addr & 255;
-            buf[2] = (addr >> 8) & 255;
+            report[1] = addr & 255;
+            report[2] = (addr >> 8) & 255;
 
             if (size)
-                memcpy(buf + 3, data, size);
-            size = block_size + 3;
+                memcpy(report + 3, data, size);
         } break;
 
         case 2: {
-            buf[1] = (addr >> 8) & 255;
-            buf[2] = (addr >> 16) & 255;
+            report[1] = (addr >> 8) & 255;
+            report[2] = (addr >> 16) & 255;
 
             if (size)
-                memcpy(buf + 3, data, size);
-            size = block_size + 3;
+                memcpy(report + 3, data, size);
         } break;
 
         case 3: {
-            buf[1] = addr & 255;
-            buf[2] = (addr >> 8) & 255;
-            buf[3] = (addr >> 16) & 255;
+            report[1] = addr & 255;
+            report[2] = (addr >> 8) & 255;
+            report[3] = (addr >> 16) & 255;
 
             if (size)
-                memcpy(buf + 65, data, size);
-            size = block_size + 65;
+                memcpy(report + 65, data, size);
         } break;
 
         default: {
             assert(false);
         } break;
     }
+}
 
-    /* We may get errors along the way (while the bootloader works) so try again
-       until timeout expires. */
-    start = ty_millis();
-    hs_error_mask(HS_ERROR_IO);
-restart:
-    r = hs_hid_write(port, buf, size);
-    if (r == HS_ERROR_IO && ty_millis() - start < timeout) {
-        ty_delay(20);
-        goto restart;
+/* HalfKay generates STALL if you go too fast (translates to EPIPE on Linux), and the
+   first write takes longer because it triggers a complete erase of all blocks. How long
+   depends a lot on the model, so instead of fixed delays we learn how long to wait after
+   the erase and after a stall. Stalls double the wait (exponential backoff), and clean
+   writes make us try a bit shorter next time. What we learn is kept per model in
+   TyTools/HalfKay.ini. */
+
+#define HALFKAY_TIMEOUT 3000
+#define HALFKAY_DEFAULT_ERASE_DELAY 200
+#define HALFKAY_MAX_ERASE_DELAY 2000
+#define HALFKAY_DEFAULT_RETRY_DELAY 20
+#define HALFKAY_MAX_RETRY_DELAY 200
+
+struct halfkay_pacing {
+    int erase_delay;
+    int retry_delay;
+};
+
+static ty_mutex halfkay_pacing_mutex;
+static struct halfkay_pacing halfkay_pacings[TY_MODEL_TEENSY_40 + 1];
+
+static bool get_halfkay_pacing_filename(char *buf, size_t size, bool save)
+{
+    char dir[1][TY_PATH_MAX_SIZE];
+    int r;
+
+#ifndef _WIN32
+    // Without a user directory, the first one is a system directory such as /etc/xdg
+    if (save && !getenv("XDG_CONFIG_HOME") && !getenv("HOME"))
+        return false;
+#else
+    TY_UNUSED(save);
+#endif
+
+    if (!ty_standard_get_paths(TY_PATH_CONFIG_DIRECTORY, "TyTools", dir, 1))
+        return false;
+    r = snprintf(buf, size, "%s/HalfKay.ini", dir[0]);
+
+    return r < (int)size;
+}
+
+static int load_halfkay_pacing_callback(const char *section, char *key, char *value, void *udata)
+{
+    TY_UNUSED(udata);
+
+    ty_model model;
+    int delay;
+
+    if (!section)
+        return 0;
+    model = ty_models_find(section);
+    if (!model || model >= TY_COUNTOF(halfkay_pacings))
+        return 0;
+
+    delay = atoi(value);
+    if (strcmp(key, "erase_delay") == 0) {
+        if (delay > 0 && delay <= HALFKAY_MAX_ERASE_DELAY)
+            halfkay_pacings[model].erase_delay = delay;
+    } else if (strcmp(key, "retry_delay") == 0) {
+        if (delay > 0 && delay <= HALFKAY_MAX_RETRY_DELAY)
+            halfkay_pacings[model].retry_delay = delay;
+    }
+
+    return 0;
+}
+
+/* Run once (with halfkay_pacing_once) when the monitor loads Teensy interfaces, which
+   happens before anything gets uploaded. Failing to load the learned values is not a
+   problem. */
+static int init_halfkay_pacing(void)
+{
+    char filename[TY_PATH_MAX_SIZE];
+    int r;
+
+    r = ty_mutex_init(&halfkay_pacing_mutex);
+    if (r < 0)
+        return r;
+
+    for (unsigned int i = 0; i < TY_COUNTOF(halfkay_pacings); i++) {
+        halfkay_pacings[i].erase_delay = HALFKAY_DEFAULT_ERASE_DELAY;
+        halfkay_pacings[i].retry_delay = HALFKAY_DEFAULT_RETRY_DELAY;
+    }
+    if (get_halfkay_pacing_filename(filename, sizeof(filename), false)) {
+        ty_error_mask(TY_ERROR_NOT_FOUND);
+        ty_ini_walk(filename, load_halfkay_pacing_callback, NULL);
+        ty_error_unmask();
+    }
+
+    return 0;
+}
+
+// Call with halfkay_pacing_mutex locked
+static void save_halfkay_pacing(void)
+{
+    char filename[TY_PATH_MAX_SIZE];
+    char tmp_filename[TY_PATH_MAX_SIZE + 8];
+    FILE *fp;
+
+    if (!get_halfkay_pacing_filename(filename, sizeof(filename), true))
+        return;
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename);
+
+    // Create TyTools if needed, but not the configuration directory itself
+    {
+        char dir[TY_PATH_MAX_SIZE];
+        char *ptr;
+
+        strcpy(dir, filename);
+        ptr = strrchr(dir, '/');
+        assert(ptr);
+        *ptr = 0;
+
+        ty_error_mask(TY_ERROR_NOT_FOUND);
+        ty_directory_create(dir);
+        ty_error_unmask();
+    }
+
+    fp = fopen(tmp_filename, "w");
+    if (!fp)
+        return;
+    for (unsigned int i = 0; i < TY_COUNTOF(halfkay_pacings); i++) {
+        const struct halfkay_pacing *pacing = &halfkay_pacings[i];
+
+        if (pacing->erase_delay == HALFKAY_DEFAULT_ERASE_DELAY &&
+                pacing->retry_delay == HALFKAY_DEFAULT_RETRY_DELAY)
+            continue;
+
+        fprintf(fp, "[%s]\nerase_delay = %d\nretry_delay = %d\n\n", ty_models[i].name,
+                pacing->erase_delay, pacing->retry_delay);
+    }
+    if (fclose(fp) || rename(tmp_filename, filename) < 0) {
+        remove(tmp_filename);
+        ty_log(TY_LOG_DEBUG, "Failed to save HalfKay pacing to '%s'", filename);
+    }
+}
+
+struct halfkay_pacer {
+    ty_model model;
+    // Don't save what we learn from simulated devices
+    bool persist;
+    struct halfkay_pacing pacing;
+    // Points to own_stats, unless the caller wants them
+    ty_board_upload_stats *stats;
+    ty_board_upload_stats own_stats;
+
+    // Current block, in microseconds
+    uint64_t block_start;
+    unsigned int block_stalls;
+    bool after_erase;
+};
+
+static void init_halfkay_pacer(struct halfkay_pacer *pacer, const ty_board_interface *iface,
+                               ty_board_upload_stats *stats)
+{
+    ty_model model = iface->model;
+
+    memset(pacer, 0, sizeof(*pacer));
+
+    pacer->model = model;
+    pacer->persist = !iface->dev->simulated;
+    if (stats) {
+        memset(stats, 0, sizeof(*stats));
+        pacer->stats = stats;
+    } else {
+        pacer->stats = &pacer->own_stats;
     }
+    pacer->pacing.erase_delay = HALFKAY_DEFAULT_ERASE_DELAY;
+    pacer->pacing.retry_delay = HALFKAY_DEFAULT_RETRY_DELAY;
+    if (_ty_once_done(&halfkay_pacing_once) && model < TY_COUNTOF(halfkay_pacings)) {
+        ty_mutex_lock(&halfkay_pacing_mutex);
+        pacer->pacing = halfkay_pacings[model];
+        ty_mutex_unlock(&halfkay_pacing_mutex);
+    }
+
+    pacer->stats->erase_delay = pacer->pacing.erase_delay;
+    pacer->stats->retry_delay = pacer->pacing.retry_delay;
+}
+
+/* Only keep what we learned from complete uploads. This runs once per upload, and the
+   file is only written if something changed. */
+static void commit_halfkay_pacer(const struct halfkay_pacer *pacer)
+{
+    const ty_board_upload_stats *stats = pacer->stats;
+
+    ty_log(TY_LOG_DEBUG, "HalfKay pacing: %u writes, %u stalls, %"PRIu64" ms writing "
+                         "(max %"PRIu64" ms), %"PRIu64" ms waiting",
+           stats->writes, stats->stalls, stats->write_time / 1000,
+           stats->max_write_time / 1000, stats->wait_time / 1000);
+    ty_log(TY_LOG_DEBUG, "HalfKay pacing: erase delay %d ms, retry delay %d ms",
+           stats->erase_delay, stats->retry_delay);
+
+    if (!_ty_once_done(&halfkay_pacing_once) || pacer->model >= TY_COUNTOF(halfkay_pacings))
+        return;
+
+    ty_mutex_lock(&halfkay_pacing_mutex);
+    if (memcmp(&halfkay_pacings[pacer->model], &pacer->pacing, sizeof(pacer->pacing))) {
+        halfkay_pacings[pacer->model] = pacer->pacing;
+        if (pacer->persist)
+            save_halfkay_pacing();
+    }
+    ty_mutex_unlock(&halfkay_pacing_mutex);
+}
+
+/* Try to write the report once. Returns 1 once written, or 0 if the bootloader is busy,
+   in which case *rdelay tells how long to wait before trying again. On success, *rdelay
+   is the time to wait before the next block. */
+static int halfkay_write_paced(struct halfkay_pacer *pacer, hs_port *port, size_t addr,
+                               const uint8_t *report, size_t size, unsigned int timeout,
+                               int *rdelay)
+{
+    ty_board_upload_stats *stats = pacer->stats;
+    uint64_t start, latency;
+    int delay;
+    ssize_t r;
+
+    start = ty_micros();
+    if (!pacer->block_start) {
+        pacer->block_start = start;
+        pacer->block_stalls = 0;
+    }
+
+    hs_error_mask(HS_ERROR_IO);
+    r = hs_hid_write(port, report, size);
     hs_error_unmask();
-    if (r < 0) {
-        if (r == HS_ERROR_IO)
+    latency = ty_micros() - start;
+
+    if (r == HS_ERROR_IO) {
+        stats->stalls++;
+        if ((start + latency - pacer->block_start) / 1000 >= timeout)
             return ty_error(TY_ERROR_IO, "%s", hs_error_last_message());
+
+        // The erase took longer than we thought, wait longer next time
+        if (pacer->after_erase && !pacer->block_stalls)
+            pacer->pacing.erase_delay = TY_MIN(pacer->pacing.erase_delay * 2,
+                                               HALFKAY_MAX_ERASE_DELAY);
+
+        delay = pacer->pacing.retry_delay << TY_MIN(pacer->block_stalls, 4);
+        delay = TY_MIN(delay, HALFKAY_MAX_RETRY_DELAY);
+        pacer->block_stalls++;
+
+        stats->wait_time += (uint64_t)delay * 1000;
+        *rdelay = delay;
+        return 0;
+    }
+    if (r < 0)
         return ty_libhs_translate_error((int)r);
+
+    stats->writes++;
+    stats->write_time += latency;
+    stats->max_write_time = TY_MAX(stats->max_write_time, latency);
+    ty_histogram_add(&stats->write_latency, latency);
+    ty_histogram_add(&stats->block_latency, start + latency - pacer->block_start);
+
+    if (pacer->block_stalls > 1) {
+        pacer->pacing.retry_delay = TY_MIN(pacer->pacing.retry_delay * 2,
+                                           HALFKAY_MAX_RETRY_DELAY);
+    } else if (pacer->block_stalls == 1) {
+        pacer->pacing.retry_delay = TY_MAX(pacer->pacing.retry_delay * 7 / 8, 1);
+    }
+    if (pacer->after_erase && !pacer->block_stalls)
+        pacer->pacing.erase_delay = TY_MAX(pacer->pacing.erase_delay * 7 / 8, 10);
+    pacer->after_erase = false;
+
+    if (!addr) {
+        delay = pacer->pacing.erase_delay;
+        pacer->after_erase = true;
+        stats->erase_time = start + latency - pacer->block_start + (uint64_t)delay * 1000;
+    } else {
+        delay = 0;
     }
+    pacer->block_start = 0;
 
-    /* HalfKay generates STALL if you go too fast (translates to EPIPE on Linux), and the
-       first write takes longer because it triggers a complete erase of all blocks. */
-    if (!addr)
-        ty_delay(200);
+    stats->wait_time += (uint64_t)delay * 1000;
+    stats->erase_delay = pacer->pacing.erase_delay;
+    stats->retry_delay = pacer->pacing.retry_delay;
+
+    *rdelay = delay;
+    return 1;
+}
+
+static int halfkay_send(struct halfkay_pacer *pacer, hs_port *port, unsigned int halfkay_version,
+                        size_t block_size, size_t addr, const void *data, size_t size,
+                        unsigned int timeout)
+{
+    uint8_t buf[2048] = {0};
+    int delay, r;
+
+    // Update if header gets bigger than 64 bytes
+    assert(size < sizeof(buf) - 65);
+
+    halfkay_format_report(halfkay_version, addr, data, size, buf);
+    do {
+        r = halfkay_write_paced(pacer, port, addr, buf,
+                                halfkay_get_report_size(halfkay_version, block_size), timeout,
+                                &delay);
+        if (r < 0)
+            return r;
+        if (delay)
+            ty_delay((unsigned int)delay);
+    } while (!r);
 
     return 0;
 }
@@ -668,62 +957,226 @@ static int get_halfkay_settings(ty_model model, unsigned int *rhalfkay_version,
     return 0;
 }
 
-static int teensy_upload(ty_board_interface *iface, ty_firmware *fw,
-                         ty_board_upload_progress_func *pf, void *udata)
+static int build_halfkay_plan(const ty_firmware *fw, ty_model model, _ty_upload_plan *plan)
 {
     unsigned int halfkay_version;
     size_t min_address, max_address, block_size;
+    size_t max_blocks;
     int r;
 
-    r = get_halfkay_settings(iface->model, &halfkay_version, &min_address, &max_address, &block_size);
+    r = get_halfkay_settings(model, &halfkay_version, &min_address, &max_address, &block_size);
     if (r < 0)
         return r;
+    assert(fw->max_address <= max_address);
 
-    if (fw->max_address > max_address)
-        return ty_error(TY_ERROR_RANGE, "Firmware is too big for %s",
-                        ty_models[iface->model].name);
+    plan->flash_size = max_address - min_address;
+    plan->report_size = halfkay_get_report_size(halfkay_version, block_size);
 
-    if (pf) {
-        r = (*pf)(iface->board, fw, 0, max_address - min_address, udata);
-        if (r)
-            return r;
-    }
+    max_blocks = fw->max_address > min_address ?
+                 (fw->max_address - min_address + block_size - 1) / block_size : 0;
+    plan->addresses = malloc(TY_MAX(max_blocks, 1) * sizeof(*plan->addresses));
+    plan->sizes = malloc(TY_MAX(max_blocks, 1) * sizeof(*plan->sizes));
+    plan->reports = calloc(TY_MAX(max_blocks, 1), plan->report_size);
+    if (!plan->addresses || !plan->sizes || !plan->reports)
+        return ty_error(TY_ERROR_MEMORY, NULL);
 
-    size_t uploaded_len = 0;
     for (size_t address = min_address; address < fw->max_address; address += block_size) {
-        char buf[8192];
+        uint8_t *report = plan->reports + plan->blocks_count * plan->report_size;
+        uint8_t buf[8192] = {0};
         size_t buf_len;
 
-        memset(buf, 0, sizeof(buf));
         buf_len = ty_firmware_extract(fw, (uint32_t)address, buf, block_size);
+        if (!buf_len)
+            continue;
 
-        if (buf_len) {
-            r = halfkay_send(iface->port, halfkay_version, block_size, address, buf, buf_len, 3000);
-            if (r < 0)
-                return r;
-            uploaded_len += buf_len;
+        halfkay_format_report(halfkay_version, address, buf, buf_len, report);
+        plan->addresses[plan->blocks_count] = (uint32_t)address;
+        plan->sizes[plan->blocks_count] = buf_len;
+        plan->blocks_count++;
+    }
 
-            if (pf) {
-                r = (*pf)(iface->board, fw, uploaded_len, max_address - min_address, udata);
-                if (r)
-                    return r;
-            }
+    return 0;
+}
+
+struct halfkay_upload {
+    ty_firmware *fw;
+    ty_board_upload_progress_func *pf;
+    void *udata;
+
+    unsigned int halfkay_version;
+    size_t min_address;
+    size_t max_address;
+    size_t block_size;
+
+    // Reports are prepared once for all the boards that use this firmware
+    _ty_upload_plan *plan;
+    unsigned int block;
+
+    const uint8_t *report;
+    size_t report_address;
+    size_t report_len;
+    size_t report_size;
+
+    size_t uploaded_len;
+    bool complete;
+    struct halfkay_pacer pacer;
+};
+
+static void teensy_upload_end(void *session);
+
+static int teensy_upload_start(ty_board_interface *iface, ty_firmware *fw,
+                               ty_board_upload_stats *stats, ty_board_upload_progress_func *pf,
+                               void *udata, void **rsession)
+{
+    struct halfkay_upload *upload;
+    int r;
+
+    upload = calloc(1, sizeof(*upload));
+    if (!upload)
+        return ty_error(TY_ERROR_MEMORY, NULL);
+    upload->fw = fw;
+    upload->pf = pf;
+    upload->udata = udata;
+    init_halfkay_pacer(&upload->pacer, iface, stats);
+
+    r = get_halfkay_settings(iface->model, &upload->halfkay_version, &upload->min_address,
+                             &upload->max_address, &upload->block_size);
+    if (r < 0)
+        goto error;
+    upload->report_size = halfkay_get_report_size(upload->halfkay_version, upload->block_size);
+
+    /* The first write erases the board, so streamed firmwares must be fully loaded (and
+       valid) before we start. Reading and parsing still overlap the reboot. */
+    do {
+        r = ty_firmware_wait(fw, SIZE_MAX, 100);
+        if (!r)
+            r = _ty_task_check_canceled();
+    } while (!r);
+    if (r < 0)
+        goto error;
+
+    if (fw->max_address > upload->max_address) {
+        r = ty_error(TY_ERROR_RANGE, "Firmware is too big for %s",
+                     ty_models[iface->model].name);
+        goto error;
+    }
+
+    r = _ty_upload_plan_get(fw, &_ty_teensy_class_vtable, iface->model, build_halfkay_plan,
+                            &upload->plan);
+    if (r < 0)
+        goto error;
+
+    if (pf) {
+        r = (*pf)(iface->board, fw, 0, upload->max_address - upload->min_address, udata);
+        if (r < 0)
+            goto error;
+    }
+
+    *rsession = upload;
+    return 0;
+
+error:
+    teensy_upload_end(upload);
+    return r;
+}
+
+// Returns 1 with the next report ready, or 0 if there is nothing left to send
+static int next_halfkay_report(struct halfkay_upload *upload)
+{
+    _ty_upload_plan *plan = upload->plan;
+
+    if (upload->block >= plan->blocks_count)
+        return 0;
+
+    upload->report = plan->reports + upload->block * plan->report_size;
+    upload->report_address = plan->addresses[upload->block];
+    upload->report_len = plan->sizes[upload->block];
+    upload->block++;
+
+    return 1;
+}
+
+static int teensy_upload_step(ty_board_interface *iface, void *session, int *rdelay)
+{
+    struct halfkay_upload *upload = session;
+    int r;
+
+    *rdelay = 0;
+
+    if (!upload->report) {
+        r = next_halfkay_report(upload);
+        if (!r) {
+            upload->complete = true;
+            return 1;
         }
     }
 
+    r = halfkay_write_paced(&upload->pacer, iface->port, upload->report_address, upload->report,
+                            upload->report_size, HALFKAY_TIMEOUT, rdelay);
+    if (r <= 0)
+        return r;
+    upload->report = NULL;
+    upload->uploaded_len += upload->report_len;
+
+    if (upload->pf) {
+        r = (*upload->pf)(iface->board, upload->fw, upload->uploaded_len,
+                          upload->max_address - upload->min_address, upload->udata);
+        // Non-zero values other than errors stop the upload early
+        if (r)
+            return r < 0 ? r : 1;
+    }
+
     return 0;
 }
 
+static void teensy_upload_end(void *session)
+{
+    struct halfkay_upload *upload = session;
+
+    if (upload) {
+        if (upload->complete)
+            commit_halfkay_pacer(&upload->pacer);
+        _ty_upload_plan_unref(upload->plan);
+    }
+
+    free(upload);
+}
+
+static int teensy_upload(ty_board_interface *iface, ty_firmware *fw,
+                         ty_board_upload_stats *stats, ty_board_upload_progress_func *pf,
+                         void *udata)
+{
+    void *session;
+    int delay, r;
+
+    r = teensy_upload_start(iface, fw, stats, pf, udata, &session);
+    if (r < 0)
+        return r;
+
+    do {
+        r = teensy_upload_step(iface, session, &delay);
+        if (!r && delay)
+            ty_delay((unsigned int)delay);
+        if (!r)
+            r = _ty_task_check_canceled();
+    } while (!r);
+
+    teensy_upload_end(session);
+    return r < 0 ? r : 0;
+}
+
 static int teensy_reset(ty_board_interface *iface)
 {
     unsigned int halfkay_version;
     size_t min_address, max_address, block_size;
+    struct halfkay_pacer pacer;
 
     int r = get_halfkay_settings(iface->model, &halfkay_version, &min_address, &max_address, &block_size);
     if (r < 0)
         return r;
 
-    return halfkay_send(iface->port, halfkay_version, block_size, 0xFFFFFF, NULL, 0, 250);
+    init_halfkay_pacer(&pacer, iface, NULL);
+    return halfkay_send(&pacer, iface->port, halfkay_version, block_size, 0xFFFFFF, NULL, 0, 250);
 }
 
 static int teensy_reboot(ty_board_interface *iface)
@@ -770,6 +1223,9 @@ const struct _ty_class_vtable _ty_teensy_class_vtable = {
     .serial_read = teensy_serial_read,
     .serial_write = teensy_serial_write,
     .upload = teensy_upload,
+    .upload_start = teensy_upload_start,
+    .upload_step = teensy_upload_step,
+    .upload_end = teensy_upload_end,
     .reset = teensy_reset,
     .reboot = teensy_reboot
 };
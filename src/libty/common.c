@@ -18,16 +18,66 @@
 #include "system.h"
 #include "version.h"
 #include "task.h"
+#include "thread.h"
+
+#define MESSAGE_TEXT_SIZE 512
+#define MESSAGE_MAX_CTX_LEN 255
+#define MESSAGE_RING_SIZE 128
+
+#define DEFAULT_PROGRESS_STEP 10
+#define DEFAULT_PROGRESS_INTERVAL 200
+
+/* Queued messages are copied by value, the strings they point to (context and text) are
+   copied to the record and the pointers are fixed up when the message is handled. */
+struct message_record {
+    ty_message_data msg;
+    char ctx[MESSAGE_MAX_CTX_LEN + 1];
+    char text[MESSAGE_TEXT_SIZE];
+};
+
+struct message_slot {
+    unsigned int seq;
+    struct message_record record;
+};
+
+/* Bounded MPSC ring: producers claim positions with a CAS on tail, and each slot sequence
+   number tells whether it is free (seq == pos), published (pos + 1), or not yet released
+   by the consumer. */
+static struct {
+    unsigned int enabled;
+    unsigned int producers;
+
+    struct message_slot *slots;
+    unsigned int head;
+    unsigned int tail;
+
+    ty_thread thread;
+    ty_mutex mutex;
+    ty_cond wake_cond;
+    unsigned int sleeping;
+    ty_cond drain_cond;
+    unsigned int drain_waiters;
+    bool stop;
+} async;
+
+static TY_THREAD_LOCAL bool message_consumer;
 
 int ty_config_verbosity = TY_LOG_INFO;
 
 static ty_message_func *message_handler = ty_message_default_handler;
 static void *message_handler_udata = NULL;
 
+static unsigned int progress_step = DEFAULT_PROGRESS_STEP;
+static unsigned int progress_interval = DEFAULT_PROGRESS_INTERVAL;
+// For progress messages sent outside of tasks
+static TY_THREAD_LOCAL ty_progress_state thread_progress;
+
 static TY_THREAD_LOCAL ty_err error_masks[16];
 static TY_THREAD_LOCAL unsigned int error_masks_count;
 
-static TY_THREAD_LOCAL char last_error_msg[512];
+static TY_THREAD_LOCAL char last_error_msg[MESSAGE_TEXT_SIZE];
+// Messages of masked errors without arguments are only copied to last_error_msg when needed
+static TY_THREAD_LOCAL const char *last_error_static;
 
 const char *ty_version_string(void)
 {
@@ -113,6 +163,294 @@ void ty_message_redirect(ty_message_func *f, void *udata)
 
     message_handler = f;
     message_handler_udata = udata;
+    progress_step = DEFAULT_PROGRESS_STEP;
+    progress_interval = DEFAULT_PROGRESS_INTERVAL;
+}
+
+void ty_message_set_progress_throttle(unsigned int step, unsigned int interval)
+{
+    progress_step = step;
+    progress_interval = interval;
+}
+
+static void complete_message(ty_message_data *msg)
+{
+    if (!msg->task)
+        msg->task = ty_task_get_current();
+    if (!msg->ctx && msg->task)
+        msg->ctx = msg->task->name;
+}
+
+static void send_message(ty_message_data *msg)
+{
+    ty_task *task;
+
+    complete_message(msg);
+    task = msg->task;
+
+    (*message_handler)(msg, message_handler_udata);
+    if (task && task->user_callback)
+        (*task->user_callback)(msg, task->user_callback_udata);
+}
+
+/* Producers and ty_message_flush() callers register themselves, so that
+   ty_message_stop_async() can wait for them before it stops the consumer. */
+static bool enter_async_mode(void)
+{
+    if (!_ty_atomic_load(&async.enabled) || message_consumer)
+        return false;
+
+    _ty_refcount_increase(&async.producers);
+    _ty_atomic_fence();
+    if (!_ty_atomic_load(&async.enabled)) {
+        _ty_refcount_decrease(&async.producers);
+        return false;
+    }
+
+    return true;
+}
+
+static void leave_async_mode(void)
+{
+    _ty_refcount_decrease(&async.producers);
+}
+
+static void wait_message_drain(unsigned int head)
+{
+    ty_mutex_lock(&async.mutex);
+    _ty_refcount_increase(&async.drain_waiters);
+    _ty_atomic_fence();
+    while ((int)(_ty_atomic_load(&async.head) - head) < 0)
+        ty_cond_wait(&async.drain_cond, &async.mutex, -1);
+    _ty_refcount_decrease(&async.drain_waiters);
+    ty_mutex_unlock(&async.mutex);
+}
+
+static struct message_slot *acquire_message_slot(unsigned int *rpos)
+{
+    unsigned int pos = _ty_atomic_load(&async.tail);
+
+    for (;;) {
+        struct message_slot *slot = &async.slots[pos % MESSAGE_RING_SIZE];
+        int diff = (int)(_ty_atomic_load(&slot->seq) - pos);
+
+        if (!diff) {
+            if (_ty_atomic_compare_exchange(&async.tail, &pos, pos + 1)) {
+                *rpos = pos;
+                return slot;
+            }
+        } else if (diff < 0) {
+            // The ring is full, let the consumer catch up instead of waking up for each slot
+            wait_message_drain(pos - MESSAGE_RING_SIZE / 2);
+            pos = _ty_atomic_load(&async.tail);
+        } else {
+            pos = _ty_atomic_load(&async.tail);
+        }
+    }
+}
+
+static void publish_message_slot(struct message_slot *slot, unsigned int pos)
+{
+    _ty_atomic_store(&slot->seq, pos + 1);
+
+    _ty_atomic_fence();
+    if (_ty_atomic_load(&async.sleeping)) {
+        ty_mutex_lock(&async.mutex);
+        ty_cond_signal(&async.wake_cond);
+        ty_mutex_unlock(&async.mutex);
+    }
+}
+
+static void copy_message_string(char *dest, size_t size, const char *str)
+{
+    strncpy(dest, str, size);
+    dest[size - 1] = 0;
+}
+
+/* Queue the message if async mode is enabled. Log messages are formatted from fmt and ap
+   when fmt is set, instead of using msg->u.log.msg. */
+static bool post_message(ty_message_data *msg, const char *fmt, va_list *ap)
+{
+    struct message_slot *slot;
+    struct message_record *record;
+    unsigned int pos;
+
+    if (!enter_async_mode())
+        return false;
+    complete_message(msg);
+    if (!msg->time)
+        msg->time = ty_millis();
+
+    slot = acquire_message_slot(&pos);
+    record = &slot->record;
+
+    record->msg = *msg;
+    if (msg->task)
+        ty_task_ref(msg->task);
+    if (msg->ctx)
+        copy_message_string(record->ctx, sizeof(record->ctx), msg->ctx);
+
+    switch (msg->type) {
+        case TY_MESSAGE_LOG: {
+            if (fmt) {
+                vsnprintf(record->text, sizeof(record->text), fmt, *ap);
+            } else {
+                copy_message_string(record->text, sizeof(record->text), msg->u.log.msg);
+            }
+        } break;
+
+        case TY_MESSAGE_PROGRESS: {
+            copy_message_string(record->text, sizeof(record->text), msg->u.progress.action);
+        } break;
+
+        case TY_MESSAGE_STATUS: {
+            assert(false);
+        } break;
+    }
+
+    publish_message_slot(slot, pos);
+    leave_async_mode();
+
+    return true;
+}
+
+static void dispatch_message_record(struct message_record *record)
+{
+    ty_message_data *msg = &record->msg;
+    ty_task *task = msg->task;
+
+    if (msg->ctx)
+        msg->ctx = record->ctx;
+    switch (msg->type) {
+        case TY_MESSAGE_LOG: { msg->u.log.msg = record->text; } break;
+        case TY_MESSAGE_PROGRESS: { msg->u.progress.action = record->text; } break;
+        case TY_MESSAGE_STATUS: {} break;
+    }
+
+    send_message(msg);
+
+    // This may be the last reference, e.g. for status messages of finished tasks
+    ty_task_unref(task);
+}
+
+static int run_message_consumer(void *udata)
+{
+    TY_UNUSED(udata);
+
+    // Messages emitted by the handlers are handled synchronously
+    message_consumer = true;
+
+    for (;;) {
+        struct message_slot *slot = &async.slots[async.head % MESSAGE_RING_SIZE];
+
+        if (_ty_atomic_load(&slot->seq) == async.head + 1) {
+            dispatch_message_record(&slot->record);
+
+            _ty_atomic_store(&slot->seq, async.head + MESSAGE_RING_SIZE);
+            _ty_atomic_store(&async.head, async.head + 1);
+
+            _ty_atomic_fence();
+            if (_ty_atomic_load(&async.drain_waiters)) {
+                ty_mutex_lock(&async.mutex);
+                ty_cond_broadcast(&async.drain_cond);
+                ty_mutex_unlock(&async.mutex);
+            }
+
+            continue;
+        }
+
+        ty_mutex_lock(&async.mutex);
+        _ty_atomic_store(&async.sleeping, 1);
+        _ty_atomic_fence();
+        if (_ty_atomic_load(&slot->seq) != async.head + 1) {
+            if (async.stop) {
+                ty_mutex_unlock(&async.mutex);
+                break;
+            }
+            ty_cond_wait(&async.wake_cond, &async.mutex, -1);
+        }
+        _ty_atomic_store(&async.sleeping, 0);
+        ty_mutex_unlock(&async.mutex);
+    }
+
+    return 0;
+}
+
+int ty_message_start_async(void)
+{
+    int r;
+
+    if (async.slots)
+        return 0;
+
+    async.slots = calloc(MESSAGE_RING_SIZE, sizeof(*async.slots));
+    if (!async.slots)
+        return ty_error(TY_ERROR_MEMORY, NULL);
+    for (unsigned int i = 0; i < MESSAGE_RING_SIZE; i++)
+        async.slots[i].seq = i;
+    async.head = 0;
+    async.tail = 0;
+    async.stop = false;
+
+    r = ty_mutex_init(&async.mutex);
+    if (r < 0)
+        goto error;
+    r = ty_cond_init(&async.wake_cond);
+    if (r < 0)
+        goto error;
+    r = ty_cond_init(&async.drain_cond);
+    if (r < 0)
+        goto error;
+
+    r = ty_thread_create(&async.thread, run_message_consumer, NULL);
+    if (r < 0)
+        goto error;
+
+    _ty_atomic_store(&async.enabled, 1);
+    return 0;
+
+error:
+    ty_cond_release(&async.drain_cond);
+    ty_cond_release(&async.wake_cond);
+    ty_mutex_release(&async.mutex);
+    free(async.slots);
+    async.slots = NULL;
+    return r;
+}
+
+void ty_message_stop_async(void)
+{
+    assert(!message_consumer);
+
+    if (!async.slots)
+        return;
+
+    // New messages are handled synchronously, and the consumer drains the queued ones
+    _ty_atomic_store(&async.enabled, 0);
+    _ty_atomic_fence();
+    while (_ty_atomic_load(&async.producers))
+        ty_delay(1);
+
+    ty_mutex_lock(&async.mutex);
+    async.stop = true;
+    ty_cond_signal(&async.wake_cond);
+    ty_mutex_unlock(&async.mutex);
+    ty_thread_join(&async.thread);
+
+    ty_cond_release(&async.drain_cond);
+    ty_cond_release(&async.wake_cond);
+    ty_mutex_release(&async.mutex);
+    free(async.slots);
+    async.slots = NULL;
+}
+
+void ty_message_flush(void)
+{
+    if (!enter_async_mode())
+        return;
+
+    wait_message_drain(_ty_atomic_load(&async.tail));
+    leave_async_mode();
 }
 
 void ty_log(ty_log_level level, const char *fmt, ...)
@@ -120,18 +458,26 @@ void ty_log(ty_log_level level, const char *fmt, ...)
     assert(fmt);
 
     va_list ap;
-    char buf[sizeof(last_error_msg)];
     ty_message_data msg = {0};
+    bool posted;
+
+    msg.type = TY_MESSAGE_LOG;
+    msg.u.log.level = level;
 
     va_start(ap, fmt);
-    vsnprintf(buf, sizeof(buf), fmt, ap);
+    posted = post_message(&msg, fmt, &ap);
     va_end(ap);
 
-    msg.type = TY_MESSAGE_LOG;
-    msg.u.log.level = level;
-    msg.u.log.msg = buf;
+    if (!posted) {
+        char buf[MESSAGE_TEXT_SIZE];
 
-    ty_message(&msg);
+        va_start(ap, fmt);
+        vsnprintf(buf, sizeof(buf), fmt, ap);
+        va_end(ap);
+        msg.u.log.msg = buf;
+
+        send_message(&msg);
+    }
 }
 
 static const char *generic_error(int err)
@@ -153,6 +499,8 @@ static const char *generic_error(int err)
         case TY_ERROR_RANGE: { return "Out of range error"; } break;
         case TY_ERROR_SYSTEM: { return "System error"; } break;
         case TY_ERROR_PARSE: { return "Parse error"; } break;
+        case TY_ERROR_CANCELED: { return "Canceled"; } break;
+        case TY_ERROR_SUPERSEDED: { return "Superseded"; } break;
 
         case TY_ERROR_OTHER: {} break;
     }
@@ -187,8 +535,17 @@ bool ty_error_is_masked(int err)
     return false;
 }
 
+static void set_last_error(const char *msg)
+{
+    copy_message_string(last_error_msg, sizeof(last_error_msg), msg);
+    last_error_static = NULL;
+}
+
 const char *ty_error_last_message(void)
 {
+    if (last_error_static)
+        set_last_error(last_error_static);
+
     return last_error_msg;
 }
 
@@ -198,6 +555,14 @@ int ty_error(ty_err err, const char *fmt, ...)
     char buf[sizeof(last_error_msg)];
     ty_message_data msg = {0};
 
+    /* Masked errors are common (e.g. when probing boards) and their message is rarely read,
+       so constant messages are only copied when someone asks for them. Arguments can't be
+       kept around after we return, so other messages are formatted right away. */
+    if (ty_error_is_masked(err) && (!fmt || !strchr(fmt, '%'))) {
+        last_error_static = fmt ? fmt : generic_error(err);
+        return err;
+    }
+
     /* Don't copy directly to last_error_message because we need to support
        ty_error(err, "%s", ty_error_last_message()). */
     if (fmt) {
@@ -205,10 +570,9 @@ int ty_error(ty_err err, const char *fmt, ...)
         vsnprintf(buf, sizeof(buf), fmt, ap);
         va_end(ap);
     } else {
-        strncpy(buf, generic_error(err), sizeof(buf));
-        buf[sizeof(buf) - 1] = 0;
+        copy_message_string(buf, sizeof(buf), generic_error(err));
     }
-    strcpy(last_error_msg, buf);
+    set_last_error(buf);
 
     if (!ty_error_is_masked(err)) {
         msg.type = TY_MESSAGE_LOG;
@@ -222,15 +586,60 @@ int ty_error(ty_err err, const char *fmt, ...)
     return err;
 }
 
+static bool update_progress_state(ty_progress_state *state, const char *action,
+                                  uint64_t value, uint64_t max)
+{
+    unsigned int step = progress_step;
+    unsigned int interval = progress_interval;
+    uint64_t now = 0;
+
+    if (!step && !interval)
+        return true;
+
+    /* Always send the first message of each action, and restarts. Actions are compared by
+       pointer, the previous one may not exist anymore. */
+    if (action != state->action || max != state->max || value < state->value)
+        goto update;
+
+    if (value == state->value)
+        return false;
+    if (value == max)
+        goto update;
+    if (step && (value - state->value) * 1000 >= (uint64_t)step * max)
+        goto update;
+    if (interval) {
+        now = ty_millis();
+        if (now - state->time >= interval)
+            goto update;
+    }
+
+    return false;
+
+update:
+    state->action = action;
+    state->value = value;
+    state->max = max;
+    state->time = (interval && !now) ? ty_millis() : now;
+
+    return true;
+}
+
 void ty_progress(const char *action, uint64_t value, uint64_t max)
 {
     assert(value <= max);
     assert(max);
 
+    ty_task *task = ty_task_get_current();
     ty_message_data msg = {0};
 
+    if (!action)
+        action = "Processing";
+    if (!update_progress_state(task ? &task->progress : &thread_progress, action, value, max))
+        return;
+
     msg.type = TY_MESSAGE_PROGRESS;
-    msg.u.progress.action = action ? action : "Processing";
+    msg.task = task;
+    msg.u.progress.action = action;
     msg.u.progress.value = value;
     msg.u.progress.max = max;
 
@@ -239,17 +648,15 @@ void ty_progress(const char *action, uint64_t value, uint64_t max)
 
 void ty_message(ty_message_data *msg)
 {
-    ty_task *task = msg->task;
-    if (!task) {
-        task = ty_task_get_current();
-        msg->task = task;
+    if (msg->type == TY_MESSAGE_STATUS) {
+        /* Status changes drive task callbacks (e.g. lifetime management in TyCommander),
+           keep them synchronous and after the messages that came before. */
+        ty_message_flush();
+    } else if (post_message(msg, NULL, NULL)) {
+        return;
     }
-    if (!msg->ctx && task)
-        msg->ctx = task->name;
 
-    (*message_handler)(msg, message_handler_udata);
-    if (task && task->user_callback)
-        (*task->user_callback)(msg, task->user_callback_udata);
+    send_message(msg);
 }
 
 int ty_libhs_translate_error(int err)
@@ -283,8 +690,7 @@ void ty_libhs_log_handler(hs_log_level level, int err, const char *log, void *ud
         case HS_LOG_ERROR: {
             msg.u.log.level = TY_LOG_ERROR;
             msg.u.log.err = ty_libhs_translate_error(err);
-            strncpy(last_error_msg, log, sizeof(last_error_msg));
-            last_error_msg[sizeof(last_error_msg) - 1] = 0;
+            set_last_error(log);
             if (ty_error_is_masked(msg.u.log.err))
                 return;
         } break;
@@ -315,3 +721,70 @@ unsigned int _ty_refcount_decrease(unsigned int *rrefcount)
     return 0;
 #endif
 }
+
+unsigned int _ty_atomic_load(const unsigned int *rvalue)
+{
+#ifdef _MSC_VER
+    return InterlockedCompareExchange((unsigned int *)rvalue, 0, 0);
+#else
+    return __atomic_load_n(rvalue, __ATOMIC_ACQUIRE);
+#endif
+}
+
+void _ty_atomic_store(unsigned int *rvalue, unsigned int value)
+{
+#ifdef _MSC_VER
+    InterlockedExchange(rvalue, value);
+#else
+    __atomic_store_n(rvalue, value, __ATOMIC_RELEASE);
+#endif
+}
+
+bool _ty_atomic_compare_exchange(unsigned int *rvalue, unsigned int *rexpected,
+                                 unsigned int desired)
+{
+#ifdef _MSC_VER
+    unsigned int value = InterlockedCompareExchange(rvalue, desired, *rexpected);
+    if (value == *rexpected)
+        return true;
+    *rexpected = value;
+    return false;
+#else
+    return __atomic_compare_exchange_n(rvalue, rexpected, desired, false, __ATOMIC_ACQ_REL,
+                                       __ATOMIC_ACQUIRE);
+#endif
+}
+
+void _ty_atomic_fence(void)
+{
+#ifdef _MSC_VER
+    MemoryBarrier();
+#else
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+int _ty_once(unsigned int *ronce, _ty_once_func *f)
+{
+    unsigned int state = 0;
+    int r;
+
+    while (!_ty_atomic_compare_exchange(ronce, &state, 1)) {
+        if (state == 2)
+            return 0;
+
+        // Another thread is running f, wait for it to succeed or fail
+        ty_delay(1);
+        state = 0;
+    }
+
+    r = (*f)();
+    _ty_atomic_store(ronce, r >= 0 ? 2 : 0);
+
+    return r;
+}
+
+bool _ty_once_done(const unsigned int *ronce)
+{
+    return _ty_atomic_load(ronce) == 2;
+}
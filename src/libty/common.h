@@ -105,7 +105,9 @@ typedef enum ty_err {
     TY_ERROR_RANGE         = -11,
     TY_ERROR_SYSTEM        = -12,
     TY_ERROR_PARSE         = -13,
-    TY_ERROR_OTHER         = -14
+    TY_ERROR_OTHER         = -14,
+    TY_ERROR_CANCELED      = -15,
+    TY_ERROR_SUPERSEDED    = -16
 } ty_err;
 
 typedef enum ty_message_type {
@@ -131,6 +133,8 @@ typedef enum ty_task_status {
 typedef struct ty_message_data {
     const char *ctx;
     struct ty_task *task;
+    // ty_millis() value when a message is queued in async mode, 0 otherwise
+    uint64_t time;
 
     ty_message_type type;
     union {
@@ -152,17 +156,40 @@ typedef struct ty_message_data {
 
 typedef void ty_message_func(const ty_message_data *msg, void *udata);
 
+// Last progress message sent by ty_progress(), used to coalesce the next ones
+typedef struct ty_progress_state {
+    const char *action;
+    uint64_t value;
+    uint64_t max;
+    uint64_t time;
+} ty_progress_state;
+
 extern int ty_config_verbosity;
 
 const char *ty_version_string(void);
 
 void ty_message_default_handler(const ty_message_data *msg, void *udata);
 void ty_message_redirect(ty_message_func *f, void *udata);
+/* Progress messages are coalesced: they go through when the value has moved by at least
+   step / 1000 of the maximum, or after interval milliseconds. The first and the last (100%)
+   message of each action are always sent. Use 0 for both to get every message. This
+   applies to the current handler, ty_message_redirect() restores the defaults. */
+void ty_message_set_progress_throttle(unsigned int step, unsigned int interval);
+
+/* In async mode, log and progress messages are queued and handled in order by a background
+   thread, so that slow handlers don't stall the threads that emit them. Queued messages keep
+   a reference to their task, use ty_message_flush() to wait for the messages sent so far.
+   Status messages are still handled synchronously, once the queued messages are done. */
+int ty_message_start_async(void);
+void ty_message_stop_async(void);
+void ty_message_flush(void);
 
 void ty_error_mask(ty_err err);
 void ty_error_unmask(void);
 bool ty_error_is_masked(int err);
 
+/* Constant messages of masked errors are only copied when this is called, messages with
+   arguments are always formatted. */
 const char *ty_error_last_message(void);
 
 void ty_message(ty_message_data *msg);
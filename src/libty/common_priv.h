@@ -17,4 +17,16 @@
 void _ty_refcount_increase(unsigned int *rrefcount);
 unsigned int _ty_refcount_decrease(unsigned int *rrefcount);
 
+unsigned int _ty_atomic_load(const unsigned int *rvalue);
+void _ty_atomic_store(unsigned int *rvalue, unsigned int value);
+bool _ty_atomic_compare_exchange(unsigned int *rvalue, unsigned int *rexpected,
+                                 unsigned int desired);
+void _ty_atomic_fence(void);
+
+/* Run f once, even when called concurrently. Other callers wait until it is done, and
+   if f fails, the next call tries again. ronce must be zero-initialized. */
+typedef int _ty_once_func(void);
+int _ty_once(unsigned int *ronce, _ty_once_func *f);
+bool _ty_once_done(const unsigned int *ronce);
+
 #endif
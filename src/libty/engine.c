@@ -0,0 +1,543 @@
+/* TyTools - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/tytools
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#include "common_priv.h"
+#include "../libhs/array.h"
+#include "board_priv.h"
+#include "class_priv.h"
+#include "firmware.h"
+#include "system.h"
+#include "task_priv.h"
+#include "thread.h"
+#include "timer.h"
+
+/* Upload tasks started with TY_UPLOAD_EVENT_LOOP don't get a pool thread. Instead, a
+   single engine thread runs one state machine per board, and sleeps on two timers: one
+   for the next deadline (reboot timeout, HalfKay pacing) and one that other threads
+   trigger when new tasks come in or when a monitor refresh may have changed boards.
+   The engine thread exits when it has been idle for a while.
+
+   Nothing in there may block, or all the boards would wait. Uploads of streamed firmwares
+   that are still loading go to the pool instead, because identification and upload both
+   wait for the data. Classes without step by step support upload in a separate thread. */
+
+#define ENGINE_IDLE_TIMEOUT 10000
+
+enum job_state {
+    JOB_START,
+    JOB_WAIT_BOOTLOADER,
+    JOB_PREPARE,
+    JOB_SEND,
+    JOB_WAIT_UPLOAD,
+    JOB_RESET,
+    JOB_WAIT_RUN
+};
+
+struct upload_job {
+    ty_task *task;
+    enum job_state state;
+    uint64_t deadline;
+    int flags;
+
+    ty_firmware *fw;
+    ty_board_interface *iface;
+    void *session;
+
+    // Blocking upload (no step by step support), done is set once ret is valid
+    ty_thread thread;
+    bool thread_running;
+    unsigned int thread_done;
+    int thread_ret;
+
+    // For the upload report, in microseconds
+    uint64_t start;
+    uint64_t phase_start;
+};
+
+typedef _HS_ARRAY(ty_task *) task_array;
+
+struct engine {
+    unsigned int init;
+
+    ty_mutex mutex;
+    ty_timer *wake_timer;
+    ty_timer *deadline_timer;
+    bool thread_running;
+    task_array submitted_tasks;
+
+    // Only used by the engine thread
+    _HS_ARRAY(struct upload_job *) jobs;
+};
+
+static struct engine engine;
+
+static int init_engine(void)
+{
+    int r;
+
+    r = ty_mutex_init(&engine.mutex);
+    if (r < 0)
+        goto error;
+    r = ty_timer_new(&engine.wake_timer);
+    if (r < 0)
+        goto error;
+    r = ty_timer_new(&engine.deadline_timer);
+    if (r < 0)
+        goto error;
+
+    return 0;
+
+error:
+    ty_timer_free(engine.deadline_timer);
+    engine.deadline_timer = NULL;
+    ty_timer_free(engine.wake_timer);
+    engine.wake_timer = NULL;
+    ty_mutex_release(&engine.mutex);
+    return r;
+}
+
+static int start_job(struct upload_job *job)
+{
+    ty_task *task = job->task;
+    ty_board *board = task->u.upload.board;
+    int r;
+
+    job->start = ty_micros();
+    job->flags = task->u.upload.flags;
+
+    if (job->flags & TY_UPLOAD_NOCHECK) {
+        job->fw = task->u.upload.fws[0];
+    } else if (ty_models[board->model].mcu) {
+        r = _ty_board_select_firmware(board, task->u.upload.fws, task->u.upload.fws_count,
+                                      &job->fw);
+        if (r < 0)
+            return r;
+    }
+
+    ty_log(TY_LOG_INFO, "Uploading to board '%s' (%s)", board->tag, ty_models[board->model].name);
+
+    job->state = JOB_WAIT_BOOTLOADER;
+    job->deadline = UINT64_MAX;
+    if (!ty_board_has_capability(board, TY_BOARD_CAPABILITY_UPLOAD)) {
+        if (job->flags & TY_UPLOAD_WAIT) {
+            ty_log(TY_LOG_INFO, "Waiting for device (press button to reboot)...");
+        } else {
+            ty_log(TY_LOG_INFO, "Triggering board reboot");
+            r = ty_board_reboot(board);
+            if (r < 0)
+                return r;
+
+            job->deadline = ty_millis() + MANUAL_REBOOT_DELAY;
+        }
+    }
+
+    return 1;
+}
+
+static int wait_bootloader(struct upload_job *job)
+{
+    ty_task *task = job->task;
+    ty_board *board = task->u.upload.board;
+    int r;
+
+    r = ty_board_wait_for(board, TY_BOARD_CAPABILITY_UPLOAD, 0);
+    if (r < 0)
+        return r;
+    if (!r) {
+        if (ty_millis() < job->deadline)
+            return 0;
+
+        ty_log(TY_LOG_INFO, "Reboot didn't work, press button manually");
+        job->flags |= TY_UPLOAD_WAIT;
+        job->deadline = UINT64_MAX;
+        task->u.upload.report.retries++;
+
+        return 0;
+    }
+
+    task->u.upload.report.phase_times[TY_UPLOAD_PHASE_REBOOT] = ty_micros() - job->start;
+    job->state = JOB_PREPARE;
+    return 1;
+}
+
+static void wake_engine(void)
+{
+    ty_mutex_lock(&engine.mutex);
+    if (engine.thread_running)
+        ty_timer_set(engine.wake_timer, 0, TY_TIMER_ONESHOT);
+    ty_mutex_unlock(&engine.mutex);
+}
+
+static int run_upload_thread(void *udata)
+{
+    struct upload_job *job = udata;
+    ty_task *task = job->task;
+
+    // Messages and cancellation checks must still refer to the task
+    _ty_task_swap_current(task);
+    job->thread_ret = _ty_board_upload(task->u.upload.board, job->fw,
+                                       &task->u.upload.report.upload,
+                                       _ty_board_upload_progress, NULL);
+    _ty_task_swap_current(NULL);
+
+    _ty_atomic_store(&job->thread_done, 1);
+    wake_engine();
+
+    return 0;
+}
+
+static int prepare_upload(struct upload_job *job)
+{
+    ty_task *task = job->task;
+    ty_board *board = task->u.upload.board;
+    int r;
+
+    if (!job->fw) {
+        r = _ty_board_select_firmware(board, task->u.upload.fws, task->u.upload.fws_count,
+                                      &job->fw);
+        if (r < 0)
+            return r;
+    }
+
+    r = ty_board_open_interface(board, TY_BOARD_CAPABILITY_UPLOAD, &job->iface);
+    if (r < 0)
+        return r;
+    if (!r)
+        return ty_error(TY_ERROR_MODE, "Cannot upload to board '%s'", board->tag);
+    job->phase_start = ty_micros();
+
+    if (!job->iface->class_vtable->upload_start) {
+        ty_board_interface_close(job->iface);
+        job->iface = NULL;
+
+        r = ty_thread_create(&job->thread, run_upload_thread, job);
+        if (r < 0)
+            return r;
+        job->thread_running = true;
+
+        job->deadline = UINT64_MAX;
+        job->state = JOB_WAIT_UPLOAD;
+        return 0;
+    }
+
+    r = (*job->iface->class_vtable->upload_start)(job->iface, job->fw,
+                                                   &task->u.upload.report.upload,
+                                                   _ty_board_upload_progress, NULL, &job->session);
+    if (r < 0)
+        return r;
+
+    job->deadline = 0;
+    job->state = JOB_SEND;
+    return 1;
+}
+
+static int send_block(struct upload_job *job)
+{
+    ty_task *task = job->task;
+    const struct _ty_class_vtable *vtable = job->iface->class_vtable;
+    int delay, r;
+
+    // The class decides how long to wait between steps (erase, busy bootloader)
+    r = (*vtable->upload_step)(job->iface, job->session, &delay);
+    if (r < 0)
+        return r;
+    if (!r) {
+        // Give other boards a turn after each step, even without any delay
+        job->deadline = ty_millis() + (uint64_t)delay;
+        return 0;
+    }
+
+    (*vtable->upload_end)(job->session);
+    job->session = NULL;
+    ty_board_interface_close(job->iface);
+    job->iface = NULL;
+    task->usb.transferred = job->fw->total_size;
+    _ty_upload_report_split_upload(&task->u.upload.report, ty_micros() - job->phase_start);
+    job->phase_start = ty_micros();
+
+    job->state = JOB_RESET;
+    return 1;
+}
+
+static int wait_upload(struct upload_job *job)
+{
+    ty_task *task = job->task;
+
+    if (!_ty_atomic_load(&job->thread_done))
+        return 0;
+    ty_thread_join(&job->thread);
+    job->thread_running = false;
+
+    if (job->thread_ret < 0)
+        return job->thread_ret;
+    task->usb.transferred = job->fw->total_size;
+    _ty_upload_report_split_upload(&task->u.upload.report, ty_micros() - job->phase_start);
+    job->phase_start = ty_micros();
+
+    job->state = JOB_RESET;
+    return 1;
+}
+
+static int reset_board(struct upload_job *job)
+{
+    ty_board *board = job->task->u.upload.board;
+    int r;
+
+    if (job->flags & TY_UPLOAD_NORESET) {
+        ty_log(TY_LOG_INFO, "Firmware uploaded, reset the board to use it");
+        return 2;
+    }
+
+    ty_log(TY_LOG_INFO, "Sending reset command");
+    r = ty_board_reset(board);
+    if (r < 0)
+        return r;
+
+    job->deadline = ty_millis() + FINAL_TASK_TIMEOUT;
+    job->state = JOB_WAIT_RUN;
+    return 1;
+}
+
+static int wait_run(struct upload_job *job)
+{
+    ty_board *board = job->task->u.upload.board;
+    int r;
+
+    r = ty_board_wait_for(board, TY_BOARD_CAPABILITY_RUN, 0);
+    if (r < 0)
+        return r;
+    if (!r) {
+        if (ty_millis() < job->deadline)
+            return 0;
+        return ty_error(TY_ERROR_TIMEOUT, "Failed to reset board '%s'", board->tag);
+    }
+
+    return 2;
+}
+
+/* Returns 0 when the job has to wait, or 2 once it is done. Each state function returns
+   1 to move on to the next state right away. */
+static int step_job(struct upload_job *job)
+{
+    int r;
+
+    do {
+        switch (job->state) {
+            case JOB_START: { r = start_job(job); } break;
+            case JOB_WAIT_BOOTLOADER: { r = wait_bootloader(job); } break;
+            case JOB_PREPARE: { r = prepare_upload(job); } break;
+            case JOB_SEND: { r = send_block(job); } break;
+            case JOB_WAIT_UPLOAD: { r = wait_upload(job); } break;
+            case JOB_RESET: { r = reset_board(job); } break;
+            case JOB_WAIT_RUN: { r = wait_run(job); } break;
+
+            default: {
+                assert(false);
+                r = ty_error(TY_ERROR_OTHER, NULL);
+            } break;
+        }
+    } while (r == 1);
+
+    return r;
+}
+
+static void finish_job(struct upload_job *job, int ret)
+{
+    ty_task *task = job->task;
+
+    if (job->thread_running)
+        ty_thread_join(&job->thread);
+    if (job->session)
+        (*job->iface->class_vtable->upload_end)(job->session);
+    ty_board_interface_close(job->iface);
+
+    if (ret >= 0) {
+        ty_upload_report *report = &task->u.upload.report;
+        uint64_t now = ty_micros();
+
+        report->phase_times[TY_UPLOAD_PHASE_RESET] = now - job->phase_start;
+        report->total_time = now - job->start;
+
+        task->result = ty_firmware_ref(job->fw);
+        task->result_cleanup = _ty_board_unref_upload_firmware;
+        ret = 0;
+    }
+    _ty_task_end(task, ret);
+
+    ty_task_unref(task);
+    free(job);
+}
+
+// Returns false if the job is finished
+static bool run_job(struct upload_job *job, bool started)
+{
+    ty_task *previous_task;
+    int r;
+
+    previous_task = _ty_task_swap_current(job->task);
+
+    if (!started)
+        _ty_task_begin(job->task);
+    // The upload thread checks for cancellation itself, don't wait for it here
+    r = job->state != JOB_WAIT_UPLOAD ? _ty_task_check_canceled() : 0;
+    if (!r)
+        r = step_job(job);
+    if (r) {
+        finish_job(job, r);
+        _ty_task_swap_current(previous_task);
+        return false;
+    }
+
+    _ty_task_swap_current(previous_task);
+    return true;
+}
+
+static int engine_thread(void *udata)
+{
+    TY_UNUSED(udata);
+
+    ty_descriptor_set set = {0};
+    uint64_t idle_since = ty_millis();
+
+    ty_timer_get_descriptors(engine.wake_timer, &set, 0);
+    ty_timer_get_descriptors(engine.deadline_timer, &set, 1);
+
+    while (true) {
+        task_array new_tasks;
+        uint64_t now, next_deadline;
+
+        ty_timer_rearm(engine.wake_timer);
+        ty_timer_rearm(engine.deadline_timer);
+
+        // Pick up new tasks, or stop if there is nothing left to do
+        ty_mutex_lock(&engine.mutex);
+        new_tasks = engine.submitted_tasks;
+        memset(&engine.submitted_tasks, 0, sizeof(engine.submitted_tasks));
+        if (!new_tasks.count && !engine.jobs.count &&
+                ty_millis() - idle_since >= ENGINE_IDLE_TIMEOUT) {
+            _hs_array_release(&engine.jobs);
+            engine.thread_running = false;
+
+            ty_mutex_unlock(&engine.mutex);
+            break;
+        }
+        ty_mutex_unlock(&engine.mutex);
+
+        for (size_t i = 0; i < new_tasks.count; i++) {
+            ty_task *task = new_tasks.values[i];
+            struct upload_job *job;
+
+            job = calloc(1, sizeof(*job));
+            if (!job || _hs_array_push(&engine.jobs, job) < 0) {
+                free(job);
+
+                _ty_task_begin(task);
+                _ty_task_end(task, ty_error(TY_ERROR_MEMORY, NULL));
+                ty_task_unref(task);
+                continue;
+            }
+            job->task = task;
+
+            if (!run_job(job, false))
+                _hs_array_pop(&engine.jobs, 1);
+        }
+        _hs_array_release(&new_tasks);
+
+        // Step every job, boards may have changed and some deadlines have passed
+        now = ty_millis();
+        next_deadline = UINT64_MAX;
+        for (size_t i = 0; i < engine.jobs.count; i++) {
+            struct upload_job *job = engine.jobs.values[i];
+
+            if (job->state != JOB_WAIT_BOOTLOADER && job->state != JOB_WAIT_UPLOAD &&
+                    job->state != JOB_WAIT_RUN && job->deadline > now) {
+                next_deadline = TY_MIN(next_deadline, job->deadline);
+                continue;
+            }
+
+            if (!run_job(job, true)) {
+                _hs_array_remove(&engine.jobs, i--, 1);
+                continue;
+            }
+            next_deadline = TY_MIN(next_deadline, job->deadline);
+        }
+
+        if (engine.jobs.count) {
+            idle_since = ty_millis();
+        }
+        if (next_deadline == UINT64_MAX) {
+            ty_timer_set(engine.deadline_timer, engine.jobs.count ? -1 : ENGINE_IDLE_TIMEOUT,
+                         TY_TIMER_ONESHOT);
+        } else {
+            now = ty_millis();
+            ty_timer_set(engine.deadline_timer,
+                         next_deadline > now ? (int)(next_deadline - now) : 0, TY_TIMER_ONESHOT);
+        }
+
+        ty_poll(&set, -1);
+    }
+
+    return 0;
+}
+
+int _ty_engine_submit(ty_task *task)
+{
+    int r;
+
+    for (unsigned int i = 0; i < task->u.upload.fws_count; i++) {
+        if (!ty_firmware_is_loaded(task->u.upload.fws[i])) {
+            task->task_start = NULL;
+            return _ty_task_submit(task);
+        }
+    }
+
+    r = _ty_once(&engine.init, init_engine);
+    if (r < 0)
+        return r;
+
+    ty_mutex_lock(&engine.mutex);
+
+    r = _hs_array_push(&engine.submitted_tasks, task);
+    if (r < 0) {
+        r = ty_libhs_translate_error(r);
+        goto cleanup;
+    }
+    ty_task_ref(task);
+
+    if (!engine.thread_running) {
+        ty_thread thread;
+
+        r = ty_thread_create(&thread, engine_thread, NULL);
+        if (r < 0) {
+            _hs_array_pop(&engine.submitted_tasks, 1);
+            ty_task_unref(task);
+            goto cleanup;
+        }
+        ty_thread_detach(&thread);
+
+        engine.thread_running = true;
+    } else {
+        ty_timer_set(engine.wake_timer, 0, TY_TIMER_ONESHOT);
+    }
+
+    r = 0;
+cleanup:
+    ty_mutex_unlock(&engine.mutex);
+    return r;
+}
+
+// Called after each monitor refresh, boards waiting for a mode change may be ready
+void _ty_engine_wake(void)
+{
+    if (!_ty_once_done(&engine.init))
+        return;
+
+    wake_engine();
+}
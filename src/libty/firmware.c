@@ -11,8 +11,27 @@
 #include "common_priv.h"
 #include "../libhs/array.h"
 #include "class_priv.h"
-#include "firmware.h"
+#include "firmware_priv.h"
 #include "system.h"
+#include "thread.h"
+
+struct ty_firmware_stream {
+    ty_mutex mutex;
+    ty_cond cond;
+
+    const ty_firmware_format *format;
+    bool incremental;
+    _ty_ihex_parser ihex;
+    // Incomplete IHEX record, or the whole file for other formats
+    _HS_ARRAY(uint8_t) buf;
+
+    bool loaded;
+    int err;
+
+    FILE *fp;
+    bool close_fp;
+    _ty_firmware_cache_key cache_key;
+};
 
 const ty_firmware_format ty_firmware_formats[] = {
     {"elf",  ".elf", ty_firmware_load_elf},
@@ -50,6 +69,10 @@ int ty_firmware_new(const char *filename, ty_firmware **rfw)
     }
     fw->refcount = 1;
 
+    r = ty_mutex_init(&fw->plans_mutex);
+    if (r < 0)
+        goto error;
+
     fw->filename = strdup(filename);
     if (!fw->filename) {
         r = ty_error(TY_ERROR_MEMORY, NULL);
@@ -106,6 +129,39 @@ static int find_format(const char *filename, const char *format_name,
     return 0;
 }
 
+static int open_file(const char *filename, FILE **rfp)
+{
+    FILE *fp;
+
+#ifdef _WIN32
+    fp = fopen(filename, "rb");
+#else
+    fp = fopen(filename, "rbe");
+#endif
+    if (!fp) {
+        switch (errno) {
+            case EACCES: {
+                return ty_error(TY_ERROR_ACCESS, "Permission denied for '%s'", filename);
+            } break;
+            case EIO: {
+                return ty_error(TY_ERROR_IO, "I/O error while opening '%s' for reading", filename);
+            } break;
+            case ENOENT:
+            case ENOTDIR: {
+                return ty_error(TY_ERROR_NOT_FOUND, "File '%s' does not exist", filename);
+            } break;
+
+            default: {
+                return ty_error(TY_ERROR_SYSTEM, "fopen('%s') failed: %s", filename,
+                                strerror(errno));
+            } break;
+        }
+    }
+
+    *rfp = fp;
+    return 0;
+}
+
 int ty_firmware_load_file(const char *filename, FILE *fp, const char *format_name,
                           ty_firmware **rfw)
 {
@@ -114,7 +170,9 @@ int ty_firmware_load_file(const char *filename, FILE *fp, const char *format_nam
 
     const ty_firmware_format *format;
     bool close_fp = false;
-    _HS_ARRAY(uint8_t) buf = {0};
+    _ty_firmware_cache_key cache_key;
+    uint8_t *mem = NULL;
+    size_t len = 0;
     ty_firmware *fw = NULL;
     int r;
 
@@ -123,72 +181,52 @@ int ty_firmware_load_file(const char *filename, FILE *fp, const char *format_nam
         goto cleanup;
 
     if (!fp) {
-#ifdef _WIN32
-        fp = fopen(filename, "rb");
-#else
-        fp = fopen(filename, "rbe");
-#endif
-        if (!fp) {
-            switch (errno) {
-                case EACCES: {
-                    r = ty_error(TY_ERROR_ACCESS, "Permission denied for '%s'", filename);
-                } break;
-                case EIO: {
-                    r = ty_error(TY_ERROR_IO, "I/O error while opening '%s' for reading", filename);
-                } break;
-                case ENOENT:
-                case ENOTDIR: {
-                    r = ty_error(TY_ERROR_NOT_FOUND, "File '%s' does not exist", filename);
-                } break;
-
-                default: {
-                    r = ty_error(TY_ERROR_SYSTEM, "fopen('%s') failed: %s", filename,
-                                 strerror(errno));
-                } break;
-            }
-            goto cleanup;
+        r = _ty_firmware_cache_lookup(filename, format, &cache_key, &fw);
+        if (r > 0) {
+            *rfw = fw;
+            return 0;
         }
-        close_fp = true;
-    }
 
-    // Load file to memory
-    while (!feof(fp)) {
-        r = _hs_array_grow(&buf, 128 * 1024);
+        r = open_file(filename, &fp);
         if (r < 0)
             goto cleanup;
-
-        buf.count += fread(buf.values + buf.count, 1, 131072, fp);
-        if (ferror(fp)) {
-            if (errno == EIO) {
-                r = ty_error(TY_ERROR_IO, "I/O error while reading from '%s'", filename);
-            } else {
-                r = ty_error(TY_ERROR_SYSTEM, "fread('%s') failed: %s", filename, strerror(errno));
-            }
-            goto cleanup;
-        }
-        if (buf.count > 8 * 1024 * 1024) {
-            r = ty_error(TY_ERROR_RANGE, "Firmware '%s' is too big to load", filename);
-            goto cleanup;
-        }
+        close_fp = true;
+    } else {
+        cache_key.filename[0] = 0;
     }
-    _hs_array_shrink(&buf);
+
+    r = ty_file_read_all(fp, filename, 8 * 1024 * 1024, &mem, &len);
+    if (r < 0)
+        goto cleanup;
 
     r = ty_firmware_new(filename, &fw);
     if (r < 0)
         goto cleanup;
 
-    r = (*format->load)(fw, buf.values, buf.count);
+    // The firmware keeps the file contents, ELF segments point directly into them
+    fw->file_mem = mem;
+    fw->file_len = len;
+    mem = NULL;
+
+    r = (*format->load)(fw, fw->file_mem, fw->file_len);
     if (r < 0)
         goto cleanup;
 
+    if (cache_key.filename[0]) {
+        fw->models_count = ty_firmware_identify(fw, fw->models, TY_COUNTOF(fw->models));
+        fw->identified = true;
+
+        _ty_firmware_cache_store(&cache_key, format, fw, fw->file_mem, fw->file_len);
+    }
+
     *rfw = fw;
     fw = NULL;
 
 cleanup:
     ty_firmware_unref(fw);
+    free(mem);
     if (close_fp)
         fclose(fp);
-    _hs_array_release(&buf);
     return r;
 }
 
@@ -223,6 +261,350 @@ cleanup:
     return r;
 }
 
+int ty_firmware_stream_new(const char *filename, const char *format_name, ty_firmware **rfw)
+{
+    assert(filename);
+    assert(rfw);
+
+    const ty_firmware_format *format;
+    struct ty_firmware_stream *stream;
+    ty_firmware *fw = NULL;
+    int r;
+
+    r = find_format(filename, format_name, &format);
+    if (r < 0)
+        goto error;
+
+    r = ty_firmware_new(filename, &fw);
+    if (r < 0)
+        goto error;
+
+    stream = calloc(1, sizeof(*stream));
+    if (!stream) {
+        r = ty_error(TY_ERROR_MEMORY, NULL);
+        goto error;
+    }
+    fw->stream = stream;
+
+    r = ty_mutex_init(&stream->mutex);
+    if (r < 0)
+        goto error;
+    r = ty_cond_init(&stream->cond);
+    if (r < 0)
+        goto error;
+
+    stream->format = format;
+    // IHEX records can be parsed (and used) as they come, other formats are loaded at the end
+    if (format->load == ty_firmware_load_ihex) {
+        r = _ty_ihex_parser_init(&stream->ihex, fw);
+        if (r < 0)
+            goto error;
+        stream->incremental = true;
+    }
+
+    *rfw = fw;
+    return 0;
+
+error:
+    ty_firmware_unref(fw);
+    return r;
+}
+
+static int feed_ihex(ty_firmware *fw, const uint8_t *mem, size_t len, bool end)
+{
+    struct ty_firmware_stream *stream = fw->stream;
+    ssize_t consumed;
+    size_t ready_address;
+    int r;
+
+    if (stream->buf.count) {
+        r = _hs_array_grow(&stream->buf, len);
+        if (r < 0)
+            return r;
+        if (len)
+            memcpy(stream->buf.values + stream->buf.count, mem, len);
+        stream->buf.count += len;
+
+        consumed = _ty_ihex_parser_feed(&stream->ihex, stream->buf.values, stream->buf.count, end);
+        if (consumed < 0)
+            return (int)consumed;
+        _hs_array_remove(&stream->buf, 0, (size_t)consumed);
+    } else {
+        consumed = _ty_ihex_parser_feed(&stream->ihex, mem, len, end);
+        if (consumed < 0)
+            return (int)consumed;
+
+        r = _hs_array_grow(&stream->buf, len - (size_t)consumed);
+        if (r < 0)
+            return r;
+        if (len > (size_t)consumed)
+            memcpy(stream->buf.values, mem + consumed, len - (size_t)consumed);
+        stream->buf.count = len - (size_t)consumed;
+    }
+
+    /* Records that go back to published blocks are rare but valid, in this case nothing is
+       final until the whole firmware is loaded (and identified again). */
+    if (stream->ihex.unordered) {
+        fw->identified = false;
+        return 0;
+    }
+
+    // Publish complete blocks
+    ready_address = stream->ihex.end_address / TY_FIRMWARE_STREAM_BLOCK_SIZE *
+                    TY_FIRMWARE_STREAM_BLOCK_SIZE;
+    if (ready_address > stream->ihex.ready_address) {
+        stream->ihex.ready_address = ready_address;
+        ty_cond_broadcast(&stream->cond);
+    }
+
+    return 0;
+}
+
+int ty_firmware_stream_feed(ty_firmware *fw, const uint8_t *mem, size_t len)
+{
+    assert(fw);
+    assert(fw->stream);
+    assert(mem || !len);
+
+    struct ty_firmware_stream *stream = fw->stream;
+    int r;
+
+    ty_mutex_lock(&stream->mutex);
+
+    assert(!stream->loaded);
+    if (stream->err) {
+        r = stream->err;
+        goto cleanup;
+    }
+
+    if (stream->incremental) {
+        r = feed_ihex(fw, mem, len, false);
+    } else {
+        r = _hs_array_grow(&stream->buf, len);
+        if (!r && len) {
+            memcpy(stream->buf.values + stream->buf.count, mem, len);
+            stream->buf.count += len;
+        }
+    }
+    if (r < 0) {
+        stream->err = r;
+        ty_cond_broadcast(&stream->cond);
+    }
+
+cleanup:
+    ty_mutex_unlock(&stream->mutex);
+    return r;
+}
+
+/* Pass a negative error code to abort the stream, anyone waiting on the firmware will
+   get it. Otherwise, parse what remains and mark the firmware as loaded. */
+int ty_firmware_stream_finish(ty_firmware *fw, int err)
+{
+    assert(fw);
+    assert(fw->stream);
+    assert(err <= 0);
+
+    struct ty_firmware_stream *stream = fw->stream;
+    int r;
+
+    ty_mutex_lock(&stream->mutex);
+
+    assert(!stream->loaded);
+    if (stream->err) {
+        r = stream->err;
+        goto cleanup;
+    }
+
+    r = err;
+    if (!r) {
+        if (stream->incremental) {
+            r = feed_ihex(fw, NULL, 0, true);
+            if (!r)
+                r = _ty_ihex_parser_finish(&stream->ihex);
+        } else {
+            r = (*stream->format->load)(fw, stream->buf.values, stream->buf.count);
+        }
+    }
+    _hs_array_release(&stream->buf);
+
+    if (r < 0) {
+        stream->err = r;
+    } else {
+        stream->loaded = true;
+    }
+    ty_cond_broadcast(&stream->cond);
+
+cleanup:
+    ty_mutex_unlock(&stream->mutex);
+    return r;
+}
+
+static int stream_thread(void *udata)
+{
+    ty_firmware *fw = udata;
+    struct ty_firmware_stream *stream = fw->stream;
+    _HS_ARRAY(uint8_t) content = {0};
+    size_t total_len = 0;
+    int r = 0;
+
+    /* Feed small chunks, so that the first blocks get published as soon as possible. The
+       cache needs the whole content, keep a copy of what we read instead of reading the
+       file again (it could have changed in the meantime). */
+    while (!r && !feof(stream->fp)) {
+        uint8_t buf[16384];
+        size_t len;
+
+        len = fread(buf, 1, sizeof(buf), stream->fp);
+        if (ferror(stream->fp)) {
+            if (errno == EIO) {
+                r = ty_error(TY_ERROR_IO, "I/O error while reading from '%s'", fw->filename);
+            } else {
+                r = ty_error(TY_ERROR_SYSTEM, "fread('%s') failed: %s", fw->filename,
+                             strerror(errno));
+            }
+            break;
+        }
+        total_len += len;
+        if (total_len > 8 * 1024 * 1024) {
+            r = ty_error(TY_ERROR_RANGE, "Firmware '%s' is too big to load", fw->filename);
+            break;
+        }
+
+        if (stream->cache_key.filename[0]) {
+            r = _hs_array_grow(&content, len);
+            if (r < 0)
+                break;
+            memcpy(content.values + content.count, buf, len);
+            content.count += len;
+        }
+        r = ty_firmware_stream_feed(fw, buf, len);
+    }
+
+    r = ty_firmware_stream_finish(fw, r);
+    if (!r && stream->cache_key.filename[0])
+        _ty_firmware_cache_store(&stream->cache_key, stream->format, fw, content.values,
+                                 content.count);
+
+    _hs_array_release(&content);
+    ty_firmware_unref(fw);
+    return r;
+}
+
+/* Like ty_firmware_load_file(), except that the file is read and parsed in a background
+   thread. The firmware can be used (see ty_firmware_wait()) before it is fully loaded. */
+int ty_firmware_stream_file(const char *filename, FILE *fp, const char *format_name,
+                            ty_firmware **rfw)
+{
+    assert(filename);
+    assert(rfw);
+
+    const ty_firmware_format *format;
+    bool close_fp = false;
+    _ty_firmware_cache_key cache_key;
+    ty_firmware *fw = NULL;
+    ty_thread thread;
+    int r;
+
+    r = find_format(filename, format_name, &format);
+    if (r < 0)
+        goto error;
+    if (format->load != ty_firmware_load_ihex)
+        return ty_firmware_load_file(filename, fp, format_name, rfw);
+
+    if (!fp) {
+        r = _ty_firmware_cache_lookup(filename, format, &cache_key, &fw);
+        if (r > 0) {
+            *rfw = fw;
+            return 0;
+        }
+
+        r = open_file(filename, &fp);
+        if (r < 0)
+            goto error;
+        close_fp = true;
+    } else {
+        cache_key.filename[0] = 0;
+    }
+
+    r = ty_firmware_stream_new(filename, format_name, &fw);
+    if (r < 0)
+        goto error;
+    fw->stream->cache_key = cache_key;
+    fw->stream->fp = fp;
+    fw->stream->close_fp = close_fp;
+    close_fp = false;
+
+    // The thread keeps its own reference, until it is done with the file
+    r = ty_thread_create(&thread, stream_thread, ty_firmware_ref(fw));
+    if (r < 0) {
+        ty_firmware_unref(fw);
+        goto error;
+    }
+    ty_thread_detach(&thread);
+
+    *rfw = fw;
+    return 0;
+
+error:
+    ty_firmware_unref(fw);
+    if (close_fp)
+        fclose(fp);
+    return r;
+}
+
+bool ty_firmware_is_loaded(const ty_firmware *fw)
+{
+    assert(fw);
+
+    bool loaded;
+
+    if (!fw->stream)
+        return true;
+
+    ty_mutex_lock(&fw->stream->mutex);
+    loaded = fw->stream->loaded;
+    ty_mutex_unlock(&fw->stream->mutex);
+
+    return loaded;
+}
+
+static bool is_stream_ready(const struct ty_firmware_stream *stream, size_t address)
+{
+    return stream->loaded || (!stream->ihex.unordered && stream->ihex.ready_address >= address);
+}
+
+/* Wait until all the firmware data below address is final. Returns 1 when it is (or when
+   the firmware is fully loaded), 0 on timeout and the stream error if loading fails.
+   Streams that go back to published data only become final once they are loaded. */
+int ty_firmware_wait(const ty_firmware *fw, size_t address, int timeout)
+{
+    assert(fw);
+
+    struct ty_firmware_stream *stream = fw->stream;
+    uint64_t start;
+    int r;
+
+    if (!stream)
+        return 1;
+
+    ty_mutex_lock(&stream->mutex);
+
+    start = ty_millis();
+    while (!stream->err && !is_stream_ready(stream, address)) {
+        if (!ty_cond_wait(&stream->cond, &stream->mutex, ty_adjust_timeout(timeout, start)))
+            break;
+    }
+
+    if (stream->err) {
+        r = stream->err;
+    } else {
+        r = is_stream_ready(stream, address);
+    }
+
+    ty_mutex_unlock(&stream->mutex);
+    return r;
+}
+
 ty_firmware *ty_firmware_ref(ty_firmware *fw)
 {
     assert(fw);
@@ -237,8 +619,26 @@ void ty_firmware_unref(ty_firmware *fw)
         if (_ty_refcount_decrease(&fw->refcount))
             return;
 
-        for (unsigned int i = 0; i < fw->segments_count; i++)
-            free(fw->segments[i].data);
+        for (unsigned int i = 0; i < fw->segments_count; i++) {
+            if (fw->segments[i].alloc_size)
+                free(fw->segments[i].data);
+        }
+        free(fw->file_mem);
+        while (fw->plans) {
+            struct _ty_upload_plan *plan = fw->plans;
+
+            fw->plans = plan->next;
+            _ty_upload_plan_unref(plan);
+        }
+        ty_mutex_release(&fw->plans_mutex);
+        if (fw->stream) {
+            if (fw->stream->close_fp)
+                fclose(fw->stream->fp);
+            _hs_array_release(&fw->stream->buf);
+            ty_cond_release(&fw->stream->cond);
+            ty_mutex_release(&fw->stream->mutex);
+            free(fw->stream);
+        }
         free(fw->name);
         free(fw->filename);
     }
@@ -265,6 +665,9 @@ size_t ty_firmware_extract(const ty_firmware *fw, uint32_t address, uint8_t *buf
     assert(fw);
 
     size_t total_len = 0;
+
+    if (fw->stream)
+        ty_mutex_lock(&fw->stream->mutex);
     for (unsigned int i = 0; i < fw->segments_count; i++) {
         const ty_firmware_segment *segment = &fw->segments[i];
 
@@ -283,6 +686,9 @@ size_t ty_firmware_extract(const ty_firmware *fw, uint32_t address, uint8_t *buf
         }
     }
 
+    if (fw->stream)
+        ty_mutex_unlock(&fw->stream->mutex);
+
     return total_len;
 }
 
@@ -311,6 +717,47 @@ int ty_firmware_add_segment(ty_firmware *fw, uint32_t address, size_t size,
     return 0;
 }
 
+/* When data lies inside the firmware file contents, the segment references it directly. Otherwise
+   this works like ty_firmware_add_segment() followed by a copy. */
+int ty_firmware_add_segment_from(ty_firmware *fw, uint32_t address, const uint8_t *data,
+                                 size_t size, ty_firmware_segment **rsegment)
+{
+    assert(fw);
+    assert(data || !size);
+
+    ty_firmware_segment *segment;
+    int r;
+
+    if (!fw->file_mem || data < fw->file_mem || size > fw->file_len ||
+            (size_t)(data - fw->file_mem) > fw->file_len - size) {
+        r = ty_firmware_add_segment(fw, address, size, &segment);
+        if (r < 0)
+            return r;
+        if (size)
+            memcpy(segment->data, data, size);
+
+        if (rsegment)
+            *rsegment = segment;
+        return 0;
+    }
+
+    if (fw->segments_count >= TY_FIRMWARE_MAX_SEGMENTS)
+        return ty_error(TY_ERROR_RANGE, "Firmware '%s' has too many segments", fw->filename);
+    if (size > TY_FIRMWARE_MAX_SEGMENT_SIZE)
+        return ty_error(TY_ERROR_RANGE, "Firmware '%s' has excessive segment size (max %u bytes)",
+                        fw->filename, TY_FIRMWARE_MAX_SEGMENT_SIZE);
+
+    segment = &fw->segments[fw->segments_count++];
+    segment->data = (uint8_t *)data;
+    segment->size = size;
+    segment->alloc_size = 0;
+    segment->address = address;
+
+    if (rsegment)
+        *rsegment = segment;
+    return 0;
+}
+
 int ty_firmware_expand_segment(ty_firmware *fw, ty_firmware_segment *segment, size_t size)
 {
     const size_t step_size = 65536;
@@ -324,9 +771,17 @@ int ty_firmware_expand_segment(ty_firmware *fw, ty_firmware_segment *segment, si
                             fw->filename, TY_FIRMWARE_MAX_SEGMENT_SIZE);
 
         alloc_size = (size + (step_size - 1)) / step_size * step_size;
-        tmp = realloc(segment->data, alloc_size);
-        if (!tmp)
-            return ty_error(TY_ERROR_MEMORY, NULL);
+        if (segment->alloc_size || !segment->data) {
+            tmp = realloc(segment->data, alloc_size);
+            if (!tmp)
+                return ty_error(TY_ERROR_MEMORY, NULL);
+        } else {
+            // Mapped segment, copy it before anyone writes to it
+            tmp = malloc(alloc_size);
+            if (!tmp)
+                return ty_error(TY_ERROR_MEMORY, NULL);
+            memcpy(tmp, segment->data, segment->size);
+        }
 
         segment->data = tmp;
         segment->alloc_size = alloc_size;
@@ -336,13 +791,9 @@ int ty_firmware_expand_segment(ty_firmware *fw, ty_firmware_segment *segment, si
     return 0;
 }
 
-unsigned int ty_firmware_identify(const ty_firmware *fw, ty_model *rmodels,
-                                  unsigned int max_models)
+static unsigned int identify_models(const ty_firmware *fw, ty_model *rmodels,
+                                    unsigned int max_models)
 {
-    assert(fw);
-    assert(rmodels);
-    assert(max_models);
-
     unsigned int guesses_count = 0;
 
     for (unsigned int i = 0; i < _ty_classes_count; i++) {
@@ -363,3 +814,61 @@ unsigned int ty_firmware_identify(const ty_firmware *fw, ty_model *rmodels,
 
     return guesses_count;
 }
+
+// Most models can be recognized with the beginning of the image
+static bool has_identification_block(const ty_firmware *fw)
+{
+    for (unsigned int i = 0; i < fw->segments_count; i++) {
+        const ty_firmware_segment *segment = &fw->segments[i];
+
+        if (segment->size)
+            return is_stream_ready(fw->stream, segment->address + TY_FIRMWARE_STREAM_BLOCK_SIZE);
+    }
+
+    return false;
+}
+
+unsigned int ty_firmware_identify(const ty_firmware *fw, ty_model *rmodels,
+                                  unsigned int max_models)
+{
+    assert(fw);
+    assert(rmodels);
+    assert(max_models);
+
+    struct ty_firmware_stream *stream = fw->stream;
+    ty_firmware *mutable_fw = (ty_firmware *)fw;
+    unsigned int guesses_count;
+
+    if (!stream) {
+        if (!fw->identified)
+            return identify_models(fw, rmodels, max_models);
+
+        guesses_count = TY_MIN(fw->models_count, max_models);
+        memcpy(rmodels, fw->models, guesses_count * sizeof(*rmodels));
+        return guesses_count;
+    }
+
+    /* Identification results only depend on the first block for ARM models, which cannot
+       change anymore once it is published. Other models need the whole firmware. The
+       result is kept so that uploads to many boards only identify the firmware once. */
+    ty_mutex_lock(&stream->mutex);
+    if (!fw->identified) {
+        while (!stream->loaded && !stream->err && !has_identification_block(fw))
+            ty_cond_wait(&stream->cond, &stream->mutex, -1);
+        mutable_fw->models_count = identify_models(fw, mutable_fw->models,
+                                                   TY_COUNTOF(mutable_fw->models));
+        if (!fw->models_count) {
+            while (!stream->loaded && !stream->err)
+                ty_cond_wait(&stream->cond, &stream->mutex, -1);
+            if (stream->loaded)
+                mutable_fw->models_count = identify_models(fw, mutable_fw->models,
+                                                           TY_COUNTOF(mutable_fw->models));
+        }
+        mutable_fw->identified = fw->models_count || stream->loaded;
+    }
+    guesses_count = TY_MIN(fw->models_count, max_models);
+    memcpy(rmodels, fw->models, guesses_count * sizeof(*rmodels));
+    ty_mutex_unlock(&stream->mutex);
+
+    return guesses_count;
+}
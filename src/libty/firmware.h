@@ -13,15 +13,23 @@
 
 #include "common.h"
 #include "class.h"
+#include "thread.h"
 
 TY_C_BEGIN
 
 #define TY_FIRMWARE_MAX_SEGMENTS 16
 #define TY_FIRMWARE_MAX_SEGMENT_SIZE (2 * 1024 * 1024)
+#define TY_FIRMWARE_STREAM_BLOCK_SIZE 1024
+#define TY_FIRMWARE_MAX_MODELS 16
+#define TY_FIRMWARE_DEFAULT_CACHE_SIZE (64 * 1024 * 1024)
+
+struct ty_firmware_stream;
+struct _ty_upload_plan;
 
 typedef struct ty_firmware_segment {
     uint8_t *data;
     size_t size;
+    // Zero when data points inside the file contents, use ty_firmware_expand_segment() to write
     size_t alloc_size;
     uint32_t address;
 } ty_firmware_segment;
@@ -35,8 +43,25 @@ typedef struct ty_firmware {
     ty_firmware_segment segments[TY_FIRMWARE_MAX_SEGMENTS];
     unsigned int segments_count;
 
+    // Only valid once the firmware is loaded, see ty_firmware_is_loaded()
     size_t max_address;
     size_t total_size;
+
+    // Known identification result (e.g. from the firmware cache), see ty_firmware_identify()
+    ty_model models[TY_FIRMWARE_MAX_MODELS];
+    unsigned int models_count;
+    bool identified;
+
+    // Firmware file contents (if any), released with the last reference
+    uint8_t *file_mem;
+    size_t file_len;
+
+    // Set for firmwares built with ty_firmware_stream_new(), even once they are loaded
+    struct ty_firmware_stream *stream;
+
+    // Upload plans built by board classes, released with the firmware
+    ty_mutex plans_mutex;
+    struct _ty_upload_plan *plans;
 } ty_firmware;
 
 typedef struct ty_firmware_format {
@@ -49,12 +74,23 @@ typedef struct ty_firmware_format {
 extern const ty_firmware_format ty_firmware_formats[];
 extern const unsigned int ty_firmware_formats_count;
 
+void ty_firmware_set_cache_size(uint64_t max_size);
+
 int ty_firmware_new(const char *filename, ty_firmware **rfw);
 int ty_firmware_load_file(const char *filename, FILE *fp, const char *format_name,
                           ty_firmware **rfw);
 int ty_firmware_load_mem(const char *filename, const uint8_t *mem, size_t len,
                          const char *format_name, ty_firmware **rfw);
 
+int ty_firmware_stream_new(const char *filename, const char *format_name, ty_firmware **rfw);
+int ty_firmware_stream_feed(ty_firmware *fw, const uint8_t *mem, size_t len);
+int ty_firmware_stream_finish(ty_firmware *fw, int err);
+int ty_firmware_stream_file(const char *filename, FILE *fp, const char *format_name,
+                            ty_firmware **rfw);
+
+bool ty_firmware_is_loaded(const ty_firmware *fw);
+int ty_firmware_wait(const ty_firmware *fw, size_t address, int timeout);
+
 int ty_firmware_load_elf(ty_firmware *fw, const uint8_t *mem, size_t len);
 int ty_firmware_load_ihex(ty_firmware *fw, const uint8_t *mem, size_t len);
 
@@ -66,6 +102,8 @@ size_t ty_firmware_extract(const ty_firmware *fw, uint32_t address, uint8_t *buf
 
 int ty_firmware_add_segment(ty_firmware *fw, uint32_t address, size_t size,
                             ty_firmware_segment **rsegment);
+int ty_firmware_add_segment_from(ty_firmware *fw, uint32_t address, const uint8_t *data,
+                                 size_t size, ty_firmware_segment **rsegment);
 int ty_firmware_expand_segment(ty_firmware *fw, ty_firmware_segment *segment, size_t size);
 
 
@@ -0,0 +1,656 @@
+/* TyTools - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/tytools
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#include "common_priv.h"
+#include <time.h>
+#include "../libhs/array.h"
+#include "firmware_priv.h"
+#include "system.h"
+
+/* Cache entries store the parsed segments and the identification results, so that uploading
+   the same file again and again does not need any parsing. They live in the configuration
+   directory, one file per firmware path:
+
+       magic[8]  | file size (u64) | file mtime (i64) | entry time (i64) | content hash (u64)
+       format name (u8 length + chars) | total_size (u64) | max_address (u64)
+       models count (u32) + model names (u8 length + chars)
+       segments count (u32) + segments (address (u32), size (u32), data)
+       entry hash (u64)
+
+   Integers are little endian. Entries are valid if the file size and mtime match. When the
+   mtime differs (or is too close to the entry time to be trusted), we fall back to the
+   content hash.
+
+   The cache is disabled unless the application calls ty_firmware_set_cache_size(). Once the
+   entries use more than that, the oldest ones are deleted. */
+
+#define CACHE_MAGIC "TYFWC\x01\r\n"
+#define CACHE_DIRECTORY "FirmwareCache"
+// Filesystems such as FAT or HFS+ have coarse timestamps
+#define CACHE_MTIME_GRANULARITY 2
+// Same limit as ty_firmware_load_file(), entries (segments and metadata) stay below twice that
+#define CACHE_MAX_FIRMWARE_SIZE (8 * 1024 * 1024)
+#define CACHE_MAX_ENTRY_SIZE (2 * CACHE_MAX_FIRMWARE_SIZE + 4096)
+// Temporary files older than this were left behind by a process that did not finish writing
+#define CACHE_STALE_TMP_DELAY 600
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ull
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4Full
+#define XXH_PRIME64_3 0x165667B19E3779F9ull
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ull
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ull
+
+struct cache_file {
+    char name[32];
+    ty_file_info info;
+};
+
+struct cache_listing {
+    _HS_ARRAY(struct cache_file) entries;
+    uint64_t total_size;
+    int64_t stale_time;
+    const char *dir;
+};
+
+static uint64_t cache_max_size;
+
+struct cache_reader {
+    const uint8_t *ptr;
+    const uint8_t *end;
+    bool error;
+};
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read_uint64_unaligned(const uint8_t *ptr)
+{
+    uint64_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static inline uint32_t read_uint32_unaligned(const uint8_t *ptr)
+{
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t value)
+{
+    acc ^= xxh64_round(0, value);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/* This is XXH64 on little endian machines. Hashes never leave the machine, so we don't
+   bother with byte swaps for big endian ones. */
+static uint64_t hash_content(const uint8_t *mem, size_t len)
+{
+    const uint8_t *ptr = mem;
+    const uint8_t *end = mem + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = XXH_PRIME64_2;
+        uint64_t v3 = 0;
+        uint64_t v4 = 0 - XXH_PRIME64_1;
+
+        do {
+            v1 = xxh64_round(v1, read_uint64_unaligned(ptr));
+            v2 = xxh64_round(v2, read_uint64_unaligned(ptr + 8));
+            v3 = xxh64_round(v3, read_uint64_unaligned(ptr + 16));
+            v4 = xxh64_round(v4, read_uint64_unaligned(ptr + 24));
+            ptr += 32;
+        } while (end - ptr >= 32);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    } else {
+        h = XXH_PRIME64_5;
+    }
+    h += len;
+
+    while (end - ptr >= 8) {
+        h ^= xxh64_round(0, read_uint64_unaligned(ptr));
+        h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        ptr += 8;
+    }
+    if (end - ptr >= 4) {
+        h ^= (uint64_t)read_uint32_unaligned(ptr) * XXH_PRIME64_1;
+        h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        ptr += 4;
+    }
+    while (ptr < end) {
+        h ^= *ptr++ * XXH_PRIME64_5;
+        h = rotl64(h, 11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+static uint64_t read_uint(struct cache_reader *reader, unsigned int size)
+{
+    uint64_t value = 0;
+
+    if ((size_t)(reader->end - reader->ptr) < size) {
+        reader->error = true;
+        return 0;
+    }
+    for (unsigned int i = 0; i < size; i++)
+        value |= (uint64_t)reader->ptr[i] << (i * 8);
+    reader->ptr += size;
+
+    return value;
+}
+
+static const uint8_t *read_bytes(struct cache_reader *reader, size_t len)
+{
+    const uint8_t *ptr = reader->ptr;
+
+    if ((size_t)(reader->end - reader->ptr) < len) {
+        reader->error = true;
+        return NULL;
+    }
+    reader->ptr += len;
+
+    return ptr;
+}
+
+static bool read_string(struct cache_reader *reader, char *buf, size_t size)
+{
+    size_t len = (size_t)read_uint(reader, 1);
+    const uint8_t *ptr = read_bytes(reader, len);
+
+    if (!ptr || len >= size)
+        return false;
+    memcpy(buf, ptr, len);
+    buf[len] = 0;
+
+    return true;
+}
+
+typedef _HS_ARRAY(uint8_t) entry_buffer;
+
+static int write_uint(entry_buffer *buf, uint64_t value, unsigned int size)
+{
+    int r;
+
+    r = _hs_array_grow(buf, size);
+    if (r < 0)
+        return r;
+    for (unsigned int i = 0; i < size; i++)
+        buf->values[buf->count++] = (uint8_t)(value >> (i * 8));
+
+    return 0;
+}
+
+static int write_bytes(entry_buffer *buf, const void *data, size_t len)
+{
+    int r;
+
+    r = _hs_array_grow(buf, len);
+    if (r < 0)
+        return r;
+    memcpy(buf->values + buf->count, data, len);
+    buf->count += len;
+
+    return 0;
+}
+
+static int write_string(entry_buffer *buf, const char *str)
+{
+    size_t len = strlen(str);
+    int r;
+
+    assert(len <= UINT8_MAX);
+
+    r = write_uint(buf, len, 1);
+    if (r < 0)
+        return r;
+    return write_bytes(buf, str, len);
+}
+
+static int make_key(const char *filename, _ty_firmware_cache_key *rkey)
+{
+    char path[TY_PATH_MAX_SIZE];
+    char dir[1][TY_PATH_MAX_SIZE];
+    int r;
+
+    r = ty_file_get_absolute_path(filename, path, sizeof(path));
+    if (r < 0)
+        return r;
+    r = ty_file_stat(path, &rkey->info);
+    if (r < 0)
+        return r;
+
+    if (!ty_standard_get_paths(TY_PATH_CONFIG_DIRECTORY, "TyTools", dir, 1))
+        return TY_ERROR_NOT_FOUND;
+    r = snprintf(rkey->filename, sizeof(rkey->filename), "%s/%s/%016" PRIx64 ".bin", dir[0],
+                 CACHE_DIRECTORY, hash_content((const uint8_t *)path, strlen(path)));
+    if (r >= (int)sizeof(rkey->filename))
+        return ty_error(TY_ERROR_RANGE, "Path '%s' is too long", dir[0]);
+
+    return 0;
+}
+
+static bool is_mtime_racy(int64_t mtime, int64_t entry_time)
+{
+    return mtime / 1000000000 + CACHE_MTIME_GRANULARITY >= entry_time;
+}
+
+static int check_content(const char *filename, uint64_t hash)
+{
+    FILE *fp;
+    uint8_t *mem;
+    size_t len;
+    int r;
+
+#ifdef _WIN32
+    fp = fopen(filename, "rb");
+#else
+    fp = fopen(filename, "rbe");
+#endif
+    if (!fp)
+        return 0;
+
+    // Files too big to be firmwares can't match any entry
+    ty_error_mask(TY_ERROR_RANGE);
+    r = ty_file_read_all(fp, filename, CACHE_MAX_FIRMWARE_SIZE, &mem, &len);
+    ty_error_unmask();
+    if (!r) {
+        r = hash_content(mem, len) == hash;
+        free(mem);
+    } else {
+        r = 0;
+    }
+
+    fclose(fp);
+    return r;
+}
+
+static int load_entry(const char *filename, const ty_firmware_format *format,
+                      const _ty_firmware_cache_key *key, const uint8_t *mem, size_t len,
+                      bool *rrefresh, ty_firmware *fw)
+{
+    struct cache_reader reader = {mem, mem + len, false};
+    int64_t mtime, entry_time;
+    uint64_t content_hash;
+    char buf[256];
+    unsigned int models_count, segments_count;
+    int r;
+
+    // Check the entry itself first, it may have been truncated or corrupted
+    if (len < 8 + 8 || memcmp(mem, CACHE_MAGIC, 8) ||
+            hash_content(mem, len - 8) != read_uint64_unaligned(mem + len - 8))
+        return 0;
+    reader.ptr += 8;
+    reader.end -= 8;
+
+    if (read_uint(&reader, 8) != key->info.size)
+        return 0;
+    mtime = (int64_t)read_uint(&reader, 8);
+    entry_time = (int64_t)read_uint(&reader, 8);
+    content_hash = read_uint(&reader, 8);
+    if (mtime != key->info.mtime || is_mtime_racy(mtime, entry_time)) {
+        r = check_content(filename, content_hash);
+        if (r <= 0)
+            return r;
+        *rrefresh = mtime != key->info.mtime || !is_mtime_racy(key->info.mtime, (int64_t)time(NULL));
+    }
+
+    if (!read_string(&reader, buf, sizeof(buf)) || strcmp(buf, format->name))
+        return 0;
+    fw->total_size = (size_t)read_uint(&reader, 8);
+    fw->max_address = (size_t)read_uint(&reader, 8);
+
+    models_count = (unsigned int)read_uint(&reader, 4);
+    if (models_count > TY_COUNTOF(fw->models))
+        return 0;
+    for (unsigned int i = 0; i < models_count; i++) {
+        ty_model model;
+
+        if (!read_string(&reader, buf, sizeof(buf)))
+            return 0;
+        // Models can come and go with ty_models_load_patch()
+        model = ty_models_find(buf);
+        if (!model)
+            return 0;
+        fw->models[i] = model;
+    }
+    fw->models_count = models_count;
+
+    segments_count = (unsigned int)read_uint(&reader, 4);
+    if (segments_count > TY_FIRMWARE_MAX_SEGMENTS)
+        return 0;
+    for (unsigned int i = 0; i < segments_count; i++) {
+        uint32_t address = (uint32_t)read_uint(&reader, 4);
+        size_t size = (size_t)read_uint(&reader, 4);
+        const uint8_t *data = read_bytes(&reader, size);
+
+        if (!data)
+            return 0;
+
+        r = ty_firmware_add_segment_from(fw, address, data, size, NULL);
+        if (r < 0)
+            return r;
+    }
+    if (reader.error)
+        return 0;
+
+    fw->identified = true;
+    return 1;
+}
+
+/* Returns 1 and a ready-to-use firmware if the cache has a valid entry for this file, or 0
+   if it does not. Use the key to store the firmware once it is parsed. Cache problems are
+   never fatal, an empty key filename means there is no cache to store the firmware to. */
+int _ty_firmware_cache_lookup(const char *filename, const ty_firmware_format *format,
+                              _ty_firmware_cache_key *rkey, ty_firmware **rfw)
+{
+    assert(filename);
+    assert(format);
+    assert(rkey);
+    assert(rfw);
+
+    FILE *fp = NULL;
+    uint8_t *mem = NULL;
+    size_t len = 0;
+    bool refresh = false;
+    ty_firmware *fw = NULL;
+    int r;
+
+    rkey->filename[0] = 0;
+    if (!cache_max_size)
+        return 0;
+
+    // The caller will complain about these problems when it tries to load the file
+    ty_error_mask(TY_ERROR_NOT_FOUND);
+    ty_error_mask(TY_ERROR_ACCESS);
+    r = make_key(filename, rkey);
+    ty_error_unmask();
+    ty_error_unmask();
+    if (r < 0) {
+        rkey->filename[0] = 0;
+        return 0;
+    }
+
+#ifdef _WIN32
+    fp = fopen(rkey->filename, "rb");
+#else
+    fp = fopen(rkey->filename, "rbe");
+#endif
+    if (!fp)
+        return 0;
+    ty_error_mask(TY_ERROR_RANGE);
+    r = ty_file_read_all(fp, rkey->filename, CACHE_MAX_ENTRY_SIZE, &mem, &len);
+    ty_error_unmask();
+    if (r < 0) {
+        r = 0;
+        goto cleanup;
+    }
+
+    r = ty_firmware_new(filename, &fw);
+    if (r < 0)
+        goto cleanup;
+    fw->file_mem = mem;
+    fw->file_len = len;
+    mem = NULL;
+
+    r = load_entry(filename, format, rkey, fw->file_mem, fw->file_len, &refresh, fw);
+    if (r <= 0)
+        goto cleanup;
+
+    // The mtime has changed but not the content, update the entry to skip the hash next time
+    if (refresh)
+        _ty_firmware_cache_store(rkey, format, fw, NULL, 0);
+
+    *rfw = fw;
+    fw = NULL;
+
+cleanup:
+    ty_firmware_unref(fw);
+    free(mem);
+    fclose(fp);
+    return r;
+}
+
+static int write_entry(const _ty_firmware_cache_key *key, const ty_firmware_format *format,
+                       const ty_firmware *fw, uint64_t content_hash)
+{
+    entry_buffer buf = {0};
+    char tmp_filename[TY_PATH_MAX_SIZE + 8];
+    FILE *fp = NULL;
+    ty_model models[TY_FIRMWARE_MAX_MODELS];
+    unsigned int models_count;
+    int r;
+
+    models_count = ty_firmware_identify(fw, models, TY_COUNTOF(models));
+
+#define WRITE(Call) \
+        do { \
+            r = (Call); \
+            if (r < 0) \
+                goto cleanup; \
+        } while (false)
+
+    WRITE(write_bytes(&buf, CACHE_MAGIC, 8));
+    WRITE(write_uint(&buf, key->info.size, 8));
+    WRITE(write_uint(&buf, (uint64_t)key->info.mtime, 8));
+    WRITE(write_uint(&buf, (uint64_t)time(NULL), 8));
+    WRITE(write_uint(&buf, content_hash, 8));
+
+    WRITE(write_string(&buf, format->name));
+    WRITE(write_uint(&buf, fw->total_size, 8));
+    WRITE(write_uint(&buf, fw->max_address, 8));
+
+    WRITE(write_uint(&buf, models_count, 4));
+    for (unsigned int i = 0; i < models_count; i++)
+        WRITE(write_string(&buf, ty_models[models[i]].name));
+
+    WRITE(write_uint(&buf, fw->segments_count, 4));
+    for (unsigned int i = 0; i < fw->segments_count; i++) {
+        const ty_firmware_segment *segment = &fw->segments[i];
+
+        WRITE(write_uint(&buf, segment->address, 4));
+        WRITE(write_uint(&buf, segment->size, 4));
+        WRITE(write_bytes(&buf, segment->data, segment->size));
+    }
+
+    WRITE(write_uint(&buf, hash_content(buf.values, buf.count), 8));
+
+#undef WRITE
+
+    /* Write to a temporary file first. Concurrent writers may step on each other, but the
+       entry hash protects us from any mess. */
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", key->filename);
+    fp = fopen(tmp_filename, "wb");
+    if (!fp) {
+        r = ty_error(TY_ERROR_SYSTEM, "fopen('%s') failed: %s", tmp_filename, strerror(errno));
+        goto cleanup;
+    }
+    if (fwrite(buf.values, 1, buf.count, fp) != buf.count || fflush(fp)) {
+        r = ty_error(TY_ERROR_IO, "I/O error while writing to '%s'", tmp_filename);
+        goto cleanup;
+    }
+    fclose(fp);
+    fp = NULL;
+
+#ifdef _WIN32
+    remove(key->filename);
+#endif
+    if (rename(tmp_filename, key->filename) < 0) {
+        r = ty_error(TY_ERROR_SYSTEM, "rename('%s') failed: %s", tmp_filename, strerror(errno));
+        remove(tmp_filename);
+        goto cleanup;
+    }
+
+    r = 0;
+cleanup:
+    if (fp) {
+        fclose(fp);
+        remove(tmp_filename);
+    }
+    _hs_array_release(&buf);
+    return r;
+}
+
+static int list_cache_file(const char *name, const ty_file_info *info, void *udata)
+{
+    struct cache_listing *listing = udata;
+    size_t len = strlen(name);
+
+    if (len > 4 && !strcmp(name + len - 4, ".tmp")) {
+        if (info->mtime < listing->stale_time) {
+            char filename[TY_PATH_MAX_SIZE];
+
+            snprintf(filename, sizeof(filename), "%s/%s", listing->dir, name);
+            remove(filename);
+        }
+    } else if (len > 4 && len < sizeof(listing->entries.values[0].name) &&
+               !strcmp(name + len - 4, ".bin")) {
+        struct cache_file *entry;
+
+        if (_hs_array_grow(&listing->entries, 1) < 0)
+            return -1;
+        entry = &listing->entries.values[listing->entries.count++];
+        strcpy(entry->name, name);
+        entry->info = *info;
+
+        listing->total_size += info->size;
+    }
+
+    return 0;
+}
+
+static int compare_cache_files(const void *a, const void *b)
+{
+    const struct cache_file *entry1 = a;
+    const struct cache_file *entry2 = b;
+
+    return (entry1->info.mtime > entry2->info.mtime) - (entry1->info.mtime < entry2->info.mtime);
+}
+
+// Delete temporary files left behind, and the oldest entries until the cache fits
+static void trim_cache(const char *dir)
+{
+    struct cache_listing listing = {0};
+    int r;
+
+    listing.dir = dir;
+    listing.stale_time = ((int64_t)time(NULL) - CACHE_STALE_TMP_DELAY) * 1000000000;
+
+    ty_error_mask(TY_ERROR_NOT_FOUND);
+    r = ty_directory_list(dir, list_cache_file, &listing);
+    ty_error_unmask();
+    if (r < 0)
+        goto cleanup;
+
+    if (listing.total_size > cache_max_size) {
+        qsort(listing.entries.values, listing.entries.count, sizeof(*listing.entries.values),
+              compare_cache_files);
+
+        for (size_t i = 0; i < listing.entries.count && listing.total_size > cache_max_size; i++) {
+            const struct cache_file *entry = &listing.entries.values[i];
+            char filename[TY_PATH_MAX_SIZE];
+
+            snprintf(filename, sizeof(filename), "%s/%s", dir, entry->name);
+            if (!remove(filename))
+                listing.total_size -= entry->info.size;
+        }
+    }
+
+cleanup:
+    _hs_array_release(&listing.entries);
+}
+
+/* Give the file content (mem and len), unless the firmware comes from a cache entry. In
+   this case the content hash is reused. */
+void _ty_firmware_cache_store(const _ty_firmware_cache_key *key, const ty_firmware_format *format,
+                              const ty_firmware *fw, const uint8_t *mem, size_t len)
+{
+    assert(key);
+    assert(format);
+    assert(fw);
+
+    char dir[TY_PATH_MAX_SIZE];
+    char *ptr;
+    uint64_t content_hash;
+    int r;
+
+    if (!key->filename[0])
+        return;
+
+    if (mem) {
+        if (len != key->info.size)
+            return;
+        content_hash = hash_content(mem, len);
+    } else {
+        struct cache_reader reader = {fw->file_mem, fw->file_mem + fw->file_len, false};
+
+        // Skip magic, size, mtime and entry time
+        read_bytes(&reader, 32);
+        content_hash = read_uint(&reader, 8);
+        assert(!reader.error);
+    }
+
+    // Create TyTools/FirmwareCache if needed, but not the configuration directory itself
+    strcpy(dir, key->filename);
+    ptr = strrchr(dir, '/');
+    assert(ptr);
+    *ptr = 0;
+    ptr = strrchr(dir, '/');
+    assert(ptr);
+    *ptr = 0;
+
+    ty_error_mask(TY_ERROR_NOT_FOUND);
+    r = ty_directory_create(dir);
+    if (!r) {
+        *ptr = '/';
+        r = ty_directory_create(dir);
+    }
+    ty_error_unmask();
+    if (r < 0)
+        return;
+
+    r = write_entry(key, format, fw, content_hash);
+    if (r < 0) {
+        ty_log(TY_LOG_DEBUG, "Failed to store '%s' in firmware cache", fw->filename);
+        return;
+    }
+
+    trim_cache(dir);
+}
+
+/* Parsed firmwares are stored in the configuration directory, and reused as long as the
+   files don't change. Zero (the default) disables the cache. */
+void ty_firmware_set_cache_size(uint64_t max_size)
+{
+    cache_max_size = max_size;
+}
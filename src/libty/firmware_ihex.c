@@ -9,90 +9,156 @@
    See the LICENSE file for more details. */
 
 #include "common_priv.h"
-#include "firmware.h"
-
-struct parser_context {
-    ty_firmware *fw;
-    unsigned int line;
-
-    const char *ptr;
-    const char *end;
-    uint8_t sum;
-    bool error;
-
-    uint32_t offset1;
-    uint32_t offset2;
-    ty_firmware_segment *segment;
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define IHEX_USE_SSE2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    #include <arm_neon.h>
+    #define IHEX_USE_NEON
+#endif
+#include "firmware_priv.h"
+
+// Smallest record is ':' + 5 bytes (length, address, type, checksum) in hexadecimal
+#define MIN_RECORD_LENGTH 11
+
+// Values >= 0x10 are not hexadecimal digits (we only check the high nibble)
+static const uint8_t hex_nibbles[256] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
 };
 
-static uint32_t parse_hex_value(struct parser_context *ctx, size_t size)
+/* Decode len / 2 bytes from the hexadecimal string in src, and add them to *rsum. Returns
+   false if src contains anything but hexadecimal digits. */
+static bool decode_hex_bytes(const uint8_t *src, size_t len, uint8_t *dest, uint8_t *rsum)
 {
-    if (ctx->error)
-        return 0;
-
-    uint32_t value = 0;
-    while (size--) {
-        char buf[3];
-        char *end;
-        unsigned long byte;
-
-        if (ctx->ptr > ctx->end - 2) {
-            ctx->error = true;
-            return 0;
+    unsigned int sum = *rsum;
+    size_t i = 0;
+
+#if defined(IHEX_USE_SSE2)
+    if (len >= 32) {
+        const __m128i zero = _mm_setzero_si128();
+        __m128i sum128 = zero;
+
+        for (; i + 32 <= len; i += 32) {
+            __m128i out[2];
+
+            for (int j = 0; j < 2; j++) {
+                __m128i c = _mm_loadu_si128((const __m128i *)(src + i + 16 * j));
+                __m128i digit, digit_mask, alpha, alpha_mask, value;
+
+                /* Unsigned range checks: x <= max <=> min(x, max) == x. Lower-case letters
+                   differ from upper-case letters by 0x20, fold them together. */
+                digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+                digit_mask = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+                alpha = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+                alpha_mask = _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(5)), alpha);
+                if (_mm_movemask_epi8(_mm_or_si128(digit_mask, alpha_mask)) != 0xFFFF)
+                    return false;
+
+                value = _mm_or_si128(_mm_and_si128(digit_mask, digit),
+                                     _mm_and_si128(alpha_mask, _mm_add_epi8(alpha, _mm_set1_epi8(10))));
+
+                // Each 16-bit lane holds (low << 8) | high, merge into a single byte
+                out[j] = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(value, _mm_set1_epi16(0xFF)), 4),
+                                      _mm_srli_epi16(value, 8));
+            }
+
+            __m128i bytes = _mm_packus_epi16(out[0], out[1]);
+            _mm_storeu_si128((__m128i *)(dest + i / 2), bytes);
+            sum128 = _mm_add_epi64(sum128, _mm_sad_epu8(bytes, zero));
         }
-        memcpy(buf, ctx->ptr, 2);
-        buf[2] = 0;
 
-        byte = strtoul(buf, &end, 16);
-        if (end == buf || end[0]) {
-            ctx->error = true;
-            return 0;
+        sum += (unsigned int)_mm_cvtsi128_si32(sum128) +
+               (unsigned int)_mm_cvtsi128_si32(_mm_srli_si128(sum128, 8));
+    }
+#elif defined(IHEX_USE_NEON)
+    for (; i + 32 <= len; i += 32) {
+        uint8x16x2_t c = vld2q_u8(src + i);
+        uint8x16_t nibbles[2];
+
+        for (int j = 0; j < 2; j++) {
+            uint8x16_t digit, digit_mask, alpha, alpha_mask;
+
+            digit = vsubq_u8(c.val[j], vdupq_n_u8('0'));
+            digit_mask = vcleq_u8(digit, vdupq_n_u8(9));
+            alpha = vsubq_u8(vorrq_u8(c.val[j], vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+            alpha_mask = vcleq_u8(alpha, vdupq_n_u8(5));
+            if (vminvq_u8(vorrq_u8(digit_mask, alpha_mask)) != 0xFF)
+                return false;
+
+            nibbles[j] = vbslq_u8(digit_mask, digit, vaddq_u8(alpha, vdupq_n_u8(10)));
         }
 
-        value = (value << 8) | (uint8_t)byte;
-        ctx->sum = (uint8_t)(ctx->sum + byte);
-        ctx->ptr += 2;
+        uint8x16_t bytes = vorrq_u8(vshlq_n_u8(nibbles[0], 4), nibbles[1]);
+        vst1q_u8(dest + i / 2, bytes);
+        sum += vaddlvq_u8(bytes);
     }
+#endif
 
-    return value;
+    uint8_t invalid = 0;
+    for (; i + 2 <= len; i += 2) {
+        uint8_t high = hex_nibbles[src[i]];
+        uint8_t low = hex_nibbles[src[i + 1]];
+
+        invalid |= high | low;
+        dest[i / 2] = (uint8_t)((high << 4) | (low & 0xF));
+        sum += dest[i / 2];
+    }
+    if (invalid & 0xF0)
+        return false;
+
+    *rsum = (uint8_t)sum;
+    return true;
 }
 
-static int ihex_parse_error(struct parser_context *ctx)
+static int ihex_parse_error(_ty_ihex_parser *ctx)
 {
     return ty_error(TY_ERROR_PARSE, "IHEX parse error on line %u in '%s'", ctx->line,
                     ctx->fw->filename);
 }
 
-static int parse_line(struct parser_context *ctx, const char *line, size_t line_len)
+static int parse_record(_ty_ihex_parser *ctx, const uint8_t *bytes)
 {
     unsigned int data_len, type;
     uint32_t address;
-    uint8_t sum, checksum;
     int r;
 
-    ctx->ptr = line;
-    ctx->end = line + line_len;
-    ctx->sum = 0;
-    ctx->error = false;
-
-    if (!line_len || *ctx->ptr++ != ':')
-        return ihex_parse_error(ctx);
-    data_len = parse_hex_value(ctx, 1);
-    if (11 + 2 * data_len != line_len)
-        return ihex_parse_error(ctx);
-    address = parse_hex_value(ctx, 2);
-    type = parse_hex_value(ctx, 1);
+    data_len = bytes[0];
+    address = (uint32_t)(bytes[1] << 8) | bytes[2];
+    type = bytes[3];
+    bytes += 4;
 
     switch (type) {
         case 0: { // data record
             address += ctx->offset1 + ctx->offset2;
 
-            r = ty_firmware_expand_segment(ctx->fw, ctx->segment, address + data_len);
-            if (r < 0)
-                return r;
+            // Streamed firmwares can't publish blocks anymore once this happens
+            if (ctx->segment->address + address < ctx->ready_address)
+                ctx->unordered = true;
+
+            if (address + data_len > ctx->segment->size) {
+                r = ty_firmware_expand_segment(ctx->fw, ctx->segment, address + data_len);
+                if (r < 0)
+                    return r;
+            }
+            memcpy(ctx->segment->data + address, bytes, data_len);
 
-            for (unsigned int i = 0; i < data_len; i++)
-                ctx->segment->data[address + i] = (uint8_t)parse_hex_value(ctx, 1);
+            ctx->end_address = TY_MAX(ctx->end_address,
+                                      ctx->segment->address + address + data_len);
         } break;
 
         case 1: { // EOF record
@@ -104,14 +170,14 @@ static int parse_line(struct parser_context *ctx, const char *line, size_t line_
             if (data_len != 2)
                 return ihex_parse_error(ctx);
 
-            ctx->offset2 = (uint32_t)parse_hex_value(ctx, 2) << 4;
+            ctx->offset2 = (uint32_t)((bytes[0] << 8) | bytes[1]) << 4;
         } break;
 
         case 4: { // extended linear address record
             if (data_len != 2)
                 return ihex_parse_error(ctx);
 
-            address = (uint32_t)parse_hex_value(ctx, 2) << 16;
+            address = (uint32_t)((bytes[0] << 8) | bytes[1]) << 16;
 
             if (address + 65536 > ctx->segment->address + TY_FIRMWARE_MAX_SEGMENT_SIZE) {
                 r = ty_firmware_add_segment(ctx->fw, address, 0, &ctx->segment);
@@ -128,8 +194,6 @@ static int parse_line(struct parser_context *ctx, const char *line, size_t line_
         case 5: { // start linear address record
             if (data_len != 4)
                 return ihex_parse_error(ctx);
-
-            parse_hex_value(ctx, 4);
         } break;
 
         default: {
@@ -137,50 +201,85 @@ static int parse_line(struct parser_context *ctx, const char *line, size_t line_
         } break;
     }
 
-    // Don't checksum the checksum :)
-    sum = ctx->sum;
-    checksum = (uint8_t)parse_hex_value(ctx, 1);
-
-    if (ctx->error)
-        return ihex_parse_error(ctx);
-    if ((sum + checksum) & 0xFF)
-        return ihex_parse_error(ctx);
-
     // Return 1 for EOF records, to end the parsing
     return (type == 1);
 }
 
-int ty_firmware_load_ihex(ty_firmware *fw, const uint8_t *mem, size_t len)
+int _ty_ihex_parser_init(_ty_ihex_parser *parser, ty_firmware *fw)
 {
+    assert(parser);
     assert(fw);
     assert(!fw->segments_count && !fw->total_size);
+
+    memset(parser, 0, sizeof(*parser));
+    parser->fw = fw;
+
+    return ty_firmware_add_segment(fw, 0, 0, &parser->segment);
+}
+
+/* Parse all the complete records in mem and return the number of bytes consumed, the caller
+   must keep the rest and feed it again once more data is available. Set end if there is
+   nothing left after this. */
+ssize_t _ty_ihex_parser_feed(_ty_ihex_parser *parser, const uint8_t *mem, size_t len, bool end)
+{
+    assert(parser);
     assert(mem || !len);
 
-    struct parser_context ctx = {0};
+    size_t offset = 0;
     int r;
 
-    ctx.fw = fw;
-    r = ty_firmware_add_segment(fw, 0, 0, &ctx.segment);
-    if (r < 0)
-        return r;
-
-    size_t start, end = 0;
-    do {
-        start = end;
-        while (start < len && (mem[start] == '\r' || mem[start] == '\n'))
-            start++;
-        if (start >= len)
-            return ty_error(TY_ERROR_PARSE, "Missing EOF record in '%s' (IHEX)", fw->filename);
-        end = start;
-        while (end < len && mem[end] != '\r' && mem[end] != '\n')
-            end++;
-        ctx.line++;
+    while (!parser->eof) {
+        uint8_t bytes[5 + 255];
+        size_t record_len;
+        uint8_t sum;
+
+        while (offset < len && (mem[offset] == '\r' || mem[offset] == '\n'))
+            offset++;
+        if (offset >= len)
+            break;
+
+        /* The data length byte gives us the length of the whole record, which must be
+           followed by a line ending (or the end of the file). We decode the record at once
+           and check the checksum as we go. */
+        if (len - offset < MIN_RECORD_LENGTH && !end)
+            break;
+        parser->line++;
+        sum = 0;
+        if (mem[offset] != ':' || len - offset < MIN_RECORD_LENGTH ||
+                !decode_hex_bytes(mem + offset + 1, 2, bytes, &sum))
+            return ihex_parse_error(parser);
+        record_len = MIN_RECORD_LENGTH + 2 * (size_t)bytes[0];
+        if (len - offset <= record_len && !end) {
+            parser->line--;
+            break;
+        }
+        if (len - offset < record_len ||
+                (len - offset > record_len && mem[offset + record_len] != '\r' &&
+                                              mem[offset + record_len] != '\n'))
+            return ihex_parse_error(parser);
+        if (!decode_hex_bytes(mem + offset + 3, record_len - 3, bytes + 1, &sum) || sum)
+            return ihex_parse_error(parser);
+        offset += record_len;
 
         // Returns 1 when EOF record is detected
-        r = parse_line(&ctx, (const char *)mem + start, end - start);
+        r = parse_record(parser, bytes);
         if (r < 0)
             return r;
-    } while (!r);
+        parser->eof = r;
+    }
+
+    // Anything after the EOF record is ignored
+    return (ssize_t)(parser->eof ? len : offset);
+}
+
+int _ty_ihex_parser_finish(_ty_ihex_parser *parser)
+{
+    assert(parser);
+
+    ty_firmware *fw = parser->fw;
+
+    if (!parser->eof)
+        return ty_error(TY_ERROR_PARSE, "Missing EOF record in '%s' (IHEX)", fw->filename);
 
     for (unsigned int i = 0; i < fw->segments_count; i++) {
         const ty_firmware_segment *segment = &fw->segments[i];
@@ -190,3 +289,22 @@ int ty_firmware_load_ihex(ty_firmware *fw, const uint8_t *mem, size_t len)
 
     return 0;
 }
+
+int ty_firmware_load_ihex(ty_firmware *fw, const uint8_t *mem, size_t len)
+{
+    assert(fw);
+    assert(!fw->segments_count && !fw->total_size);
+    assert(mem || !len);
+
+    _ty_ihex_parser parser;
+    ssize_t r;
+
+    r = _ty_ihex_parser_init(&parser, fw);
+    if (r < 0)
+        return (int)r;
+    r = _ty_ihex_parser_feed(&parser, mem, len, true);
+    if (r < 0)
+        return (int)r;
+
+    return _ty_ihex_parser_finish(&parser);
+}
@@ -0,0 +1,51 @@
+/* TyTools - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/tytools
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#ifndef TY_FIRMWARE_PRIV_H
+#define TY_FIRMWARE_PRIV_H
+
+#include "common_priv.h"
+#include "firmware.h"
+#include "system.h"
+
+TY_C_BEGIN
+
+typedef struct _ty_ihex_parser {
+    ty_firmware *fw;
+    unsigned int line;
+
+    uint32_t offset1;
+    uint32_t offset2;
+    ty_firmware_segment *segment;
+
+    // Data below ready_address is final, unless a record goes back there (unordered)
+    size_t ready_address;
+    size_t end_address;
+    bool unordered;
+    bool eof;
+} _ty_ihex_parser;
+
+int _ty_ihex_parser_init(_ty_ihex_parser *parser, ty_firmware *fw);
+ssize_t _ty_ihex_parser_feed(_ty_ihex_parser *parser, const uint8_t *mem, size_t len, bool end);
+int _ty_ihex_parser_finish(_ty_ihex_parser *parser);
+
+typedef struct _ty_firmware_cache_key {
+    char filename[TY_PATH_MAX_SIZE];
+    ty_file_info info;
+} _ty_firmware_cache_key;
+
+int _ty_firmware_cache_lookup(const char *filename, const ty_firmware_format *format,
+                              _ty_firmware_cache_key *rkey, ty_firmware **rfw);
+void _ty_firmware_cache_store(const _ty_firmware_cache_key *key, const ty_firmware_format *format,
+                              const ty_firmware *fw, const uint8_t *mem, size_t len);
+
+TY_C_END
+
+#endif
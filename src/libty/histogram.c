@@ -0,0 +1,106 @@
+/* TyTools - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/tytools
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#include "common_priv.h"
+#include "histogram.h"
+
+static unsigned int find_bucket(uint32_t value)
+{
+    unsigned int exponent;
+
+    if (value < TY_HISTOGRAM_SUB_BUCKETS)
+        return value;
+
+    exponent = 31;
+    while (!(value & (1u << exponent)))
+        exponent--;
+
+    return (exponent - 3) * TY_HISTOGRAM_SUB_BUCKETS +
+           ((value >> (exponent - 4)) & (TY_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+static uint64_t get_bucket_max(unsigned int bucket)
+{
+    unsigned int exponent;
+    uint64_t base, width;
+
+    if (bucket < TY_HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+
+    exponent = bucket / TY_HISTOGRAM_SUB_BUCKETS + 3;
+    width = (uint64_t)1 << (exponent - 4);
+    base = ((uint64_t)1 << exponent) + (bucket % TY_HISTOGRAM_SUB_BUCKETS) * width;
+
+    return base + width - 1;
+}
+
+void ty_histogram_add(ty_histogram *h, uint64_t value)
+{
+    assert(h);
+
+    if (value > TY_HISTOGRAM_MAX_VALUE)
+        value = TY_HISTOGRAM_MAX_VALUE;
+
+    h->buckets[find_bucket((uint32_t)value)]++;
+    if (!h->count || value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+    h->sum += value;
+    h->count++;
+}
+
+void ty_histogram_merge(ty_histogram *h, const ty_histogram *other)
+{
+    assert(h);
+    assert(other);
+
+    if (!other->count)
+        return;
+
+    for (unsigned int i = 0; i < TY_HISTOGRAM_BUCKETS; i++)
+        h->buckets[i] += other->buckets[i];
+    if (!h->count || other->min < h->min)
+        h->min = other->min;
+    if (other->max > h->max)
+        h->max = other->max;
+    h->sum += other->sum;
+    h->count += other->count;
+}
+
+uint64_t ty_histogram_get_percentile(const ty_histogram *h, double percentile)
+{
+    assert(h);
+    assert(percentile >= 0.0 && percentile <= 100.0);
+
+    uint64_t threshold, seen;
+
+    if (!h->count)
+        return 0;
+
+    threshold = (uint64_t)(percentile / 100.0 * (double)h->count + 0.5);
+    if (!threshold)
+        threshold = 1;
+
+    seen = 0;
+    for (unsigned int i = 0; i < TY_HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= threshold)
+            return TY_MIN(get_bucket_max(i), h->max);
+    }
+
+    return h->max;
+}
+
+uint64_t ty_histogram_get_mean(const ty_histogram *h)
+{
+    assert(h);
+    return h->count ? h->sum / h->count : 0;
+}
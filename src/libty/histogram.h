@@ -0,0 +1,43 @@
+/* TyTools - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/tytools
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#ifndef TY_HISTOGRAM_H
+#define TY_HISTOGRAM_H
+
+#include "common.h"
+
+TY_C_BEGIN
+
+/* Log-linear buckets, like HDR histograms: each power of two is split in 16 linear
+   sub-buckets, so values are recorded with a relative error below 1/16. Values above
+   TY_HISTOGRAM_MAX_VALUE are recorded as TY_HISTOGRAM_MAX_VALUE. */
+#define TY_HISTOGRAM_SUB_BUCKETS 16
+#define TY_HISTOGRAM_BUCKETS ((32 - 3) * TY_HISTOGRAM_SUB_BUCKETS)
+#define TY_HISTOGRAM_MAX_VALUE UINT32_MAX
+
+typedef struct ty_histogram {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+
+    uint32_t buckets[TY_HISTOGRAM_BUCKETS];
+} ty_histogram;
+
+void ty_histogram_add(ty_histogram *h, uint64_t value);
+void ty_histogram_merge(ty_histogram *h, const ty_histogram *other);
+
+// Returns the highest value of the bucket where the percentile falls, 0 if empty
+uint64_t ty_histogram_get_percentile(const ty_histogram *h, double percentile);
+uint64_t ty_histogram_get_mean(const ty_histogram *h);
+
+TY_C_END
+
+#endif
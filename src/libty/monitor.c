@@ -14,16 +14,31 @@
 #include "../libhs/monitor.h"
 #include "board_priv.h"
 #include "class_priv.h"
+#include "histogram.h"
 #include "monitor.h"
 #include "system.h"
+#include "task.h"
+#include "task_priv.h"
 #include "timer.h"
 
 struct callback {
     int id;
+    // Only one of these is set
     ty_monitor_callback_func *f;
+    ty_monitor_batch_func *batch_f;
     void *udata;
 };
 
+// Threads blocked in ty_board_wait_for(), woken only when their board changes
+struct board_waiter {
+    ty_board *board;
+    ty_board_capability capability;
+
+    ty_cond cond;
+    // Start of the refresh that woke us up, used to measure the wakeup latency
+    uint64_t woken_at;
+};
+
 struct ty_monitor {
     int drop_delay;
 
@@ -34,18 +49,209 @@ struct ty_monitor {
 
     _HS_ARRAY(struct callback) callbacks;
     int current_callback_id;
+    unsigned int batch_callbacks;
+    // Referenced boards changed since the last flush, with their first event
+    _HS_ARRAY(ty_monitor_batch_event) batch;
 
     ty_mutex refresh_mutex;
     ty_cond refresh_cond;
     int refresh_callback_ret;
+    uint64_t refresh_start;
+
+    // Protected by refresh_mutex
+    _HS_ARRAY(struct board_waiter *) waiters;
+    ty_histogram wakeup_latency;
 
     _HS_ARRAY(ty_board *) boards;
+    _hs_htable boards_by_location;
+    _hs_htable boards_by_id;
+    // Missing boards, ordered by drop deadline (min-heap on missing_since)
+    _HS_ARRAY(ty_board *) drop_heap;
     _hs_htable ifaces;
 
     ty_thread_id main_thread_id;
 };
 
 #define DROP_BOARD_DELAY 15000
+#define BOARD_TABLE_SIZE 256
+// Tasks waiting for a board check for cancellation this often
+#define CANCEL_CHECK_DELAY 100
+
+static void swap_drop_heap(ty_monitor *monitor, size_t i, size_t j)
+{
+    ty_board **values = monitor->drop_heap.values;
+    ty_board *tmp = values[i];
+
+    values[i] = values[j];
+    values[j] = tmp;
+    values[i]->drop_index = i + 1;
+    values[j]->drop_index = j + 1;
+}
+
+static void sift_drop_heap(ty_monitor *monitor, size_t i)
+{
+    ty_board **values = monitor->drop_heap.values;
+    size_t count = monitor->drop_heap.count;
+
+    while (i && values[i]->missing_since < values[(i - 1) / 2]->missing_since) {
+        swap_drop_heap(monitor, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+
+    for (;;) {
+        size_t left = 2 * i + 1, right = 2 * i + 2, min = i;
+
+        if (left < count && values[left]->missing_since < values[min]->missing_since)
+            min = left;
+        if (right < count && values[right]->missing_since < values[min]->missing_since)
+            min = right;
+        if (min == i)
+            break;
+
+        swap_drop_heap(monitor, i, min);
+        i = min;
+    }
+}
+
+static int push_drop_deadline(ty_monitor *monitor, ty_board *board)
+{
+    int r;
+
+    r = _hs_array_push(&monitor->drop_heap, board);
+    if (r < 0)
+        return ty_libhs_translate_error(r);
+    board->drop_index = monitor->drop_heap.count;
+    sift_drop_heap(monitor, board->drop_index - 1);
+
+    return 0;
+}
+
+static void remove_drop_deadline(ty_monitor *monitor, ty_board *board)
+{
+    size_t i, last;
+
+    if (!board->drop_index)
+        return;
+
+    i = board->drop_index - 1;
+    last = monitor->drop_heap.count - 1;
+    board->drop_index = 0;
+
+    if (i != last) {
+        monitor->drop_heap.values[i] = monitor->drop_heap.values[last];
+        monitor->drop_heap.values[i]->drop_index = i + 1;
+    }
+    _hs_array_pop(&monitor->drop_heap, 1);
+    if (i < monitor->drop_heap.count)
+        sift_drop_heap(monitor, i);
+}
+
+static void wake_board_waiters(ty_board *board)
+{
+    ty_monitor *monitor = board->monitor;
+
+    ty_mutex_lock(&monitor->refresh_mutex);
+    for (size_t i = 0; i < monitor->waiters.count; i++) {
+        struct board_waiter *waiter = monitor->waiters.values[i];
+
+        if (waiter->board == board && (board->status == TY_BOARD_STATUS_DROPPED ||
+                                       (board->capabilities & (1 << waiter->capability)))) {
+            if (!waiter->woken_at)
+                waiter->woken_at = monitor->refresh_start;
+            ty_cond_signal(&waiter->cond);
+        }
+    }
+    ty_mutex_unlock(&monitor->refresh_mutex);
+}
+
+static int add_batch_event(ty_monitor *monitor, ty_board *board, ty_monitor_event event)
+{
+    ty_monitor_batch_event ev;
+    int r;
+
+    // Keep the first event, the final one is computed from the board status on flush
+    if (board->batch_index)
+        return 0;
+
+    ev.board = ty_board_ref(board);
+    ev.event = event;
+    r = _hs_array_push(&monitor->batch, ev);
+    if (r < 0) {
+        ty_board_unref(board);
+        return ty_libhs_translate_error(r);
+    }
+    board->batch_index = monitor->batch.count;
+
+    return 0;
+}
+
+// Returns -1 when the board must be skipped
+static int coalesce_batch_event(const ty_monitor_batch_event *ev)
+{
+    ty_board *board = ev->board;
+
+    if (ev->event == TY_MONITOR_EVENT_ADDED)
+        return board->status == TY_BOARD_STATUS_DROPPED ? -1 : TY_MONITOR_EVENT_ADDED;
+
+    switch (board->status) {
+        case TY_BOARD_STATUS_ONLINE: { return TY_MONITOR_EVENT_CHANGED; } break;
+        case TY_BOARD_STATUS_MISSING: { return TY_MONITOR_EVENT_DISAPPEARED; } break;
+        case TY_BOARD_STATUS_DROPPED: { return TY_MONITOR_EVENT_DROPPED; } break;
+    }
+
+    assert(false);
+    return -1;
+}
+
+static int flush_batch(ty_monitor *monitor)
+{
+    size_t count = 0;
+    int r = 0;
+
+    if (!monitor->batch.count)
+        return 0;
+
+    /* Boards created and dropped within the batch are skipped, the others get a single
+       event describing the difference between the first and the final state. */
+    for (size_t i = 0; i < monitor->batch.count; i++) {
+        ty_monitor_batch_event ev = monitor->batch.values[i];
+        int event = coalesce_batch_event(&ev);
+
+        ev.board->batch_index = 0;
+        if (event < 0) {
+            ty_board_unref(ev.board);
+            continue;
+        }
+
+        ev.event = (ty_monitor_event)event;
+        monitor->batch.values[count++] = ev;
+    }
+
+    // Same rules as in change_board_status()
+    size_t remove_count = 0;
+    for (size_t i = 0; i < monitor->callbacks.count; i++) {
+        struct callback *callback_it = &monitor->callbacks.values[i - remove_count];
+        if (remove_count)
+            *callback_it = monitor->callbacks.values[i];
+
+        if (!r && callback_it->batch_f && count) {
+            r = (*callback_it->batch_f)(monitor->batch.values, (unsigned int)count,
+                                        callback_it->udata);
+            if (r > 0) {
+                monitor->batch_callbacks--;
+                remove_count++;
+                r = 0;
+            }
+        }
+    }
+    monitor->callbacks.count -= remove_count;
+
+    for (size_t i = 0; i < count; i++)
+        ty_board_unref(monitor->batch.values[i].board);
+    monitor->batch.count = 0;
+
+    return r;
+}
 
 static int change_board_status(ty_board *board, ty_board_status status, ty_monitor_event event)
 {
@@ -54,8 +260,11 @@ static int change_board_status(ty_board *board, ty_board_status status, ty_monit
 
     // Set new board status, engage drop timer if needed
     if (status == TY_BOARD_STATUS_MISSING && status != board->status) {
-        board->status = TY_BOARD_STATUS_MISSING;
         board->missing_since = ty_millis();
+        r = push_drop_deadline(monitor, board);
+        if (r < 0)
+            return r;
+        board->status = TY_BOARD_STATUS_MISSING;
 
         if (!monitor->timer_running) {
             int timer_delay = ty_adjust_timeout(monitor->drop_delay, board->missing_since);
@@ -65,9 +274,13 @@ static int change_board_status(ty_board *board, ty_board_status status, ty_monit
             monitor->timer_running = true;
         }
     } else {
+        if (status != TY_BOARD_STATUS_MISSING)
+            remove_drop_deadline(monitor, board);
         board->status = status;
     }
 
+    wake_board_waiters(board);
+
     /* Notify callbacks and do some additional stuff as we go:
        - Drop callback that return r > 0
        - Stop calling them is one returns r < 0 */
@@ -77,7 +290,7 @@ static int change_board_status(ty_board *board, ty_board_status status, ty_monit
         if (remove_count)
             *callback_it = monitor->callbacks.values[i];
 
-        if (!r) {
+        if (!r && callback_it->f) {
             r = (*callback_it->f)(board, event, callback_it->udata);
             if (r > 0) {
                 remove_count++;
@@ -87,6 +300,9 @@ static int change_board_status(ty_board *board, ty_board_status status, ty_monit
     }
     monitor->callbacks.count -= remove_count;
 
+    if (!r && monitor->batch_callbacks)
+        r = add_batch_event(monitor, board, event);
+
     return r;
 }
 
@@ -109,6 +325,9 @@ static int create_board(ty_monitor *monitor, ty_board_interface *iface, ty_board
     }
 
     r = ty_mutex_init(&board->ifaces_lock);
+    if (r < 0)
+        goto error;
+    r = ty_mutex_init(&board->tasks_lock);
     if (r < 0)
         goto error;
 
@@ -126,6 +345,10 @@ static int create_board(ty_monitor *monitor, ty_board_interface *iface, ty_board
         r = ty_libhs_translate_error(r);
         goto error;
     }
+    board->monitor_index = monitor->boards.count;
+    _hs_htable_add(&monitor->boards_by_location, _hs_htable_hash_str(board->location),
+                   &board->location_hnode);
+    _hs_htable_add(&monitor->boards_by_id, _hs_htable_hash_str(board->id), &board->id_hnode);
 
     *rboard = board;
     return 1;
@@ -156,6 +379,7 @@ static int close_board(ty_board *board)
 
         if (iface_it->monitor_hnode.next)
             _hs_htable_remove(&iface_it->monitor_hnode);
+        _ty_board_interface_drop(iface_it);
         ty_board_interface_unref(iface_it);
     }
     _hs_array_release(&ifaces);
@@ -170,21 +394,30 @@ static void drop_board(ty_board *board)
     // Change board status
     change_board_status(board, TY_BOARD_STATUS_DROPPED, TY_MONITOR_EVENT_DROPPED);
 
-    // Remove this board from the monitor list
+    // Remove this board from the monitor list (the last board takes its place) and indexes
     board->monitor = NULL;
-    for (size_t i = 0; i < monitor->boards.count; i++) {
-        if (monitor->boards.values[i] == board)
-            _hs_array_remove(&monitor->boards, i, 1);
+    if (board->monitor_index) {
+        size_t i = board->monitor_index - 1;
+        ty_board *last = monitor->boards.values[monitor->boards.count - 1];
+
+        monitor->boards.values[i] = last;
+        last->monitor_index = i + 1;
+        _hs_array_pop(&monitor->boards, 1);
+        board->monitor_index = 0;
     }
+    if (board->location_hnode.next)
+        _hs_htable_remove(&board->location_hnode);
+    if (board->id_hnode.next)
+        _hs_htable_remove(&board->id_hnode);
 }
 
 static ty_board *find_monitor_board(ty_monitor *monitor, const char *location)
 {
-    for (size_t i = 0; i < monitor->boards.count; i++) {
-        ty_board *board_it = monitor->boards.values[i];
+    _hs_htable_foreach_hash(cur, &monitor->boards_by_location, _hs_htable_hash_str(location)) {
+        ty_board *board = ty_container_of(cur, ty_board, location_hnode);
 
-        if (strcmp(board_it->location, location) == 0)
-            return board_it;
+        if (strcmp(board->location, location) == 0)
+            return board;
     }
 
     return NULL;
@@ -262,6 +495,11 @@ static int update_or_create_board(ty_monitor *monitor, ty_board_interface *iface
         if (update_tag_pointer)
             board->tag = board->id;
 
+        // The class may have changed the board id (e.g. serial number now available)
+        _hs_htable_remove(&board->id_hnode);
+        _hs_htable_add(&monitor->boards_by_id, _hs_htable_hash_str(board->id),
+                       &board->id_hnode);
+
         /* The class function update_board() returns 1 if the interface is compatible with
            this board, or 0 if not. In the latter case, the old board is dropped and a new
            one is used. */
@@ -372,8 +610,9 @@ static int remove_interface_with_device(ty_monitor *monitor, hs_device *dev)
         return 0;
     board = iface->board;
 
-    // Unregister from monitor
+    // Unregister from monitor, and invalidate pinned serial handles
     _hs_htable_remove(&iface->monitor_hnode);
+    _ty_board_interface_drop(iface);
     ty_board_interface_unref(iface);
 
     ty_mutex_lock(&board->ifaces_lock);
@@ -467,6 +706,12 @@ int ty_monitor_new(ty_monitor **rmonitor)
     if (r < 0)
         goto error;
 
+    r = _hs_htable_init(&monitor->boards_by_location, BOARD_TABLE_SIZE);
+    if (r < 0)
+        goto error;
+    r = _hs_htable_init(&monitor->boards_by_id, BOARD_TABLE_SIZE);
+    if (r < 0)
+        goto error;
     r = _hs_htable_init(&monitor->ifaces, 64);
     if (r < 0)
         goto error;
@@ -487,7 +732,10 @@ void ty_monitor_free(ty_monitor *monitor)
         ty_monitor_stop(monitor);
 
         _hs_array_release(&monitor->callbacks);
+        _hs_htable_release(&monitor->boards_by_location);
+        _hs_htable_release(&monitor->boards_by_id);
         _hs_htable_release(&monitor->ifaces);
+        _hs_array_release(&monitor->waiters);
 
         ty_cond_release(&monitor->refresh_cond);
         ty_mutex_release(&monitor->refresh_mutex);
@@ -515,6 +763,9 @@ int ty_monitor_start(ty_monitor *monitor)
     monitor->started = true;
 
     r = hs_monitor_list(monitor->device_monitor, device_callback, monitor);
+    if (r < 0)
+        goto error;
+    r = flush_batch(monitor);
     if (r < 0)
         goto error;
 
@@ -537,14 +788,26 @@ void ty_monitor_stop(ty_monitor *monitor)
     ty_timer_set(monitor->timer, -1, 0);
     monitor->timer_running = false;
 
+    // Drop pending batch events
+    for (size_t i = 0; i < monitor->batch.count; i++) {
+        monitor->batch.values[i].board->batch_index = 0;
+        ty_board_unref(monitor->batch.values[i].board);
+    }
+    _hs_array_release(&monitor->batch);
+
     // Clear registered boards
     for (size_t i = 0; i < monitor->boards.count; i++) {
         ty_board *board_it = monitor->boards.values[i];
 
         board_it->monitor = NULL;
+        board_it->monitor_index = 0;
+        board_it->drop_index = 0;
         ty_board_unref(board_it);
     }
     _hs_array_release(&monitor->boards);
+    _hs_array_release(&monitor->drop_heap);
+    _hs_htable_clear(&monitor->boards_by_location);
+    _hs_htable_clear(&monitor->boards_by_id);
 
     // Clear registered interfaces
     _hs_htable_foreach(cur, &monitor->ifaces) {
@@ -552,6 +815,7 @@ void ty_monitor_stop(ty_monitor *monitor)
 
         if (iface_it->monitor_hnode.next)
             _hs_htable_remove(&iface_it->monitor_hnode);
+        _ty_board_interface_drop(iface_it);
         ty_board_interface_unref(iface_it);
     }
     _hs_htable_clear(&monitor->ifaces);
@@ -581,6 +845,27 @@ int ty_monitor_register_callback(ty_monitor *monitor, ty_monitor_callback_func *
     return ty_libhs_translate_error(_hs_array_push(&monitor->callbacks, callback));
 }
 
+int ty_monitor_register_batch_callback(ty_monitor *monitor, ty_monitor_batch_func *f,
+                                       void *udata)
+{
+    assert(monitor);
+    assert(f);
+
+    struct callback callback = {
+        .id = monitor->current_callback_id++,
+        .batch_f = f,
+        .udata = udata
+    };
+    int r;
+
+    r = _hs_array_push(&monitor->callbacks, callback);
+    if (r < 0)
+        return ty_libhs_translate_error(r);
+    monitor->batch_callbacks++;
+
+    return 0;
+}
+
 void ty_monitor_deregister_callback(ty_monitor *monitor, int id)
 {
     assert(monitor);
@@ -588,6 +873,8 @@ void ty_monitor_deregister_callback(ty_monitor *monitor, int id)
 
     for (size_t i = 0; i < monitor->callbacks.count; i++) {
         if (monitor->callbacks.values[i].id == id) {
+            if (monitor->callbacks.values[i].batch_f)
+                monitor->batch_callbacks--;
             _hs_array_remove(&monitor->callbacks, i, 1);
             break;
         }
@@ -600,23 +887,25 @@ int ty_monitor_refresh(ty_monitor *monitor)
 
     int r;
 
+    monitor->refresh_start = ty_micros();
+
     if (ty_timer_rearm(monitor->timer)) {
         int timer_delay = -1;
 
-        for (size_t i = 0; i < monitor->boards.count; i++) {
-            ty_board *board_it = monitor->boards.values[i];
-
-            if (board_it->status == TY_BOARD_STATUS_MISSING) {
-                int board_timeout = ty_adjust_timeout(monitor->drop_delay, board_it->missing_since);
-                /* Drop boards that are about to expire (< 20 ms) to deal with limited timer
-                   resolution (e.g. TickCount64() on Windows). */
-                if (board_timeout < 20) {
-                    drop_board(board_it);
-                    ty_board_unref(board_it);
-                } else if (board_timeout < timer_delay || timer_delay == -1) {
-                    timer_delay = board_timeout;
-                }
+        while (monitor->drop_heap.count) {
+            ty_board *board = monitor->drop_heap.values[0];
+            int board_timeout = ty_adjust_timeout(monitor->drop_delay, board->missing_since);
+
+            /* Drop boards that are about to expire (< 20 ms) to deal with limited timer
+               resolution (e.g. TickCount64() on Windows). */
+            if (board_timeout >= 20) {
+                timer_delay = board_timeout;
+                break;
             }
+
+            // This removes the board from the heap
+            drop_board(board);
+            ty_board_unref(board);
         }
 
         r = ty_timer_set(monitor->timer, timer_delay, TY_TIMER_ONESHOT);
@@ -638,9 +927,14 @@ int ty_monitor_refresh(ty_monitor *monitor)
         return ty_libhs_translate_error(r);
     }
 
+    r = flush_batch(monitor);
+    if (r < 0)
+        return r;
+
     ty_mutex_lock(&monitor->refresh_mutex);
     ty_cond_broadcast(&monitor->refresh_cond);
     ty_mutex_unlock(&monitor->refresh_mutex);
+    _ty_engine_wake();
 
     return 0;
 }
@@ -686,6 +980,128 @@ int ty_monitor_wait(ty_monitor *monitor, ty_monitor_wait_func *f, void *udata, i
     }
 }
 
+static int check_board_waiter(ty_monitor *monitor, void *udata)
+{
+    TY_UNUSED(monitor);
+
+    const struct board_waiter *waiter = udata;
+    ty_board *board = waiter->board;
+    int r;
+
+    r = _ty_task_check_canceled();
+    if (r < 0)
+        return r;
+
+    if (board->status == TY_BOARD_STATUS_DROPPED)
+        return ty_error(TY_ERROR_NOT_FOUND, "Board '%s' has disappeared", board->tag);
+
+    return ty_board_has_capability(board, waiter->capability);
+}
+
+static int get_cancel_wait_timeout(int timeout, uint64_t start)
+{
+    int wait_timeout = ty_adjust_timeout(timeout, start);
+
+    if (wait_timeout < 0 || wait_timeout > CANCEL_CHECK_DELAY)
+        wait_timeout = CANCEL_CHECK_DELAY;
+    return wait_timeout;
+}
+
+/* Threads other than the monitor thread register a waiter, and sleep until the monitor
+   thread signals a change of this specific board instead of waking up on every refresh. */
+
+int _ty_monitor_wait_board(ty_monitor *monitor, ty_board *board,
+                           ty_board_capability capability, int timeout)
+{
+    assert(monitor);
+    assert(board);
+
+    struct board_waiter waiter = {0};
+    uint64_t start;
+    int r;
+
+    waiter.board = board;
+    waiter.capability = capability;
+
+    start = ty_millis();
+
+    /* The monitor thread has to refresh the monitor itself. Tasks wake up regularly to
+       notice cancellation, nobody signals them when it happens. */
+    if (monitor->main_thread_id == ty_thread_get_self_id()) {
+        if (!ty_task_get_current())
+            return ty_monitor_wait(monitor, check_board_waiter, &waiter, timeout);
+
+        do {
+            r = ty_monitor_wait(monitor, check_board_waiter, &waiter,
+                                get_cancel_wait_timeout(timeout, start));
+        } while (!r && ty_adjust_timeout(timeout, start));
+        return r;
+    }
+
+    r = ty_cond_init(&waiter.cond);
+    if (r < 0)
+        return r;
+
+    ty_mutex_lock(&monitor->refresh_mutex);
+
+    r = _hs_array_push(&monitor->waiters, &waiter);
+    if (r < 0) {
+        r = ty_libhs_translate_error(r);
+        goto cleanup;
+    }
+
+    while (!(r = check_board_waiter(monitor, &waiter))) {
+        int wait_timeout = ty_task_get_current() ? get_cancel_wait_timeout(timeout, start)
+                                                 : ty_adjust_timeout(timeout, start);
+
+        if (!ty_cond_wait(&waiter.cond, &monitor->refresh_mutex, wait_timeout) &&
+                !ty_adjust_timeout(timeout, start))
+            break;
+
+        if (waiter.woken_at) {
+            ty_histogram_add(&monitor->wakeup_latency, ty_micros() - waiter.woken_at);
+            waiter.woken_at = 0;
+        }
+    }
+
+    for (size_t i = 0; i < monitor->waiters.count; i++) {
+        if (monitor->waiters.values[i] == &waiter) {
+            _hs_array_remove(&monitor->waiters, i, 1);
+            break;
+        }
+    }
+
+cleanup:
+    ty_mutex_unlock(&monitor->refresh_mutex);
+    ty_cond_release(&waiter.cond);
+    return r;
+}
+
+void ty_monitor_get_wakeup_latency(ty_monitor *monitor, ty_histogram *rlatency)
+{
+    assert(monitor);
+    assert(rlatency);
+
+    ty_mutex_lock(&monitor->refresh_mutex);
+    *rlatency = monitor->wakeup_latency;
+    ty_mutex_unlock(&monitor->refresh_mutex);
+}
+
+ty_board *ty_monitor_find_board(ty_monitor *monitor, const char *id)
+{
+    assert(monitor);
+    assert(id);
+
+    _hs_htable_foreach_hash(cur, &monitor->boards_by_id, _hs_htable_hash_str(id)) {
+        ty_board *board = ty_container_of(cur, ty_board, id_hnode);
+
+        if (strcmp(board->id, id) == 0)
+            return board;
+    }
+
+    return NULL;
+}
+
 int ty_monitor_list(ty_monitor *monitor, ty_monitor_callback_func *f, void *udata)
 {
     assert(monitor);
@@ -16,6 +16,7 @@
 TY_C_BEGIN
 
 struct ty_board;
+struct ty_histogram;
 
 typedef struct ty_monitor ty_monitor;
 
@@ -27,6 +28,18 @@ typedef enum ty_monitor_event {
 } ty_monitor_event;
 
 typedef int ty_monitor_callback_func(struct ty_board *board, ty_monitor_event event, void *udata);
+
+typedef struct ty_monitor_batch_event {
+    struct ty_board *board;
+    ty_monitor_event event;
+} ty_monitor_batch_event;
+
+/* Batch callbacks get the boards changed by a refresh (or by ty_monitor_start()) at once,
+   with one event per board summing up the changes: a board that disappeared and came back
+   during the refresh gets a single CHANGED event, and boards added and dropped within
+   the same refresh are skipped. */
+typedef int ty_monitor_batch_func(const ty_monitor_batch_event *events, unsigned int count,
+                                  void *udata);
 typedef int ty_monitor_wait_func(ty_monitor *monitor, void *udata);
 
 int ty_monitor_new(ty_monitor **rmonitor);
@@ -38,13 +51,21 @@ void ty_monitor_stop(ty_monitor *monitor);
 void ty_monitor_get_descriptors(const ty_monitor *monitor, struct ty_descriptor_set *set, int id);
 
 int ty_monitor_register_callback(ty_monitor *monitor, ty_monitor_callback_func *f, void *udata);
+int ty_monitor_register_batch_callback(ty_monitor *monitor, ty_monitor_batch_func *f,
+                                       void *udata);
 void ty_monitor_deregister_callback(ty_monitor *monitor, int id);
 
 int ty_monitor_refresh(ty_monitor *monitor);
 int ty_monitor_wait(ty_monitor *monitor, ty_monitor_wait_func *f, void *udata, int timeout);
 
+// Exact board id lookup, the board is not referenced and may be missing
+struct ty_board *ty_monitor_find_board(ty_monitor *monitor, const char *id);
 int ty_monitor_list(ty_monitor *monitor, ty_monitor_callback_func *f, void *udata);
 
+/* Time between the refresh that makes a board match and the wakeup of threads blocked in
+   ty_board_wait_for(), in microseconds. */
+void ty_monitor_get_wakeup_latency(ty_monitor *monitor, struct ty_histogram *rlatency);
+
 TY_C_END
 
 #endif
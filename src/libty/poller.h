@@ -0,0 +1,59 @@
+/* TyTools - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/tytools
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#ifndef TY_POLLER_H
+#define TY_POLLER_H
+
+#include "common.h"
+#include "system.h"
+
+TY_C_BEGIN
+
+/* Unlike ty_descriptor_set and ty_poll(), the poller keeps descriptors registered between
+   calls and has no fixed size limit. It uses epoll on Linux, and falls back to poll()
+   (select() on macOS) on other POSIX systems. The Windows implementation relies on
+   WaitForMultipleObjects() and is still limited to 64 descriptors. */
+typedef struct ty_poller ty_poller;
+
+enum {
+    /* Report descriptors only when they become ready, callers must then consume everything
+       available. Only supported with epoll, other implementations are level-triggered. */
+    TY_POLLER_EDGE_TRIGGERED = 1
+};
+
+typedef struct ty_poller_event {
+    ty_descriptor desc;
+    int id;
+} ty_poller_event;
+
+int ty_poller_new(ty_poller **rpoller);
+void ty_poller_free(ty_poller *poller);
+
+/* Remove descriptors before closing them. Descriptors that cannot be waited on, such as
+   regular files, are always reported as ready like poll() does (even when edge-triggered). */
+int ty_poller_add(ty_poller *poller, ty_descriptor desc, int id, int flags);
+int ty_poller_add_set(ty_poller *poller, const ty_descriptor_set *set, int flags);
+void ty_poller_remove(ty_poller *poller, int id);
+void ty_poller_clear(ty_poller *poller);
+
+unsigned int ty_poller_get_count(const ty_poller *poller);
+#ifdef __linux__
+/* The epoll descriptor becomes readable when one of the registered descriptors is ready,
+   except for the descriptors that are always ready. */
+void ty_poller_get_descriptors(const ty_poller *poller, ty_descriptor_set *set, int id);
+#endif
+
+// Returns the number of ready descriptors stored in events, 0 on timeout
+int ty_poller_wait(ty_poller *poller, ty_poller_event *events, unsigned int max_events,
+                   int timeout);
+
+TY_C_END
+
+#endif
@@ -0,0 +1,259 @@
+/* TyTools - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/tytools
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#include "common_priv.h"
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../libhs/array.h"
+#include "poller.h"
+
+/* The file behind each descriptor is identified too, because the descriptor may have been
+   closed (and its number reused) by the time it is removed. Closing the last descriptor of
+   a file drops it from the epoll set anyway, and we must not drop someone else's. */
+struct poller_registration {
+    ty_descriptor desc;
+    int id;
+
+    dev_t dev;
+    ino_t ino;
+
+    // Not in the epoll set, see ty_poller_add()
+    bool always_ready;
+};
+
+struct ty_poller {
+    int fd;
+
+    // Kept to support removal by identifier and ty_poller_clear()
+    _HS_ARRAY(struct poller_registration) descriptors;
+    unsigned int always_ready;
+    size_t always_ready_next;
+
+    struct epoll_event *events;
+    unsigned int events_size;
+};
+
+int ty_poller_new(ty_poller **rpoller)
+{
+    assert(rpoller);
+
+    ty_poller *poller;
+    int r;
+
+    poller = calloc(1, sizeof(*poller));
+    if (!poller) {
+        r = ty_error(TY_ERROR_MEMORY, NULL);
+        goto error;
+    }
+
+    poller->fd = epoll_create1(EPOLL_CLOEXEC);
+    if (poller->fd < 0) {
+        r = ty_error(TY_ERROR_SYSTEM, "epoll_create1() failed: %s", strerror(errno));
+        goto error;
+    }
+
+    *rpoller = poller;
+    return 0;
+
+error:
+    ty_poller_free(poller);
+    return r;
+}
+
+void ty_poller_free(ty_poller *poller)
+{
+    if (poller) {
+        close(poller->fd);
+        _hs_array_release(&poller->descriptors);
+        free(poller->events);
+    }
+
+    free(poller);
+}
+
+int ty_poller_add(ty_poller *poller, ty_descriptor desc, int id, int flags)
+{
+    assert(poller);
+    assert(desc >= 0);
+
+    struct poller_registration reg;
+    struct stat sb;
+    struct epoll_event ev = {0};
+    int r;
+
+    if (fstat(desc, &sb) < 0)
+        return ty_error(TY_ERROR_SYSTEM, "fstat() failed: %s", strerror(errno));
+    reg.desc = desc;
+    reg.id = id;
+    reg.dev = sb.st_dev;
+    reg.ino = sb.st_ino;
+    reg.always_ready = false;
+
+    r = _hs_array_push(&poller->descriptors, reg);
+    if (r < 0)
+        return ty_libhs_translate_error(r);
+
+    // Both are 32-bit integers, so events can be reported without any lookup
+    ev.events = EPOLLIN;
+    if (flags & TY_POLLER_EDGE_TRIGGERED)
+        ev.events |= EPOLLET;
+    ev.data.u64 = ((uint64_t)(uint32_t)id << 32) | (uint32_t)desc;
+
+    r = epoll_ctl(poller->fd, EPOLL_CTL_ADD, desc, &ev);
+    if (r < 0) {
+        /* epoll refuses regular files and some devices (e.g. /dev/null), for which poll()
+           always reports data. Do the same, e.g. for a file redirected to stdin. */
+        if (errno == EPERM) {
+            poller->descriptors.values[poller->descriptors.count - 1].always_ready = true;
+            poller->always_ready++;
+            return 0;
+        }
+
+        _hs_array_pop(&poller->descriptors, 1);
+        return ty_error(TY_ERROR_SYSTEM, "epoll_ctl(EPOLL_CTL_ADD) failed: %s", strerror(errno));
+    }
+
+    return 0;
+}
+
+int ty_poller_add_set(ty_poller *poller, const ty_descriptor_set *set, int flags)
+{
+    assert(poller);
+    assert(set);
+
+    int r;
+
+    for (unsigned int i = 0; i < set->count; i++) {
+        r = ty_poller_add(poller, set->desc[i], set->id[i], flags);
+        if (r < 0)
+            return r;
+    }
+
+    return 0;
+}
+
+static void unregister_descriptor(ty_poller *poller, const struct poller_registration *reg)
+{
+    struct stat sb;
+
+    if (reg->always_ready) {
+        poller->always_ready--;
+        return;
+    }
+    if (fstat(reg->desc, &sb) < 0 || sb.st_dev != reg->dev || sb.st_ino != reg->ino)
+        return;
+
+    epoll_ctl(poller->fd, EPOLL_CTL_DEL, reg->desc, NULL);
+}
+
+void ty_poller_remove(ty_poller *poller, int id)
+{
+    assert(poller);
+
+    for (size_t i = 0; i < poller->descriptors.count; i++) {
+        const struct poller_registration *reg = &poller->descriptors.values[i];
+
+        if (reg->id == id) {
+            unregister_descriptor(poller, reg);
+            _hs_array_remove(&poller->descriptors, i--, 1);
+        }
+    }
+}
+
+void ty_poller_clear(ty_poller *poller)
+{
+    assert(poller);
+
+    for (size_t i = 0; i < poller->descriptors.count; i++)
+        unregister_descriptor(poller, &poller->descriptors.values[i]);
+    _hs_array_release(&poller->descriptors);
+    poller->always_ready = 0;
+}
+
+unsigned int ty_poller_get_count(const ty_poller *poller)
+{
+    assert(poller);
+    return (unsigned int)poller->descriptors.count;
+}
+
+void ty_poller_get_descriptors(const ty_poller *poller, ty_descriptor_set *set, int id)
+{
+    assert(poller);
+    assert(set);
+
+    ty_descriptor_set_add(set, poller->fd, id);
+}
+
+int ty_poller_wait(ty_poller *poller, ty_poller_event *events, unsigned int max_events,
+                   int timeout)
+{
+    assert(poller);
+    assert(events);
+    assert(max_events);
+
+    uint64_t start;
+    int r;
+
+    if (max_events > INT_MAX)
+        max_events = INT_MAX;
+    if (max_events > poller->events_size) {
+        struct epoll_event *new_events;
+
+        new_events = realloc(poller->events, max_events * sizeof(*new_events));
+        if (!new_events)
+            return ty_error(TY_ERROR_MEMORY, NULL);
+        poller->events = new_events;
+        poller->events_size = max_events;
+    }
+
+    if (timeout < 0)
+        timeout = -1;
+    if (poller->always_ready)
+        timeout = 0;
+
+    start = ty_millis();
+restart:
+    r = epoll_wait(poller->fd, poller->events, (int)max_events, ty_adjust_timeout(timeout, start));
+    if (r < 0) {
+        if (errno == EINTR)
+            goto restart;
+
+        return ty_error(TY_ERROR_SYSTEM, "epoll_wait() failed: %s", strerror(errno));
+    }
+
+    for (int i = 0; i < r; i++) {
+        uint64_t data = poller->events[i].data.u64;
+
+        events[i].desc = (int)(uint32_t)data;
+        events[i].id = (int)(uint32_t)(data >> 32);
+    }
+
+    // Rotate through the always ready descriptors so that none of them starves
+    if (poller->always_ready && (unsigned int)r < max_events) {
+        size_t count = poller->descriptors.count;
+        size_t first = poller->always_ready_next;
+
+        for (size_t i = 0; i < count && (unsigned int)r < max_events; i++) {
+            size_t idx = (first + i) % count;
+            const struct poller_registration *reg = &poller->descriptors.values[idx];
+
+            if (reg->always_ready) {
+                events[r].desc = reg->desc;
+                events[r].id = reg->id;
+                r++;
+
+                poller->always_ready_next = idx + 1;
+            }
+        }
+    }
+
+    return r;
+}
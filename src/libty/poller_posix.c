@@ -0,0 +1,253 @@
+/* TyTools - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/tytools
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#include "common_priv.h"
+#ifdef __APPLE__
+    #include <sys/select.h>
+#else
+    #include <poll.h>
+#endif
+#include "../libhs/array.h"
+#include "poller.h"
+
+struct ty_poller {
+    _HS_ARRAY(ty_poller_event) descriptors;
+#ifndef __APPLE__
+    // Updated along with descriptors, instead of being rebuilt for each wait
+    _HS_ARRAY(struct pollfd) pfds;
+#endif
+
+    bool *ready;
+    size_t ready_size;
+    // Rotate the scan start so that busy descriptors cannot starve the others
+    size_t next_scan;
+};
+
+int ty_poller_new(ty_poller **rpoller)
+{
+    assert(rpoller);
+
+    ty_poller *poller;
+
+    poller = calloc(1, sizeof(*poller));
+    if (!poller)
+        return ty_error(TY_ERROR_MEMORY, NULL);
+
+    *rpoller = poller;
+    return 0;
+}
+
+void ty_poller_free(ty_poller *poller)
+{
+    if (poller) {
+        _hs_array_release(&poller->descriptors);
+#ifndef __APPLE__
+        _hs_array_release(&poller->pfds);
+#endif
+        free(poller->ready);
+    }
+
+    free(poller);
+}
+
+int ty_poller_add(ty_poller *poller, ty_descriptor desc, int id, int flags)
+{
+    assert(poller);
+    assert(desc >= 0);
+    TY_UNUSED(flags);
+
+    ty_poller_event reg;
+    int r;
+
+#ifdef __APPLE__
+    // poll() does not work with devices on macOS, and select() cannot go beyond FD_SETSIZE
+    if (desc >= FD_SETSIZE)
+        return ty_error(TY_ERROR_RANGE, "Descriptor %d is too high for select()", desc);
+#else
+    struct pollfd pfd = {0};
+
+    pfd.fd = desc;
+    pfd.events = POLLIN;
+
+    r = _hs_array_push(&poller->pfds, pfd);
+    if (r < 0)
+        return ty_libhs_translate_error(r);
+#endif
+
+    reg.desc = desc;
+    reg.id = id;
+
+    r = _hs_array_push(&poller->descriptors, reg);
+    if (r < 0) {
+#ifndef __APPLE__
+        _hs_array_pop(&poller->pfds, 1);
+#endif
+        return ty_libhs_translate_error(r);
+    }
+
+    return 0;
+}
+
+int ty_poller_add_set(ty_poller *poller, const ty_descriptor_set *set, int flags)
+{
+    assert(poller);
+    assert(set);
+
+    int r;
+
+    for (unsigned int i = 0; i < set->count; i++) {
+        r = ty_poller_add(poller, set->desc[i], set->id[i], flags);
+        if (r < 0)
+            return r;
+    }
+
+    return 0;
+}
+
+void ty_poller_remove(ty_poller *poller, int id)
+{
+    assert(poller);
+
+    for (size_t i = 0; i < poller->descriptors.count; i++) {
+        if (poller->descriptors.values[i].id == id) {
+            _hs_array_remove(&poller->descriptors, i, 1);
+#ifndef __APPLE__
+            _hs_array_remove(&poller->pfds, i, 1);
+#endif
+            i--;
+        }
+    }
+}
+
+void ty_poller_clear(ty_poller *poller)
+{
+    assert(poller);
+
+    _hs_array_release(&poller->descriptors);
+#ifndef __APPLE__
+    _hs_array_release(&poller->pfds);
+#endif
+}
+
+unsigned int ty_poller_get_count(const ty_poller *poller)
+{
+    assert(poller);
+    return (unsigned int)poller->descriptors.count;
+}
+
+#ifdef __APPLE__
+
+static int wait_descriptors(ty_poller *poller, bool *ready, int timeout)
+{
+    fd_set fds;
+    int max_fd = -1;
+    uint64_t start;
+    struct timeval tv;
+    int r;
+
+    start = ty_millis();
+restart:
+    FD_ZERO(&fds);
+    for (size_t i = 0; i < poller->descriptors.count; i++) {
+        int fd = poller->descriptors.values[i].desc;
+
+        FD_SET(fd, &fds);
+        max_fd = TY_MAX(max_fd, fd);
+    }
+
+    if (timeout >= 0) {
+        int adjusted_timeout = ty_adjust_timeout(timeout, start);
+        tv.tv_sec = adjusted_timeout / 1000;
+        tv.tv_usec = (adjusted_timeout % 1000) * 1000;
+        r = select(max_fd + 1, &fds, NULL, NULL, &tv);
+    } else {
+        r = select(max_fd + 1, &fds, NULL, NULL, NULL);
+    }
+    if (r < 0) {
+        if (errno == EINTR)
+            goto restart;
+
+        return ty_error(TY_ERROR_SYSTEM, "select() failed: %s", strerror(errno));
+    }
+
+    for (size_t i = 0; i < poller->descriptors.count; i++)
+        ready[i] = FD_ISSET(poller->descriptors.values[i].desc, &fds);
+
+    return r;
+}
+
+#else
+
+static int wait_descriptors(ty_poller *poller, bool *ready, int timeout)
+{
+    uint64_t start;
+    int r;
+
+    if (timeout < 0)
+        timeout = -1;
+
+    start = ty_millis();
+restart:
+    r = poll(poller->pfds.values, (nfds_t)poller->pfds.count, ty_adjust_timeout(timeout, start));
+    if (r < 0) {
+        if (errno == EINTR)
+            goto restart;
+
+        return ty_error(TY_ERROR_SYSTEM, "poll() failed: %s", strerror(errno));
+    }
+
+    for (size_t i = 0; i < poller->pfds.count; i++)
+        ready[i] = poller->pfds.values[i].revents & (POLLIN | POLLERR | POLLHUP | POLLNVAL);
+
+    return r;
+}
+
+#endif
+
+int ty_poller_wait(ty_poller *poller, ty_poller_event *events, unsigned int max_events,
+                   int timeout)
+{
+    assert(poller);
+    assert(events);
+    assert(max_events);
+
+    size_t count = poller->descriptors.count;
+    unsigned int events_count;
+    int r;
+
+    if (!count) {
+        if (timeout)
+            ty_delay(timeout < 0 ? UINT_MAX : (unsigned int)timeout);
+        return 0;
+    }
+
+    if (count > poller->ready_size) {
+        bool *new_ready = realloc(poller->ready, count * sizeof(*new_ready));
+        if (!new_ready)
+            return ty_error(TY_ERROR_MEMORY, NULL);
+        poller->ready = new_ready;
+        poller->ready_size = count;
+    }
+
+    r = wait_descriptors(poller, poller->ready, timeout);
+    if (r <= 0)
+        return r;
+
+    events_count = 0;
+    for (size_t i = 0; i < count && events_count < max_events; i++) {
+        size_t idx = (poller->next_scan + i) % count;
+
+        if (poller->ready[idx])
+            events[events_count++] = poller->descriptors.values[idx];
+    }
+    poller->next_scan = (poller->next_scan + 1) % count;
+
+    return (int)events_count;
+}
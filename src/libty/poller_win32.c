@@ -0,0 +1,136 @@
+/* TyTools - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/tytools
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#include "common_priv.h"
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "poller.h"
+
+struct ty_poller {
+    unsigned int count;
+    HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+    int ids[MAXIMUM_WAIT_OBJECTS];
+};
+
+int ty_poller_new(ty_poller **rpoller)
+{
+    assert(rpoller);
+
+    ty_poller *poller;
+
+    poller = calloc(1, sizeof(*poller));
+    if (!poller)
+        return ty_error(TY_ERROR_MEMORY, NULL);
+
+    *rpoller = poller;
+    return 0;
+}
+
+void ty_poller_free(ty_poller *poller)
+{
+    free(poller);
+}
+
+int ty_poller_add(ty_poller *poller, ty_descriptor desc, int id, int flags)
+{
+    assert(poller);
+    assert(desc);
+    TY_UNUSED(flags);
+
+    if (poller->count >= MAXIMUM_WAIT_OBJECTS)
+        return ty_error(TY_ERROR_RANGE, "Cannot wait on more than %d handles",
+                        MAXIMUM_WAIT_OBJECTS);
+
+    poller->handles[poller->count] = desc;
+    poller->ids[poller->count] = id;
+    poller->count++;
+
+    return 0;
+}
+
+int ty_poller_add_set(ty_poller *poller, const ty_descriptor_set *set, int flags)
+{
+    assert(poller);
+    assert(set);
+
+    int r;
+
+    for (unsigned int i = 0; i < set->count; i++) {
+        r = ty_poller_add(poller, set->desc[i], set->id[i], flags);
+        if (r < 0)
+            return r;
+    }
+
+    return 0;
+}
+
+void ty_poller_remove(ty_poller *poller, int id)
+{
+    assert(poller);
+
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < poller->count; i++) {
+        if (poller->ids[i] != id) {
+            poller->handles[count] = poller->handles[i];
+            poller->ids[count] = poller->ids[i];
+
+            count++;
+        }
+    }
+
+    poller->count = count;
+}
+
+void ty_poller_clear(ty_poller *poller)
+{
+    assert(poller);
+    poller->count = 0;
+}
+
+unsigned int ty_poller_get_count(const ty_poller *poller)
+{
+    assert(poller);
+    return poller->count;
+}
+
+/* Waiting on a handle may reset it (auto-reset events), so we cannot check the other
+   handles after the first one, and only one event is returned each time. */
+int ty_poller_wait(ty_poller *poller, ty_poller_event *events, unsigned int max_events,
+                   int timeout)
+{
+    assert(poller);
+    assert(events);
+    assert(max_events);
+    TY_UNUSED(max_events);
+
+    DWORD ret;
+
+    if (!poller->count) {
+        Sleep(timeout < 0 ? INFINITE : (DWORD)timeout);
+        return 0;
+    }
+
+    ret = WaitForMultipleObjects((DWORD)poller->count, poller->handles, FALSE,
+                                 timeout < 0 ? INFINITE : (DWORD)timeout);
+    switch (ret) {
+        case WAIT_FAILED: {
+            return ty_error(TY_ERROR_SYSTEM, "WaitForMultipleObjects() failed: %s",
+                            ty_win32_strerror(0));
+        } break;
+        case WAIT_TIMEOUT: {
+            return 0;
+        } break;
+    }
+
+    events[0].desc = poller->handles[ret - WAIT_OBJECT_0];
+    events[0].id = poller->ids[ret - WAIT_OBJECT_0];
+
+    return 1;
+}
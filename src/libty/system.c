@@ -62,3 +62,54 @@ void ty_descriptor_set_remove(ty_descriptor_set *set, int id)
 
     set->count = count;
 }
+
+/* Read everything left in fp to a new buffer (free it with free()). The buffer is a private
+   copy, so it stays valid even if the file is truncated or rewritten afterwards. */
+int ty_file_read_all(FILE *fp, const char *filename, size_t max_size, uint8_t **rmem,
+                     size_t *rlen)
+{
+    assert(fp);
+    assert(filename);
+    assert(rmem);
+    assert(rlen);
+
+    uint8_t *mem = NULL;
+    size_t len = 0, alloc_size = 0;
+    int r;
+
+    while (!feof(fp)) {
+        if (len == alloc_size) {
+            uint8_t *tmp;
+
+            alloc_size = alloc_size ? alloc_size * 2 : 128 * 1024;
+            tmp = realloc(mem, alloc_size);
+            if (!tmp) {
+                r = ty_error(TY_ERROR_MEMORY, NULL);
+                goto error;
+            }
+            mem = tmp;
+        }
+
+        len += fread(mem + len, 1, alloc_size - len, fp);
+        if (ferror(fp)) {
+            if (errno == EIO) {
+                r = ty_error(TY_ERROR_IO, "I/O error while reading from '%s'", filename);
+            } else {
+                r = ty_error(TY_ERROR_SYSTEM, "fread('%s') failed: %s", filename, strerror(errno));
+            }
+            goto error;
+        }
+        if (len > max_size) {
+            r = ty_error(TY_ERROR_RANGE, "File '%s' is too big to load", filename);
+            goto error;
+        }
+    }
+
+    *rmem = mem;
+    *rlen = len;
+    return 0;
+
+error:
+    free(mem);
+    return r;
+}
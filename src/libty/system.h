@@ -47,6 +47,14 @@ enum {
     TY_DESCRIPTOR_MODE_FILE = 8
 };
 
+typedef struct ty_file_info {
+    uint64_t size;
+    int64_t mtime; // Nanoseconds since the epoch
+} ty_file_info;
+
+// Return non-zero to stop the listing, ty_directory_list() returns the same value
+typedef int ty_directory_list_func(const char *name, const ty_file_info *info, void *udata);
+
 typedef struct ty_descriptor_set {
     unsigned int count;
     ty_descriptor desc[64];
@@ -63,6 +71,8 @@ char *ty_win32_strerror(unsigned long err);
 #endif
 
 uint64_t ty_millis(void);
+// Monotonic like ty_millis(), for latency measurements
+uint64_t ty_micros(void);
 void ty_delay(unsigned int ms);
 
 int ty_adjust_timeout(int timeout, uint64_t start);
@@ -83,6 +93,14 @@ unsigned int ty_standard_get_paths(ty_standard_path std_path, const char *suffix
 
 int ty_poll(const ty_descriptor_set *set, int timeout);
 
+int ty_file_stat(const char *path, ty_file_info *rinfo);
+int ty_file_get_absolute_path(const char *path, char *buf, size_t size);
+int ty_file_read_all(FILE *fp, const char *filename, size_t max_size, uint8_t **rmem,
+                     size_t *rlen);
+
+int ty_directory_create(const char *path);
+int ty_directory_list(const char *path, ty_directory_list_func *f, void *udata);
+
 bool ty_compare_paths(const char *path1, const char *path2);
 
 int ty_terminal_setup(int flags);
@@ -9,6 +9,7 @@
    See the LICENSE file for more details. */
 
 #include "common_priv.h"
+#include <dirent.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -44,6 +45,15 @@ uint64_t ty_millis(void)
     return (uint64_t)mach_absolute_time() * tb.numer / tb.denom / 1000000;
 }
 
+uint64_t ty_micros(void)
+{
+    static mach_timebase_info_data_t tb;
+    if (!tb.numer)
+        mach_timebase_info(&tb);
+
+    return (uint64_t)mach_absolute_time() * tb.numer / tb.denom / 1000;
+}
+
 #else
 
 uint64_t ty_millis(void)
@@ -61,7 +71,25 @@ uint64_t ty_millis(void)
         return 0;
     }
 
-    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 10000000;
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+uint64_t ty_micros(void)
+{
+    struct timespec ts;
+    int r;
+
+#ifdef CLOCK_MONOTONIC_RAW
+    r = clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+    r = clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    if (r < 0) {
+        ty_log(TY_LOG_WARNING, "clock_gettime() failed: %s", strerror(errno));
+        return 0;
+    }
+
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
 }
 
 #endif
@@ -351,6 +379,125 @@ restart:
 
 #endif
 
+int ty_file_stat(const char *path, ty_file_info *rinfo)
+{
+    assert(path);
+    assert(rinfo);
+
+    struct stat sb;
+
+    if (stat(path, &sb) < 0) {
+        switch (errno) {
+            case EACCES: { return ty_error(TY_ERROR_ACCESS, "Permission denied for '%s'", path); } break;
+            case ENOENT:
+            case ENOTDIR: { return ty_error(TY_ERROR_NOT_FOUND, "File '%s' does not exist", path); } break;
+        }
+        return ty_error(TY_ERROR_SYSTEM, "stat('%s') failed: %s", path, strerror(errno));
+    }
+
+    rinfo->size = (uint64_t)sb.st_size;
+#ifdef __APPLE__
+    rinfo->mtime = (int64_t)sb.st_mtimespec.tv_sec * 1000000000 + sb.st_mtimespec.tv_nsec;
+#else
+    rinfo->mtime = (int64_t)sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+#endif
+
+    return 0;
+}
+
+int ty_file_get_absolute_path(const char *path, char *buf, size_t size)
+{
+    assert(path);
+    assert(buf);
+
+    char *real_path;
+    size_t len;
+
+    real_path = realpath(path, NULL);
+    if (!real_path) {
+        switch (errno) {
+            case ENOMEM: { return ty_error(TY_ERROR_MEMORY, NULL); } break;
+            case EACCES: { return ty_error(TY_ERROR_ACCESS, "Permission denied for '%s'", path); } break;
+            case ENOENT:
+            case ENOTDIR: { return ty_error(TY_ERROR_NOT_FOUND, "File '%s' does not exist", path); } break;
+        }
+        return ty_error(TY_ERROR_SYSTEM, "realpath('%s') failed: %s", path, strerror(errno));
+    }
+
+    len = strlen(real_path);
+    if (len >= size) {
+        free(real_path);
+        return ty_error(TY_ERROR_RANGE, "Path '%s' is too long", path);
+    }
+    memcpy(buf, real_path, len + 1);
+    free(real_path);
+
+    return 0;
+}
+
+// Succeeds if the directory already exists
+int ty_directory_create(const char *path)
+{
+    assert(path);
+
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        switch (errno) {
+            case EACCES: { return ty_error(TY_ERROR_ACCESS, "Permission denied for '%s'", path); } break;
+            case ENOENT:
+            case ENOTDIR: { return ty_error(TY_ERROR_NOT_FOUND, "Cannot create '%s', parent does not exist", path); } break;
+        }
+        return ty_error(TY_ERROR_SYSTEM, "mkdir('%s') failed: %s", path, strerror(errno));
+    }
+
+    return 0;
+}
+
+// Regular files only, files that disappear in the meantime are skipped
+int ty_directory_list(const char *path, ty_directory_list_func *f, void *udata)
+{
+    assert(path);
+    assert(f);
+
+    DIR *dp;
+    struct dirent *ent;
+    int r;
+
+    dp = opendir(path);
+    if (!dp) {
+        switch (errno) {
+            case EACCES: { return ty_error(TY_ERROR_ACCESS, "Permission denied for '%s'", path); } break;
+            case ENOENT:
+            case ENOTDIR: { return ty_error(TY_ERROR_NOT_FOUND, "Directory '%s' does not exist", path); } break;
+        }
+        return ty_error(TY_ERROR_SYSTEM, "opendir('%s') failed: %s", path, strerror(errno));
+    }
+
+    r = 0;
+    while (!r && (ent = readdir(dp))) {
+        char filename[TY_PATH_MAX_SIZE];
+        struct stat sb;
+        ty_file_info info;
+
+        if (snprintf(filename, sizeof(filename), "%s/%s", path, ent->d_name) >=
+                (int)sizeof(filename))
+            continue;
+        if (stat(filename, &sb) < 0 || !S_ISREG(sb.st_mode))
+            continue;
+
+        info.size = (uint64_t)sb.st_size;
+#ifdef __APPLE__
+        info.mtime = (int64_t)sb.st_mtimespec.tv_sec * 1000000000 + sb.st_mtimespec.tv_nsec;
+#else
+        info.mtime = (int64_t)sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+#endif
+
+        r = (*f)(ent->d_name, &info, udata);
+    }
+
+    closedir(dp);
+    return r;
+}
+
 bool ty_compare_paths(const char *path1, const char *path2)
 {
     assert(path1);
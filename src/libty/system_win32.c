@@ -80,11 +80,134 @@ uint64_t ty_millis(void)
     return GetTickCount64_();
 }
 
+uint64_t ty_micros(void)
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    BOOL success TY_POSSIBLY_UNUSED;
+
+    if (!freq.QuadPart) {
+        success = QueryPerformanceFrequency(&freq);
+        assert(success);
+    }
+    success = QueryPerformanceCounter(&now);
+    assert(success);
+
+    return (uint64_t)now.QuadPart / (uint64_t)freq.QuadPart * 1000000 +
+           (uint64_t)now.QuadPart % (uint64_t)freq.QuadPart * 1000000 / (uint64_t)freq.QuadPart;
+}
+
 void ty_delay(unsigned int ms)
 {
     Sleep(ms);
 }
 
+int ty_file_stat(const char *path, ty_file_info *rinfo)
+{
+    assert(path);
+    assert(rinfo);
+
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    uint64_t mtime;
+
+    if (!GetFileAttributesEx(path, GetFileExInfoStandard, &attr)) {
+        switch (GetLastError()) {
+            case ERROR_ACCESS_DENIED: { return ty_error(TY_ERROR_ACCESS, "Permission denied for '%s'", path); } break;
+            case ERROR_FILE_NOT_FOUND:
+            case ERROR_PATH_NOT_FOUND: { return ty_error(TY_ERROR_NOT_FOUND, "File '%s' does not exist", path); } break;
+        }
+        return ty_error(TY_ERROR_SYSTEM, "GetFileAttributesEx('%s') failed: %s", path,
+                        ty_win32_strerror(0));
+    }
+
+    rinfo->size = ((uint64_t)attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+    // FILETIME counts 100ns intervals since January 1, 1601
+    mtime = ((uint64_t)attr.ftLastWriteTime.dwHighDateTime << 32) |
+            attr.ftLastWriteTime.dwLowDateTime;
+    rinfo->mtime = ((int64_t)mtime - 116444736000000000ll) * 100;
+
+    return 0;
+}
+
+int ty_file_get_absolute_path(const char *path, char *buf, size_t size)
+{
+    assert(path);
+    assert(buf);
+
+    DWORD len;
+
+    len = GetFullPathName(path, (DWORD)size, buf, NULL);
+    if (!len)
+        return ty_error(TY_ERROR_SYSTEM, "GetFullPathName('%s') failed: %s", path,
+                        ty_win32_strerror(0));
+    if (len >= size)
+        return ty_error(TY_ERROR_RANGE, "Path '%s' is too long", path);
+
+    return 0;
+}
+
+// Succeeds if the directory already exists
+int ty_directory_create(const char *path)
+{
+    assert(path);
+
+    if (!CreateDirectory(path, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+        switch (GetLastError()) {
+            case ERROR_ACCESS_DENIED: { return ty_error(TY_ERROR_ACCESS, "Permission denied for '%s'", path); } break;
+            case ERROR_PATH_NOT_FOUND: { return ty_error(TY_ERROR_NOT_FOUND, "Cannot create '%s', parent does not exist", path); } break;
+        }
+        return ty_error(TY_ERROR_SYSTEM, "CreateDirectory('%s') failed: %s", path,
+                        ty_win32_strerror(0));
+    }
+
+    return 0;
+}
+
+// Regular files only
+int ty_directory_list(const char *path, ty_directory_list_func *f, void *udata)
+{
+    assert(path);
+    assert(f);
+
+    char pattern[TY_PATH_MAX_SIZE];
+    HANDLE h;
+    WIN32_FIND_DATA data;
+    int r;
+
+    if (snprintf(pattern, sizeof(pattern), "%s\\*", path) >= (int)sizeof(pattern))
+        return ty_error(TY_ERROR_RANGE, "Path '%s' is too long", path);
+
+    h = FindFirstFile(pattern, &data);
+    if (h == INVALID_HANDLE_VALUE) {
+        switch (GetLastError()) {
+            case ERROR_FILE_NOT_FOUND: { return 0; } break;
+            case ERROR_ACCESS_DENIED: { return ty_error(TY_ERROR_ACCESS, "Permission denied for '%s'", path); } break;
+            case ERROR_PATH_NOT_FOUND: { return ty_error(TY_ERROR_NOT_FOUND, "Directory '%s' does not exist", path); } break;
+        }
+        return ty_error(TY_ERROR_SYSTEM, "FindFirstFile('%s') failed: %s", pattern,
+                        ty_win32_strerror(0));
+    }
+
+    r = 0;
+    do {
+        ty_file_info info;
+        uint64_t mtime;
+
+        if (data.dwFileAttributes & (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_DEVICE))
+            continue;
+
+        info.size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+        mtime = ((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) |
+                data.ftLastWriteTime.dwLowDateTime;
+        info.mtime = ((int64_t)mtime - 116444736000000000ll) * 100;
+
+        r = (*f)(data.cFileName, &info, udata);
+    } while (!r && FindNextFile(h, &data));
+
+    FindClose(h);
+    return r;
+}
+
 bool ty_compare_paths(const char *path1, const char *path2)
 {
     assert(path1);
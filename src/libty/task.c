@@ -12,25 +12,153 @@
 #include "../libhs/array.h"
 #include "system.h"
 #include "task.h"
+#include "task_priv.h"
+
+#define MAX_HUB_CONCURRENCY 32
+
+/* Tasks behind the same hub (and the same root port) share the bandwidth and the
+   patience of the hub, HalfKay uploads start to stall when there are too many of them.
+   Each group learns the aggregate throughput it gets for each concurrency level, and
+   uses that to move its limit up (probing) or down. */
+struct hub_group {
+    char *prefix;
+    bool root_port;
+
+    unsigned int running;
+    unsigned int limit;
+
+    // Aggregate throughput (bytes/s) for each concurrency level, 0 until measured
+    double throughput[MAX_HUB_CONCURRENCY + 1];
+};
+
+/* Pending tasks live in a growable ring, indexed by an ever-increasing sequence number
+   that is also stored in the task. Tasks taken out of order (hub throttling, or
+   ty_task_wait() running the task itself) leave a hole that is skipped once it reaches
+   the head. Throttled tasks can keep the head in place for a long time, so the ring gets
+   compacted once holes outnumber the tasks, and lookups only ever walk past live tasks. */
+struct _ty_task_queue {
+    ty_task **tasks;
+    size_t size;
+
+    uint64_t head;
+    uint64_t tail;
+    size_t count;
+};
+
+struct pool_worker {
+    ty_pool *pool;
+    ty_thread thread;
+
+    // Tasks with the same affinity key as the last task this worker has picked up
+    struct _ty_task_queue tasks;
+    const void *affinity;
+};
 
 struct ty_pool {
     int unused_timeout;
     unsigned int max_threads;
 
+    unsigned int max_per_hub;
+    unsigned int max_per_root;
+    _HS_ARRAY(struct hub_group) hub_groups;
+
     ty_mutex mutex;
 
-    _HS_ARRAY(ty_thread) worker_threads;
+    _HS_ARRAY(struct pool_worker *) workers;
     size_t busy_workers;
 
-    _HS_ARRAY(ty_task *) pending_tasks;
+    struct _ty_task_queue pending_tasks;
     ty_cond pending_cond;
 
     bool init;
 };
 
+struct ty_task_group {
+    ty_mutex mutex;
+    ty_cond cond;
+    bool fail_fast;
+
+    _HS_ARRAY(ty_task *) tasks;
+    ty_task_group_status status;
+
+    // Fail-fast cancellations still running, ty_task_group_free() waits for them
+    unsigned int cancel_refs;
+};
+
 static ty_pool *default_pool;
 static TY_THREAD_LOCAL ty_task *current_task;
 
+static int push_queue_task(struct _ty_task_queue *queue, ty_task *task)
+{
+    if (queue->tail - queue->head == queue->size) {
+        size_t new_size = queue->size ? queue->size * 2 : 64;
+        ty_task **new_tasks;
+
+        new_tasks = malloc(new_size * sizeof(*new_tasks));
+        if (!new_tasks)
+            return ty_error(TY_ERROR_MEMORY, NULL);
+        for (uint64_t seq = queue->head; seq < queue->tail; seq++)
+            new_tasks[seq & (new_size - 1)] = queue->tasks[seq & (queue->size - 1)];
+
+        free(queue->tasks);
+        queue->tasks = new_tasks;
+        queue->size = new_size;
+    }
+
+    queue->tasks[queue->tail & (queue->size - 1)] = task;
+    task->queue.queue = queue;
+    task->queue.seq = queue->tail++;
+    queue->count++;
+
+    return 0;
+}
+
+static void compact_queue(struct _ty_task_queue *queue)
+{
+    uint64_t dest = queue->head;
+
+    // Tasks only move towards the head, so nothing gets overwritten before it is moved
+    for (uint64_t seq = queue->head; seq < queue->tail; seq++) {
+        ty_task *task = queue->tasks[seq & (queue->size - 1)];
+
+        if (task) {
+            queue->tasks[dest & (queue->size - 1)] = task;
+            task->queue.seq = dest++;
+        }
+    }
+    queue->tail = dest;
+}
+
+static void take_queue_task(struct _ty_task_queue *queue, ty_task *task)
+{
+    assert(task->queue.queue == queue);
+    assert(queue->tasks[task->queue.seq & (queue->size - 1)] == task);
+
+    queue->tasks[task->queue.seq & (queue->size - 1)] = NULL;
+    task->queue.queue = NULL;
+    queue->count--;
+
+    while (queue->head < queue->tail && !queue->tasks[queue->head & (queue->size - 1)])
+        queue->head++;
+    if (queue->tail - queue->head > 2 * queue->count + 16)
+        compact_queue(queue);
+}
+
+static void release_queue(struct _ty_task_queue *queue)
+{
+    for (uint64_t seq = queue->head; seq < queue->tail; seq++) {
+        ty_task *task = queue->tasks[seq & (queue->size - 1)];
+
+        if (task) {
+            task->queue.queue = NULL;
+            ty_task_unref(task);
+        }
+    }
+    free(queue->tasks);
+
+    memset(queue, 0, sizeof(*queue));
+}
+
 int ty_pool_new(ty_pool **rpool)
 {
     assert(rpool);
@@ -46,6 +174,8 @@ int ty_pool_new(ty_pool **rpool)
 
     pool->max_threads = 16;
     pool->unused_timeout = 10000;
+    pool->max_per_hub = 8;
+    pool->max_per_root = 16;
 
     r = ty_mutex_init(&pool->mutex);
     if (r < 0)
@@ -70,11 +200,9 @@ void ty_pool_free(ty_pool *pool)
         if (pool->init) {
             ty_mutex_lock(&pool->mutex);
 
-            for (size_t i = 0; i < pool->pending_tasks.count; i++) {
-                ty_task *task = pool->pending_tasks.values[i];
-                ty_task_unref(task);
-            }
-            _hs_array_release(&pool->pending_tasks);
+            release_queue(&pool->pending_tasks);
+            for (size_t i = 0; i < pool->workers.count; i++)
+                release_queue(&pool->workers.values[i]->tasks);
             pool->max_threads = 0;
             ty_cond_broadcast(&pool->pending_cond);
 
@@ -84,13 +212,21 @@ void ty_pool_free(ty_pool *pool)
 
             ty_mutex_unlock(&pool->mutex);
 
-            for (size_t i = 0; i < pool->worker_threads.count; i++) {
-                ty_thread *thread = &pool->worker_threads.values[i];
-                ty_thread_join(thread);
+            for (size_t i = 0; i < pool->workers.count; i++) {
+                struct pool_worker *worker = pool->workers.values[i];
+
+                ty_thread_join(&worker->thread);
+                release_queue(&worker->tasks);
+                free(worker);
             }
-            _hs_array_release(&pool->worker_threads);
+            _hs_array_release(&pool->workers);
+            release_queue(&pool->pending_tasks);
         }
 
+        for (size_t i = 0; i < pool->hub_groups.count; i++)
+            free(pool->hub_groups.values[i].prefix);
+        _hs_array_release(&pool->hub_groups);
+
         ty_cond_release(&pool->pending_cond);
         ty_mutex_release(&pool->mutex);
     }
@@ -109,12 +245,12 @@ int ty_pool_set_max_threads(ty_pool *pool, unsigned int max)
 
     if (max > pool->max_threads) {
         size_t need_threads = pool->pending_tasks.count;
-        if (need_threads > (size_t)pool->max_threads - pool->worker_threads.count)
-            need_threads = (size_t)pool->max_threads - pool->worker_threads.count;
+        if (need_threads > (size_t)pool->max_threads - pool->workers.count)
+            need_threads = (size_t)pool->max_threads - pool->workers.count;
         for (size_t i = 0; i < need_threads; i++) {
             r = start_worker_thread(pool);
             if (r < 0) {
-                if (pool->worker_threads.count)
+                if (pool->workers.count)
                     r = 0;
                 goto cleanup;
             }
@@ -152,6 +288,38 @@ int ty_pool_get_idle_timeout(ty_pool *pool)
     return pool->unused_timeout;
 }
 
+void ty_pool_set_hub_limits(ty_pool *pool, unsigned int max_per_hub, unsigned int max_per_root)
+{
+    assert(pool);
+    assert(max_per_hub);
+    assert(max_per_root);
+
+    ty_mutex_lock(&pool->mutex);
+
+    pool->max_per_hub = TY_MIN(max_per_hub, MAX_HUB_CONCURRENCY);
+    pool->max_per_root = max_per_root;
+    for (size_t i = 0; i < pool->hub_groups.count; i++) {
+        struct hub_group *group = &pool->hub_groups.values[i];
+
+        if (!group->root_port && group->limit > pool->max_per_hub)
+            group->limit = pool->max_per_hub;
+    }
+    ty_cond_broadcast(&pool->pending_cond);
+
+    ty_mutex_unlock(&pool->mutex);
+}
+
+void ty_pool_get_hub_limits(ty_pool *pool, unsigned int *rmax_per_hub,
+                            unsigned int *rmax_per_root)
+{
+    assert(pool);
+
+    if (rmax_per_hub)
+        *rmax_per_hub = pool->max_per_hub;
+    if (rmax_per_root)
+        *rmax_per_root = pool->max_per_root;
+}
+
 static void cleanup_default_pool(void)
 {
     ty_pool_free(default_pool);
@@ -225,6 +393,8 @@ void ty_task_unref(ty_task *task)
         if (_ty_refcount_decrease(&task->refcount))
             return;
 
+        free(task->usb.location);
+
         if (task->result_cleanup)
             (*task->result_cleanup)(task->result);
 
@@ -241,16 +411,88 @@ void ty_task_unref(ty_task *task)
     free(task);
 }
 
+/* Canceling a task may finish it right away, which notifies the group, so this must run
+   without the group mutex. Tasks can be added concurrently, hence the locking dance. */
+static void cancel_group_tasks(ty_task_group *group)
+{
+    size_t count;
+
+    ty_mutex_lock(&group->mutex);
+    count = group->tasks.count;
+    ty_mutex_unlock(&group->mutex);
+
+    for (size_t i = 0; i < count; i++) {
+        ty_task *task;
+
+        ty_mutex_lock(&group->mutex);
+        task = ty_task_ref(group->tasks.values[i]);
+        ty_mutex_unlock(&group->mutex);
+
+        ty_task_cancel(task);
+        ty_task_unref(task);
+    }
+}
+
+/* Returns true if the group must be canceled (fail-fast), in which case the caller gets a
+   reference to the group and must drop it with unref_canceled_group(). */
+static bool notify_task_group(ty_task *task)
+{
+    ty_task_group *group = task->group;
+    bool cancel = false;
+
+    ty_mutex_lock(&group->mutex);
+
+    group->status.finished++;
+    // Superseded tasks did not fail, something else does their job
+    if (task->ret == TY_ERROR_CANCELED || task->ret == TY_ERROR_SUPERSEDED) {
+        group->status.canceled++;
+    } else if (task->ret < 0) {
+        group->status.failed++;
+        if (!group->status.ret) {
+            group->status.ret = task->ret;
+            cancel = group->fail_fast;
+        }
+    }
+    if (cancel)
+        group->cancel_refs++;
+    ty_cond_broadcast(&group->cond);
+
+    ty_mutex_unlock(&group->mutex);
+
+    return cancel;
+}
+
+static void unref_canceled_group(ty_task_group *group)
+{
+    ty_mutex_lock(&group->mutex);
+    group->cancel_refs--;
+    ty_cond_broadcast(&group->cond);
+    ty_mutex_unlock(&group->mutex);
+}
+
 static void change_task_status(ty_task *task, ty_task_status status)
 {
+    ty_task_group *cancel_group = NULL;
     ty_message_data msg = {0};
 
+    ty_mutex_lock(&task->mutex);
+
+    /* The group may be freed as soon as its tasks are finished, but ty_task_group_free()
+       checks the status with the task mutex locked so it waits until we're done. */
     task->status = status;
+    if (status == TY_TASK_STATUS_FINISHED && task->group && notify_task_group(task))
+        cancel_group = task->group;
 
-    ty_mutex_lock(&task->mutex);
     ty_cond_broadcast(&task->cond);
     ty_mutex_unlock(&task->mutex);
 
+    /* Cancel hooks take other locks (e.g. board tasks) and may finish other tasks, which
+       sends messages, so don't run them with the task mutex locked. */
+    if (cancel_group) {
+        cancel_group_tasks(cancel_group);
+        unref_canceled_group(cancel_group);
+    }
+
     msg.task = task;
     msg.type = TY_MESSAGE_STATUS;
     msg.u.task.status = status;
@@ -258,34 +500,274 @@ static void change_task_status(ty_task *task, ty_task_status status)
     ty_message(&msg);
 }
 
-static void run_task(ty_task *task)
+/* Locations look like usb-<bus>-<port>-<port>..., the hub is everything but the last port
+   and the root port is the first port after the bus. */
+static size_t get_location_prefix_len(const char *location, bool root_port)
 {
-    assert(task->status <= TY_TASK_STATUS_PENDING);
+    const char *last_sep = NULL;
+    unsigned int seps = 0;
+
+    for (const char *ptr = location; *ptr; ptr++) {
+        if (*ptr == '-') {
+            if (root_port && ++seps == 3)
+                return (size_t)(ptr - location);
+            last_sep = ptr;
+        }
+    }
 
-    ty_task *previous_task;
+    if (root_port)
+        return strlen(location);
+    return last_sep ? (size_t)(last_sep - location) : strlen(location);
+}
 
-    previous_task = current_task;
-    current_task = task;
+// Call with pool->mutex locked
+static struct hub_group *find_hub_group(ty_pool *pool, const char *location, bool root_port)
+{
+    size_t prefix_len = get_location_prefix_len(location, root_port);
+    struct hub_group *group;
+    int r;
+
+    for (size_t i = 0; i < pool->hub_groups.count; i++) {
+        group = &pool->hub_groups.values[i];
+
+        if (group->root_port == root_port && strlen(group->prefix) == prefix_len &&
+                !strncmp(group->prefix, location, prefix_len))
+            return group;
+    }
+
+    r = _hs_array_grow(&pool->hub_groups, 1);
+    if (r < 0)
+        return NULL;
+    group = &pool->hub_groups.values[pool->hub_groups.count];
+    memset(group, 0, sizeof(*group));
+
+    group->prefix = malloc(prefix_len + 1);
+    if (!group->prefix)
+        return NULL;
+    memcpy(group->prefix, location, prefix_len);
+    group->prefix[prefix_len] = 0;
+    group->root_port = root_port;
+    group->limit = root_port ? 0 : TY_MIN(4, pool->max_per_hub);
+
+    pool->hub_groups.count++;
+    return group;
+}
+
+// Call with pool->mutex locked
+static bool find_hub_groups(ty_pool *pool, const char *location, struct hub_group **rhub,
+                            struct hub_group **rroot)
+{
+    // The second call may move the array around, so get the pointers once both exist
+    if (!find_hub_group(pool, location, false) || !find_hub_group(pool, location, true))
+        return false;
+
+    *rhub = find_hub_group(pool, location, false);
+    *rroot = find_hub_group(pool, location, true);
+    return true;
+}
+
+// Call with pool->mutex locked
+static bool admit_task(ty_pool *pool, ty_task *task, bool force)
+{
+    struct hub_group *hub, *root;
+
+    if (!task->usb.location)
+        return true;
+
+    // Don't block tasks forever because we're out of memory
+    if (!find_hub_groups(pool, task->usb.location, &hub, &root))
+        return true;
+
+    if (!force && (hub->running >= hub->limit || root->running >= pool->max_per_root))
+        return false;
+
+    hub->running++;
+    root->running++;
+    task->usb.start = ty_millis();
+    task->usb.concurrency = TY_MIN(hub->running, MAX_HUB_CONCURRENCY);
+
+    return true;
+}
+
+// Call with pool->mutex locked
+static void learn_hub_throughput(ty_pool *pool, struct hub_group *hub, const ty_task *task)
+{
+    uint64_t duration = ty_millis() - task->usb.start;
+    unsigned int level = task->usb.concurrency;
+    double throughput;
+
+    if (!task->usb.transferred || !duration)
+        return;
+
+    throughput = (double)task->usb.transferred * 1000.0 / (double)duration * level;
+    if (hub->throughput[level]) {
+        hub->throughput[level] = 0.7 * hub->throughput[level] + 0.3 * throughput;
+    } else {
+        hub->throughput[level] = throughput;
+    }
+
+    // Only saturated runs tell us something about the limit
+    if (level != hub->limit)
+        return;
+
+    if (hub->limit > 1 && hub->throughput[hub->limit - 1] &&
+            hub->throughput[hub->limit] < hub->throughput[hub->limit - 1] * 1.05) {
+        hub->limit--;
+    } else if (hub->limit < pool->max_per_hub && (!hub->throughput[hub->limit + 1] ||
+               hub->throughput[hub->limit + 1] > hub->throughput[hub->limit] * 1.05)) {
+        hub->limit++;
+    }
+}
+
+static void release_task(ty_pool *pool, ty_task *task)
+{
+    struct hub_group *hub, *root;
+
+    ty_mutex_lock(&pool->mutex);
+
+    if (find_hub_groups(pool, task->usb.location, &hub, &root)) {
+        hub->running--;
+        root->running--;
+        learn_hub_throughput(pool, hub, task);
+    }
+    task->usb.concurrency = 0;
 
+    ty_cond_broadcast(&pool->pending_cond);
+    ty_mutex_unlock(&pool->mutex);
+}
+
+void _ty_task_begin(ty_task *task)
+{
+    assert(task->status <= TY_TASK_STATUS_PENDING);
     change_task_status(task, TY_TASK_STATUS_RUNNING);
-    task->ret = (*task->task_run)(task);
+}
+
+void _ty_task_end(ty_task *task, int ret)
+{
+    assert(task->status == TY_TASK_STATUS_RUNNING);
+
+    task->ret = ret;
     if (task->task_finalize) {
         (*task->task_finalize)(task);
         task->task_finalize = NULL;
     }
+    if (task->usb.concurrency)
+        release_task(task->pool, task);
     change_task_status(task, TY_TASK_STATUS_FINISHED);
+}
+
+ty_task *_ty_task_swap_current(ty_task *task)
+{
+    ty_task *previous_task = current_task;
+    current_task = task;
+    return previous_task;
+}
+
+static void run_task(ty_task *task)
+{
+    ty_task *previous_task;
+    int ret;
+
+    previous_task = _ty_task_swap_current(task);
+
+    _ty_task_begin(task);
+    ret = _ty_task_check_canceled();
+    if (!ret)
+        ret = (*task->task_run)(task);
+    _ty_task_end(task, ret);
+
+    _ty_task_swap_current(previous_task);
+}
+
+// Call with pool->mutex locked
+static ty_task *take_admissible_task(ty_pool *pool, struct _ty_task_queue *queue)
+{
+    for (uint64_t seq = queue->head; seq < queue->tail; seq++) {
+        ty_task *task = queue->tasks[seq & (queue->size - 1)];
+
+        if (task && admit_task(pool, task, false)) {
+            take_queue_task(queue, task);
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+/* Call with pool->mutex locked. Tasks that could not be handed over to the pool end up
+   in orphans, finish them with finish_orphan_tasks() once the mutex is unlocked. */
+static void stop_worker(struct pool_worker *worker, struct _ty_task_queue *orphans)
+{
+    ty_pool *pool = worker->pool;
+    struct _ty_task_queue *tasks = &worker->tasks;
+
+    // Don't lose tasks queued for this worker, someone else will have to run them
+    for (uint64_t seq = tasks->head; seq < tasks->tail; seq++) {
+        ty_task *task = tasks->tasks[seq & (tasks->size - 1)];
+
+        if (task) {
+            if (push_queue_task(&pool->pending_tasks, task) < 0)
+                break;
+
+            tasks->tasks[seq & (tasks->size - 1)] = NULL;
+            tasks->count--;
+        }
+        tasks->head = seq + 1;
+    }
+    worker->affinity = NULL;
+
+    // Nobody will run the tasks left, and ty_task_wait() must not try to take them anymore
+    *orphans = *tasks;
+    for (uint64_t seq = orphans->head; seq < orphans->tail; seq++) {
+        ty_task *task = orphans->tasks[seq & (orphans->size - 1)];
+
+        if (task)
+            task->queue.queue = NULL;
+    }
+    memset(tasks, 0, sizeof(*tasks));
+
+    if (pool->init) {
+        for (size_t i = 0; i < pool->workers.count; i++) {
+            if (pool->workers.values[i] == worker) {
+                pool->workers.values[i] = pool->workers.values[pool->workers.count - 1];
+                _hs_array_pop(&pool->workers, 1);
+                break;
+            }
+        }
+
+        ty_thread_detach(&worker->thread);
+        release_queue(&worker->tasks);
+        free(worker);
+
+        ty_cond_broadcast(&pool->pending_cond);
+    }
+}
 
-    current_task = previous_task;
+static void finish_orphan_tasks(struct _ty_task_queue *orphans)
+{
+    // At least release the waiters
+    for (uint64_t seq = orphans->head; seq < orphans->tail; seq++) {
+        ty_task *task = orphans->tasks[seq & (orphans->size - 1)];
+
+        if (task) {
+            _ty_task_begin(task);
+            _ty_task_end(task, TY_ERROR_MEMORY);
+            ty_task_unref(task);
+        }
+    }
+    free(orphans->tasks);
 }
 
 static int worker_thread_main(void *udata)
 {
-    ty_pool *pool = udata;
+    struct pool_worker *worker = udata;
+    ty_pool *pool = worker->pool;
+    struct _ty_task_queue orphans;
 
     while (true) {
         uint64_t start;
         bool run;
-        ty_task *task;
+        ty_task *task = NULL;
 
         ty_mutex_lock(&pool->mutex);
         pool->busy_workers--;
@@ -293,15 +775,25 @@ static int worker_thread_main(void *udata)
         run = true;
         start = ty_millis();
         while (true) {
-            if (pool->worker_threads.count > pool->max_threads)
+            if (pool->workers.count > pool->max_threads)
                 goto timeout;
-            if (pool->pending_tasks.count) {
-                task = pool->pending_tasks.values[0];
-                _hs_array_remove(&pool->pending_tasks, 0, 1);
+
+            task = take_admissible_task(pool, &worker->tasks);
+            if (!task) {
+                task = take_admissible_task(pool, &pool->pending_tasks);
+                if (task)
+                    worker->affinity = task->affinity;
+            }
+            if (task)
                 break;
+            /* Throttled tasks need someone to run them once a slot frees up. Past the timeout,
+               wait for release_task() to wake us up instead of spinning. */
+            if (!run) {
+                if (!pool->pending_tasks.count && !worker->tasks.count)
+                    goto timeout;
+                ty_cond_wait(&pool->pending_cond, &pool->mutex, -1);
+                continue;
             }
-            if (!run)
-                goto timeout;
 
             run = ty_cond_wait(&pool->pending_cond, &pool->mutex,
                                ty_adjust_timeout(pool->unused_timeout, start));
@@ -315,53 +807,76 @@ static int worker_thread_main(void *udata)
     }
 
 timeout:
-    if (pool->init) {
-        for (size_t i = 0; i < pool->worker_threads.count; i++) {
-            ty_thread *thread = &pool->worker_threads.values[i];
-            if (thread->thread_id == ty_thread_get_self_id()) {
-                ty_thread_detach(thread);
-                pool->worker_threads.values[i] =
-                    pool->worker_threads.values[pool->worker_threads.count - 1];
-                _hs_array_pop(&pool->worker_threads, 1);
-                break;
-            }
-        }
-    }
+    stop_worker(worker, &orphans);
     ty_mutex_unlock(&pool->mutex);
 
+    finish_orphan_tasks(&orphans);
+
     return 0;
 }
 
 // Call with pool->mutex locked
 static int start_worker_thread(ty_pool *pool)
 {
-    ty_thread *thread;
+    struct pool_worker *worker;
     int r;
 
     // Can't handle failure after ty_thread_create() so grow the array first
-    r = _hs_array_grow(&pool->worker_threads, 1);
+    r = _hs_array_grow(&pool->workers, 1);
     if (r < 0)
         return ty_libhs_translate_error(r);
-    thread = &pool->worker_threads.values[pool->worker_threads.count];
 
-    r = ty_thread_create(thread, worker_thread_main, pool);
-    if (r < 0)
+    worker = calloc(1, sizeof(*worker));
+    if (!worker)
+        return ty_error(TY_ERROR_MEMORY, NULL);
+    worker->pool = pool;
+
+    r = ty_thread_create(&worker->thread, worker_thread_main, worker);
+    if (r < 0) {
+        free(worker);
         return r;
+    }
 
-    pool->worker_threads.count++;
+    pool->workers.values[pool->workers.count++] = worker;
     pool->busy_workers++;
 
     return 0;
 }
 
-int ty_task_start(ty_task *task)
+// Call with pool->mutex locked
+static struct pool_worker *find_affine_worker(ty_pool *pool, const void *affinity)
 {
-    assert(task);
-    assert(task->status == TY_TASK_STATUS_READY);
+    if (!affinity)
+        return NULL;
+
+    for (size_t i = 0; i < pool->workers.count; i++) {
+        struct pool_worker *worker = pool->workers.values[i];
+
+        if (worker->affinity == affinity)
+            return worker;
+    }
+
+    return NULL;
+}
+
+int _ty_task_submit(ty_task *task)
+{
+    assert(task->status <= TY_TASK_STATUS_PENDING);
 
     ty_pool *pool;
+    struct pool_worker *worker;
     int r;
 
+    if (task->task_start) {
+        if (task->status < TY_TASK_STATUS_PENDING)
+            change_task_status(task, TY_TASK_STATUS_PENDING);
+
+        r = (*task->task_start)(task);
+        if (r < 0)
+            task->status = TY_TASK_STATUS_READY;
+        return r;
+    }
+
     if (!task->pool) {
         r = ty_pool_get_default(&task->pool);
         if (r < 0)
@@ -371,22 +886,32 @@ int ty_task_start(ty_task *task)
 
     ty_mutex_lock(&pool->mutex);
 
-    if (pool->busy_workers == pool->worker_threads.count &&
-            pool->worker_threads.count < pool->max_threads) {
-        r = start_worker_thread(pool);
+    worker = find_affine_worker(pool, task->affinity);
+    if (worker) {
+        r = push_queue_task(&worker->tasks, task);
         if (r < 0)
             goto cleanup;
-    }
 
-    r = _hs_array_push(&pool->pending_tasks, task);
-    if (r < 0) {
-        r = ty_libhs_translate_error(r);
-        goto cleanup;
+        // All workers wait on the same condition variable, make sure this one wakes up
+        ty_cond_broadcast(&pool->pending_cond);
+    } else {
+        if (pool->busy_workers == pool->workers.count &&
+                pool->workers.count < pool->max_threads) {
+            r = start_worker_thread(pool);
+            if (r < 0)
+                goto cleanup;
+        }
+
+        r = push_queue_task(&pool->pending_tasks, task);
+        if (r < 0)
+            goto cleanup;
+
+        ty_cond_signal(&pool->pending_cond);
     }
     ty_task_ref(task);
-    ty_cond_signal(&pool->pending_cond);
 
-    change_task_status(task, TY_TASK_STATUS_PENDING);
+    if (task->status < TY_TASK_STATUS_PENDING)
+        change_task_status(task, TY_TASK_STATUS_PENDING);
 
     r = 0;
 cleanup:
@@ -394,6 +919,42 @@ cleanup:
     return r;
 }
 
+// Returns 1 if the task can run now, 0 if it has been queued by task_claim
+static int claim_task(ty_task *task)
+{
+    int r;
+
+    if (!task->task_claim)
+        return 1;
+
+    change_task_status(task, TY_TASK_STATUS_PENDING);
+
+    r = (*task->task_claim)(task);
+    if (r < 0)
+        task->status = TY_TASK_STATUS_READY;
+    return r;
+}
+
+int ty_task_start(ty_task *task)
+{
+    assert(task);
+    assert(task->status == TY_TASK_STATUS_READY);
+
+    int r;
+
+    r = claim_task(task);
+    if (r <= 0)
+        return r;
+
+    r = _ty_task_submit(task);
+    if (r < 0 && task->task_claim) {
+        // Other tasks may be queued behind this one, finish it to release them
+        _ty_task_begin(task);
+        _ty_task_end(task, r);
+    }
+    return r;
+}
+
 int ty_task_wait(ty_task *task, ty_task_status status, int timeout)
 {
     assert(task);
@@ -405,19 +966,24 @@ int ty_task_wait(ty_task *task, ty_task_status status, int timeout)
     /* If the caller wants to wait until the task has finished without timing out, try
        to execute the task in this thread if it's not running already. */
     if (status == TY_TASK_STATUS_FINISHED && timeout < 0) {
-        if (task->status == TY_TASK_STATUS_PENDING) {
+        if (task->status == TY_TASK_STATUS_READY && task->task_claim) {
+            r = claim_task(task);
+            if (r < 0)
+                return r;
+            if (r) {
+                run_task(task);
+                return 1;
+            }
+        } else if (task->status == TY_TASK_STATUS_PENDING && task->pool && !task->task_start) {
             ty_pool *pool = task->pool;
 
             ty_mutex_lock(&pool->mutex);
-            if (task->status == TY_TASK_STATUS_PENDING) {
-                for (size_t i = 0; i < pool->pending_tasks.count; i++) {
-                    if (pool->pending_tasks.values[i] == task) {
-                        _hs_array_remove(&pool->pending_tasks, i, 1);
-                        break;
-                    }
-                }
+            if (task->status == TY_TASK_STATUS_PENDING && task->queue.queue) {
+                take_queue_task(task->queue.queue, task);
                 ty_task_unref(task);
 
+                // Running it here must still count against the hub limits
+                admit_task(pool, task, true);
                 task->status = TY_TASK_STATUS_READY;
             }
             ty_mutex_unlock(&pool->mutex);
@@ -460,3 +1026,202 @@ ty_task *ty_task_get_current(void)
 {
     return current_task;
 }
+
+void ty_task_cancel(ty_task *task)
+{
+    assert(task);
+
+    _ty_atomic_store(&task->canceled, 1);
+
+    // Don't wait for tasks that are queued behind something else to get their turn
+    if (task->task_cancel && task->status == TY_TASK_STATUS_PENDING)
+        (*task->task_cancel)(task);
+}
+
+bool ty_task_is_canceled(const ty_task *task)
+{
+    assert(task);
+    return _ty_atomic_load(&task->canceled);
+}
+
+int _ty_task_check_canceled(void)
+{
+    if (current_task && _ty_atomic_load(&current_task->canceled))
+        return ty_error(TY_ERROR_CANCELED, "Task '%s' was canceled", current_task->name);
+
+    return 0;
+}
+
+int ty_task_group_new(ty_task_group **rgroup)
+{
+    assert(rgroup);
+
+    ty_task_group *group;
+    int r;
+
+    group = calloc(1, sizeof(*group));
+    if (!group)
+        return ty_error(TY_ERROR_MEMORY, NULL);
+
+    r = ty_mutex_init(&group->mutex);
+    if (r < 0)
+        goto error;
+    r = ty_cond_init(&group->cond);
+    if (r < 0)
+        goto error;
+
+    *rgroup = group;
+    return 0;
+
+error:
+    ty_mutex_release(&group->mutex);
+    free(group);
+    return r;
+}
+
+void ty_task_group_free(ty_task_group *group)
+{
+    if (group) {
+        ty_task_group_cancel(group);
+
+        for (size_t i = 0; i < group->tasks.count; i++) {
+            ty_task *task = group->tasks.values[i];
+
+            // Canceled tasks that have not started yet end right away
+            if (task->status > TY_TASK_STATUS_READY)
+                ty_task_wait(task, TY_TASK_STATUS_FINISHED, -1);
+        }
+
+        // Finished tasks may still be canceling the others (fail-fast)
+        ty_mutex_lock(&group->mutex);
+        while (group->cancel_refs)
+            ty_cond_wait(&group->cond, &group->mutex, -1);
+        ty_mutex_unlock(&group->mutex);
+
+        for (size_t i = 0; i < group->tasks.count; i++) {
+            ty_task *task = group->tasks.values[i];
+
+            task->group = NULL;
+            ty_task_unref(task);
+        }
+        _hs_array_release(&group->tasks);
+
+        ty_cond_release(&group->cond);
+        ty_mutex_release(&group->mutex);
+    }
+
+    free(group);
+}
+
+void ty_task_group_set_fail_fast(ty_task_group *group, bool fail_fast)
+{
+    assert(group);
+
+    ty_mutex_lock(&group->mutex);
+    group->fail_fast = fail_fast;
+    ty_mutex_unlock(&group->mutex);
+}
+
+int ty_task_group_add(ty_task_group *group, ty_task *task)
+{
+    assert(group);
+    assert(task);
+    assert(task->status == TY_TASK_STATUS_READY);
+    assert(!task->group);
+
+    int r;
+
+    ty_mutex_lock(&group->mutex);
+
+    r = _hs_array_push(&group->tasks, task);
+    if (r < 0) {
+        r = ty_libhs_translate_error(r);
+        goto cleanup;
+    }
+    ty_task_ref(task);
+    task->group = group;
+    group->status.count++;
+
+    r = 0;
+cleanup:
+    ty_mutex_unlock(&group->mutex);
+    return r;
+}
+
+int ty_task_group_start(ty_task_group *group)
+{
+    assert(group);
+
+    int ret = 0;
+
+    for (size_t i = 0; i < group->tasks.count; i++) {
+        ty_task *task = group->tasks.values[i];
+        int r;
+
+        if (task->status != TY_TASK_STATUS_READY)
+            continue;
+
+        r = ty_task_start(task);
+        if (r < 0) {
+            // Tasks that could not start count as failed, unless they finished anyway
+            if (task->status != TY_TASK_STATUS_FINISHED) {
+                task->ret = r;
+                notify_task_group(task);
+            }
+            if (!ret)
+                ret = r;
+        }
+    }
+
+    return ret;
+}
+
+void ty_task_group_cancel(ty_task_group *group)
+{
+    assert(group);
+    cancel_group_tasks(group);
+}
+
+int ty_task_group_wait(ty_task_group *group, int timeout)
+{
+    assert(group);
+
+    uint64_t start;
+    int r;
+
+    ty_mutex_lock(&group->mutex);
+    start = ty_millis();
+    while (group->status.finished < group->status.count) {
+        if (!ty_cond_wait(&group->cond, &group->mutex, ty_adjust_timeout(timeout, start)))
+            break;
+    }
+    r = group->status.finished >= group->status.count;
+    ty_mutex_unlock(&group->mutex);
+
+    return r;
+}
+
+int ty_task_group_join(ty_task_group *group)
+{
+    assert(group);
+
+    ty_task_group_start(group);
+    ty_task_group_wait(group, -1);
+
+    if (group->status.ret)
+        return group->status.ret;
+    if (group->status.canceled)
+        return ty_error(TY_ERROR_CANCELED, "%u of %u tasks were canceled",
+                        group->status.canceled, group->status.count);
+    return 0;
+}
+
+void ty_task_group_get_status(ty_task_group *group, ty_task_group_status *rstatus)
+{
+    assert(group);
+    assert(rstatus);
+
+    ty_mutex_lock(&group->mutex);
+    *rstatus = group->status;
+    ty_mutex_unlock(&group->mutex);
+}
@@ -12,6 +12,7 @@
 #define TY_TASK_H
 
 #include "common.h"
+#include "board.h"
 #include "thread.h"
 
 TY_C_BEGIN
@@ -20,6 +21,7 @@ struct ty_board;
 struct ty_firmware;
 
 typedef struct ty_pool ty_pool;
+typedef struct ty_task_group ty_task_group;
 
 typedef struct ty_task {
     unsigned int refcount;
@@ -37,18 +39,63 @@ typedef struct ty_task {
     void *result;
     void (*result_cleanup)(void *result);
 
+    // Set (atomically) by ty_task_cancel(), long operations check it and stop early
+    unsigned int canceled;
+    ty_task_group *group;
+
     int (*task_run)(struct ty_task *task);
     void (*task_finalize)(struct ty_task *task);
+    // Hand the task to something else than the pool, task_run is still used by ty_task_join()
+    int (*task_start)(struct ty_task *task);
+    /* Tasks that must wait for other tasks (e.g. on the same board) are claimed before they
+       start or run in ty_task_join(). Return 1 to go ahead, or 0 if the task has been queued
+       and will be handed over with _ty_task_submit() later. */
+    int (*task_claim)(struct ty_task *task);
+    // Called by ty_task_cancel() on pending tasks, to finish the ones that have been queued
+    void (*task_cancel)(struct ty_task *task);
+
+    /* Tasks with a USB location are throttled by the pool, so that only a few of them run
+       at the same time behind each hub (see ty_pool_set_hub_limits()). Set transferred
+       when the task ends, the pool uses it to learn how much each hub can take. */
+    struct {
+        char *location;
+        uint64_t transferred;
+
+        // Managed by the pool
+        uint64_t start;
+        unsigned int concurrency;
+    } usb;
+
+    /* Tasks with the same affinity key (e.g. the board) are sent to the worker thread that
+       picked up the last one, if it is still around, and run in order there. */
+    const void *affinity;
+
+    // Used by ty_progress() for the messages of this task
+    ty_progress_state progress;
+
+    // Managed by the pool
+    struct {
+        struct _ty_task_queue *queue;
+        uint64_t seq;
+    } queue;
 
     ty_mutex mutex;
     ty_cond cond;
 
     union {
+        // Board tasks (below) all start with the board
+        struct {
+            struct ty_board *board;
+        } board_task;
+
         struct {
             struct ty_board *board;
             struct ty_firmware **fws;
             unsigned int fws_count;
             int flags;
+
+            // Set by the task, valid once it is finished
+            ty_upload_report report;
         } upload;
 
         struct {
@@ -81,6 +128,9 @@ int ty_pool_set_max_threads(ty_pool *pool, unsigned int max);
 unsigned int ty_pool_get_max_threads(ty_pool *pool);
 void ty_pool_set_idle_timeout(ty_pool *pool, int timeout);
 int ty_pool_get_idle_timeout(ty_pool *pool);
+void ty_pool_set_hub_limits(ty_pool *pool, unsigned int max_per_hub, unsigned int max_per_root);
+void ty_pool_get_hub_limits(ty_pool *pool, unsigned int *rmax_per_hub,
+                            unsigned int *rmax_per_root);
 
 int ty_pool_get_default(ty_pool **rpool);
 
@@ -95,6 +145,39 @@ int ty_task_join(ty_task *task);
 
 ty_task *ty_task_get_current(void);
 
+/* Cancellation is cooperative: the task fails with TY_ERROR_CANCELED if it has not started
+   yet, or when it reaches the next check (between upload blocks, serial writes, or while
+   waiting for the board). */
+void ty_task_cancel(ty_task *task);
+bool ty_task_is_canceled(const ty_task *task);
+
+typedef struct ty_task_group_status {
+    unsigned int count;
+    unsigned int finished;
+    unsigned int failed;
+    // Superseded tasks (TY_ERROR_SUPERSEDED) count as canceled
+    unsigned int canceled;
+
+    // Error code of the first task that failed (other than cancellation), or 0
+    int ret;
+} ty_task_group_status;
+
+int ty_task_group_new(ty_task_group **rgroup);
+// Unfinished tasks are canceled, and this waits for the running ones to stop
+void ty_task_group_free(ty_task_group *group);
+
+// With fail_fast, the first failure cancels every other task of the group
+void ty_task_group_set_fail_fast(ty_task_group *group, bool fail_fast);
+
+int ty_task_group_add(ty_task_group *group, ty_task *task);
+int ty_task_group_start(ty_task_group *group);
+void ty_task_group_cancel(ty_task_group *group);
+
+// Returns 1 once every task has finished, 0 on timeout
+int ty_task_group_wait(ty_task_group *group, int timeout);
+int ty_task_group_join(ty_task_group *group);
+void ty_task_group_get_status(ty_task_group *group, ty_task_group_status *rstatus);
+
 TY_C_END
 
 #endif
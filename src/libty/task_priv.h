@@ -0,0 +1,35 @@
+/* TyTools - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/tytools
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#ifndef TY_TASK_PRIV_H
+#define TY_TASK_PRIV_H
+
+#include "common_priv.h"
+#include "task.h"
+
+TY_C_BEGIN
+
+/* For code that runs tasks outside of the pool (with task->task_start), these change
+   the task status and send the messages exactly like the pool does. */
+void _ty_task_begin(ty_task *task);
+void _ty_task_end(ty_task *task, int ret);
+
+// Start a pending task once task_claim has let it go, with task_start or in the pool
+int _ty_task_submit(ty_task *task);
+
+// Fails with TY_ERROR_CANCELED if the current task has been canceled
+int _ty_task_check_canceled(void);
+
+// Messages are attributed to the current task, returns the previous one
+ty_task *_ty_task_swap_current(ty_task *task);
+
+TY_C_END
+
+#endif
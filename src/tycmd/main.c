@@ -13,6 +13,7 @@
     #include <sys/wait.h>
 #endif
 #include "../libhs/common.h"
+#include "../libty/firmware.h"
 #include "../libty/system.h"
 #include "main.h"
 
@@ -39,7 +40,8 @@ static const struct command commands[] = {
 
 const char *tycmd_executable_name;
 
-static const char *main_board_tag = NULL;
+static const char *main_board_tags[64];
+static unsigned int main_board_tags_count;
 
 static ty_monitor *main_board_monitor;
 static ty_board *main_board;
@@ -74,6 +76,7 @@ void print_common_options(FILE *f)
                "       --help               Show help message\n"
                "       --version            Display version information\n\n"
                "   -B, --board <tag>        Work with board <tag> instead of first detected\n"
+               "                            Repeat to select multiple boards (upload)\n"
                "   -q, --quiet              Disable output, use -qqq to silence errors\n");
 }
 
@@ -82,6 +85,19 @@ static inline unsigned int get_board_priority(ty_board *board)
     return ty_models[ty_board_get_model(board)].priority;
 }
 
+static bool board_matches_tags(ty_board *board)
+{
+    if (!main_board_tags_count)
+        return true;
+
+    for (unsigned int i = 0; i < main_board_tags_count; i++) {
+        if (ty_board_matches_tag(board, main_board_tags[i]))
+            return true;
+    }
+
+    return false;
+}
+
 static int board_callback(ty_board *board, ty_monitor_event event, void *udata)
 {
     TY_UNUSED(udata);
@@ -89,7 +105,7 @@ static int board_callback(ty_board *board, ty_monitor_event event, void *udata)
     switch (event) {
         case TY_MONITOR_EVENT_ADDED: {
             if ((!main_board || get_board_priority(board) > get_board_priority(main_board))
-                    && ty_board_matches_tag(board, main_board_tag)) {
+                    && board_matches_tags(board)) {
                 ty_board_unref(main_board);
                 main_board = ty_board_ref(board);
             }
@@ -155,8 +171,10 @@ int get_board(ty_board **rboard)
         return r;
 
     if (!main_board) {
-        if (main_board_tag) {
-            return ty_error(TY_ERROR_NOT_FOUND, "Board '%s' not found", main_board_tag);
+        if (main_board_tags_count == 1) {
+            return ty_error(TY_ERROR_NOT_FOUND, "Board '%s' not found", main_board_tags[0]);
+        } else if (main_board_tags_count) {
+            return ty_error(TY_ERROR_NOT_FOUND, "No matching board available");
         } else {
             return ty_error(TY_ERROR_NOT_FOUND, "No board available");
         }
@@ -166,14 +184,130 @@ int get_board(ty_board **rboard)
     return 0;
 }
 
+unsigned int get_board_tags_count(void)
+{
+    return main_board_tags_count;
+}
+
+struct list_boards_context {
+    const char *tag;
+    bool all;
+
+    ty_board **boards;
+    unsigned int boards_count;
+    unsigned int max_boards;
+
+    ty_board *best_board;
+};
+
+static int add_board(struct list_boards_context *ctx, ty_board *board)
+{
+    for (unsigned int i = 0; i < ctx->boards_count; i++) {
+        if (ctx->boards[i] == board)
+            return 0;
+    }
+
+    if (ctx->boards_count == ctx->max_boards) {
+        ty_board **new_boards;
+        unsigned int new_max;
+
+        new_max = ctx->max_boards ? ctx->max_boards * 2 : 16;
+        new_boards = realloc(ctx->boards, new_max * sizeof(*new_boards));
+        if (!new_boards)
+            return ty_error(TY_ERROR_MEMORY, NULL);
+        ctx->boards = new_boards;
+        ctx->max_boards = new_max;
+    }
+    ctx->boards[ctx->boards_count++] = ty_board_ref(board);
+
+    return 0;
+}
+
+static int list_boards_callback(ty_board *board, ty_monitor_event event, void *udata)
+{
+    TY_UNUSED(event);
+
+    struct list_boards_context *ctx = udata;
+
+    if (ctx->all) {
+        if (!board_matches_tags(board))
+            return 0;
+        return add_board(ctx, board);
+    } else {
+        if (ty_board_matches_tag(board, ctx->tag) && (!ctx->best_board ||
+                get_board_priority(board) > get_board_priority(ctx->best_board)))
+            ctx->best_board = board;
+        return 0;
+    }
+}
+
+/* With all set, this lists every board matching one of the --board tags (or every
+   board if there are none). Otherwise, each tag must match a board. */
+int get_boards(bool all, ty_board ***rboards, unsigned int *rcount)
+{
+    struct list_boards_context ctx = {0};
+    int r;
+
+    r = init_monitor();
+    if (r < 0)
+        return r;
+
+    if (all) {
+        ctx.all = true;
+
+        r = ty_monitor_list(main_board_monitor, list_boards_callback, &ctx);
+        if (r < 0)
+            goto error;
+        if (!ctx.boards_count) {
+            r = ty_error(TY_ERROR_NOT_FOUND, "No board available");
+            goto error;
+        }
+    } else {
+        for (unsigned int i = 0; i < main_board_tags_count; i++) {
+            ctx.tag = main_board_tags[i];
+            ctx.best_board = NULL;
+
+            r = ty_monitor_list(main_board_monitor, list_boards_callback, &ctx);
+            if (r < 0)
+                goto error;
+            if (!ctx.best_board) {
+                r = ty_error(TY_ERROR_NOT_FOUND, "Board '%s' not found", ctx.tag);
+                goto error;
+            }
+
+            r = add_board(&ctx, ctx.best_board);
+            if (r < 0)
+                goto error;
+        }
+    }
+
+    *rboards = ctx.boards;
+    *rcount = ctx.boards_count;
+    return 0;
+
+error:
+    for (unsigned int i = 0; i < ctx.boards_count; i++)
+        ty_board_unref(ctx.boards[i]);
+    free(ctx.boards);
+    return r;
+}
+
 bool parse_common_option(ty_optline_context *optl, char *arg)
 {
     if (strcmp(arg, "--board") == 0 || strcmp(arg, "-B") == 0) {
-        main_board_tag = ty_optline_get_value(optl);
-        if (!main_board_tag) {
+        const char *tag = ty_optline_get_value(optl);
+
+        if (!tag) {
             ty_log(TY_LOG_ERROR, "Option '--board' takes an argument");
             return false;
         }
+        if (main_board_tags_count == TY_COUNTOF(main_board_tags)) {
+            ty_log(TY_LOG_ERROR, "Too many '--board' options (max %zu)",
+                   TY_COUNTOF(main_board_tags));
+            return false;
+        }
+        main_board_tags[main_board_tags_count++] = tag;
+
         return true;
     } else if (strcmp(arg, "--quiet") == 0 || strcmp(arg, "-q") == 0) {
         ty_config_verbosity--;
@@ -202,6 +336,7 @@ int main(int argc, char *argv[])
     }
 
     hs_log_set_handler(ty_libhs_log_handler, NULL);
+    ty_firmware_set_cache_size(TY_FIRMWARE_DEFAULT_CACHE_SIZE);
     r = ty_models_load_patch(NULL);
     if (r == TY_ERROR_MEMORY)
         return EXIT_FAILURE;
@@ -26,6 +26,8 @@ bool parse_common_option(ty_optline_context *optl, char *arg);
 
 int get_monitor(ty_monitor **rmonitor);
 int get_board(ty_board **rboard);
+int get_boards(bool all, ty_board ***rboards, unsigned int *rcount);
+unsigned int get_board_tags_count(void);
 
 TY_C_END
 
@@ -15,6 +15,7 @@
 #endif
 #include "../libhs/device.h"
 #include "../libhs/serial.h"
+#include "../libty/poller.h"
 #include "../libty/system.h"
 #include "main.h"
 
@@ -194,116 +195,138 @@ static int open_serial_interface(ty_board *board, ty_board_interface **riface)
     ty_board_interface *iface;
     int r;
 
-    r = ty_board_open_interface(board, TY_BOARD_CAPABILITY_SERIAL, &iface);
+    r = ty_board_serial_acquire(board, &iface);
     if (r < 0)
         return r;
-    if (!r)
-        return ty_error(TY_ERROR_MODE, "Board '%s' is not available for serial I/O",
-                        ty_board_get_tag(board));
 
     if (ty_board_interface_get_device(iface)->type == HS_DEVICE_TYPE_SERIAL) {
         r = hs_serial_set_config(ty_board_interface_get_handle(iface), &monitor_serial_config);
-        if (r < 0)
+        if (r < 0) {
+            ty_board_serial_release(iface);
             return (int)r;
+        }
     }
 
     *riface = iface;
     return 0;
 }
 
-static int fill_descriptor_set(ty_descriptor_set *set, ty_board *board)
+static int fill_poller(ty_poller *poller, ty_board *board, ty_board_interface **riface)
 {
-    ty_board_interface *iface = NULL;
+    ty_descriptor_set set = {0};
+    ty_board_interface *iface;
     int r;
 
-    ty_descriptor_set_clear(set);
+    ty_poller_clear(poller);
 
     // Board events / state changes
-    ty_monitor_get_descriptors(ty_board_get_monitor(board), set, 1);
+    ty_monitor_get_descriptors(ty_board_get_monitor(board), &set, 1);
 
     r = open_serial_interface(board, &iface);
     if (r < 0)
         return r;
 
     if (monitor_directions & DIRECTION_INPUT)
-        ty_board_interface_get_descriptors(iface, set, 2);
+        ty_board_interface_get_descriptors(iface, &set, 2);
 #ifdef _WIN32
     if (monitor_directions & DIRECTION_OUTPUT) {
         if (monitor_input_available) {
-            ty_descriptor_set_add(set, monitor_input_available, 3);
+            ty_descriptor_set_add(&set, monitor_input_available, 3);
         } else {
-            ty_descriptor_set_add(set, GetStdHandle(STD_INPUT_HANDLE), 3);
+            ty_descriptor_set_add(&set, GetStdHandle(STD_INPUT_HANDLE), 3);
         }
     }
 #else
     if (monitor_directions & DIRECTION_OUTPUT)
-        ty_descriptor_set_add(set, STDIN_FILENO, 3);
+        ty_descriptor_set_add(&set, STDIN_FILENO, 3);
 #endif
 
-    /* ty_board_interface_unref() keeps iface->open_count > 0 so the device file does not
-       get closed, and we can monitor the descriptor. When the refcount reaches 0, the
-       device is closed anyway so we don't leak anything. */
-    ty_board_interface_unref(iface);
+    r = ty_poller_add_set(poller, &set, 0);
+    if (r < 0) {
+        ty_board_serial_release(iface);
+        return r;
+    }
 
+    // The interface stays open (pinned) until the loop releases it
+    *riface = iface;
     return 0;
 }
 
 static int loop(ty_board *board, int outfd)
 {
-    ty_descriptor_set set = {0};
+    ty_poller *poller;
+    ty_board_interface *iface = NULL;
     int timeout;
     char buf[BUFFER_SIZE];
     ssize_t r;
 
-restart:
-    r = fill_descriptor_set(&set, board);
+    r = ty_poller_new(&poller);
     if (r < 0)
         return (int)r;
+
+restart:
+    ty_board_serial_release(iface);
+    iface = NULL;
+    r = fill_poller(poller, board, &iface);
+    if (r < 0)
+        goto cleanup;
     timeout = -1;
 
     ty_log(TY_LOG_INFO, "Monitoring '%s'", ty_board_get_tag(board));
 
     while (true) {
-        if (!set.count)
-            return 0;
+        ty_poller_event ev;
 
-        r = ty_poll(&set, timeout);
+        if (!ty_poller_get_count(poller)) {
+            r = 0;
+            goto cleanup;
+        }
+
+        r = ty_poller_wait(poller, &ev, 1, timeout);
         if (r < 0)
-            return (int)r;
+            goto cleanup;
+        if (r)
+            r = ev.id;
 
         switch (r) {
             case 0: {
-                return 0;
+                r = 0;
+                goto cleanup;
             } break;
 
             case 1: {
                 r = ty_monitor_refresh(ty_board_get_monitor(board));
                 if (r < 0)
-                    return (int)r;
+                    goto cleanup;
 
                 if (!ty_board_has_capability(board, TY_BOARD_CAPABILITY_SERIAL)) {
-                    if (!monitor_reconnect)
-                        return 0;
+                    if (!monitor_reconnect) {
+                        r = 0;
+                        goto cleanup;
+                    }
 
                     ty_log(TY_LOG_INFO, "Waiting for '%s'...", ty_board_get_tag(board));
                     r = ty_board_wait_for(board, TY_BOARD_CAPABILITY_SERIAL, -1);
                     if (r < 0)
-                        return (int)r;
+                        goto cleanup;
 
                     goto restart;
                 }
+                // The serial device may have been replaced since we pinned it
+                if (ty_board_interface_is_dropped(iface))
+                    goto restart;
             } break;
 
             case 2: {
-                r = ty_board_serial_read(board, buf, sizeof(buf), 0);
+                r = ty_board_interface_serial_read(iface, buf, sizeof(buf), 0);
                 if (r < 0) {
                     if (r == TY_ERROR_IO && monitor_reconnect) {
                         timeout = ERROR_IO_TIMEOUT;
-                        ty_descriptor_set_remove(&set, 2);
-                        ty_descriptor_set_remove(&set, 3);
+                        ty_poller_remove(poller, 2);
+                        ty_poller_remove(poller, 3);
                         break;
                     }
-                    return (int)r;
+                    goto cleanup;
                 }
 
 #ifdef _WIN32
@@ -312,18 +335,23 @@ restart:
                 r = write(outfd, buf, (size_t)r);
 #endif
                 if (r < 0) {
-                    if (errno == EIO)
-                        return ty_error(TY_ERROR_IO, "I/O error on standard output");
-                    return ty_error(TY_ERROR_IO, "Failed to write to standard output: %s",
-                                    strerror(errno));
+                    if (errno == EIO) {
+                        r = ty_error(TY_ERROR_IO, "I/O error on standard output");
+                    } else {
+                        r = ty_error(TY_ERROR_IO, "Failed to write to standard output: %s",
+                                     strerror(errno));
+                    }
+                    goto cleanup;
                 }
             } break;
 
             case 3: {
 #ifdef _WIN32
                 if (monitor_input_available) {
-                    if (monitor_input_ret < 0)
-                        return (int)monitor_input_ret;
+                    if (monitor_input_ret < 0) {
+                        r = monitor_input_ret;
+                        goto cleanup;
+                    }
 
                     memcpy(buf, monitor_input_line, (size_t)monitor_input_ret);
                     r = monitor_input_ret;
@@ -337,18 +365,21 @@ restart:
                 r = read(STDIN_FILENO, buf, sizeof(buf));
 #endif
                 if (r < 0) {
-                    if (errno == EIO)
-                        return ty_error(TY_ERROR_IO, "I/O error on standard input");
-                    return ty_error(TY_ERROR_IO, "Failed to read from standard input: %s",
-                                    strerror(errno));
+                    if (errno == EIO) {
+                        r = ty_error(TY_ERROR_IO, "I/O error on standard input");
+                    } else {
+                        r = ty_error(TY_ERROR_IO, "Failed to read from standard input: %s",
+                                     strerror(errno));
+                    }
+                    goto cleanup;
                 }
                 if (!r) {
                     if (monitor_timeout_eof >= 0) {
                         /* EOF reached, don't listen to stdin anymore, and start timeout to give some
                            time for the device to send any data before closing down. */
                         timeout = monitor_timeout_eof;
-                        ty_descriptor_set_remove(&set, 1);
-                        ty_descriptor_set_remove(&set, 3);
+                        ty_poller_remove(poller, 1);
+                        ty_poller_remove(poller, 3);
                     }
                     break;
                 }
@@ -357,23 +388,28 @@ restart:
                 if (monitor_fake_echo) {
                     r = write(outfd, buf, (unsigned int)r);
                     if (r < 0)
-                        return (int)r;
+                        goto cleanup;
                 }
 #endif
 
-                r = ty_board_serial_write(board, buf, (size_t)r);
+                r = ty_board_interface_serial_write(iface, buf, (size_t)r);
                 if (r < 0) {
                     if (r == TY_ERROR_IO && monitor_reconnect) {
                         timeout = ERROR_IO_TIMEOUT;
-                        ty_descriptor_set_remove(&set, 2);
-                        ty_descriptor_set_remove(&set, 3);
+                        ty_poller_remove(poller, 2);
+                        ty_poller_remove(poller, 3);
                         break;
                     }
-                    return (int)r;
+                    goto cleanup;
                 }
             } break;
         }
     }
+
+cleanup:
+    ty_board_serial_release(iface);
+    ty_poller_free(poller);
+    return (int)r;
 }
 
 int monitor(int argc, char *argv[])
@@ -9,11 +9,28 @@
    See the LICENSE file for more details. */
 
 #include "../libty/firmware.h"
+#include "../libty/system.h"
 #include "../libty/task.h"
 #include "main.h"
 
+struct upload_board {
+    ty_board *board;
+    ty_task *task;
+
+    uint64_t start;
+    uint64_t duration;
+    uint64_t uploaded;
+    unsigned int progress_step;
+};
+
 static int upload_flags = 0;
 static const char *upload_firmware_format = NULL;
+static bool upload_all = false;
+static bool upload_stats = false;
+static bool upload_fail_fast = false;
+
+// Protects the upload_board structs, which get updated by the task threads
+static ty_mutex upload_mutex;
 
 static void print_upload_usage(FILE *f)
 {
@@ -24,12 +41,18 @@ static void print_upload_usage(FILE *f)
 
     fprintf(f, "Upload options:\n"
                "   -w, --wait               Wait for the bootloader instead of rebooting\n"
+               "       --all                Upload to all boards (matching --board tags)\n"
+               "       --event-loop         Run parallel uploads in one thread, for many boards\n"
                "       --nocheck            Force upload even if the board is not compatible\n"
                "       --noreset            Do not reset the device once the upload is finished\n"
+               "       --stats              Print upload phase timings and latency percentiles\n"
+               "       --fail-fast          Cancel the other uploads as soon as one fails\n"
                "   -f, --format <format>    Firmware file format (autodetected by default)\n\n"
                "You can pass multiple firmwares, and the first compatible one will be used.\n\n"
                "Use '-' to read firmware from stdin, in which case you need to specificy the\n"
-               "format with -f <format>.\n\n");
+               "format with -f <format>.\n\n"
+               "Boards are flashed in parallel when you use --all or repeat --board, and a\n"
+               "summary is printed once all uploads are done.\n\n");
 
     fprintf(f, "Supported firmware formats: ");
     for (unsigned int i = 0; i < ty_firmware_formats_count; i++)
@@ -37,6 +60,259 @@ static void print_upload_usage(FILE *f)
     fprintf(f, ".\n");
 }
 
+static void upload_message_handler(const ty_message_data *msg, void *udata)
+{
+    TY_UNUSED(udata);
+
+    // Progress is printed by board_message_callback(), overwriting lines does not work here
+    if (msg->type == TY_MESSAGE_PROGRESS && msg->task)
+        return;
+
+    ty_message_default_handler(msg, NULL);
+}
+
+static void board_message_callback(const ty_message_data *msg, void *udata)
+{
+    struct upload_board *ub = udata;
+
+    switch (msg->type) {
+        case TY_MESSAGE_LOG: {
+        } break;
+
+        case TY_MESSAGE_PROGRESS: {
+            unsigned int step;
+
+            if (!msg->u.progress.max)
+                break;
+
+            ty_mutex_lock(&upload_mutex);
+            ub->uploaded = msg->u.progress.value;
+
+            // Print one line every 25%, the messages of all boards are interleaved
+            step = (unsigned int)(4 * msg->u.progress.value / msg->u.progress.max);
+            if (step > ub->progress_step && ty_config_verbosity >= TY_LOG_INFO) {
+                printf("%28s  %s... %u%%\n", msg->ctx, msg->u.progress.action, step * 25);
+                fflush(stdout);
+            }
+            ub->progress_step = step;
+            ty_mutex_unlock(&upload_mutex);
+        } break;
+
+        case TY_MESSAGE_STATUS: {
+            ty_mutex_lock(&upload_mutex);
+            if (msg->u.task.status == TY_TASK_STATUS_RUNNING) {
+                ub->start = ty_millis();
+            } else if (msg->u.task.status == TY_TASK_STATUS_FINISHED) {
+                ub->duration = ty_millis() - ub->start;
+            }
+            ty_mutex_unlock(&upload_mutex);
+        } break;
+    }
+}
+
+static int tasks_finished_callback(ty_monitor *monitor, void *udata)
+{
+    TY_UNUSED(monitor);
+
+    ty_task_group *group = udata;
+    return ty_task_group_wait(group, 0);
+}
+
+static void print_upload_summary(const struct upload_board *ubs, unsigned int count)
+{
+    if (ty_config_verbosity < TY_LOG_ERROR)
+        return;
+
+    ty_mutex_lock(&upload_mutex);
+    printf("\n%-28s  %10s  %10s  %7s  %s\n", "Board", "Duration", "Bytes", "Retries", "Result");
+    for (unsigned int i = 0; i < count; i++) {
+        const struct upload_board *ub = &ubs[i];
+        int ret = ub->task ? ub->task->ret : TY_ERROR_OTHER;
+        const char *result;
+
+        if (ret == TY_ERROR_CANCELED) {
+            result = "CANCELED";
+        } else {
+            result = ret ? "FAILED" : "OK";
+        }
+
+        printf("%-28s  %8.1f s  %10"PRIu64"  %7u  %s\n", ty_board_get_tag(ub->board),
+               (double)ub->duration / 1000.0, ub->uploaded,
+               ub->task ? ub->task->u.upload.report.retries : 0, result);
+    }
+    fflush(stdout);
+    ty_mutex_unlock(&upload_mutex);
+}
+
+static void print_latency(const char *name, const ty_histogram *h)
+{
+    if (!h->count)
+        return;
+
+    printf("  %-15s %6"PRIu64" samples, p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+           name, h->count, (double)ty_histogram_get_percentile(h, 50.0) / 1000.0,
+           (double)ty_histogram_get_percentile(h, 90.0) / 1000.0,
+           (double)ty_histogram_get_percentile(h, 99.0) / 1000.0, (double)h->max / 1000.0);
+}
+
+static void print_upload_report(const char *tag, const ty_upload_report *report)
+{
+    const uint64_t *times = report->phase_times;
+
+    printf("%s:\n", tag);
+    printf("  %-15s reboot %.1f ms, erase %.1f ms, write %.1f ms, reset %.1f ms\n", "Phases",
+           (double)times[TY_UPLOAD_PHASE_REBOOT] / 1000.0,
+           (double)times[TY_UPLOAD_PHASE_ERASE] / 1000.0,
+           (double)times[TY_UPLOAD_PHASE_WRITE] / 1000.0,
+           (double)times[TY_UPLOAD_PHASE_RESET] / 1000.0);
+    printf("  %-15s %u reboot, %u stalls\n", "Retries", report->retries, report->upload.stalls);
+    print_latency("Block latency", &report->upload.block_latency);
+    print_latency("Write latency", &report->upload.write_latency);
+}
+
+static void print_upload_stats(const struct upload_board *ubs, unsigned int count)
+{
+    ty_histogram block_latency = {0}, write_latency = {0};
+    ty_histogram wakeup_latency = {0};
+    ty_monitor *monitor;
+    unsigned int reported = 0;
+
+    if (ty_config_verbosity < TY_LOG_ERROR)
+        return;
+
+    printf("\n");
+    for (unsigned int i = 0; i < count; i++) {
+        const ty_upload_report *report;
+
+        if (!ubs[i].task)
+            continue;
+        report = &ubs[i].task->u.upload.report;
+
+        print_upload_report(ty_board_get_tag(ubs[i].board), report);
+        ty_histogram_merge(&block_latency, &report->upload.block_latency);
+        ty_histogram_merge(&write_latency, &report->upload.write_latency);
+        reported++;
+    }
+
+    if (reported > 1) {
+        printf("All boards:\n");
+        print_latency("Block latency", &block_latency);
+        print_latency("Write latency", &write_latency);
+    }
+
+    // Time between the board changes (e.g. bootloader appears) and the task wakeup
+    if (get_monitor(&monitor) >= 0)
+        ty_monitor_get_wakeup_latency(monitor, &wakeup_latency);
+    if (wakeup_latency.count) {
+        printf("Monitor:\n");
+        print_latency("Wakeup latency", &wakeup_latency);
+    }
+    fflush(stdout);
+}
+
+/* Upload tasks run in the task pool, and this thread refreshes the monitor for them
+   while they wait for the bootloader. Firmwares are shared by all the tasks, so they
+   get parsed, identified and prepared only once. */
+static int upload_parallel(ty_firmware **fws, unsigned int fws_count)
+{
+    ty_monitor *monitor;
+    ty_board **boards = NULL;
+    unsigned int boards_count = 0;
+    struct upload_board *ubs = NULL;
+    ty_task_group *group = NULL;
+    unsigned int failures = 0;
+    int r;
+
+    r = get_monitor(&monitor);
+    if (r < 0)
+        return r;
+    r = get_boards(upload_all, &boards, &boards_count);
+    if (r < 0)
+        return r;
+    r = ty_mutex_init(&upload_mutex);
+    if (r < 0)
+        goto cleanup;
+    r = ty_task_group_new(&group);
+    if (r < 0)
+        goto cleanup;
+    ty_task_group_set_fail_fast(group, upload_fail_fast);
+
+    // The last entry has a NULL board and ends the array
+    ubs = calloc(boards_count + 1, sizeof(*ubs));
+    if (!ubs) {
+        r = ty_error(TY_ERROR_MEMORY, NULL);
+        goto cleanup;
+    }
+
+    /* Queue messages and print them from a separate thread, so that writing to the terminal
+       does not slow down the upload tasks. If that fails, messages stay synchronous. */
+    ty_message_redirect(upload_message_handler, NULL);
+    ty_message_start_async();
+
+    for (unsigned int i = 0; i < boards_count; i++) {
+        struct upload_board *ub = &ubs[i];
+
+        ub->board = boards[i];
+
+        r = ty_upload(ub->board, fws, fws_count, upload_flags, &ub->task);
+        if (r < 0)
+            continue;
+        ub->task->user_callback = board_message_callback;
+        ub->task->user_callback_udata = ub;
+
+        r = ty_task_group_add(group, ub->task);
+        if (r < 0) {
+            ty_task_unref(ub->task);
+            ub->task = NULL;
+        }
+    }
+
+    // Tasks that fail to start count as failed in the group, and in the summary
+    ty_task_group_start(group);
+
+    /* Tasks do not wake us up when they finish, unlike board events, so check them
+       regularly. */
+    do {
+        r = ty_monitor_wait(monitor, tasks_finished_callback, group, 100);
+    } while (!r);
+    // Freeing the group cancels the tasks and waits for them, before ubs goes away
+    if (r < 0)
+        goto cleanup;
+
+    // The summary needs the progress messages that are still queued
+    ty_message_stop_async();
+    ty_message_redirect(ty_message_default_handler, NULL);
+
+    print_upload_summary(ubs, boards_count);
+    if (upload_stats)
+        print_upload_stats(ubs, boards_count);
+    for (unsigned int i = 0; i < boards_count; i++) {
+        if (!ubs[i].task || ubs[i].task->ret < 0)
+            failures++;
+    }
+    if (failures) {
+        r = ty_error(TY_ERROR_OTHER, "Upload failed on %u of %u boards", failures,
+                     boards_count);
+    } else {
+        r = 0;
+    }
+
+cleanup:
+    ty_message_stop_async();
+    ty_message_redirect(ty_message_default_handler, NULL);
+    ty_task_group_free(group);
+    if (ubs) {
+        for (unsigned int i = 0; i < boards_count; i++)
+            ty_task_unref(ubs[i].task);
+        free(ubs);
+    }
+    ty_mutex_release(&upload_mutex);
+    for (unsigned int i = 0; i < boards_count; i++)
+        ty_board_unref(boards[i]);
+    free(boards);
+    return r;
+}
+
 int upload(int argc, char *argv[])
 {
     ty_optline_context optl;
@@ -54,10 +330,18 @@ int upload(int argc, char *argv[])
             return EXIT_SUCCESS;
         } else if (strcmp(opt, "--wait") == 0 || strcmp(opt, "-w") == 0) {
             upload_flags |= TY_UPLOAD_WAIT;
+        } else if (strcmp(opt, "--all") == 0) {
+            upload_all = true;
+        } else if (strcmp(opt, "--event-loop") == 0) {
+            upload_flags |= TY_UPLOAD_EVENT_LOOP;
         } else if (strcmp(opt, "--nocheck") == 0) {
             upload_flags |= TY_UPLOAD_NOCHECK;
         } else if (strcmp(opt, "--noreset") == 0) {
             upload_flags |= TY_UPLOAD_NORESET;
+        } else if (strcmp(opt, "--stats") == 0) {
+            upload_stats = true;
+        } else if (strcmp(opt, "--fail-fast") == 0) {
+            upload_fail_fast = true;
         } else if (strcmp(opt, "--format") == 0 || strcmp(opt, "-f") == 0) {
             upload_firmware_format = ty_optline_get_value(&optl);
             if (!upload_firmware_format) {
@@ -78,8 +362,9 @@ int upload(int argc, char *argv[])
             break;
         }
 
-        r = ty_firmware_load_file(opt, !strcmp(opt, "-") ? stdin : NULL,
-                                  upload_firmware_format, &fws[fws_count]);
+        // IHEX files are parsed in the background, while we look for the board and reboot it
+        r = ty_firmware_stream_file(opt, !strcmp(opt, "-") ? stdin : NULL,
+                                    upload_firmware_format, &fws[fws_count]);
         if (!r)
             fws_count++;
     }
@@ -89,6 +374,13 @@ int upload(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    if (upload_all || get_board_tags_count() > 1) {
+        r = upload_parallel(fws, fws_count);
+        for (unsigned int i = 0; i < fws_count; i++)
+            ty_firmware_unref(fws[i]);
+        return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
     r = get_board(&board);
     if (r < 0)
         goto cleanup;
@@ -100,6 +392,10 @@ int upload(int argc, char *argv[])
         goto cleanup;
 
     r = ty_task_join(task);
+    if (upload_stats) {
+        struct upload_board ub = {.board = board, .task = task};
+        print_upload_stats(&ub, 1);
+    }
 
 cleanup:
     ty_task_unref(task);
@@ -124,6 +124,10 @@ void Board::loadSettings(Monitor *monitor)
 
 bool Board::updateSerialInterface()
 {
+    // The serial device may have been replaced, don't hang on to the old one
+    if (serial_iface_ && ty_board_interface_is_dropped(serial_iface_))
+        closeSerialInterface();
+
     if (enable_serial_ && hasCapability(TY_BOARD_CAPABILITY_SERIAL)) {
         openSerialInterface();
         if (!serial_iface_) {
@@ -600,6 +604,9 @@ void Board::serialReceived(ty_descriptor desc)
 
     QMutexLocker locker(&serial_lock_);
 
+    if (!serial_iface_)
+        return;
+
     ty_error_mask(TY_ERROR_MODE);
     ty_error_mask(TY_ERROR_IO);
 
@@ -611,8 +618,9 @@ void Board::serialReceived(ty_descriptor desc)
         if (serial_buf_len_ == sizeof(serial_buf_))
             break;
 
-        int r = ty_board_serial_read(board_, serial_buf_ + serial_buf_len_,
-                                     sizeof(serial_buf_) - serial_buf_len_, 0);
+        // The interface is pinned while serial_iface_ is set, no need to reopen it
+        ssize_t r = ty_board_interface_serial_read(serial_iface_, serial_buf_ + serial_buf_len_,
+                                                   sizeof(serial_buf_) - serial_buf_len_, 0);
         if (r < 0) {
             serial_notifier_.clear();
             break;
@@ -9,11 +9,160 @@
    See the LICENSE file for more details. */
 
 #include <QThread>
+#ifdef __linux__
+    #include <QThreadStorage>
+    #include <condition_variable>
+    #include <memory>
+    #include <mutex>
+    #include <unordered_map>
+#endif
 
 #include "descriptor_notifier.hpp"
+#ifdef __linux__
+    #include "../libty/poller.h"
+#endif
 
 using namespace std;
 
+#ifdef __linux__
+
+/* Qt watches each QSocketNotifier separately, which gets expensive with many boards. On
+   Linux, all the notifiers living in a thread share an epoll poller instead, and Qt only
+   watches the epoll descriptor. */
+class DescriptorPoller {
+    ty_poller *poller_ = nullptr;
+    QSocketNotifier *notifier_ = nullptr;
+
+    /* Notifiers can be destroyed from another thread. Signals are emitted without the lock,
+       so slots can do anything, and unregisterNotifier() waits until the notifier is not
+       in use anymore. */
+    mutex mutex_;
+    condition_variable dispatch_cond_;
+    unordered_map<int, DescriptorNotifier *> notifiers_;
+    DescriptorNotifier *dispatching_ = nullptr;
+    int next_id_ = 1;
+
+public:
+    ~DescriptorPoller();
+
+    static DescriptorPoller *current();
+
+    int registerNotifier(DescriptorNotifier *notifier);
+    void unregisterNotifier(int id);
+
+    bool add(int id, ty_descriptor desc);
+    void remove(int id);
+
+private:
+    void dispatch();
+};
+
+DescriptorPoller::~DescriptorPoller()
+{
+    delete notifier_;
+    ty_poller_free(poller_);
+}
+
+DescriptorPoller *DescriptorPoller::current()
+{
+    static QThreadStorage<DescriptorPoller *> pollers;
+
+    if (!pollers.hasLocalData()) {
+        unique_ptr<DescriptorPoller> poller(new DescriptorPoller);
+        ty_descriptor_set set = {};
+
+        if (ty_poller_new(&poller->poller_) < 0)
+            return nullptr;
+        ty_poller_get_descriptors(poller->poller_, &set, 0);
+
+        auto ptr = poller.get();
+        poller->notifier_ = new QSocketNotifier(set.desc[0], QSocketNotifier::Read);
+        QObject::connect(poller->notifier_, &QSocketNotifier::activated, poller->notifier_,
+                         [=]() { ptr->dispatch(); });
+
+        pollers.setLocalData(poller.release());
+    }
+
+    return pollers.localData();
+}
+
+int DescriptorPoller::registerNotifier(DescriptorNotifier *notifier)
+{
+    lock_guard<mutex> lock(mutex_);
+
+    int id = next_id_++;
+    notifiers_[id] = notifier;
+
+    return id;
+}
+
+void DescriptorPoller::unregisterNotifier(int id)
+{
+    unique_lock<mutex> lock(mutex_);
+
+    // A slot may destroy its own notifier, only wait for dispatch in other threads
+    if (notifier_->thread() != QThread::currentThread()) {
+        auto it = notifiers_.find(id);
+        if (it != notifiers_.end()) {
+            DescriptorNotifier *notifier = it->second;
+            dispatch_cond_.wait(lock, [&]() { return dispatching_ != notifier; });
+        }
+    }
+
+    ty_poller_remove(poller_, id);
+    notifiers_.erase(id);
+}
+
+bool DescriptorPoller::add(int id, ty_descriptor desc)
+{
+    lock_guard<mutex> lock(mutex_);
+    return ty_poller_add(poller_, desc, id, 0) >= 0;
+}
+
+void DescriptorPoller::remove(int id)
+{
+    lock_guard<mutex> lock(mutex_);
+    ty_poller_remove(poller_, id);
+}
+
+void DescriptorPoller::dispatch()
+{
+    ty_poller_event events[64];
+    int r;
+
+    /* Registrations are level-triggered, if more descriptors are ready the epoll descriptor
+       stays readable and we get called again. */
+    {
+        lock_guard<mutex> lock(mutex_);
+        r = ty_poller_wait(poller_, events, TY_COUNTOF(events), 0);
+    }
+
+    for (int i = 0; i < r; i++) {
+        DescriptorNotifier *notifier;
+
+        // Slots may clear or destroy notifiers, look them up each time
+        {
+            lock_guard<mutex> lock(mutex_);
+
+            auto it = notifiers_.find(events[i].id);
+            if (it == notifiers_.end())
+                continue;
+            notifier = it->second;
+            dispatching_ = notifier;
+        }
+
+        emit notifier->activated(events[i].desc);
+
+        {
+            lock_guard<mutex> lock(mutex_);
+            dispatching_ = nullptr;
+        }
+        dispatch_cond_.notify_all();
+    }
+}
+
+#endif
+
 DescriptorNotifier::DescriptorNotifier(ty_descriptor desc, QObject *parent)
     : QObject(parent)
 {
@@ -27,6 +176,14 @@ DescriptorNotifier::DescriptorNotifier(ty_descriptor_set *set, QObject *parent)
         addDescriptorSet(set);
 }
 
+DescriptorNotifier::~DescriptorNotifier()
+{
+#ifdef __linux__
+    if (poller_)
+        poller_->unregisterNotifier(poller_id_);
+#endif
+}
+
 void DescriptorNotifier::addDescriptorSet(ty_descriptor_set *set)
 {
     for (unsigned int i = 0; i < set->count; i++)
@@ -36,6 +193,18 @@ void DescriptorNotifier::addDescriptorSet(ty_descriptor_set *set)
 void DescriptorNotifier::addDescriptor(ty_descriptor desc)
 {
     execute([=]() {
+#ifdef __linux__
+        if (!poller_) {
+            poller_ = DescriptorPoller::current();
+            if (poller_)
+                poller_id_ = poller_->registerNotifier(this);
+        }
+        if (poller_ && (!enabled_ || poller_->add(poller_id_, desc))) {
+            polled_.push_back(desc);
+            return;
+        }
+#endif
+
 #ifdef _WIN32
         auto notifier = new QWinEventNotifier(desc, this);
         connect(notifier, &QWinEventNotifier::activated, this, &DescriptorNotifier::activated);
@@ -52,6 +221,17 @@ void DescriptorNotifier::addDescriptor(ty_descriptor desc)
 void DescriptorNotifier::setEnabled(bool enable)
 {
     execute([=]() {
+#ifdef __linux__
+        if (poller_ && enable != enabled_) {
+            if (enable) {
+                for (auto desc: polled_)
+                    poller_->add(poller_id_, desc);
+            } else {
+                poller_->remove(poller_id_);
+            }
+        }
+#endif
+
         enabled_ = enable;
         for (auto notifier: notifiers_)
             notifier->setEnabled(enable);
@@ -61,6 +241,12 @@ void DescriptorNotifier::setEnabled(bool enable)
 void DescriptorNotifier::clear()
 {
     execute([=]() {
+#ifdef __linux__
+        if (poller_)
+            poller_->remove(poller_id_);
+        polled_.clear();
+#endif
+
         for (auto notifier: notifiers_)
             delete notifier;
         notifiers_.clear();
@@ -22,6 +22,8 @@
 
 #include "../libty/system.h"
 
+class DescriptorPoller;
+
 class DescriptorNotifier : public QObject {
     Q_OBJECT
 
@@ -31,6 +33,13 @@ class DescriptorNotifier : public QObject {
     std::vector<QSocketNotifier *> notifiers_;
 #endif
 
+#ifdef __linux__
+    // Descriptors registered in the shared poller of our thread, see descriptor_notifier.cc
+    DescriptorPoller *poller_ = nullptr;
+    int poller_id_ = 0;
+    std::vector<ty_descriptor> polled_;
+#endif
+
     bool enabled_ = true;
 
 public:
@@ -38,6 +47,7 @@ public:
         : QObject(parent) {}
     DescriptorNotifier(ty_descriptor desc, QObject *parent = nullptr);
     DescriptorNotifier(ty_descriptor_set *set, QObject *parent = nullptr);
+    ~DescriptorNotifier();
 
     void addDescriptorSet(ty_descriptor_set *set);
     void addDescriptor(ty_descriptor desc);
@@ -182,7 +182,8 @@ bool Monitor::start()
             return false;
         unique_ptr<ty_monitor, decltype(&ty_monitor_free)> monitor_ptr(monitor, ty_monitor_free);
 
-        r = ty_monitor_register_callback(monitor, handleEvent, this);
+        // Get one event per board for each refresh, instead of every interface change
+        r = ty_monitor_register_batch_callback(monitor, handleEvents, this);
         if (r < 0)
             return false;
 
@@ -388,6 +389,15 @@ int Monitor::handleEvent(ty_board *board, ty_monitor_event event, void *udata)
     return 0;
 }
 
+int Monitor::handleEvents(const ty_monitor_batch_event *events, unsigned int count,
+                          void *udata)
+{
+    for (unsigned int i = 0; i < count; i++)
+        handleEvent(events[i].board, events[i].event, udata);
+
+    return 0;
+}
+
 Monitor::iterator Monitor::findBoardIterator(ty_board *board)
 {
     return find_if(boards_.begin(), boards_.end(),
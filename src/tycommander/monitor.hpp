@@ -131,6 +131,8 @@ private:
     iterator findBoardIterator(ty_board *board);
 
     static int handleEvent(ty_board *board, ty_monitor_event event, void *udata);
+    static int handleEvents(const ty_monitor_batch_event *events, unsigned int count,
+                            void *udata);
     void handleAddedEvent(ty_board *board);
     void handleChangedEvent(ty_board *board);
 
@@ -25,6 +25,7 @@
 #include "arduino_install.hpp"
 #include "client_handler.hpp"
 #include "../libty/common.h"
+#include "../libty/firmware.h"
 #include "log_dialog.hpp"
 #include "main_window.hpp"
 #include "../libty/optline.h"
@@ -78,6 +79,9 @@ TyCommander::TyCommander(int &argc, char *argv[])
             }
         }
     }, nullptr);
+    // Each progress message ends up in the board model, progress bars don't need more
+    ty_message_set_progress_throttle(20, 250);
+    ty_firmware_set_cache_size(TY_FIRMWARE_DEFAULT_CACHE_SIZE);
 
     initDatabase("tyqt", tycommander_db_);
     setDatabase(&tycommander_db_);
@@ -105,6 +109,7 @@ TyCommander::TyCommander(int &argc, char *argv[])
 
 TyCommander::~TyCommander()
 {
+    ty_message_stop_async();
     ty_message_redirect(ty_message_default_handler, nullptr);
 }
 
@@ -286,6 +291,10 @@ int TyCommander::runMainInstance(int argc, char *argv[])
        happens because quitWhenLastClosed is true, but this works. */
     connect(this, &TyCommander::lastWindowClosed, this, &TyCommander::quit);
 
+    /* Keep the handler (and the Qt signal dispatch) out of the upload and serial threads,
+       the main instance does not need synchronous output. */
+    ty_message_start_async();
+
     if (!monitor_.start()) {
         showClientError(ty_error_last_message());
         return EXIT_FAILURE;
@@ -0,0 +1,288 @@
+/* TyTools - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/tytools
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#include "bench_libty.h"
+#include "../../src/libty/class.h"
+#include "../../src/libty/firmware.h"
+
+// Roughly the size of a big Teensy 4.0 firmware
+#define IMAGE_ADDRESS 0x60000000u
+#define IMAGE_SIZE (540 * 1024)
+#define EXTRACT_BLOCK_SIZE 1024
+
+static uint8_t *generate_image(size_t size)
+{
+    uint8_t *image;
+    uint32_t rand_state = 0x12345678;
+
+    image = (uint8_t *)malloc(size);
+    if (!image)
+        return NULL;
+
+    for (size_t i = 0; i < size; i++) {
+        rand_state ^= rand_state << 13;
+        rand_state ^= rand_state >> 17;
+        rand_state ^= rand_state << 5;
+        image[i] = (uint8_t)rand_state;
+    }
+
+    return image;
+}
+
+static char *generate_ihex(const uint8_t *image, size_t size, size_t *rlen)
+{
+    char *hex, *ptr;
+
+    // Each 16-byte record takes 45 characters, plus extended address records
+    hex = (char *)malloc(size / 16 * 45 + size / 65536 * 17 + 64);
+    if (!hex)
+        return NULL;
+    ptr = hex;
+
+    for (size_t offset = 0; offset < size; offset += 16) {
+        uint8_t sum;
+
+        if (!(offset % 65536)) {
+            uint16_t high = (uint16_t)((IMAGE_ADDRESS >> 16) + offset / 65536);
+
+            sum = (uint8_t)(2 + 4 + (high >> 8) + (high & 0xFF));
+            ptr += sprintf(ptr, ":02000004%04X%02X\r\n", high, (uint8_t)-sum);
+        }
+
+        sum = (uint8_t)(16 + ((offset >> 8) & 0xFF) + (offset & 0xFF));
+        ptr += sprintf(ptr, ":10%04X00", (unsigned int)(offset & 0xFFFF));
+        for (unsigned int i = 0; i < 16; i++) {
+            ptr += sprintf(ptr, "%02X", image[offset + i]);
+            sum = (uint8_t)(sum + image[offset + i]);
+        }
+        ptr += sprintf(ptr, "%02X\r\n", (uint8_t)-sum);
+    }
+    ptr += sprintf(ptr, ":00000001FF\r\n");
+
+    *rlen = (size_t)(ptr - hex);
+    return hex;
+}
+
+/* This is how ty_firmware_load_ihex() used to decode records, with one strtoul() call per
+   byte. It only decodes and checks records (into a 64 kiB window), which is the part that
+   matters, so that ihex_load can be compared to it. */
+static int decode_ihex_strtoul(const char *hex, size_t len, uint8_t *window)
+{
+    const char *ptr = hex;
+    const char *end = hex + len;
+
+    while (ptr < end) {
+        uint8_t bytes[5 + 255];
+        const char *line_end;
+        size_t bytes_count;
+        uint8_t sum = 0;
+
+        while (ptr < end && (*ptr == '\r' || *ptr == '\n'))
+            ptr++;
+        if (ptr == end)
+            break;
+        line_end = ptr;
+        while (line_end < end && *line_end != '\r' && *line_end != '\n')
+            line_end++;
+        if (*ptr++ != ':')
+            return -1;
+
+        bytes_count = (size_t)(line_end - ptr) / 2;
+        if (bytes_count < 5 || bytes_count > sizeof(bytes))
+            return -1;
+        for (size_t i = 0; i < bytes_count; i++) {
+            char buf[3];
+            char *buf_end;
+
+            memcpy(buf, ptr + 2 * i, 2);
+            buf[2] = 0;
+
+            bytes[i] = (uint8_t)strtoul(buf, &buf_end, 16);
+            if (buf_end == buf || buf_end[0])
+                return -1;
+            sum = (uint8_t)(sum + bytes[i]);
+        }
+        if (sum)
+            return -1;
+
+        if (bytes[3] == 0)
+            memcpy(window + ((bytes[1] << 8) | bytes[2]), bytes + 4, bytes[0]);
+        ptr = line_end;
+    }
+
+    return 0;
+}
+
+static void write_uint16(uint8_t *ptr, uint16_t u)
+{
+    ptr[0] = (uint8_t)u;
+    ptr[1] = (uint8_t)(u >> 8);
+}
+
+static void write_uint32(uint8_t *ptr, uint32_t u)
+{
+    write_uint16(ptr, (uint16_t)u);
+    write_uint16(ptr + 2, (uint16_t)(u >> 16));
+}
+
+// Little-endian 32-bit ELF file with a single PT_LOAD program header
+static uint8_t *generate_elf(const uint8_t *image, size_t size, size_t *rlen)
+{
+    const size_t ehdr_size = 52, phdr_size = 32;
+    uint8_t *elf;
+
+    elf = (uint8_t *)calloc(1, ehdr_size + phdr_size + size);
+    if (!elf)
+        return NULL;
+
+    memcpy(elf, "\177ELF\1\1\1", 7);
+    write_uint16(elf + 16, 2); // e_type = ET_EXEC
+    write_uint16(elf + 18, 40); // e_machine = EM_ARM
+    write_uint32(elf + 20, 1); // e_version
+    write_uint32(elf + 28, (uint32_t)ehdr_size); // e_phoff
+    write_uint16(elf + 40, (uint16_t)ehdr_size); // e_ehsize
+    write_uint16(elf + 42, (uint16_t)phdr_size); // e_phentsize
+    write_uint16(elf + 44, 1); // e_phnum
+
+    write_uint32(elf + ehdr_size, 1); // p_type = PT_LOAD
+    write_uint32(elf + ehdr_size + 4, (uint32_t)(ehdr_size + phdr_size)); // p_offset
+    write_uint32(elf + ehdr_size + 8, IMAGE_ADDRESS); // p_vaddr
+    write_uint32(elf + ehdr_size + 12, IMAGE_ADDRESS); // p_paddr
+    write_uint32(elf + ehdr_size + 16, (uint32_t)size); // p_filesz
+    write_uint32(elf + ehdr_size + 20, (uint32_t)size); // p_memsz
+    memcpy(elf + ehdr_size + phdr_size, image, size);
+
+    *rlen = ehdr_size + phdr_size + size;
+    return elf;
+}
+
+static void bench_load(const char *name, const char *filename, const uint8_t *mem, size_t len)
+{
+    bench_loop loop;
+
+    if (!bench_enabled(name))
+        return;
+
+    for (bench_start(&loop); bench_next(&loop);) {
+        ty_firmware *fw;
+        int r;
+
+        r = ty_firmware_load_mem(filename, mem, len, NULL, &fw);
+        if (r < 0) {
+            bench_fail(name, ty_error_last_message());
+            return;
+        }
+        ty_firmware_unref(fw);
+    }
+
+    report_bench(name, bench_rate(&loop, (double)len) / (1024.0 * 1024.0), "MB/s", &loop);
+}
+
+static void bench_ihex_reference(const char *hex, size_t len)
+{
+    const char *name = "firmware.ihex_decode_reference";
+    uint8_t *window;
+    bench_loop loop;
+
+    if (!bench_enabled(name))
+        return;
+
+    window = (uint8_t *)malloc(65536 + 256);
+    if (!window) {
+        bench_fail(name, "Failed to allocate memory");
+        return;
+    }
+
+    for (bench_start(&loop); bench_next(&loop);) {
+        if (decode_ihex_strtoul(hex, len, window) < 0) {
+            bench_fail(name, "Reference decoder failed");
+            goto cleanup;
+        }
+    }
+
+    report_bench(name, bench_rate(&loop, (double)len) / (1024.0 * 1024.0), "MB/s", &loop);
+
+cleanup:
+    free(window);
+}
+
+static void bench_identify(const ty_firmware *fw)
+{
+    const char *name = "firmware.identify";
+    bench_loop loop;
+
+    if (!bench_enabled(name))
+        return;
+
+    for (bench_start(&loop); bench_next(&loop);) {
+        ty_model models[TY_FIRMWARE_MAX_MODELS];
+        ty_firmware_identify(fw, models, TY_COUNTOF(models));
+    }
+
+    report_bench(name, bench_rate(&loop, 1.0), "calls/s", &loop);
+}
+
+static void bench_extract(const ty_firmware *fw)
+{
+    const char *name = "firmware.extract";
+    bench_loop loop;
+
+    if (!bench_enabled(name))
+        return;
+
+    // Extract the full image block by block, like uploads do
+    for (bench_start(&loop); bench_next(&loop);) {
+        uint8_t buf[EXTRACT_BLOCK_SIZE];
+
+        for (size_t addr = IMAGE_ADDRESS; addr < fw->max_address; addr += sizeof(buf))
+            ty_firmware_extract(fw, (uint32_t)addr, buf, sizeof(buf));
+    }
+
+    report_bench(name, bench_rate(&loop, (double)fw->total_size) / (1024.0 * 1024.0), "MB/s",
+                 &loop);
+}
+
+void bench_firmware(void)
+{
+    uint8_t *image;
+    char *hex = NULL;
+    uint8_t *elf = NULL;
+    size_t hex_len, elf_len;
+    ty_firmware *fw = NULL;
+    int r;
+
+    image = generate_image(IMAGE_SIZE);
+    if (image)
+        hex = generate_ihex(image, IMAGE_SIZE, &hex_len);
+    if (image)
+        elf = generate_elf(image, IMAGE_SIZE, &elf_len);
+    if (!image || !hex || !elf) {
+        bench_fail("firmware", "Failed to allocate memory");
+        goto cleanup;
+    }
+
+    bench_load("firmware.ihex_load", "bench.hex", (const uint8_t *)hex, hex_len);
+    bench_ihex_reference(hex, hex_len);
+    bench_load("firmware.elf_load", "bench.elf", elf, elf_len);
+
+    r = ty_firmware_load_mem("bench.elf", elf, elf_len, NULL, &fw);
+    if (r < 0) {
+        bench_fail("firmware", ty_error_last_message());
+        goto cleanup;
+    }
+    bench_identify(fw);
+    bench_extract(fw);
+
+cleanup:
+    ty_firmware_unref(fw);
+    free(elf);
+    free(hex);
+    free(image);
+}
@@ -0,0 +1,207 @@
+/* TyTools - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/tytools
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#include "bench_libty.h"
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+#include "../../src/libhs/device.h"
+#include "../../src/libhs/htable.h"
+#include "../../src/libhs/serial.h"
+
+#define HTABLE_ENTRIES 1024
+#define HTABLE_LOOKUPS 4096
+#define SERIAL_CHUNK_SIZE 1024
+#define SERIAL_TIMEOUT 5000
+
+struct htable_entry {
+    _hs_htable_head hnode;
+    char key[32];
+};
+
+static void bench_htable(void)
+{
+    const char *name = "libhs.htable_lookup";
+    _hs_htable table = {0};
+    struct htable_entry *entries;
+    bench_loop loop;
+    unsigned int found = 0;
+    int r;
+
+    if (!bench_enabled(name))
+        return;
+
+    // Same table size and key format as the device tables in monitors
+    entries = (struct htable_entry *)calloc(HTABLE_ENTRIES, sizeof(*entries));
+    r = _hs_htable_init(&table, 64);
+    if (!entries || r < 0) {
+        bench_fail(name, "Failed to allocate memory");
+        goto cleanup;
+    }
+    for (unsigned int i = 0; i < HTABLE_ENTRIES; i++) {
+        snprintf(entries[i].key, sizeof(entries[i].key), "usb-%u-%u-%u", i / 256 + 1,
+                 i / 16 % 16 + 1, i % 16 + 1);
+        _hs_htable_add(&table, _hs_htable_hash_str(entries[i].key), &entries[i].hnode);
+    }
+
+    for (bench_start(&loop); bench_next(&loop);) {
+        for (unsigned int i = 0; i < HTABLE_LOOKUPS; i++) {
+            const char *key = entries[(i * 7919) % HTABLE_ENTRIES].key;
+
+            _hs_htable_foreach_hash(cur, &table, _hs_htable_hash_str(key)) {
+                struct htable_entry *entry = (struct htable_entry *)cur;
+
+                if (!strcmp(entry->key, key)) {
+                    found++;
+                    break;
+                }
+            }
+        }
+    }
+    if (found != loop.iterations * HTABLE_LOOKUPS) {
+        bench_fail(name, "Missing entries");
+        goto cleanup;
+    }
+
+    report_bench(name, bench_rate(&loop, HTABLE_LOOKUPS), "lookups/s", &loop);
+
+cleanup:
+    _hs_htable_release(&table);
+    free(entries);
+}
+
+#ifndef _WIN32
+
+static int open_pty(int *rmaster, hs_port **rport)
+{
+    int master;
+    hs_device *dev = NULL;
+    int r;
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+        goto error;
+
+    // The device is never enumerated, fill in what hs_port_open() needs
+    dev = (hs_device *)calloc(1, sizeof(*dev));
+    if (!dev)
+        goto error;
+    dev->refcount = 1;
+    dev->type = HS_DEVICE_TYPE_SERIAL;
+    dev->status = HS_DEVICE_STATUS_ONLINE;
+    // Like simulated boards, ptys have no modem control lines
+    dev->simulated = true;
+    dev->path = strdup(ptsname(master));
+    if (!dev->path)
+        goto error;
+
+    r = hs_port_open(dev, HS_PORT_MODE_RW, rport);
+    hs_device_unref(dev);
+    if (r < 0) {
+        close(master);
+        return r;
+    }
+
+    *rmaster = master;
+    return 0;
+
+error:
+    hs_device_unref(dev);
+    if (master >= 0)
+        close(master);
+    return -1;
+}
+
+static bool read_full(int fd, uint8_t *buf, size_t size)
+{
+    while (size) {
+        ssize_t len = read(fd, buf, size);
+        if (len <= 0)
+            return false;
+
+        buf += len;
+        size -= (size_t)len;
+    }
+
+    return true;
+}
+
+static void bench_serial(void)
+{
+    const char *write_name = "libhs.serial_write";
+    const char *read_name = "libhs.serial_read";
+    int master = -1;
+    hs_port *port = NULL;
+    uint8_t chunk[SERIAL_CHUNK_SIZE], buf[SERIAL_CHUNK_SIZE];
+    bench_loop loop;
+    int r;
+
+    if (!bench_enabled(write_name) && !bench_enabled(read_name))
+        return;
+
+    r = open_pty(&master, &port);
+    if (r < 0) {
+        bench_fail("libhs.serial", "Failed to open pseudo-terminal");
+        return;
+    }
+    for (size_t i = 0; i < sizeof(chunk); i++)
+        chunk[i] = (uint8_t)i;
+
+    // Data goes through the pty line discipline, so this measures libhs with kernel overhead
+    if (bench_enabled(write_name)) {
+        for (bench_start(&loop); bench_next(&loop);) {
+            ssize_t len = hs_serial_write(port, chunk, sizeof(chunk), SERIAL_TIMEOUT);
+
+            if (len != (ssize_t)sizeof(chunk) || !read_full(master, buf, sizeof(buf))) {
+                bench_fail(write_name, "Serial write failed");
+                goto cleanup;
+            }
+        }
+        report_bench(write_name, bench_rate(&loop, sizeof(chunk)) / (1024.0 * 1024.0), "MB/s",
+                     &loop);
+    }
+
+    if (bench_enabled(read_name)) {
+        for (bench_start(&loop); bench_next(&loop);) {
+            size_t total = 0;
+
+            if (write(master, chunk, sizeof(chunk)) != (ssize_t)sizeof(chunk)) {
+                bench_fail(read_name, "Pseudo-terminal write failed");
+                goto cleanup;
+            }
+            while (total < sizeof(buf)) {
+                ssize_t len = hs_serial_read(port, buf + total, sizeof(buf) - total,
+                                             SERIAL_TIMEOUT);
+                if (len <= 0) {
+                    bench_fail(read_name, "Serial read failed");
+                    goto cleanup;
+                }
+                total += (size_t)len;
+            }
+        }
+        report_bench(read_name, bench_rate(&loop, sizeof(chunk)) / (1024.0 * 1024.0), "MB/s",
+                     &loop);
+    }
+
+cleanup:
+    hs_port_close(port);
+    close(master);
+}
+
+#endif
+
+void bench_libhs(void)
+{
+    bench_htable();
+#ifndef _WIN32
+    bench_serial();
+#endif
+}
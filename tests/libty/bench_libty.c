@@ -0,0 +1,167 @@
+/* TyTools - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/tytools
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#include "bench_libty.h"
+#include "../../src/libty/optline.h"
+#include "../../src/libty/system.h"
+
+void bench_firmware(void);
+void bench_libhs(void);
+void bench_task(void);
+
+#define DEFAULT_MIN_DURATION 1000
+
+static unsigned int min_duration = DEFAULT_MIN_DURATION;
+static char **filters;
+static unsigned int filters_count;
+
+static unsigned int results_count;
+static unsigned int failures_count;
+
+static void print_usage(FILE *f)
+{
+    fprintf(f, "usage: ty_bench [options] [filters]\n\n"
+               "Options:\n"
+               "       --help               Show help message\n"
+               "   -d, --duration <ms>      Minimum duration of each benchmark (default: %d)\n\n"
+               "Filters select benchmarks by name prefix (e.g. firmware.ihex).\n"
+               "Results are written to the standard output in JSON format.\n",
+            DEFAULT_MIN_DURATION);
+}
+
+void bench_start(bench_loop *loop)
+{
+    loop->start = ty_micros();
+    loop->duration = 0;
+    loop->iterations = 0;
+}
+
+bool bench_next(bench_loop *loop)
+{
+    loop->duration = ty_micros() - loop->start;
+    if (loop->iterations && loop->duration >= (uint64_t)min_duration * 1000)
+        return false;
+
+    loop->iterations++;
+    return true;
+}
+
+double bench_rate(const bench_loop *loop, double units_per_iteration)
+{
+    if (!loop->duration)
+        return 0.0;
+    return units_per_iteration * (double)loop->iterations / ((double)loop->duration / 1000000.0);
+}
+
+bool bench_enabled(const char *name)
+{
+    if (!filters_count)
+        return true;
+
+    for (unsigned int i = 0; i < filters_count; i++) {
+        if (!strncmp(name, filters[i], strlen(filters[i])))
+            return true;
+    }
+    return false;
+}
+
+static void begin_result(const char *name)
+{
+    printf("%s\n    {\"name\": \"%s\"", results_count ? "," : "", name);
+    results_count++;
+
+    fprintf(stderr, "  %s\n", name);
+}
+
+static void end_result(const bench_loop *loop)
+{
+    printf(", \"iterations\": %"PRIu64", \"duration_us\": %"PRIu64"}", loop->iterations,
+           loop->duration);
+}
+
+void bench_fail(const char *name, const char *msg)
+{
+    fprintf(stderr, "  %s failed: %s\n", name, msg);
+    failures_count++;
+}
+
+void report_bench(const char *name, double value, const char *unit, const bench_loop *loop)
+{
+    begin_result(name);
+    printf(", \"value\": %.3f, \"unit\": \"%s\"", value, unit);
+    end_result(loop);
+}
+
+void report_bench_latency(const char *name, const ty_histogram *hist, const bench_loop *loop)
+{
+    double mean = hist->count ? (double)hist->sum / (double)hist->count : 0.0;
+
+    begin_result(name);
+    printf(", \"value\": %.3f, \"unit\": \"us\", \"min\": %"PRIu64", \"p50\": %"PRIu64
+           ", \"p90\": %"PRIu64", \"p99\": %"PRIu64", \"max\": %"PRIu64, mean, hist->min,
+           ty_histogram_get_percentile(hist, 50.0), ty_histogram_get_percentile(hist, 90.0),
+           ty_histogram_get_percentile(hist, 99.0), hist->max);
+    end_result(loop);
+}
+
+int main(int argc, char *argv[])
+{
+    ty_optline_context optl;
+    char *opt;
+
+    ty_optline_init_argv(&optl, argc, argv);
+    while ((opt = ty_optline_next_option(&optl))) {
+        if (strcmp(opt, "--help") == 0) {
+            print_usage(stdout);
+            return EXIT_SUCCESS;
+        } else if (strcmp(opt, "--duration") == 0 || strcmp(opt, "-d") == 0) {
+            char *value = ty_optline_get_value(&optl);
+            char *end;
+
+            if (!value) {
+                fprintf(stderr, "Option '--duration' takes an argument\n");
+                print_usage(stderr);
+                return EXIT_FAILURE;
+            }
+            errno = 0;
+            min_duration = (unsigned int)strtoul(value, &end, 10);
+            if (errno || end == value || *end) {
+                fprintf(stderr, "Option '--duration' takes a number of milliseconds\n");
+                print_usage(stderr);
+                return EXIT_FAILURE;
+            }
+        } else {
+            fprintf(stderr, "Unknown option '%s'\n", opt);
+            print_usage(stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    filters = (char **)malloc((size_t)argc * sizeof(*filters));
+    if (!filters) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return EXIT_FAILURE;
+    }
+    while ((opt = ty_optline_consume_non_option(&optl)))
+        filters[filters_count++] = opt;
+
+    printf("{\n  \"version\": \"%s\",\n  \"min_duration_ms\": %u,\n  \"results\": [",
+           ty_version_string(), min_duration);
+
+    fprintf(stderr, "Running benchmarks (%u ms each)\n", min_duration);
+    bench_firmware();
+    bench_libhs();
+    bench_task();
+
+    printf("\n  ]\n}\n");
+
+    free(filters);
+    return failures_count ? EXIT_FAILURE : EXIT_SUCCESS;
+}
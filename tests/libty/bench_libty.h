@@ -0,0 +1,43 @@
+/* TyTools - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/tytools
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#ifndef BENCH_LIBTY_H
+#define BENCH_LIBTY_H
+
+#include "../../src/libty/common.h"
+#include "../../src/libty/histogram.h"
+
+TY_C_BEGIN
+
+typedef struct bench_loop {
+    uint64_t start;
+    uint64_t duration; // in µs
+    uint64_t iterations;
+} bench_loop;
+
+/* Run the loop body until the minimum benchmark duration has elapsed, at least once:
+
+       for (bench_start(&loop); bench_next(&loop);) { ... } */
+void bench_start(bench_loop *loop);
+bool bench_next(bench_loop *loop);
+
+// Units per second, with units_per_iteration units processed by each loop iteration
+double bench_rate(const bench_loop *loop, double units_per_iteration);
+
+bool bench_enabled(const char *name);
+void bench_fail(const char *name, const char *msg);
+
+void report_bench(const char *name, double value, const char *unit, const bench_loop *loop);
+// Latency values recorded in µs
+void report_bench_latency(const char *name, const ty_histogram *hist, const bench_loop *loop);
+
+TY_C_END
+
+#endif
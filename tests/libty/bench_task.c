@@ -0,0 +1,335 @@
+/* TyTools - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/tytools
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#include "bench_libty.h"
+#include "../../src/libty/system.h"
+#include "../../src/libty/task.h"
+
+#define POOL_BATCH_SIZE 64
+#define POOL_DEEP_QUEUE_SIZE 4096
+#define POOL_TIMEOUT 10000
+
+static int run_timestamp_task(ty_task *task)
+{
+    uint64_t *rtime = (uint64_t *)task->result;
+
+    *rtime = ty_micros();
+    return 0;
+}
+
+static int run_empty_task(ty_task *task)
+{
+    TY_UNUSED(task);
+    return 0;
+}
+
+static void bench_pool_latency(ty_pool *pool)
+{
+    const char *name = "task.pool_latency";
+    ty_histogram dispatch = {0}, roundtrip = {0};
+    bench_loop loop;
+
+    if (!bench_enabled(name))
+        return;
+
+    /* Dispatch latency goes from ty_task_start() to the task starting in a pool thread,
+       round-trip latency ends when the caller sees the task as finished. */
+    for (bench_start(&loop); bench_next(&loop);) {
+        ty_task *task;
+        uint64_t start, run_time = 0;
+        int r;
+
+        r = ty_task_new("bench", run_timestamp_task, &task);
+        if (r < 0) {
+            bench_fail(name, ty_error_last_message());
+            return;
+        }
+        task->pool = pool;
+        task->result = &run_time;
+
+        /* Waiting without a timeout (and ty_task_join) runs the task inline if the pool
+           has not picked it up yet, which is not what we want to measure. */
+        start = ty_micros();
+        r = ty_task_start(task);
+        if (!r) {
+            ty_task_wait(task, TY_TASK_STATUS_FINISHED, POOL_TIMEOUT);
+            r = task->ret;
+        }
+        ty_histogram_add(&dispatch, run_time - start);
+        ty_histogram_add(&roundtrip, ty_micros() - start);
+
+        task->result = NULL;
+        ty_task_unref(task);
+        if (r < 0) {
+            bench_fail(name, ty_error_last_message());
+            return;
+        }
+    }
+
+    report_bench_latency("task.pool_latency.dispatch", &dispatch, &loop);
+    report_bench_latency("task.pool_latency.roundtrip", &roundtrip, &loop);
+}
+
+static void bench_pool_throughput(ty_pool *pool)
+{
+    const char *name = "task.pool_throughput";
+    bench_loop loop;
+
+    if (!bench_enabled(name))
+        return;
+
+    for (bench_start(&loop); bench_next(&loop);) {
+        ty_task *tasks[POOL_BATCH_SIZE] = {0};
+        int r = 0;
+
+        for (unsigned int i = 0; i < TY_COUNTOF(tasks) && !r; i++) {
+            r = ty_task_new("bench", run_empty_task, &tasks[i]);
+            if (!r) {
+                tasks[i]->pool = pool;
+                r = ty_task_start(tasks[i]);
+            }
+        }
+        for (unsigned int i = 0; i < TY_COUNTOF(tasks); i++) {
+            if (tasks[i])
+                ty_task_wait(tasks[i], TY_TASK_STATUS_FINISHED, POOL_TIMEOUT);
+            ty_task_unref(tasks[i]);
+        }
+        if (r < 0) {
+            bench_fail(name, ty_error_last_message());
+            return;
+        }
+    }
+
+    report_bench(name, bench_rate(&loop, POOL_BATCH_SIZE), "tasks/s", &loop);
+}
+
+static void bench_pool_deep_queue(ty_pool *pool)
+{
+    const char *name = "task.pool_deep_queue";
+    ty_histogram dispatch = {0};
+    bench_loop loop;
+    ty_task **tasks;
+    uint64_t *starts, *run_times;
+
+    if (!bench_enabled(name))
+        return;
+
+    tasks = calloc(POOL_DEEP_QUEUE_SIZE, sizeof(*tasks));
+    starts = calloc(POOL_DEEP_QUEUE_SIZE, sizeof(*starts));
+    run_times = calloc(POOL_DEEP_QUEUE_SIZE, sizeof(*run_times));
+    if (!tasks || !starts || !run_times) {
+        bench_fail(name, "Out of memory");
+        goto cleanup;
+    }
+
+    /* Thousands of tasks are queued at once, this measures how long each one waits between
+       ty_task_start() and running in a pool thread. */
+    for (bench_start(&loop); bench_next(&loop);) {
+        int r = 0;
+
+        for (unsigned int i = 0; i < POOL_DEEP_QUEUE_SIZE && !r; i++) {
+            r = ty_task_new("bench", run_timestamp_task, &tasks[i]);
+            if (!r) {
+                tasks[i]->pool = pool;
+                tasks[i]->result = &run_times[i];
+                starts[i] = ty_micros();
+                r = ty_task_start(tasks[i]);
+            }
+        }
+        for (unsigned int i = 0; i < POOL_DEEP_QUEUE_SIZE; i++) {
+            if (tasks[i]) {
+                if (ty_task_wait(tasks[i], TY_TASK_STATUS_FINISHED, POOL_TIMEOUT) == 1 &&
+                        !tasks[i]->ret && !r)
+                    ty_histogram_add(&dispatch, run_times[i] - starts[i]);
+                tasks[i]->result = NULL;
+            }
+            ty_task_unref(tasks[i]);
+            tasks[i] = NULL;
+        }
+        if (r < 0) {
+            bench_fail(name, ty_error_last_message());
+            goto cleanup;
+        }
+    }
+
+    report_bench_latency(name, &dispatch, &loop);
+
+cleanup:
+    free(run_times);
+    free(starts);
+    free(tasks);
+}
+
+static void discard_message(const ty_message_data *msg, void *udata)
+{
+    TY_UNUSED(msg);
+    TY_UNUSED(udata);
+}
+
+static void bench_log(void)
+{
+    const char *name = "message.log";
+    bench_loop loop;
+
+    if (!bench_enabled(name))
+        return;
+
+    ty_message_redirect(discard_message, NULL);
+    for (bench_start(&loop); bench_next(&loop);)
+        ty_log(TY_LOG_INFO, "Uploaded block %"PRIu64" to board '%s'", loop.iterations, "bench");
+    ty_message_redirect(ty_message_default_handler, NULL);
+
+    report_bench(name, bench_rate(&loop, 1.0), "messages/s", &loop);
+}
+
+static void bench_log_async(void)
+{
+    const char *name = "message.log_async";
+    bench_loop loop;
+    int r;
+
+    if (!bench_enabled(name))
+        return;
+
+    ty_message_redirect(discard_message, NULL);
+    r = ty_message_start_async();
+    if (r < 0) {
+        ty_message_redirect(ty_message_default_handler, NULL);
+        bench_fail(name, ty_error_last_message());
+        return;
+    }
+    for (bench_start(&loop); bench_next(&loop);)
+        ty_log(TY_LOG_INFO, "Uploaded block %"PRIu64" to board '%s'", loop.iterations, "bench");
+    ty_message_stop_async();
+    ty_message_redirect(ty_message_default_handler, NULL);
+
+    report_bench(name, bench_rate(&loop, 1.0), "messages/s", &loop);
+}
+
+static void write_message(const ty_message_data *msg, void *udata)
+{
+    FILE *fp = (FILE *)udata;
+
+    if (msg->type == TY_MESSAGE_LOG) {
+        fprintf(fp, "%28s  %s\n", msg->ctx ? msg->ctx : "", msg->u.log.msg);
+        fflush(fp);
+    }
+}
+
+// Time spent in ty_log() by the emitting thread, when the handler writes to a file
+static void bench_log_latency(bool async)
+{
+    const char *name = async ? "message.log_latency.async" : "message.log_latency.sync";
+    ty_histogram latency = {0};
+    bench_loop loop;
+    FILE *fp;
+    int r;
+
+    if (!bench_enabled(name))
+        return;
+
+    fp = tmpfile();
+    if (!fp) {
+        bench_fail(name, "Failed to create temporary file");
+        return;
+    }
+
+    ty_message_redirect(write_message, fp);
+    if (async) {
+        r = ty_message_start_async();
+        if (r < 0) {
+            ty_message_redirect(ty_message_default_handler, NULL);
+            fclose(fp);
+            bench_fail(name, ty_error_last_message());
+            return;
+        }
+    }
+    for (bench_start(&loop); bench_next(&loop);) {
+        uint64_t start = ty_micros();
+
+        ty_log(TY_LOG_INFO, "Uploaded block %"PRIu64" to board '%s'", loop.iterations, "bench");
+        ty_histogram_add(&latency, ty_micros() - start);
+
+        // Leave the consumer some time, we don't want to measure a full ring
+        if (!(loop.iterations % 64))
+            ty_message_flush();
+    }
+    ty_message_stop_async();
+    ty_message_redirect(ty_message_default_handler, NULL);
+    fclose(fp);
+
+    report_bench_latency(name, &latency, &loop);
+}
+
+static void bench_masked_error(bool constant)
+{
+    const char *name = constant ? "message.masked_error.constant"
+                                : "message.masked_error.formatted";
+    bench_loop loop;
+
+    if (!bench_enabled(name))
+        return;
+
+    /* Only constant messages are deferred until ty_error_last_message(), messages with
+       arguments still go through vsnprintf() on each call. */
+    ty_error_mask(TY_ERROR_NOT_FOUND);
+    for (bench_start(&loop); bench_next(&loop);) {
+        if (constant) {
+            ty_error(TY_ERROR_NOT_FOUND, "Board not found");
+        } else {
+            ty_error(TY_ERROR_NOT_FOUND, "Board '%s' not found (serial %"PRIu64")", "bench",
+                     loop.iterations);
+        }
+    }
+    ty_error_unmask();
+
+    report_bench(name, bench_rate(&loop, 1.0), "calls/s", &loop);
+}
+
+static void bench_progress(void)
+{
+    const char *name = "message.progress";
+    bench_loop loop;
+
+    if (!bench_enabled(name))
+        return;
+
+    ty_message_redirect(discard_message, NULL);
+    for (bench_start(&loop); bench_next(&loop);)
+        ty_progress("Uploading", loop.iterations % 1024, 1024);
+    ty_message_redirect(ty_message_default_handler, NULL);
+
+    report_bench(name, bench_rate(&loop, 1.0), "messages/s", &loop);
+}
+
+void bench_task(void)
+{
+    ty_pool *pool;
+    int r;
+
+    r = ty_pool_new(&pool);
+    if (r < 0) {
+        bench_fail("task", ty_error_last_message());
+        return;
+    }
+
+    bench_pool_latency(pool);
+    bench_pool_throughput(pool);
+    bench_pool_deep_queue(pool);
+    bench_log();
+    bench_log_async();
+    bench_log_latency(false);
+    bench_log_latency(true);
+    bench_masked_error(false);
+    bench_masked_error(true);
+    bench_progress();
+
+    ty_pool_free(pool);
+}
@@ -0,0 +1,536 @@
+/* TyTools - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/tytools
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#include "test_libty.h"
+#if !defined(_WIN32) && !defined(__APPLE__)
+    #include <dirent.h>
+    #include <unistd.h>
+    #include <utime.h>
+#endif
+#include "../../src/libty/class_priv.h"
+#include "../../src/libty/firmware.h"
+
+static int load_ihex(const char *str, ty_firmware **rfw)
+{
+    int r;
+
+    ty_error_mask(TY_ERROR_PARSE);
+    r = ty_firmware_load_mem("test.hex", (const uint8_t *)str, strlen(str), NULL, rfw);
+    ty_error_unmask();
+
+    return r;
+}
+
+static void test_firmware_ihex_simple(void)
+{
+    {
+        ty_firmware *fw = NULL;
+        int r = load_ihex(":0400000001020304F2\r\n"
+                          ":00000001FF\r\n", &fw);
+
+        ASSERT(!r);
+        if (!r) {
+            ASSERT(fw->segments_count == 1);
+            ASSERT(fw->total_size == 4 && fw->max_address == 4);
+            ASSERT(!memcmp(fw->segments[0].data, "\x01\x02\x03\x04", 4));
+        }
+        ty_firmware_unref(fw);
+    }
+
+    {
+        ty_firmware *fw = NULL;
+        int r = load_ihex(":0400000001020304f2\n:00000001ff", &fw);
+
+        ASSERT(!r);
+        if (!r)
+            ASSERT(fw->total_size == 4);
+        ty_firmware_unref(fw);
+    }
+}
+
+static void test_firmware_ihex_long(void)
+{
+    // Long records go through the vectorized decoder (if any)
+    {
+        ty_firmware *fw = NULL;
+        int r = load_ihex(":20001000000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1FE0\n"
+                          ":20003000A0A1A2A3A4A5A6A7A8A9AAABACADAEAFB0B1B2B3B4B5B6B7B8B9BABBBCBDBEBFC0\n"
+                          ":00000001FF\n", &fw);
+
+        ASSERT(!r);
+        if (!r) {
+            ASSERT(fw->segments[0].size == 0x50);
+            ASSERT(fw->segments[0].data[0x10] == 0x00 && fw->segments[0].data[0x2F] == 0x1F);
+            ASSERT(fw->segments[0].data[0x30] == 0xA0 && fw->segments[0].data[0x4F] == 0xBF);
+        }
+        ty_firmware_unref(fw);
+    }
+
+    {
+        ty_firmware *fw = NULL;
+        int r = load_ihex(":20001000000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1FE1\n"
+                          ":00000001FF\n", &fw);
+        ASSERT(r == TY_ERROR_PARSE);
+        ty_firmware_unref(fw);
+    }
+
+    {
+        ty_firmware *fw = NULL;
+        int r = load_ihex(":20001000000102030405060708090A0B0C0D0E0F10111213141516171819G.1B1C1D1E1FE0\n"
+                          ":00000001FF\n", &fw);
+        ASSERT(r == TY_ERROR_PARSE);
+        ty_firmware_unref(fw);
+    }
+}
+
+static void test_firmware_ihex_extended(void)
+{
+    {
+        ty_firmware *fw = NULL;
+        int r = load_ihex(":0200000460009A\n"
+                          ":08000000464346420001005690\n"
+                          ":00000001FF\n", &fw);
+
+        ASSERT(!r);
+        if (!r) {
+            const ty_firmware_segment *segment = ty_firmware_find_segment(fw, 0x60000000);
+
+            ASSERT(segment && segment->size == 8);
+            ASSERT(fw->max_address == 0x60000008);
+        }
+        ty_firmware_unref(fw);
+    }
+}
+
+static void test_firmware_ihex_errors(void)
+{
+    static const char *const invalid_hexes[] = {
+        "",
+        ":0400000001020304F2\n",
+        ":0400000001020304F3\n:00000001FF\n",
+        ":0400000001020304\n:00000001FF\n",
+        ":0400000001020304F2FF\n:00000001FF\n",
+        "0400000001020304F2\n:00000001FF\n",
+        ":04000000010203 4F2\n:00000001FF\n",
+        ":00000007F9\n"
+    };
+
+    for (unsigned int i = 0; i < TY_COUNTOF(invalid_hexes); i++) {
+        ty_firmware *fw = NULL;
+        int r = load_ihex(invalid_hexes[i], &fw);
+
+        ASSERT(r == TY_ERROR_PARSE);
+        ty_firmware_unref(fw);
+    }
+}
+
+static char *generate_ihex(uint32_t address, size_t size, char *buf)
+{
+    char *ptr = buf;
+
+    for (size_t offset = 0; offset < size; offset += 16) {
+        uint32_t record_address = (uint32_t)(address + offset);
+        uint8_t sum = (uint8_t)(16 + (record_address >> 8) + record_address);
+
+        ptr += sprintf(ptr, ":10%04X00", record_address & 0xFFFF);
+        for (unsigned int i = 0; i < 16; i++) {
+            uint8_t byte = (uint8_t)(offset + i);
+
+            ptr += sprintf(ptr, "%02X", byte);
+            sum = (uint8_t)(sum + byte);
+        }
+        ptr += sprintf(ptr, "%02X\n", (uint8_t)-sum);
+    }
+
+    return ptr;
+}
+
+static void test_firmware_ihex_stream(void)
+{
+    static char hex[4096 / 16 * 44 + 64];
+    size_t len;
+
+    len = (size_t)(generate_ihex(0, 4096, hex) - hex);
+
+    // Odd chunk sizes split records (and line endings) everywhere
+    for (size_t chunk_len = 1; chunk_len < 64; chunk_len += 7) {
+        ty_firmware *fw = NULL;
+        int r;
+
+        r = ty_firmware_stream_new("test.hex", NULL, &fw);
+        ASSERT(!r);
+        if (r < 0)
+            continue;
+
+        for (size_t offset = 0; !r && offset < len; offset += chunk_len)
+            r = ty_firmware_stream_feed(fw, (const uint8_t *)hex + offset, TY_MIN(chunk_len, len - offset));
+        ASSERT(!r);
+        ASSERT(ty_firmware_wait(fw, 4096, 0) == 1);
+        ASSERT(!ty_firmware_wait(fw, 8192, 0) && !ty_firmware_is_loaded(fw));
+
+        r = ty_firmware_stream_feed(fw, (const uint8_t *)":00000001FF", 11);
+        ASSERT(!r);
+        r = ty_firmware_stream_finish(fw, 0);
+        ASSERT(!r);
+
+        ASSERT(ty_firmware_is_loaded(fw) && ty_firmware_wait(fw, SIZE_MAX, 0) == 1);
+        ASSERT(fw->total_size == 4096 && fw->segments[0].data[4095] == 0xFF);
+
+        ty_firmware_unref(fw);
+    }
+
+    // Records that go back to published blocks are valid, but nothing is final until the end
+    {
+        ty_firmware *fw = NULL;
+        int r;
+
+        r = ty_firmware_stream_new("test.hex", NULL, &fw);
+        ASSERT(!r);
+        if (!r) {
+            r = ty_firmware_stream_feed(fw, (const uint8_t *)hex, len);
+            ASSERT(!r);
+            ASSERT(ty_firmware_wait(fw, 4096, 0) == 1);
+
+            r = ty_firmware_stream_feed(fw, (const uint8_t *)":0100000042BD\n:00000001FF\n", 26);
+            ASSERT(!r);
+            ASSERT(!ty_firmware_wait(fw, 4096, 0));
+
+            r = ty_firmware_stream_finish(fw, 0);
+            ASSERT(!r);
+            ASSERT(ty_firmware_wait(fw, 4096, 0) == 1);
+            ASSERT(fw->total_size == 4096 && fw->segments[0].data[0] == 0x42);
+        }
+        ty_firmware_unref(fw);
+    }
+
+    // Background parsing
+    {
+        FILE *fp = tmpfile();
+        ty_firmware *fw = NULL;
+        int r;
+
+        ASSERT(fp);
+        if (!fp)
+            return;
+        fwrite(hex, 1, len, fp);
+        fputs(":00000001FF\n", fp);
+        rewind(fp);
+
+        r = ty_firmware_stream_file("test.hex", fp, NULL, &fw);
+        ASSERT(!r);
+        if (!r) {
+            ASSERT(ty_firmware_wait(fw, SIZE_MAX, -1) == 1);
+            ASSERT(fw->total_size == 4096 && fw->max_address == 4096);
+        }
+        ty_firmware_unref(fw);
+
+        fclose(fp);
+    }
+}
+
+// Minimal little-endian ELF32 with one PT_LOAD segment (8 bytes at 0x60000000)
+static size_t build_elf(uint8_t *buf)
+{
+    static const uint8_t ehdr[52] = {
+        0x7F, 'E', 'L', 'F', 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        2, 0, 40, 0, 1, 0, 0, 0, 0, 0, 0, 0x60, 52, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 52, 0, 32, 0, 1, 0, 0, 0,
+        0, 0, 0, 0
+    };
+    static const uint8_t phdr[32] = {
+        1, 0, 0, 0, 84, 0, 0, 0, 0, 0, 0, 0x60, 0, 0, 0, 0x60,
+        8, 0, 0, 0, 8, 0, 0, 0, 5, 0, 0, 0, 4, 0, 0, 0
+    };
+
+    memcpy(buf, ehdr, sizeof(ehdr));
+    memcpy(buf + 52, phdr, sizeof(phdr));
+    memcpy(buf + 84, "FCFB\x01\x02\x03\x04", 8);
+
+    return 92;
+}
+
+static void test_firmware_elf_in_place(void)
+{
+    uint8_t elf[92];
+    size_t len = build_elf(elf);
+
+    {
+        ty_firmware *fw = NULL;
+        int r = ty_firmware_load_mem("test.elf", elf, len, NULL, &fw);
+
+        ASSERT(!r);
+        if (!r) {
+            ASSERT(fw->segments_count == 1 && fw->segments[0].alloc_size);
+            ASSERT(fw->segments[0].address == 0x60000000 && fw->max_address == 0x60000008);
+            ASSERT(!memcmp(fw->segments[0].data, "FCFB\x01\x02\x03\x04", 8));
+        }
+        ty_firmware_unref(fw);
+    }
+
+    {
+        FILE *fp = tmpfile();
+        ty_firmware *fw = NULL;
+        int r;
+
+        ASSERT(fp);
+        if (!fp)
+            return;
+        ASSERT(fwrite(elf, 1, len, fp) == len);
+        fflush(fp);
+        rewind(fp);
+
+        r = ty_firmware_load_file("test", fp, "elf", &fw);
+        ASSERT(!r);
+        if (!r) {
+            ty_firmware_segment *segment = &fw->segments[0];
+
+            // The segment should point inside the file contents
+            ASSERT(fw->segments_count == 1 && segment->size == 8);
+            ASSERT(!segment->alloc_size && segment->data == fw->file_mem + 84);
+            ASSERT(!memcmp(segment->data, "FCFB\x01\x02\x03\x04", 8));
+
+            // Rewriting the file must not change (or break) the loaded firmware
+            rewind(fp);
+            memset(elf, 0xFF, len);
+            ASSERT(fwrite(elf, 1, len, fp) == len);
+            fflush(fp);
+            ASSERT(!memcmp(segment->data, "FCFB\x01\x02\x03\x04", 8));
+
+            // Expanding must copy the segment out of the file contents
+            r = ty_firmware_expand_segment(fw, segment, 12);
+            ASSERT(!r && segment->alloc_size >= 12);
+            ASSERT(!memcmp(segment->data, "FCFB\x01\x02\x03\x04", 8));
+        }
+        ty_firmware_unref(fw);
+
+        fclose(fp);
+    }
+}
+
+#if !defined(_WIN32) && !defined(__APPLE__)
+
+static bool write_file(const char *filename, const char *content)
+{
+    FILE *fp = fopen(filename, "wb");
+
+    if (!fp)
+        return false;
+    fputs(content, fp);
+    fclose(fp);
+
+    return true;
+}
+
+static void delete_tree(const char *path)
+{
+    DIR *d = opendir(path);
+
+    if (d) {
+        struct dirent *ent;
+
+        while ((ent = readdir(d))) {
+            char child[1024];
+
+            if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+                continue;
+
+            snprintf(child, sizeof(child), "%s/%s", path, ent->d_name);
+            delete_tree(child);
+        }
+
+        closedir(d);
+        rmdir(path);
+    } else {
+        unlink(path);
+    }
+}
+
+static void test_firmware_cache(void)
+{
+    char dir[] = "/tmp/test_libty_XXXXXX";
+    char filename[64];
+    char cache_dir[96];
+    char *prev_config_home;
+
+    if (!mkdtemp(dir)) {
+        ASSERT(false);
+        return;
+    }
+    prev_config_home = getenv("XDG_CONFIG_HOME");
+    if (prev_config_home)
+        prev_config_home = strdup(prev_config_home);
+    setenv("XDG_CONFIG_HOME", dir, 1);
+
+    snprintf(filename, sizeof(filename), "%s/teensy40.hex", dir);
+    ASSERT(write_file(filename, ":0200000460009A\n"
+                         ":08000000464346420000015690\n"
+                         ":00000001FF\n"));
+    snprintf(cache_dir, sizeof(cache_dir), "%s/TyTools/FirmwareCache", dir);
+
+    // Nothing gets stored unless the application enables the cache
+    {
+        ty_firmware *fw = NULL;
+        int r = ty_firmware_load_file(filename, NULL, NULL, &fw);
+
+        ASSERT(!r && access(cache_dir, F_OK) < 0);
+        ty_firmware_unref(fw);
+    }
+    ty_firmware_set_cache_size(1024);
+
+    // Parse and identify, then store
+    {
+        ty_firmware *fw = NULL;
+        int r = ty_firmware_load_file(filename, NULL, NULL, &fw);
+
+        ASSERT(!r);
+        if (!r)
+            ASSERT(fw->identified && fw->segments[1].alloc_size);
+        ty_firmware_unref(fw);
+    }
+
+    // Straight from the cache, the segment points inside the entry
+    {
+        ty_firmware *fw = NULL;
+        int r = ty_firmware_load_file(filename, NULL, NULL, &fw);
+
+        ASSERT(!r);
+        if (!r) {
+            const ty_firmware_segment *segment = ty_firmware_find_segment(fw, 0x60000000);
+            ty_model models[4];
+
+            ASSERT(segment && !segment->alloc_size && segment->size == 8);
+            ASSERT(fw->max_address == 0x60000008 && fw->total_size == 8);
+            ASSERT(ty_firmware_identify(fw, models, TY_COUNTOF(models)) >= 1 &&
+                   models[0] == TY_MODEL_TEENSY_40);
+        }
+        ty_firmware_unref(fw);
+    }
+
+    // Same size, same (coarse) mtime, but the content hash does not match
+    ASSERT(write_file(filename, ":0200000460009A\n"
+                         ":08000000464346420000015790\n"
+                         ":00000001FF\n"));
+    {
+        ty_firmware *fw = NULL;
+        int r;
+
+        ty_error_mask(TY_ERROR_PARSE);
+        r = ty_firmware_load_file(filename, NULL, NULL, &fw);
+        ty_error_unmask();
+
+        // The checksum is wrong now, so this must come from the parser
+        ASSERT(r == TY_ERROR_PARSE);
+        ty_firmware_unref(fw);
+    }
+
+    // Storing a new entry deletes old entries beyond the size limit and stale temporary files
+    {
+        static const char *const names[] = {"0000000000000000.bin", "0000000000000000.bin.tmp",
+                                            "0000000000000001.bin.tmp"};
+        char path[160];
+        struct utimbuf times;
+        ty_firmware *fw = NULL;
+        int r;
+
+        times.actime = times.modtime = time(NULL) - 3600;
+        for (unsigned int i = 0; i < TY_COUNTOF(names); i++) {
+            char content[2048];
+
+            memset(content, 'x', sizeof(content) - 1);
+            content[sizeof(content) - 1] = 0;
+            snprintf(path, sizeof(path), "%s/%s", cache_dir, names[i]);
+            ASSERT(write_file(path, content));
+            if (i < 2)
+                utime(path, &times);
+        }
+
+        snprintf(filename, sizeof(filename), "%s/other.hex", dir);
+        ASSERT(write_file(filename, ":0200000460009A\n"
+                             ":08000000464346420000015690\n"
+                             ":00000001FF\n"));
+        r = ty_firmware_load_file(filename, NULL, NULL, &fw);
+        ASSERT(!r);
+        ty_firmware_unref(fw);
+
+        for (unsigned int i = 0; i < TY_COUNTOF(names); i++) {
+            snprintf(path, sizeof(path), "%s/%s", cache_dir, names[i]);
+            ASSERT((access(path, F_OK) == 0) == (i == 2));
+        }
+    }
+
+    ty_firmware_set_cache_size(0);
+    if (prev_config_home) {
+        setenv("XDG_CONFIG_HOME", prev_config_home, 1);
+        free(prev_config_home);
+    } else {
+        unsetenv("XDG_CONFIG_HOME");
+    }
+    delete_tree(dir);
+}
+
+#endif
+
+static unsigned int plan_builds;
+
+static int build_test_plan(const ty_firmware *fw, ty_model model, _ty_upload_plan *plan)
+{
+    plan_builds++;
+
+    plan->report_size = 16;
+    plan->blocks_count = (unsigned int)fw->segments_count + (unsigned int)model;
+
+    return 0;
+}
+
+static void test_firmware_upload_plan(void)
+{
+    static const struct _ty_class_vtable vtable;
+    ty_firmware *fw;
+    _ty_upload_plan *plan1 = NULL, *plan2 = NULL, *plan3 = NULL;
+    int r;
+
+    r = load_ihex(":0400000001020304F2\n:00000001FF\n", &fw);
+    ASSERT(!r);
+    if (r < 0)
+        return;
+
+    plan_builds = 0;
+    r = _ty_upload_plan_get(fw, &vtable, 1, build_test_plan, &plan1);
+    ASSERT(!r && plan1);
+    r = _ty_upload_plan_get(fw, &vtable, 1, build_test_plan, &plan2);
+    ASSERT(!r && plan2 == plan1);
+    ASSERT(plan_builds == 1);
+    r = _ty_upload_plan_get(fw, &vtable, 2, build_test_plan, &plan3);
+    ASSERT(!r && plan3 && plan3 != plan1);
+    ASSERT(plan_builds == 2);
+    ASSERT(plan3 && plan3->blocks_count == 3);
+
+    // Plans must outlive the firmware as long as someone uses them
+    ty_firmware_unref(fw);
+    ASSERT(plan1 && plan1->blocks_count == 2 && plan1->report_size == 16);
+
+    _ty_upload_plan_unref(plan3);
+    _ty_upload_plan_unref(plan2);
+    _ty_upload_plan_unref(plan1);
+}
+
+void test_firmware(void)
+{
+    test_firmware_ihex_simple();
+    test_firmware_ihex_long();
+    test_firmware_ihex_extended();
+    test_firmware_ihex_errors();
+    test_firmware_ihex_stream();
+    test_firmware_elf_in_place();
+    test_firmware_upload_plan();
+#if !defined(_WIN32) && !defined(__APPLE__)
+    test_firmware_cache();
+#endif
+}
@@ -0,0 +1,66 @@
+/* TyTools - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/tytools
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#include "test_libty.h"
+#include "../../src/libty/histogram.h"
+
+static void test_histogram_percentiles(void)
+{
+    ty_histogram h = {0};
+
+    ASSERT(!ty_histogram_get_percentile(&h, 50.0));
+    ASSERT(!ty_histogram_get_mean(&h));
+
+    // Small values get their own bucket
+    for (uint64_t i = 1; i <= 10; i++)
+        ty_histogram_add(&h, i);
+    ASSERT(h.count == 10 && h.min == 1 && h.max == 10);
+    ASSERT(ty_histogram_get_percentile(&h, 50.0) == 5);
+    ASSERT(ty_histogram_get_percentile(&h, 100.0) == 10);
+    ASSERT(ty_histogram_get_mean(&h) == 5);
+
+    // Bigger values are approximated, with less than 1/16 of error
+    for (unsigned int i = 0; i < 90; i++)
+        ty_histogram_add(&h, 100000);
+    ASSERT(ty_histogram_get_percentile(&h, 10.0) == 10);
+    ASSERT(ty_histogram_get_percentile(&h, 50.0) >= 100000);
+    ASSERT(ty_histogram_get_percentile(&h, 50.0) <= 100000 + 100000 / 16);
+    ASSERT(ty_histogram_get_percentile(&h, 99.0) == 100000);
+
+    // Too big, clamped
+    ty_histogram_add(&h, UINT64_MAX);
+    ASSERT(h.max == TY_HISTOGRAM_MAX_VALUE);
+}
+
+static void test_histogram_merge(void)
+{
+    ty_histogram h1 = {0}, h2 = {0}, empty = {0};
+
+    ty_histogram_add(&h1, 20);
+    ty_histogram_add(&h1, 30);
+    ty_histogram_add(&h2, 5);
+    ty_histogram_add(&h2, 4000);
+
+    ty_histogram_merge(&h1, &empty);
+    ASSERT(h1.count == 2 && h1.min == 20);
+
+    ty_histogram_merge(&h1, &h2);
+    ASSERT(h1.count == 4);
+    ASSERT(h1.min == 5 && h1.max == 4000);
+    ASSERT(h1.sum == 4055);
+    ASSERT(ty_histogram_get_percentile(&h1, 25.0) == 5);
+    ASSERT(ty_histogram_get_percentile(&h1, 100.0) == 4000);
+}
+
+void test_histogram(void)
+{
+    test_histogram_percentiles();
+    test_histogram_merge();
+}
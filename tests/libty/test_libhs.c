@@ -0,0 +1,183 @@
+/* TyTools - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/tytools
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#include "test_libty.h"
+#ifdef __linux__
+    #include <arpa/inet.h>
+    #include "../../src/libhs/monitor_priv.h"
+#endif
+
+#ifdef __linux__
+
+#define KERNEL_ADD_MESSAGE \
+    "add@/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2:1.0/0003:16C0:0486.0001/hidraw/hidraw0\0" \
+    "ACTION=add\0" \
+    "DEVPATH=/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2:1.0/0003:16C0:0486.0001/hidraw/hidraw0\0" \
+    "SUBSYSTEM=hidraw\0" \
+    "MAJOR=243\0" \
+    "MINOR=0\0" \
+    "DEVNAME=hidraw0\0" \
+    "SEQNUM=4242\0"
+
+// Same layout as the header udevd puts in front of its messages
+struct udev_header {
+    char prefix[8];
+    unsigned int magic;
+    unsigned int header_size;
+    unsigned int properties_off;
+    unsigned int properties_len;
+};
+
+#define COPY_MESSAGE(buf, msg) \
+    copy_message((buf), sizeof(buf), (msg), sizeof(msg) - 1)
+
+static size_t copy_message(char *buf, size_t size, const char *msg, size_t len)
+{
+    if (len >= size)
+        len = size - 1;
+    memcpy(buf, msg, len);
+    buf[len] = 0;
+
+    return len;
+}
+
+static void test_uevent_kernel(void)
+{
+    char buf[512];
+    struct _hs_uevent ev;
+    size_t len;
+    bool valid;
+
+    len = COPY_MESSAGE(buf, KERNEL_ADD_MESSAGE);
+    valid = _hs_parse_uevent(buf, len, _HS_UEVENT_GROUP_KERNEL, &ev);
+    ASSERT(valid);
+    if (valid) {
+        ASSERT_STR_EQUAL(ev.action, "add");
+        ASSERT_STR_EQUAL(ev.devpath, "/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2:1.0/"
+                                     "0003:16C0:0486.0001/hidraw/hidraw0");
+        ASSERT_STR_EQUAL(ev.subsystem, "hidraw");
+        ASSERT_STR_EQUAL(ev.devname, "hidraw0");
+    }
+
+    // Devices without a node (e.g. USB interfaces) have no DEVNAME
+    len = COPY_MESSAGE(buf, "remove@/devices/usb1/1-2/1-2:1.0\0ACTION=remove\0"
+                            "DEVPATH=/devices/usb1/1-2/1-2:1.0\0SUBSYSTEM=usb\0");
+    valid = _hs_parse_uevent(buf, len, _HS_UEVENT_GROUP_KERNEL, &ev);
+    ASSERT(valid);
+    if (valid) {
+        ASSERT_STR_EQUAL(ev.action, "remove");
+        ASSERT_STR_EQUAL(ev.subsystem, "usb");
+        ASSERT(!ev.devname);
+    }
+
+    // Truncated properties are ignored, the rest of the message must still be complete
+    len = copy_message(buf, sizeof(buf), KERNEL_ADD_MESSAGE, sizeof(KERNEL_ADD_MESSAGE) - 8);
+    valid = _hs_parse_uevent(buf, len, _HS_UEVENT_GROUP_KERNEL, &ev);
+    ASSERT(valid && ev.devname && !strcmp(ev.devname, "hidraw0"));
+    len = copy_message(buf, sizeof(buf), KERNEL_ADD_MESSAGE, 40);
+    ASSERT(!_hs_parse_uevent(buf, len, _HS_UEVENT_GROUP_KERNEL, &ev));
+
+    // No action@devpath header, or missing ACTION
+    len = COPY_MESSAGE(buf, "ACTION=add\0DEVPATH=/devices/foo\0SUBSYSTEM=tty\0");
+    ASSERT(!_hs_parse_uevent(buf, len, _HS_UEVENT_GROUP_KERNEL, &ev));
+    len = COPY_MESSAGE(buf, "add@/devices/foo\0DEVPATH=/devices/foo\0SUBSYSTEM=tty\0");
+    ASSERT(!_hs_parse_uevent(buf, len, _HS_UEVENT_GROUP_KERNEL, &ev));
+
+    // Kernel messages are not valid on the udev group
+    len = COPY_MESSAGE(buf, KERNEL_ADD_MESSAGE);
+    ASSERT(!_hs_parse_uevent(buf, len, _HS_UEVENT_GROUP_UDEV, &ev));
+
+    ASSERT(!_hs_parse_uevent(buf, 0, _HS_UEVENT_GROUP_KERNEL, &ev));
+}
+
+static size_t build_udev_message(char *buf, size_t size, const char *props, size_t props_len)
+{
+    struct udev_header header = {0};
+    size_t len;
+
+    memcpy(header.prefix, "libudev", 8);
+    header.magic = htonl(0xFEEDCAFE);
+    header.header_size = sizeof(header);
+    header.properties_off = sizeof(header) + 8;
+    header.properties_len = (unsigned int)props_len;
+
+    // udevd puts filter data between the header and the properties
+    len = header.properties_off + props_len;
+    if (len >= size)
+        return 0;
+    memset(buf, 0, size);
+    memcpy(buf, &header, sizeof(header));
+    memcpy(buf + header.properties_off, props, props_len);
+
+    return len;
+}
+
+static void test_uevent_udev(void)
+{
+    static const char props[] = "ACTION=add\0DEVPATH=/devices/usb1/1-2/1-2:1.0/tty/ttyACM0\0"
+                                "SUBSYSTEM=tty\0DEVNAME=/dev/ttyACM0\0";
+    char buf[512];
+    struct _hs_uevent ev;
+    struct udev_header header;
+    size_t len;
+    bool valid;
+
+    len = build_udev_message(buf, sizeof(buf), props, sizeof(props) - 1);
+    valid = _hs_parse_uevent(buf, len, _HS_UEVENT_GROUP_UDEV, &ev);
+    ASSERT(valid);
+    if (valid) {
+        ASSERT_STR_EQUAL(ev.action, "add");
+        ASSERT_STR_EQUAL(ev.devpath, "/devices/usb1/1-2/1-2:1.0/tty/ttyACM0");
+        ASSERT_STR_EQUAL(ev.subsystem, "tty");
+        ASSERT_STR_EQUAL(ev.devname, "/dev/ttyACM0");
+    }
+
+    // Udev messages are not valid on the kernel group
+    ASSERT(!_hs_parse_uevent(buf, len, _HS_UEVENT_GROUP_KERNEL, &ev));
+
+    // Truncated header or properties
+    ASSERT(!_hs_parse_uevent(buf, sizeof(header) - 1, _HS_UEVENT_GROUP_UDEV, &ev));
+    ASSERT(!_hs_parse_uevent(buf, len - 1, _HS_UEVENT_GROUP_UDEV, &ev));
+
+    // Bad prefix or magic
+    len = build_udev_message(buf, sizeof(buf), props, sizeof(props) - 1);
+    buf[0] = 'x';
+    ASSERT(!_hs_parse_uevent(buf, len, _HS_UEVENT_GROUP_UDEV, &ev));
+    len = build_udev_message(buf, sizeof(buf), props, sizeof(props) - 1);
+    memcpy(&header, buf, sizeof(header));
+    header.magic = 0xFEEDCAFE;
+    memcpy(buf, &header, sizeof(header));
+    ASSERT(!_hs_parse_uevent(buf, len, _HS_UEVENT_GROUP_UDEV, &ev));
+
+    // Properties outside of the message
+    len = build_udev_message(buf, sizeof(buf), props, sizeof(props) - 1);
+    memcpy(&header, buf, sizeof(header));
+    header.properties_off = 4;
+    memcpy(buf, &header, sizeof(header));
+    ASSERT(!_hs_parse_uevent(buf, len, _HS_UEVENT_GROUP_UDEV, &ev));
+    header.properties_off = sizeof(header) + 8;
+    header.properties_len = UINT_MAX;
+    memcpy(buf, &header, sizeof(header));
+    ASSERT(!_hs_parse_uevent(buf, len, _HS_UEVENT_GROUP_UDEV, &ev));
+
+    // Missing ACTION
+    len = build_udev_message(buf, sizeof(buf), props + 11, sizeof(props) - 12);
+    ASSERT(!_hs_parse_uevent(buf, len, _HS_UEVENT_GROUP_UDEV, &ev));
+}
+
+#endif
+
+void test_libhs(void)
+{
+#ifdef __linux__
+    test_uevent_kernel();
+    test_uevent_udev();
+#endif
+}
@@ -11,7 +11,14 @@
 #include <stdarg.h>
 #include "test_libty.h"
 
+void test_firmware(void);
+void test_histogram(void);
+void test_libhs(void);
+void test_message(void);
 void test_optline(void);
+void test_poller(void);
+void test_simulator(void);
+void test_task(void);
 
 static char current_file[1024];
 static char current_fn[256];
@@ -68,7 +75,14 @@ void report_test(bool pred, const char *file, unsigned int line, const char *fn,
 
 int main(void)
 {
+    test_firmware();
+    test_histogram();
+    test_libhs();
+    test_message();
     test_optline();
+    test_poller();
+    test_simulator();
+    test_task();
 
     conclude_current_test();
     if (cases_failures) {
@@ -0,0 +1,272 @@
+/* TyTools - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/tytools
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#include "test_libty.h"
+#include "../../src/libty/system.h"
+#include "../../src/libty/task.h"
+#include "../../src/libty/thread.h"
+
+#define ASYNC_THREADS 4
+#define ASYNC_MESSAGES 300
+
+struct message_capture {
+    ty_mutex mutex;
+
+    unsigned int count;
+    ty_thread_id thread_id;
+    bool same_thread;
+
+    unsigned int next[ASYNC_THREADS];
+    bool ordered;
+
+    ty_task *task;
+    unsigned int task_logs;
+    unsigned int task_logs_at_finish;
+    ty_thread_id status_thread;
+
+    unsigned int progress_count;
+    uint64_t progress_value;
+};
+
+static struct message_capture capture;
+
+static void capture_message(const ty_message_data *msg, void *udata)
+{
+    TY_UNUSED(udata);
+
+    ty_mutex_lock(&capture.mutex);
+
+    if (!capture.count++)
+        capture.thread_id = ty_thread_get_self_id();
+    if (capture.thread_id != ty_thread_get_self_id())
+        capture.same_thread = false;
+
+    switch (msg->type) {
+        case TY_MESSAGE_LOG: {
+            unsigned int thread, idx;
+
+            if (msg->task && msg->task == capture.task) {
+                capture.task_logs++;
+            } else if (sscanf(msg->u.log.msg, "thread %u message %u", &thread, &idx) == 2 &&
+                       thread < ASYNC_THREADS) {
+                if (idx != capture.next[thread])
+                    capture.ordered = false;
+                capture.next[thread] = idx + 1;
+            }
+        } break;
+
+        case TY_MESSAGE_STATUS: {
+            if (msg->task == capture.task) {
+                capture.status_thread = ty_thread_get_self_id();
+                if (msg->u.task.status == TY_TASK_STATUS_FINISHED)
+                    capture.task_logs_at_finish = capture.task_logs;
+            }
+        } break;
+
+        case TY_MESSAGE_PROGRESS: {
+            capture.progress_count++;
+            capture.progress_value = msg->u.progress.value;
+        } break;
+    }
+
+    ty_mutex_unlock(&capture.mutex);
+}
+
+static void test_message_masked_error(void)
+{
+    char str[32] = "abcdef";
+    char expected[600];
+    unsigned int count;
+
+    ty_mutex_init(&capture.mutex);
+    ty_message_redirect(capture_message, NULL);
+    capture.count = 0;
+
+    // Masked errors don't reach the handler, messages with arguments are formatted right away
+    ty_error_mask(TY_ERROR_IO);
+    ty_error(TY_ERROR_IO, "%s|%d|%5.2f|%ls", str, -42, 3.14159, L"wide");
+    memset(str, 'x', 6);
+    ASSERT_STR_EQUAL(ty_error_last_message(), "abcdef|-42| 3.14|wide");
+
+    ty_error(TY_ERROR_IO, "Wrapped: %s", ty_error_last_message());
+    ASSERT_STR_EQUAL(ty_error_last_message(), "Wrapped: abcdef|-42| 3.14|wide");
+
+    // Constant messages are only copied when needed
+    ty_error(TY_ERROR_IO, NULL);
+    ASSERT_STR_EQUAL(ty_error_last_message(), "I/O error");
+    ty_error(TY_ERROR_IO, "Constant message");
+    ty_error(TY_ERROR_IO, "Another constant message");
+    ASSERT_STR_EQUAL(ty_error_last_message(), "Another constant message");
+    ASSERT_STR_EQUAL(ty_error_last_message(), "Another constant message");
+    ty_error(TY_ERROR_IO, "100%% constant");
+    ASSERT_STR_EQUAL(ty_error_last_message(), "100% constant");
+
+    // Long messages are truncated
+    memset(expected, 'y', sizeof(expected) - 1);
+    expected[sizeof(expected) - 1] = 0;
+    ty_error(TY_ERROR_IO, "%s", expected);
+    ASSERT(strlen(ty_error_last_message()) == 511);
+
+    ty_error_mask(TY_ERROR_CANCELED);
+    ty_error(TY_ERROR_CANCELED, NULL);
+    ty_error_unmask();
+    ASSERT_STR_EQUAL(ty_error_last_message(), "Canceled");
+
+    // Error codes are part of the ABI, new ones go after TY_ERROR_OTHER
+    ASSERT(TY_ERROR_PARSE == -13 && TY_ERROR_OTHER == -14);
+    ASSERT(TY_ERROR_CANCELED < TY_ERROR_OTHER && TY_ERROR_SUPERSEDED < TY_ERROR_OTHER);
+
+    ty_error_unmask();
+
+    ty_mutex_lock(&capture.mutex);
+    count = capture.count;
+    ty_mutex_unlock(&capture.mutex);
+    ASSERT(!count);
+
+    // Unmasked errors replace the pending constant message
+    ty_error_mask(TY_ERROR_IO);
+    ty_error(TY_ERROR_IO, "Hidden");
+    ty_error_unmask();
+    ty_error(TY_ERROR_IO, "Visible %d", 1);
+    ASSERT_STR_EQUAL(ty_error_last_message(), "Visible 1");
+    ASSERT(capture.count == 1);
+
+    ty_message_redirect(ty_message_default_handler, NULL);
+    ty_mutex_release(&capture.mutex);
+}
+
+static int run_async_producer(void *udata)
+{
+    unsigned int thread = (unsigned int)(uintptr_t)udata;
+
+    for (unsigned int i = 0; i < ASYNC_MESSAGES; i++)
+        ty_log(TY_LOG_DEBUG, "thread %u message %u", thread, i);
+
+    return 0;
+}
+
+static int run_logging_task(ty_task *task)
+{
+    TY_UNUSED(task);
+
+    for (unsigned int i = 0; i < 50; i++)
+        ty_log(TY_LOG_DEBUG, "task message %u", i);
+
+    return 0;
+}
+
+static void test_message_async(void)
+{
+    ty_thread threads[ASYNC_THREADS];
+    unsigned int threads_count = 0;
+    ty_task *task = NULL;
+    int r;
+
+    ty_mutex_init(&capture.mutex);
+    capture.count = 0;
+    capture.same_thread = true;
+    capture.ordered = true;
+    ty_message_redirect(capture_message, NULL);
+
+    r = ty_message_start_async();
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+
+    // Each thread logs more messages than the ring holds
+    for (unsigned int i = 0; i < ASYNC_THREADS; i++) {
+        r = ty_thread_create(&threads[i], run_async_producer, (void *)(uintptr_t)i);
+        ASSERT(!r);
+        if (r < 0)
+            break;
+        threads_count++;
+    }
+    for (unsigned int i = 0; i < threads_count; i++)
+        ty_thread_join(&threads[i]);
+
+    ty_message_flush();
+    ty_mutex_lock(&capture.mutex);
+    ASSERT(capture.count == threads_count * ASYNC_MESSAGES);
+    ASSERT(capture.same_thread && capture.thread_id != ty_thread_get_self_id());
+    ASSERT(capture.ordered);
+    for (unsigned int i = 0; i < threads_count; i++)
+        ASSERT(capture.next[i] == ASYNC_MESSAGES);
+    ty_mutex_unlock(&capture.mutex);
+
+    // Status messages are handled synchronously, after the messages logged by the task
+    r = ty_task_new("logging", run_logging_task, &task);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+    capture.task = task;
+    r = ty_task_join(task);
+    ASSERT(!r);
+    ty_mutex_lock(&capture.mutex);
+    ASSERT(capture.task_logs_at_finish == 50);
+    ASSERT(capture.status_thread == ty_thread_get_self_id());
+    ty_mutex_unlock(&capture.mutex);
+
+    // Stopping handles the remaining messages
+    ty_log(TY_LOG_DEBUG, "thread 0 message %u", ASYNC_MESSAGES);
+    ty_message_stop_async();
+    ASSERT(capture.next[0] == ASYNC_MESSAGES + 1);
+
+cleanup:
+    ty_message_stop_async();
+    ty_message_redirect(ty_message_default_handler, NULL);
+    capture.task = NULL;
+    ty_task_unref(task);
+    ty_mutex_release(&capture.mutex);
+}
+
+static void test_message_progress_throttle(void)
+{
+    ty_mutex_init(&capture.mutex);
+    ty_message_redirect(capture_message, NULL);
+
+    // One message every 10%, including the first and the last one
+    ty_message_set_progress_throttle(100, 0);
+    capture.progress_count = 0;
+    for (uint64_t i = 0; i <= 1000; i++)
+        ty_progress("Writing", i, 1000);
+    ASSERT(capture.progress_count == 11 && capture.progress_value == 1000);
+
+    // No repeated 100% event, but a new action or a restart goes through
+    ty_progress("Writing", 1000, 1000);
+    ASSERT(capture.progress_count == 11);
+    ty_progress("Writing", 0, 1000);
+    ty_progress("Checking", 3, 1000);
+    ASSERT(capture.progress_count == 13 && capture.progress_value == 3);
+
+    // Slow progress is still reported after the interval
+    ty_message_set_progress_throttle(1000, 30);
+    capture.progress_count = 0;
+    ty_progress("Erasing", 0, 1000);
+    ty_progress("Erasing", 1, 1000);
+    ty_delay(40);
+    ty_progress("Erasing", 2, 1000);
+    ASSERT(capture.progress_count == 2 && capture.progress_value == 2);
+
+    ty_message_set_progress_throttle(0, 0);
+    capture.progress_count = 0;
+    for (uint64_t i = 0; i < 100; i++)
+        ty_progress("Sending", i, 1000);
+    ASSERT(capture.progress_count == 100);
+
+    ty_message_redirect(ty_message_default_handler, NULL);
+    ty_mutex_release(&capture.mutex);
+}
+
+void test_message(void)
+{
+    test_message_masked_error();
+    test_message_async();
+    test_message_progress_throttle();
+}
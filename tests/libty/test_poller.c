@@ -0,0 +1,243 @@
+/* TyTools - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/tytools
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#include "test_libty.h"
+#ifndef _WIN32
+    #include <unistd.h>
+#endif
+#include "../../src/libty/poller.h"
+
+#ifndef _WIN32
+
+#define PIPES_COUNT 100
+
+static bool has_event(const ty_poller_event *events, int count, int id)
+{
+    for (int i = 0; i < count; i++) {
+        if (events[i].id == id)
+            return true;
+    }
+    return false;
+}
+
+static void test_poller_many(void)
+{
+    ty_poller *poller = NULL;
+    int pipes[PIPES_COUNT][2];
+    unsigned int pipes_count = 0;
+    ty_poller_event events[16];
+    int r;
+
+    r = ty_poller_new(&poller);
+    ASSERT(!r);
+    if (r < 0)
+        return;
+
+    // More than what ty_descriptor_set can hold
+    for (unsigned int i = 0; i < PIPES_COUNT; i++) {
+        r = pipe(pipes[i]);
+        ASSERT(!r);
+        if (r < 0)
+            goto cleanup;
+        pipes_count++;
+
+        r = ty_poller_add(poller, pipes[i][0], (int)i + 1, 0);
+        ASSERT(!r);
+        if (r < 0)
+            goto cleanup;
+    }
+    ASSERT(ty_poller_get_count(poller) == PIPES_COUNT);
+
+    r = ty_poller_wait(poller, events, TY_COUNTOF(events), 0);
+    ASSERT(!r);
+
+    ASSERT(write(pipes[10][1], "a", 1) == 1);
+    ASSERT(write(pipes[50][1], "b", 1) == 1);
+    ASSERT(write(pipes[99][1], "c", 1) == 1);
+
+    r = ty_poller_wait(poller, events, TY_COUNTOF(events), 1000);
+    ASSERT(r == 3);
+    ASSERT(has_event(events, r, 11) && has_event(events, r, 51) && has_event(events, r, 100));
+
+    // Level-triggered descriptors stay ready until the data is consumed
+    ty_poller_remove(poller, 51);
+    ASSERT(ty_poller_get_count(poller) == PIPES_COUNT - 1);
+    r = ty_poller_wait(poller, events, TY_COUNTOF(events), 0);
+    ASSERT(r == 2);
+    ASSERT(has_event(events, r, 11) && has_event(events, r, 100) && !has_event(events, r, 51));
+
+    // Events are returned in batches of at most max_events
+    r = ty_poller_wait(poller, events, 1, 0);
+    ASSERT(r == 1);
+
+    ty_poller_clear(poller);
+    ASSERT(!ty_poller_get_count(poller));
+    r = ty_poller_wait(poller, events, TY_COUNTOF(events), 0);
+    ASSERT(!r);
+
+cleanup:
+    ty_poller_free(poller);
+    for (unsigned int i = 0; i < pipes_count; i++) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+}
+
+static void test_poller_regular_file(void)
+{
+    ty_poller *poller = NULL;
+    FILE *fp;
+    int fds[2] = {-1, -1};
+    ty_poller_event events[4];
+    uint64_t start;
+    int r;
+
+    r = ty_poller_new(&poller);
+    ASSERT(!r);
+    if (r < 0)
+        return;
+    fp = tmpfile();
+    ASSERT(fp);
+    if (!fp)
+        goto cleanup;
+    r = pipe(fds);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+
+    // Regular files (e.g. redirected to stdin) can always be read, like with poll()
+    r = ty_poller_add(poller, fileno(fp), 1, 0);
+    ASSERT(!r);
+    r = ty_poller_add(poller, fds[0], 2, 0);
+    ASSERT(!r);
+    ASSERT(ty_poller_get_count(poller) == 2);
+
+    start = ty_millis();
+    r = ty_poller_wait(poller, events, TY_COUNTOF(events), 5000);
+    ASSERT(r == 1 && events[0].id == 1 && events[0].desc == fileno(fp));
+    ASSERT(ty_millis() - start < 1000);
+
+    ASSERT(write(fds[1], "a", 1) == 1);
+    r = ty_poller_wait(poller, events, TY_COUNTOF(events), 1000);
+    ASSERT(r == 2 && has_event(events, r, 1) && has_event(events, r, 2));
+
+    ty_poller_remove(poller, 1);
+    ASSERT(ty_poller_get_count(poller) == 1);
+    r = ty_poller_wait(poller, events, TY_COUNTOF(events), 0);
+    ASSERT(r == 1 && events[0].id == 2);
+
+cleanup:
+    ty_poller_free(poller);
+    if (fp)
+        fclose(fp);
+    if (fds[0] >= 0) {
+        close(fds[0]);
+        close(fds[1]);
+    }
+}
+
+#ifdef __linux__
+
+static void test_poller_edge_triggered(void)
+{
+    ty_poller *poller = NULL;
+    int fds[2] = {-1, -1};
+    ty_poller_event ev;
+    int r;
+
+    r = ty_poller_new(&poller);
+    ASSERT(!r);
+    if (r < 0)
+        return;
+    r = pipe(fds);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+
+    r = ty_poller_add(poller, fds[0], 1, TY_POLLER_EDGE_TRIGGERED);
+    ASSERT(!r);
+
+    ASSERT(write(fds[1], "a", 1) == 1);
+    r = ty_poller_wait(poller, &ev, 1, 1000);
+    ASSERT(r == 1 && ev.id == 1 && ev.desc == fds[0]);
+
+    // Nothing new happened, even though the data is still there
+    r = ty_poller_wait(poller, &ev, 1, 0);
+    ASSERT(!r);
+
+    ASSERT(write(fds[1], "b", 1) == 1);
+    r = ty_poller_wait(poller, &ev, 1, 1000);
+    ASSERT(r == 1 && ev.id == 1);
+
+cleanup:
+    ty_poller_free(poller);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void test_poller_reused_descriptor(void)
+{
+    ty_poller *poller = NULL;
+    int old_fds[2] = {-1, -1}, fds[2] = {-1, -1};
+    ty_poller_event ev;
+    int r;
+
+    r = ty_poller_new(&poller);
+    ASSERT(!r);
+    if (r < 0)
+        return;
+    r = pipe(old_fds);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+    r = ty_poller_add(poller, old_fds[0], 1, 0);
+    ASSERT(!r);
+
+    // Closed too early, and the new pipe gets the same descriptor numbers
+    close(old_fds[0]);
+    close(old_fds[1]);
+    r = pipe(fds);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+    ASSERT(fds[0] == old_fds[0]);
+    r = ty_poller_add(poller, fds[0], 2, 0);
+    ASSERT(!r);
+
+    // Removing the stale registration must not remove the new one
+    ty_poller_remove(poller, 1);
+    ASSERT(ty_poller_get_count(poller) == 1);
+    ASSERT(write(fds[1], "a", 1) == 1);
+    r = ty_poller_wait(poller, &ev, 1, 1000);
+    ASSERT(r == 1 && ev.id == 2 && ev.desc == fds[0]);
+
+cleanup:
+    ty_poller_free(poller);
+    if (fds[0] >= 0) {
+        close(fds[0]);
+        close(fds[1]);
+    }
+}
+
+#endif
+
+#endif
+
+void test_poller(void)
+{
+#ifndef _WIN32
+    test_poller_many();
+    test_poller_regular_file();
+#ifdef __linux__
+    test_poller_edge_triggered();
+    test_poller_reused_descriptor();
+#endif
+#endif
+}
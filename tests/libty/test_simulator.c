@@ -0,0 +1,604 @@
+/* TyTools - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/tytools
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#include "test_libty.h"
+#if defined(__linux__) && defined(TEST_SIMULATOR)
+    #include <unistd.h>
+#endif
+#include "../../src/libty/board.h"
+#include "../../src/libty/firmware.h"
+#include "../../src/libty/monitor.h"
+#include "../../src/libty/system.h"
+#include "../../src/libty/task.h"
+#include "../../src/libty/thread.h"
+
+#if defined(__linux__) && defined(TEST_SIMULATOR)
+
+static int find_board_callback(ty_board *board, ty_monitor_event event, void *udata)
+{
+    ty_board **rboard = udata;
+
+    if (event == TY_MONITOR_EVENT_ADDED && !*rboard)
+        *rboard = ty_board_ref(board);
+
+    return 0;
+}
+
+// Earlier tests may leave some boards in bootloader mode
+static int find_running_board_callback(ty_board *board, ty_monitor_event event, void *udata)
+{
+    ty_board **rboard = udata;
+
+    if (event == TY_MONITOR_EVENT_ADDED && !*rboard &&
+            ty_board_has_capability(board, TY_BOARD_CAPABILITY_RUN))
+        *rboard = ty_board_ref(board);
+
+    return 0;
+}
+
+static int new_test_firmware(ty_firmware **rfw)
+{
+    ty_firmware *fw;
+    ty_firmware_segment *segment;
+    int r;
+
+    r = ty_firmware_new("simulator.hex", &fw);
+    if (r < 0)
+        return r;
+    r = ty_firmware_add_segment(fw, 0, 8192, &segment);
+    if (r < 0) {
+        ty_firmware_unref(fw);
+        return r;
+    }
+    for (size_t i = 0; i < segment->size; i++)
+        segment->data[i] = (uint8_t)i;
+    fw->total_size = segment->size;
+    fw->max_address = segment->size;
+
+    *rfw = fw;
+    return 0;
+}
+
+static void test_simulator_upload(void)
+{
+    ty_monitor *monitor = NULL;
+    ty_board *board = NULL;
+    ty_firmware *fw = NULL;
+    ty_task *task = NULL;
+    int r;
+
+    r = ty_monitor_new(&monitor);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+    r = ty_monitor_start(monitor);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+
+    r = ty_monitor_list(monitor, find_board_callback, &board);
+    ASSERT(!r && board);
+    if (!board)
+        goto cleanup;
+    ASSERT(ty_board_has_capability(board, TY_BOARD_CAPABILITY_REBOOT));
+    ASSERT(ty_monitor_find_board(monitor, ty_board_get_id(board)) == board);
+    ASSERT(!ty_monitor_find_board(monitor, "0-Teensy"));
+
+    r = new_test_firmware(&fw);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+
+    // The board goes through reboot, erase, write and reset in simulated time
+    r = ty_upload(board, &fw, 1, TY_UPLOAD_NOCHECK, &task);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+    r = ty_task_join(task);
+    ASSERT(!r);
+
+    ASSERT(task->u.upload.report.upload.block_latency.count == 8);
+    ASSERT(ty_board_has_capability(board, TY_BOARD_CAPABILITY_RUN));
+
+cleanup:
+    ty_task_unref(task);
+    ty_firmware_unref(fw);
+    ty_board_unref(board);
+    ty_monitor_free(monitor);
+}
+
+static void test_simulator_serial_pin(void)
+{
+    ty_monitor *monitor = NULL;
+    ty_board *board = NULL;
+    ty_board_interface *iface = NULL;
+    char buf[16];
+    size_t len;
+    ssize_t r;
+
+    r = ty_monitor_new(&monitor);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+    r = ty_monitor_start(monitor);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+
+    r = ty_monitor_list(monitor, find_board_callback, &board);
+    ASSERT(!r && board);
+    if (!board)
+        goto cleanup;
+
+    r = ty_board_serial_acquire(board, &iface);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+
+    // Simulated serial ports echo everything back
+    r = ty_board_interface_serial_write(iface, "ping", 4);
+    ASSERT(r == 4);
+    len = 0;
+    while (len < 4) {
+        r = ty_board_interface_serial_read(iface, buf + len, sizeof(buf) - len, 1000);
+        if (r <= 0)
+            break;
+        len += (size_t)r;
+    }
+    ASSERT(len == 4 && !memcmp(buf, "ping", 4));
+    ASSERT(!ty_board_interface_is_dropped(iface));
+
+    // The serial device disappears when the board reboots to the bootloader
+    r = ty_board_reboot(board);
+    ASSERT(!r);
+    r = ty_board_wait_for(board, TY_BOARD_CAPABILITY_UPLOAD, 5000);
+    ASSERT(r > 0);
+
+    ASSERT(ty_board_interface_is_dropped(iface));
+    ty_error_mask(TY_ERROR_IO);
+    r = ty_board_interface_serial_read(iface, buf, sizeof(buf), 0);
+    ty_error_unmask();
+    ASSERT(r == TY_ERROR_IO);
+
+cleanup:
+    ty_board_serial_release(iface);
+    ty_board_unref(board);
+    ty_monitor_free(monitor);
+}
+
+struct batch_stats {
+    unsigned int batches;
+    unsigned int events;
+    unsigned int added;
+    bool duplicates;
+};
+
+static int count_batch_callback(const ty_monitor_batch_event *events, unsigned int count,
+                                void *udata)
+{
+    struct batch_stats *stats = udata;
+
+    for (unsigned int i = 0; i < count; i++) {
+        for (unsigned int j = 0; j < i; j++)
+            stats->duplicates |= (events[j].board == events[i].board);
+        stats->added += (events[i].event == TY_MONITOR_EVENT_ADDED);
+    }
+    stats->batches++;
+    stats->events += count;
+
+    return 0;
+}
+
+static void test_simulator_batch_events(void)
+{
+    ty_monitor *monitor = NULL;
+    ty_board *board = NULL;
+    struct batch_stats stats = {0};
+    int r;
+
+    r = ty_monitor_new(&monitor);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+    r = ty_monitor_register_batch_callback(monitor, count_batch_callback, &stats);
+    ASSERT(!r);
+    r = ty_monitor_start(monitor);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+
+    // Boards found by ty_monitor_start() come in a single batch
+    ASSERT(stats.batches == 1 && stats.events == 2 && stats.added == 2);
+
+    r = ty_monitor_list(monitor, find_board_callback, &board);
+    ASSERT(!r && board);
+    if (!board)
+        goto cleanup;
+
+    // Previous tests may leave the board in the bootloader, switch mode either way
+    if (ty_board_has_capability(board, TY_BOARD_CAPABILITY_RESET)) {
+        r = ty_board_reset(board);
+        ASSERT(!r);
+        r = ty_board_wait_for(board, TY_BOARD_CAPABILITY_RUN, 5000);
+    } else {
+        r = ty_board_reboot(board);
+        ASSERT(!r);
+        r = ty_board_wait_for(board, TY_BOARD_CAPABILITY_UPLOAD, 5000);
+    }
+    ASSERT(r > 0);
+
+    ASSERT(stats.batches > 1);
+    ASSERT(stats.added == 2);
+    ASSERT(!stats.duplicates);
+
+cleanup:
+    ty_board_unref(board);
+    ty_monitor_free(monitor);
+}
+
+static int check_task_finished(ty_monitor *monitor, void *udata)
+{
+    ty_task *task = udata;
+
+    TY_UNUSED(monitor);
+    return task->status == TY_TASK_STATUS_FINISHED;
+}
+
+static int check_board_bootloader(ty_monitor *monitor, void *udata)
+{
+    ty_board *board = udata;
+
+    TY_UNUSED(monitor);
+    return ty_board_has_capability(board, TY_BOARD_CAPABILITY_UPLOAD);
+}
+
+static int check_board_running(ty_monitor *monitor, void *udata)
+{
+    ty_board *board = udata;
+
+    TY_UNUSED(monitor);
+    return ty_board_has_capability(board, TY_BOARD_CAPABILITY_RUN);
+}
+
+static void test_simulator_stream_invalid(void)
+{
+    ty_monitor *monitor = NULL;
+    ty_board *board = NULL;
+    ty_firmware *fw = NULL;
+    ty_task *task = NULL;
+    int r;
+
+    r = ty_monitor_new(&monitor);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+    r = ty_monitor_start(monitor);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+
+    r = ty_monitor_list(monitor, find_board_callback, &board);
+    ASSERT(!r && board);
+    if (!board)
+        goto cleanup;
+
+    r = ty_firmware_stream_new("simulator.hex", NULL, &fw);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+    // Two complete blocks of zeros, enough to start writing if we did not wait
+    for (unsigned int address = 0; !r && address < 2048; address += 16) {
+        char record[64];
+        uint8_t sum = (uint8_t)(16 + (address >> 8) + address);
+
+        sprintf(record, ":10%04X0000000000000000000000000000000000%02X\n", address, (uint8_t)-sum);
+        r = ty_firmware_stream_feed(fw, (const uint8_t *)record, strlen(record));
+    }
+    ASSERT(!r);
+
+    r = ty_upload(board, &fw, 1, TY_UPLOAD_NOCHECK, &task);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+    r = ty_task_start(task);
+    ASSERT(!r);
+
+    // The parse error comes once the board is in the bootloader, nothing must be written
+    r = ty_monitor_wait(monitor, check_board_bootloader, board, 5000);
+    ASSERT(r > 0);
+    ty_error_mask(TY_ERROR_PARSE);
+    r = ty_firmware_stream_feed(fw, (const uint8_t *)":00000007F9\n", 12);
+    ty_error_unmask();
+    ASSERT(r == TY_ERROR_PARSE);
+
+    for (unsigned int i = 0; i < 100 && task->status != TY_TASK_STATUS_FINISHED; i++)
+        ty_monitor_wait(monitor, check_task_finished, task, 50);
+    ASSERT(task->status == TY_TASK_STATUS_FINISHED && task->ret == TY_ERROR_PARSE);
+    ASSERT(!task->u.upload.report.upload.block_latency.count);
+
+cleanup:
+    ty_task_unref(task);
+    ty_firmware_unref(fw);
+    ty_board_unref(board);
+    ty_monitor_free(monitor);
+}
+
+static void test_simulator_task_queue(void)
+{
+    ty_monitor *monitor = NULL;
+    ty_board *board = NULL;
+    ty_firmware *fw = NULL;
+    ty_task *uploads[3] = {0}, *reset = NULL;
+    ty_task *upload = NULL, *canceled_upload = NULL, *canceled_reset = NULL;
+    int r;
+
+    r = ty_monitor_new(&monitor);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+    r = ty_monitor_start(monitor);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+
+    r = ty_monitor_list(monitor, find_board_callback, &board);
+    ASSERT(!r && board);
+    if (!board)
+        goto cleanup;
+    r = new_test_firmware(&fw);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+
+    /* The first upload owns the board, the second one waits and gets superseded by the
+       third, and the reset is merged into the last upload because it resets the board. */
+    for (unsigned int i = 0; i < TY_COUNTOF(uploads); i++) {
+        r = ty_upload(board, &fw, 1, TY_UPLOAD_NOCHECK, &uploads[i]);
+        ASSERT(!r);
+        if (r < 0)
+            goto cleanup;
+        r = ty_task_start(uploads[i]);
+        ASSERT(!r);
+    }
+    r = ty_reset(board, &reset);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+    r = ty_task_start(reset);
+    ASSERT(!r);
+
+    ASSERT(uploads[1]->status == TY_TASK_STATUS_FINISHED &&
+           uploads[1]->ret == TY_ERROR_SUPERSEDED);
+    ASSERT(reset->status == TY_TASK_STATUS_PENDING);
+
+    /* Pool threads need this thread to refresh the monitor, and the task may finish after
+       the last board change. */
+    for (unsigned int i = 0; i < 200 && uploads[2]->status != TY_TASK_STATUS_FINISHED; i++)
+        ty_monitor_wait(monitor, check_task_finished, uploads[2], 50);
+    ASSERT(uploads[2]->status == TY_TASK_STATUS_FINISHED);
+    ASSERT(!uploads[0]->ret && !uploads[2]->ret);
+    ASSERT(uploads[2]->u.upload.report.upload.block_latency.count == 8);
+    ASSERT(reset->status == TY_TASK_STATUS_FINISHED && !reset->ret);
+    ASSERT(ty_board_has_capability(board, TY_BOARD_CAPABILITY_RUN));
+
+    // A merged reset fails if the upload it depends on fails
+    r = ty_upload(board, &fw, 1, TY_UPLOAD_NOCHECK, &upload);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+    r = ty_task_start(upload);
+    ASSERT(!r);
+    r = ty_upload(board, &fw, 1, TY_UPLOAD_NOCHECK, &canceled_upload);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+    r = ty_task_start(canceled_upload);
+    ASSERT(!r);
+    r = ty_reset(board, &canceled_reset);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+    r = ty_task_start(canceled_reset);
+    ASSERT(!r);
+
+    // Queued tasks don't wait for their turn to end once canceled
+    ty_task_cancel(canceled_upload);
+    ASSERT(upload->status != TY_TASK_STATUS_FINISHED);
+    ASSERT(canceled_upload->status == TY_TASK_STATUS_FINISHED &&
+           canceled_upload->ret == TY_ERROR_CANCELED);
+    ASSERT(canceled_reset->status == TY_TASK_STATUS_FINISHED &&
+           canceled_reset->ret == TY_ERROR_CANCELED);
+    for (unsigned int i = 0; i < 200 && upload->status != TY_TASK_STATUS_FINISHED; i++)
+        ty_monitor_wait(monitor, check_task_finished, upload, 50);
+    ASSERT(upload->status == TY_TASK_STATUS_FINISHED && !upload->ret);
+    r = ty_monitor_wait(monitor, check_board_running, board, 5000);
+    ASSERT(r > 0);
+
+cleanup:
+    for (unsigned int i = 0; i < TY_COUNTOF(uploads); i++)
+        ty_task_unref(uploads[i]);
+    ty_task_unref(reset);
+    ty_task_unref(upload);
+    ty_task_unref(canceled_upload);
+    ty_task_unref(canceled_reset);
+    ty_firmware_unref(fw);
+    ty_board_unref(board);
+    ty_monitor_free(monitor);
+}
+
+static void test_simulator_cancel(void)
+{
+    ty_monitor *monitor = NULL;
+    ty_board *board = NULL;
+    ty_firmware *fw = NULL;
+    ty_task *upload = NULL, *reboot = NULL;
+    uint64_t start;
+    int r;
+
+    r = ty_monitor_new(&monitor);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+    r = ty_monitor_start(monitor);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+
+    r = ty_monitor_list(monitor, find_running_board_callback, &board);
+    ASSERT(!r && board);
+    if (!board)
+        goto cleanup;
+    r = new_test_firmware(&fw);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+
+    // Nobody is going to press the button, the upload waits until we cancel it
+    r = ty_upload(board, &fw, 1, TY_UPLOAD_NOCHECK | TY_UPLOAD_WAIT, &upload);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+    r = ty_task_start(upload);
+    ASSERT(!r);
+    r = ty_reboot(board, &reboot);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+    r = ty_task_start(reboot);
+    ASSERT(!r);
+
+    ty_monitor_wait(monitor, NULL, NULL, 100);
+    ASSERT(upload->status == TY_TASK_STATUS_RUNNING);
+
+    /* Canceling must wake the waiting upload by itself, so don't refresh the monitor until
+       it is done. The timeout only keeps a broken build from hanging. */
+    ty_task_cancel(upload);
+    r = ty_task_wait(upload, TY_TASK_STATUS_FINISHED, 5000);
+    ASSERT(r > 0);
+    ASSERT(upload->status == TY_TASK_STATUS_FINISHED && upload->ret == TY_ERROR_CANCELED);
+
+    // The board is free again for the next task
+    start = ty_millis();
+    while (ty_millis() - start < 5000 && reboot->status != TY_TASK_STATUS_FINISHED)
+        ty_monitor_wait(monitor, NULL, NULL, 20);
+    ASSERT(reboot->status == TY_TASK_STATUS_FINISHED && !reboot->ret);
+    ASSERT(ty_board_has_capability(board, TY_BOARD_CAPABILITY_UPLOAD));
+
+cleanup:
+    ty_task_unref(reboot);
+    ty_task_unref(upload);
+    ty_firmware_unref(fw);
+    ty_board_unref(board);
+    ty_monitor_free(monitor);
+}
+
+struct wait_thread_context {
+    ty_board *board;
+    int ret;
+};
+
+static int wait_for_bootloader(void *udata)
+{
+    struct wait_thread_context *ctx = udata;
+
+    ctx->ret = ty_board_wait_for(ctx->board, TY_BOARD_CAPABILITY_UPLOAD, 5000);
+    return 0;
+}
+
+static void test_simulator_wait_thread(void)
+{
+    ty_monitor *monitor = NULL;
+    ty_board *board = NULL;
+    ty_thread thread;
+    bool thread_started = false;
+    struct wait_thread_context ctx = {0};
+    ty_histogram latency = {0};
+    int r;
+
+    r = ty_monitor_new(&monitor);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+    r = ty_monitor_start(monitor);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+
+    r = ty_monitor_list(monitor, find_board_callback, &board);
+    ASSERT(!r && board);
+    if (!board)
+        goto cleanup;
+
+    /* Boards only change when this thread refreshes the monitor, so the waiter is
+       registered before the bootloader shows up. */
+    ctx.board = board;
+    r = ty_thread_create(&thread, wait_for_bootloader, &ctx);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+    thread_started = true;
+    ty_delay(50);
+
+    r = ty_board_reboot(board);
+    ASSERT(!r);
+    for (unsigned int i = 0; i < 100 && !latency.count; i++) {
+        ty_monitor_wait(monitor, NULL, NULL, 50);
+        ty_monitor_get_wakeup_latency(monitor, &latency);
+    }
+
+    ty_thread_join(&thread);
+    thread_started = false;
+    ASSERT(ctx.ret > 0);
+    ASSERT(latency.count == 1);
+
+cleanup:
+    if (thread_started)
+        ty_thread_join(&thread);
+    ty_board_unref(board);
+    ty_monitor_free(monitor);
+}
+
+#endif
+
+void test_simulator(void)
+{
+#if defined(__linux__) && defined(TEST_SIMULATOR)
+    char dir[] = "/tmp/test_libty_XXXXXX";
+    char *prev_config_home;
+
+    // Simulated uploads must not leave anything behind (such as learned HalfKay pacing)
+    if (!mkdtemp(dir)) {
+        ASSERT(false);
+        return;
+    }
+    prev_config_home = getenv("XDG_CONFIG_HOME");
+    if (prev_config_home)
+        prev_config_home = strdup(prev_config_home);
+    setenv("XDG_CONFIG_HOME", dir, 1);
+
+    setenv("LIBHS_SIMULATOR", "boards=2,erase=20,write=1,reboot=20", 1);
+    test_simulator_upload();
+    test_simulator_serial_pin();
+    test_simulator_wait_thread();
+    test_simulator_batch_events();
+    test_simulator_task_queue();
+    test_simulator_cancel();
+    test_simulator_stream_invalid();
+    unsetenv("LIBHS_SIMULATOR");
+
+    if (prev_config_home) {
+        setenv("XDG_CONFIG_HOME", prev_config_home, 1);
+        free(prev_config_home);
+    } else {
+        unsetenv("XDG_CONFIG_HOME");
+    }
+    ASSERT(!rmdir(dir));
+#endif
+}
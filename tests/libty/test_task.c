@@ -0,0 +1,376 @@
+/* TyTools - public domain
+   Niels Martignène <niels.martignene@protonmail.com>
+   https://koromix.dev/tytools
+
+   This software is in the public domain. Where that dedication is not
+   recognized, you are granted a perpetual, irrevocable license to copy,
+   distribute, and modify this file as you see fit.
+
+   See the LICENSE file for more details. */
+
+#include "test_libty.h"
+#include <time.h>
+#include "../../src/libty/system.h"
+#include "../../src/libty/task.h"
+
+struct hub_usage {
+    ty_mutex mutex;
+
+    unsigned int running[2];
+    unsigned int max_running[2];
+    unsigned int root_running;
+    unsigned int max_root_running;
+};
+
+static struct hub_usage hub_usage;
+
+static int run_hub_task(ty_task *task)
+{
+    unsigned int hub = task->usb.location[8] == '1' ? 0 : 1;
+
+    ty_mutex_lock(&hub_usage.mutex);
+    hub_usage.running[hub]++;
+    hub_usage.max_running[hub] = TY_MAX(hub_usage.max_running[hub], hub_usage.running[hub]);
+    hub_usage.root_running++;
+    hub_usage.max_root_running = TY_MAX(hub_usage.max_root_running, hub_usage.root_running);
+    ty_mutex_unlock(&hub_usage.mutex);
+
+    ty_delay(20);
+
+    ty_mutex_lock(&hub_usage.mutex);
+    hub_usage.running[hub]--;
+    hub_usage.root_running--;
+    ty_mutex_unlock(&hub_usage.mutex);
+
+    task->usb.transferred = 65536;
+    return 0;
+}
+
+static void test_task_hub_limits(void)
+{
+    ty_pool *pool;
+    ty_task *tasks[48] = {0};
+    unsigned int max_per_hub, max_per_root;
+    int r;
+
+    r = ty_pool_new(&pool);
+    ASSERT(!r);
+    if (r < 0)
+        return;
+    ty_mutex_init(&hub_usage.mutex);
+
+    ty_pool_set_hub_limits(pool, 2, 3);
+    ty_pool_get_hub_limits(pool, &max_per_hub, &max_per_root);
+    ASSERT(max_per_hub == 2 && max_per_root == 3);
+
+    // Two hubs (usb-1-2-1 and usb-1-2-2) behind the same root port
+    for (unsigned int i = 0; i < TY_COUNTOF(tasks); i++) {
+        char location[32];
+
+        r = ty_task_new("hub", run_hub_task, &tasks[i]);
+        ASSERT(!r);
+        if (r < 0)
+            goto cleanup;
+
+        snprintf(location, sizeof(location), "usb-1-2-%u-%u", i % 2 + 1, i / 2 + 1);
+        tasks[i]->usb.location = strdup(location);
+        tasks[i]->pool = pool;
+    }
+
+    for (unsigned int i = 0; i < TY_COUNTOF(tasks); i++) {
+        r = ty_task_start(tasks[i]);
+        ASSERT(!r);
+    }
+    for (unsigned int i = 0; i < TY_COUNTOF(tasks); i++) {
+        r = ty_task_wait(tasks[i], TY_TASK_STATUS_FINISHED, 5000);
+        ASSERT(r == 1 && !tasks[i]->ret);
+    }
+
+    ASSERT(hub_usage.max_running[0] && hub_usage.max_running[0] <= 2);
+    ASSERT(hub_usage.max_running[1] && hub_usage.max_running[1] <= 2);
+    ASSERT(hub_usage.max_root_running <= 3);
+
+cleanup:
+    for (unsigned int i = 0; i < TY_COUNTOF(tasks); i++)
+        ty_task_unref(tasks[i]);
+    ty_pool_free(pool);
+    ty_mutex_release(&hub_usage.mutex);
+}
+
+static int run_sleeping_task(ty_task *task)
+{
+    TY_UNUSED(task);
+
+    ty_delay(100);
+    return 0;
+}
+
+static void test_task_throttled_idle(void)
+{
+    ty_pool *pool;
+    ty_task *tasks[4] = {0};
+    clock_t cpu_start;
+    uint64_t start;
+    int r;
+
+    r = ty_pool_new(&pool);
+    ASSERT(!r);
+    if (r < 0)
+        return;
+
+    // Workers outlive their idle timeout while throttled tasks wait for the hub
+    ty_pool_set_hub_limits(pool, 1, 1);
+    ty_pool_set_idle_timeout(pool, 1);
+
+    for (unsigned int i = 0; i < TY_COUNTOF(tasks); i++) {
+        r = ty_task_new("sleep", run_sleeping_task, &tasks[i]);
+        ASSERT(!r);
+        if (r < 0)
+            goto cleanup;
+
+        tasks[i]->usb.location = strdup("usb-1-2-1");
+        tasks[i]->pool = pool;
+    }
+
+    cpu_start = clock();
+    start = ty_millis();
+    for (unsigned int i = 0; i < TY_COUNTOF(tasks); i++) {
+        r = ty_task_start(tasks[i]);
+        ASSERT(!r);
+    }
+    for (unsigned int i = 0; i < TY_COUNTOF(tasks); i++) {
+        r = ty_task_wait(tasks[i], TY_TASK_STATUS_FINISHED, 5000);
+        ASSERT(r == 1 && !tasks[i]->ret);
+    }
+
+    // Idle workers must sleep, not spin on the pool mutex (clock() is wall time on Windows)
+#ifndef _WIN32
+    ASSERT((uint64_t)(clock() - cpu_start) * 1000 / CLOCKS_PER_SEC < (ty_millis() - start) / 4);
+#else
+    TY_UNUSED(cpu_start);
+    TY_UNUSED(start);
+#endif
+
+cleanup:
+    for (unsigned int i = 0; i < TY_COUNTOF(tasks); i++)
+        ty_task_unref(tasks[i]);
+    ty_pool_free(pool);
+}
+
+struct affinity_run {
+    ty_thread_id thread_id;
+    bool ran;
+};
+
+static int run_affinity_task(ty_task *task)
+{
+    struct affinity_run *run = task->result;
+
+    run->thread_id = ty_thread_get_self_id();
+    run->ran = true;
+    ty_delay(5);
+
+    return 0;
+}
+
+static void test_task_affinity(void)
+{
+    ty_pool *pool;
+    ty_task *tasks[8] = {0};
+    struct affinity_run runs[8] = {0};
+    static const int key1 = 1, key2 = 2;
+    int r;
+
+    r = ty_pool_new(&pool);
+    ASSERT(!r);
+    if (r < 0)
+        return;
+    ty_pool_set_max_threads(pool, 4);
+
+    for (unsigned int i = 0; i < TY_COUNTOF(tasks); i++) {
+        r = ty_task_new("affinity", run_affinity_task, &tasks[i]);
+        ASSERT(!r);
+        if (r < 0)
+            goto cleanup;
+
+        tasks[i]->pool = pool;
+        tasks[i]->affinity = (i % 2) ? &key2 : &key1;
+        tasks[i]->result = &runs[i];
+    }
+
+    // Follow-up tasks go to the worker that runs the first one
+    r = ty_task_start(tasks[0]);
+    ASSERT(!r);
+    r = ty_task_wait(tasks[0], TY_TASK_STATUS_RUNNING, 5000);
+    ASSERT(r == 1);
+    for (unsigned int i = 1; i < TY_COUNTOF(tasks); i++) {
+        r = ty_task_start(tasks[i]);
+        ASSERT(!r);
+    }
+    for (unsigned int i = 0; i < TY_COUNTOF(tasks); i++) {
+        r = ty_task_wait(tasks[i], TY_TASK_STATUS_FINISHED, 5000);
+        ASSERT(r == 1 && !tasks[i]->ret && runs[i].ran);
+    }
+
+    for (unsigned int i = 2; i < TY_COUNTOF(tasks); i += 2)
+        ASSERT(runs[i].thread_id == runs[0].thread_id);
+
+cleanup:
+    for (unsigned int i = 0; i < TY_COUNTOF(tasks); i++) {
+        if (tasks[i])
+            tasks[i]->result = NULL;
+        ty_task_unref(tasks[i]);
+    }
+    ty_pool_free(pool);
+}
+
+static void test_task_steal(void)
+{
+    ty_pool *pool;
+    ty_task *tasks[64] = {0};
+    struct affinity_run runs[64] = {0};
+    int r;
+
+    r = ty_pool_new(&pool);
+    ASSERT(!r);
+    if (r < 0)
+        return;
+    ty_pool_set_max_threads(pool, 1);
+
+    for (unsigned int i = 0; i < TY_COUNTOF(tasks); i++) {
+        r = ty_task_new("steal", run_affinity_task, &tasks[i]);
+        ASSERT(!r);
+        if (r < 0)
+            goto cleanup;
+
+        tasks[i]->pool = pool;
+        tasks[i]->result = &runs[i];
+        r = ty_task_start(tasks[i]);
+        ASSERT(!r);
+    }
+
+    // Joining a queued task runs it right away, in this thread
+    r = ty_task_join(tasks[TY_COUNTOF(tasks) / 2]);
+    ASSERT(!r);
+    ASSERT(runs[TY_COUNTOF(tasks) / 2].thread_id == ty_thread_get_self_id());
+
+    for (unsigned int i = 0; i < TY_COUNTOF(tasks); i++) {
+        r = ty_task_join(tasks[i]);
+        ASSERT(!r && runs[i].ran);
+    }
+
+cleanup:
+    for (unsigned int i = 0; i < TY_COUNTOF(tasks); i++) {
+        if (tasks[i])
+            tasks[i]->result = NULL;
+        ty_task_unref(tasks[i]);
+    }
+    ty_pool_free(pool);
+}
+
+static int run_group_task(ty_task *task)
+{
+    int behavior = *(int *)task->result;
+
+    if (behavior < 0)
+        return behavior;
+
+    for (unsigned int i = 0; i < 1000 && behavior; i++) {
+        if (ty_task_is_canceled(task))
+            return TY_ERROR_CANCELED;
+        ty_delay(5);
+    }
+
+    return 0;
+}
+
+static void test_task_group(void)
+{
+    ty_pool *pool;
+    ty_task_group *group = NULL;
+    ty_task *tasks[8] = {0};
+    int behaviors[8];
+    ty_task_group_status status;
+    int r;
+
+    r = ty_pool_new(&pool);
+    ASSERT(!r);
+    if (r < 0)
+        return;
+    ty_pool_set_max_threads(pool, 2);
+
+    // Quick tasks that all succeed
+    r = ty_task_group_new(&group);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+    for (unsigned int i = 0; i < TY_COUNTOF(tasks); i++) {
+        behaviors[i] = 0;
+
+        r = ty_task_new("group", run_group_task, &tasks[i]);
+        ASSERT(!r);
+        if (r < 0)
+            goto cleanup;
+        tasks[i]->pool = pool;
+        tasks[i]->result = &behaviors[i];
+
+        r = ty_task_group_add(group, tasks[i]);
+        ASSERT(!r);
+    }
+    r = ty_task_group_join(group);
+    ASSERT(!r);
+    ty_task_group_get_status(group, &status);
+    ASSERT(status.count == 8 && status.finished == 8 && !status.failed && !status.canceled);
+
+    ty_task_group_free(group);
+    group = NULL;
+    for (unsigned int i = 0; i < TY_COUNTOF(tasks); i++) {
+        tasks[i]->result = NULL;
+        ty_task_unref(tasks[i]);
+        tasks[i] = NULL;
+    }
+
+    /* With fail_fast, the first failure cancels the slow tasks that are running, and the
+       queued ones end without running. */
+    r = ty_task_group_new(&group);
+    ASSERT(!r);
+    if (r < 0)
+        goto cleanup;
+    ty_task_group_set_fail_fast(group, true);
+    for (unsigned int i = 0; i < TY_COUNTOF(tasks); i++) {
+        behaviors[i] = (i == 1) ? TY_ERROR_IO : 1;
+
+        r = ty_task_new("group", run_group_task, &tasks[i]);
+        ASSERT(!r);
+        if (r < 0)
+            goto cleanup;
+        tasks[i]->pool = pool;
+        tasks[i]->result = &behaviors[i];
+
+        r = ty_task_group_add(group, tasks[i]);
+        ASSERT(!r);
+    }
+    r = ty_task_group_join(group);
+    ASSERT(r == TY_ERROR_IO);
+    ty_task_group_get_status(group, &status);
+    ASSERT(status.finished == 8 && status.failed == 1 && status.canceled == 7);
+    ASSERT(status.ret == TY_ERROR_IO);
+
+cleanup:
+    ty_task_group_free(group);
+    for (unsigned int i = 0; i < TY_COUNTOF(tasks); i++) {
+        if (tasks[i])
+            tasks[i]->result = NULL;
+        ty_task_unref(tasks[i]);
+    }
+    ty_pool_free(pool);
+}
+
+void test_task(void)
+{
+    test_task_hub_limits();
+    test_task_throttled_idle();
+    test_task_affinity();
+    test_task_steal();
+    test_task_group();
+}